@@ -0,0 +1,46 @@
+#!/bin/bash
+# Per-call cost of ioctl interposition: a FIONREAD loop on a pipe, timed
+# without the shim, through its exported ioctl, and with ROTATE_TARGETED=1.
+#
+#   $ scripts/bench_ioctl.sh [path/to/tiler_shim.so] [iterations]
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+SHIM=$(realpath "${1:-$DIR/tiler_shim.so}")
+ITERATIONS=${2:-1000000}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/bench.c" <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+int main(int argc, char **argv) {
+	long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+	int fds[2], n;
+	struct timespec t0, t1;
+
+	if (pipe(fds) != 0)
+		return 1;
+	/* Warm up the PLT and caches */
+	for (int i = 0; i < 1000; i++)
+		ioctl(fds[0], FIONREAD, &n);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (long i = 0; i < iterations; i++)
+		ioctl(fds[0], FIONREAD, &n);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("bench: %.1f ns/ioctl over %ld calls\n",
+		((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / iterations, iterations);
+	return 0;
+}
+EOF
+gcc -O2 -o "$TMP/bench" "$TMP/bench.c" || exit 1
+
+echo -n "unshimmed: "
+"$TMP/bench" $ITERATIONS | grep '^bench:'
+echo -n "shim:      "
+LD_PRELOAD=$SHIM "$TMP/bench" $ITERATIONS | grep '^bench:'
+echo -n "targeted:  "
+ROTATE_TARGETED=1 LD_PRELOAD=$SHIM "$TMP/bench" $ITERATIONS | grep '^bench:'
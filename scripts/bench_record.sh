@@ -0,0 +1,53 @@
+#!/bin/bash
+# Per-ioctl cost of the flight recorder: a DRM_IOCTL_GET_CAP loop on the
+# card, timed through the shim with ROTATE_RECORD=0 and with it on. Run on
+# the target board; with ROTATE_SIM=1 in the environment it runs anywhere.
+#
+#   $ scripts/bench_record.sh [path/to/tiler_shim.so] [iterations] [device]
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+SHIM=$(realpath "${1:-$DIR/tiler_shim.so}")
+ITERATIONS=${2:-1000000}
+DEVICE=${3:-/dev/dri/card0}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/bench.c" <<'EOF'
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <drm/drm.h>
+
+/* CLOCK_BOOTTIME: the simulator turns CLOCK_MONOTONIC into its virtual clock */
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+	int fd = open(argc > 2 ? argv[2] : "/dev/dri/card0", O_RDWR);
+	struct drm_get_cap cap = { .capability = DRM_CAP_DUMB_BUFFER };
+
+	if (fd < 0 || ioctl(fd, DRM_IOCTL_GET_CAP, &cap) != 0)
+		return 1;
+	for (int i = 0; i < 1000; i++)
+		ioctl(fd, DRM_IOCTL_GET_CAP, &cap);
+	double start = now_ns();
+	for (long i = 0; i < iterations; i++)
+		ioctl(fd, DRM_IOCTL_GET_CAP, &cap);
+	printf("bench: %.1f ns/ioctl over %ld calls\n", (now_ns() - start) / iterations, iterations);
+	return 0;
+}
+EOF
+gcc -O2 $CFLAGS -o "$TMP/bench" "$TMP/bench.c" || exit 1
+
+echo -n "record off: "
+ROTATE_RECORD=0 LD_PRELOAD=$SHIM "$TMP/bench" $ITERATIONS "$DEVICE" | grep '^bench:'
+echo -n "record on:  "
+ROTATE_RECORD_FILE=$TMP/bench.rec LD_PRELOAD=$SHIM "$TMP/bench" $ITERATIONS "$DEVICE" | grep '^bench:'
@@ -0,0 +1,198 @@
+#!/bin/bash
+# Flip paths on the simulated device: a legacy PAGE_FLIP loop that waits
+# for each flip event, and a nonblocking atomic loop that flips the primary
+# plane as fast as it is let, each run plain, with ROTATE_MAX_FPS and with
+# ROTATE_ASYNC_FLIP. Prints the client's view and the simulator's summary.
+# Each frame costs ROTATE_SIM_RENDER_US of virtual time (default 4000 here,
+# so the loops don't outrun the refresh rate for free); other ROTATE_SIM_*
+# options are taken from the environment too.
+#
+#   $ scripts/bench_sim.sh [path/to/tiler_shim.so] [frames]
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+SHIM=$(realpath "${1:-$DIR/tiler_shim.so}")
+FRAMES=${2:-600}
+export ROTATE_SIM_RENDER_US=${ROTATE_SIM_RENDER_US:-4000}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/bench.c" <<'EOF'
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+
+static int fd;
+static uint32_t crtc_id, connector_id, plane_id, fb_id_prop, fbs[2];
+static struct drm_mode_modeinfo mode;
+
+/* CLOCK_MONOTONIC is the simulator's virtual clock */
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what) {
+	printf("bench: %s failed (errno %d)\n", what, errno);
+	exit(1);
+}
+
+static void setup(void) {
+	struct drm_mode_card_res res;
+	struct drm_mode_get_connector conn;
+	uint32_t encoder;
+
+	memset(&res, 0, sizeof(res));
+	res.crtc_id_ptr = (uint64_t)(uintptr_t)&crtc_id;
+	res.connector_id_ptr = (uint64_t)(uintptr_t)&connector_id;
+	res.encoder_id_ptr = (uint64_t)(uintptr_t)&encoder;
+	res.count_crtcs = res.count_connectors = res.count_encoders = 1;
+	if (ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res) != 0)
+		fail("GETRESOURCES");
+	memset(&conn, 0, sizeof(conn));
+	conn.connector_id = connector_id;
+	conn.count_modes = 1;
+	conn.modes_ptr = (uint64_t)(uintptr_t)&mode;
+	if (ioctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) != 0)
+		fail("GETCONNECTOR");
+
+	for (int i = 0; i < 2; i++) {
+		struct drm_mode_create_dumb create = { .width = mode.hdisplay, .height = mode.vdisplay, .bpp = 32 };
+		if (ioctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) != 0)
+			fail("CREATE_DUMB");
+		struct drm_mode_fb_cmd fb = {
+			.width = create.width, .height = create.height, .pitch = create.pitch,
+			.bpp = 32, .depth = 24, .handle = create.handle,
+		};
+		if (ioctl(fd, DRM_IOCTL_MODE_ADDFB, &fb) != 0)
+			fail("ADDFB");
+		fbs[i] = fb.fb_id;
+	}
+
+	struct drm_mode_crtc crtc;
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = crtc_id;
+	crtc.fb_id = fbs[0];
+	crtc.set_connectors_ptr = (uint64_t)(uintptr_t)&connector_id;
+	crtc.count_connectors = 1;
+	crtc.mode = mode;
+	crtc.mode_valid = 1;
+	if (ioctl(fd, DRM_IOCTL_MODE_SETCRTC, &crtc) != 0)
+		fail("SETCRTC");
+}
+
+/* The plane showing fbs[0] and its FB_ID property */
+static void find_plane(void) {
+	struct drm_set_client_cap cap = { .capability = DRM_CLIENT_CAP_ATOMIC, .value = 1 };
+	uint32_t planes[8];
+	struct drm_mode_get_plane_res res;
+
+	if (ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, &cap) != 0)
+		fail("SET_CLIENT_CAP");
+	memset(&res, 0, sizeof(res));
+	res.plane_id_ptr = (uint64_t)(uintptr_t)planes;
+	res.count_planes = 8;
+	if (ioctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) != 0)
+		fail("GETPLANERESOURCES");
+	for (uint32_t i = 0; i < res.count_planes && i < 8 && !fb_id_prop; i++) {
+		struct drm_mode_get_plane plane;
+		memset(&plane, 0, sizeof(plane));
+		plane.plane_id = planes[i];
+		if (ioctl(fd, DRM_IOCTL_MODE_GETPLANE, &plane) != 0 || plane.fb_id != fbs[0])
+			continue;
+		uint32_t ids[32];
+		uint64_t values[32];
+		struct drm_mode_obj_get_properties props;
+		memset(&props, 0, sizeof(props));
+		props.obj_id = plane_id = planes[i];
+		props.obj_type = DRM_MODE_OBJECT_PLANE;
+		props.props_ptr = (uint64_t)(uintptr_t)ids;
+		props.prop_values_ptr = (uint64_t)(uintptr_t)values;
+		props.count_props = 32;
+		if (ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props) != 0)
+			fail("OBJ_GETPROPERTIES");
+		for (uint32_t j = 0; j < props.count_props && j < 32; j++) {
+			struct drm_mode_get_property prop;
+			memset(&prop, 0, sizeof(prop));
+			prop.prop_id = ids[j];
+			if (ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop) == 0 && strcmp(prop.name, "FB_ID") == 0)
+				fb_id_prop = ids[j];
+		}
+	}
+	if (!fb_id_prop)
+		fail("finding the primary plane");
+}
+
+static void wait_event(void) {
+	char buf[256];
+	if (read(fd, buf, sizeof(buf)) < (ssize_t)sizeof(struct drm_event))
+		fail("read event");
+}
+
+int main(int argc, char **argv) {
+	int atomic = argc > 1 && strcmp(argv[1], "atomic") == 0;
+	long frames = argc > 2 ? atol(argv[2]) : 600, ebusy = 0;
+
+	fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		fail("open");
+	setup();
+	if (atomic)
+		find_plane();
+
+	double start = now_s();
+	for (long i = 1; i <= frames; i++) {
+		uint32_t fb_id = fbs[i & 1];
+		int ret;
+		if (atomic) {
+			uint32_t count = 1;
+			uint64_t value = fb_id;
+			struct drm_mode_atomic req = {
+				.flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+				.count_objs = 1, .objs_ptr = (uint64_t)(uintptr_t)&plane_id,
+				.count_props_ptr = (uint64_t)(uintptr_t)&count, .props_ptr = (uint64_t)(uintptr_t)&fb_id_prop,
+				.prop_values_ptr = (uint64_t)(uintptr_t)&value,
+			};
+			ret = ioctl(fd, DRM_IOCTL_MODE_ATOMIC, &req);
+		} else {
+			struct drm_mode_crtc_page_flip flip = {
+				.crtc_id = crtc_id, .fb_id = fb_id, .flags = DRM_MODE_PAGE_FLIP_EVENT,
+			};
+			ret = ioctl(fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+		}
+		if (ret != 0 && errno == EBUSY) {
+			/* The previous flip is still queued: wait for it and try again */
+			ebusy++;
+			wait_event();
+			i--;
+			continue;
+		}
+		if (ret != 0)
+			fail(atomic ? "ATOMIC" : "PAGE_FLIP");
+		/* The atomic loop only reads events once it is told to wait */
+		if (!atomic)
+			wait_event();
+	}
+	double elapsed = now_s() - start;
+	printf("bench: %s, %ld frames in %.2fs virtual, %.1f fps, %ld EBUSY\n", atomic ? "atomic" : "page flip",
+		frames, elapsed, elapsed > 0 ? frames / elapsed : 0.0, ebusy);
+	return 0;
+}
+EOF
+gcc -O2 $CFLAGS -o "$TMP/bench" "$TMP/bench.c" || exit 1
+
+for loop in flip atomic; do
+	for options in "" "ROTATE_MAX_FPS=30" "ROTATE_ASYNC_FLIP=1 ROTATE_SIM_ASYNC=1"; do
+		echo "$loop ${options:-(plain)}:"
+		env ROTATE_SIM=1 ROTATE_RECORD=0 $options LD_PRELOAD=$SHIM "$TMP/bench" $loop $FRAMES |
+			grep -E '^(bench|limit|async flip):|^sim: [0-9]+ frames' | sed 's/^/    /'
+	done
+done
@@ -0,0 +1,60 @@
+/*
+	ROTATE_ASYNC_FLIP on a simulated device that takes async flips:
+	legacy flips and atomic commits of just FB_ID are shown at once, in the
+	vblank they were made in. A commit that also moves the plane is
+	refused as an async flip, and has to be resubmitted vsynced without the
+	client seeing an error.
+*/
+
+#include "sim_client.h"
+
+#define FRAMES 10
+
+int main(void) {
+	struct sim_client c;
+	struct sim_buffer buffers[2];
+	uint32_t plane_id, fb_id_prop, src_x_prop, seq, now;
+	uint64_t value;
+
+	sim_client_open(&c);
+	for (int i = 0; i < 2; i++)
+		sim_buffer_new(&c, &buffers[i], c.mode.hdisplay, c.mode.vdisplay);
+	sim_client_set_crtc(&c, &buffers[0]);
+
+	for (int frame = 1; frame <= FRAMES; frame++) {
+		now = sim_client_vblank(&c);
+		check(sim_client_flip(&c, &buffers[frame & 1], 0) == 0, "PAGE_FLIP frame %d", frame);
+		seq = sim_client_wait_event(&c, DRM_EVENT_FLIP_COMPLETE);
+		check(seq == now, "page flip frame %d waited %u vblanks", frame, seq - now);
+	}
+
+	check(sim_client_plane_prop(&c, buffers[0].fb_id, "FB_ID", &plane_id, &fb_id_prop, &value) == 0,
+			"no plane shows the last buffer");
+	check(sim_client_plane_prop(&c, buffers[0].fb_id, "SRC_X", &plane_id, &src_x_prop, &value) == 0,
+			"no SRC_X");
+	struct drm_set_client_cap atomic = { .capability = DRM_CLIENT_CAP_ATOMIC, .value = 1 };
+	check(ioctl(c.fd, DRM_IOCTL_SET_CLIENT_CAP, &atomic) == 0, "SET_CLIENT_CAP");
+	for (int frame = 1; frame <= FRAMES; frame++) {
+		now = sim_client_vblank(&c);
+		check(sim_client_commit(&c, plane_id, fb_id_prop, buffers[frame & 1].fb_id, DRM_MODE_ATOMIC_NONBLOCK) == 0,
+				"ATOMIC frame %d", frame);
+		seq = sim_client_wait_event(&c, DRM_EVENT_FLIP_COMPLETE);
+		check(seq == now, "atomic frame %d waited %u vblanks", frame, seq - now);
+	}
+
+	/* FB_ID and SRC_X together: not something an async flip may change */
+	uint32_t objs[1] = { plane_id }, counts[1] = { 2 }, props[2] = { fb_id_prop, src_x_prop };
+	uint64_t values[2] = { buffers[1].fb_id, value + (16 << 16) };
+	struct drm_mode_atomic req = {
+		.flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, .count_objs = 1,
+		.objs_ptr = (uint64_t)(uintptr_t)objs, .count_props_ptr = (uint64_t)(uintptr_t)counts,
+		.props_ptr = (uint64_t)(uintptr_t)props, .prop_values_ptr = (uint64_t)(uintptr_t)values,
+	};
+	now = sim_client_vblank(&c);
+	check(ioctl(c.fd, DRM_IOCTL_MODE_ATOMIC, &req) == 0, "moving ATOMIC");
+	check(req.flags == (DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT), "flags left as %x", req.flags);
+	seq = sim_client_wait_event(&c, DRM_EVENT_FLIP_COMPLETE);
+	check(seq > now, "moving commit torn");
+	printf("async_flip: ok\n");
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+	ROTATE_DIRTY: writes to tracked mappings, made read-only after every
+	flip, must be caught and let through, both by plain stores and by the
+	kernel reading into the buffer (read, readv, recvmsg), with the flight
+	recorder's handler installed too.
+*/
+
+#include "sim_client.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int main(void) {
+	struct sim_client c;
+	struct sim_buffer buffers[2];
+	int pipe_fds[2], sock_fds[2];
+
+	sim_client_open(&c);
+	for (int i = 0; i < 2; i++)
+		sim_buffer_new(&c, &buffers[i], c.mode.hdisplay, c.mode.vdisplay);
+	sim_client_set_crtc(&c, &buffers[0]);
+	check(pipe(pipe_fds) == 0, "pipe");
+	check(socketpair(AF_UNIX, SOCK_STREAM, 0, sock_fds) == 0, "socketpair");
+
+	for (int frame = 1; frame <= 30; frame++) {
+		struct sim_buffer *b = &buffers[frame & 1];
+		/* A few rows, then the whole frame now and again */
+		size_t rows = frame % 5 == 0 ? b->height - 8 : 16;
+		memset(b->map + (size_t)(frame % 8) * b->pitch, frame, rows * b->pitch);
+
+		char line[64];
+		memset(line, frame, sizeof(line));
+		check(write(pipe_fds[1], line, sizeof(line)) == sizeof(line), "write pipe");
+		check(read(pipe_fds[0], b->map + (size_t)(b->height - 1) * b->pitch, sizeof(line)) == sizeof(line),
+				"read into tracked buffer");
+
+		/* Scattered over two pages the stores above haven't touched */
+		struct iovec iov[2] = {
+			{ b->map + (size_t)(b->height - 2) * b->pitch, sizeof(line) / 2 },
+			{ b->map + (size_t)(b->height - 3) * b->pitch, sizeof(line) / 2 },
+		};
+		check(write(pipe_fds[1], line, sizeof(line)) == sizeof(line), "write pipe");
+		check(readv(pipe_fds[0], iov, 2) == sizeof(line), "readv into tracked buffer");
+		check(write(sock_fds[1], line, sizeof(line)) == sizeof(line), "write socket");
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+		check(recvmsg(sock_fds[0], &msg, 0) == sizeof(line), "recvmsg into tracked buffer");
+
+		check(sim_client_flip(&c, b, 0) == 0, "PAGE_FLIP frame %d", frame);
+		sim_client_wait_event(&c, DRM_EVENT_FLIP_COMPLETE);
+		check(b->map[(size_t)(frame % 8) * b->pitch] == (uint8_t)frame, "frame %d contents", frame);
+	}
+	printf("dirty: ok\n");
+	return 0;
+}
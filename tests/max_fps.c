@@ -0,0 +1,46 @@
+/*
+	ROTATE_MAX_FPS=30 on the 60Hz simulated panel: a client flipping as
+	fast as its events come back gets a new frame shown every second
+	vblank, through legacy page flips and through atomic commits of just
+	FB_ID after a legacy modeset.
+*/
+
+#include "sim_client.h"
+
+#define FRAMES 20
+
+int main(void) {
+	struct sim_client c;
+	struct sim_buffer buffers[2];
+	uint32_t plane_id, fb_id_prop, last;
+	uint64_t value;
+
+	sim_client_open(&c);
+	check(c.mode.vrefresh == 60, "mode refresh %u", c.mode.vrefresh);
+	for (int i = 0; i < 2; i++)
+		sim_buffer_new(&c, &buffers[i], c.mode.hdisplay, c.mode.vdisplay);
+	sim_client_set_crtc(&c, &buffers[0]);
+
+	check(sim_client_flip(&c, &buffers[1], 0) == 0, "first PAGE_FLIP");
+	last = sim_client_wait_event(&c, DRM_EVENT_FLIP_COMPLETE);
+	for (int frame = 0; frame < FRAMES; frame++) {
+		check(sim_client_flip(&c, &buffers[frame & 1], 0) == 0, "PAGE_FLIP frame %d", frame);
+		uint32_t seq = sim_client_wait_event(&c, DRM_EVENT_FLIP_COMPLETE);
+		check(seq - last == 2, "page flip frame %d shown %u vblanks after the last", frame, seq - last);
+		last = seq;
+	}
+
+	check(sim_client_plane_prop(&c, buffers[1].fb_id, "FB_ID", &plane_id, &fb_id_prop, &value) == 0,
+			"no plane shows the last buffer");
+	struct drm_set_client_cap atomic = { .capability = DRM_CLIENT_CAP_ATOMIC, .value = 1 };
+	check(ioctl(c.fd, DRM_IOCTL_SET_CLIENT_CAP, &atomic) == 0, "SET_CLIENT_CAP");
+	for (int frame = 0; frame < FRAMES; frame++) {
+		check(sim_client_commit(&c, plane_id, fb_id_prop, buffers[frame & 1].fb_id, DRM_MODE_ATOMIC_NONBLOCK) == 0,
+				"ATOMIC frame %d", frame);
+		uint32_t seq = sim_client_wait_event(&c, DRM_EVENT_FLIP_COMPLETE);
+		check(seq - last == 2, "atomic frame %d shown %u vblanks after the last", frame, seq - last);
+		last = seq;
+	}
+	printf("max_fps: ok\n");
+	return 0;
+}
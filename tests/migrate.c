@@ -0,0 +1,59 @@
+/*
+	ROTATE_MIGRATE: a double-buffered client that reads its first buffer
+	back with CPU_PREP gets that buffer moved to cached memory, and what it
+	drew into either buffer is still there in its mapping after every
+	flip, migrations included. The shim reports migrations on stdout with
+	ROTATE_DEBUG=1, which the test sends to a file to look at afterwards.
+*/
+
+#include "sim_client.h"
+
+#include <drm/omap_drm.h>
+
+#define FRAMES 200
+
+int main(void) {
+	struct sim_client c;
+	struct sim_buffer buffers[2];
+	char line[256];
+	int migrated = 0;
+
+	FILE *log = tmpfile();
+	check(log != NULL, "tmpfile");
+	int out = dup(STDOUT_FILENO);
+	fflush(stdout);
+	check(dup2(fileno(log), STDOUT_FILENO) == STDOUT_FILENO, "dup2");
+
+	sim_client_open(&c);
+	for (int i = 0; i < 2; i++)
+		sim_buffer_new(&c, &buffers[i], c.mode.hdisplay, c.mode.vdisplay);
+	sim_client_set_crtc(&c, &buffers[0]);
+
+	for (int frame = 1; frame <= FRAMES; frame++) {
+		struct sim_buffer *b = &buffers[frame & 1], *other = &buffers[!(frame & 1)];
+		for (uint32_t y = 0; y < b->height; y++)
+			for (uint32_t x = 0; x < b->width; x += 64)
+				((uint32_t *)(b->map + (size_t)y * b->pitch))[x] = frame * 100000 + y;
+
+		struct drm_omap_gem_cpu_prep prep = { .handle = buffers[0].handle, .op = OMAP_GEM_READ };
+		check(ioctl(c.fd, DRM_IOCTL_OMAP_GEM_CPU_PREP, &prep) == 0, "CPU_PREP");
+		check(sim_client_flip(&c, b, 0) == 0, "PAGE_FLIP frame %d", frame);
+		sim_client_wait_event(&c, DRM_EVENT_FLIP_COMPLETE);
+
+		/* Drawn a frame ago, and possibly migrated since */
+		for (uint32_t y = 0; frame > 1 && y < other->height; y += 37) {
+			uint32_t pixel = ((uint32_t *)(other->map + (size_t)y * other->pitch))[128];
+			check(pixel == (uint32_t)(frame - 1) * 100000 + y, "frame %d row %u reads %u", frame, y, pixel);
+		}
+	}
+
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	rewind(log);
+	while (fgets(line, sizeof(line), log))
+		if (strncmp(line, "migrate: buffer", 15) == 0 && strstr(line, "-> tiled cached"))
+			migrated++;
+	check(migrated > 0, "no buffer was moved to cached memory");
+	printf("migrate: ok, %d migrations to cached memory\n", migrated);
+	return 0;
+}
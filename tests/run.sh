@@ -0,0 +1,45 @@
+#!/bin/bash
+# Builds tiler_shim.so and runs the simulator-driven tests against it.
+#
+#   $ tests/run.sh [test ...]
+#
+# CC and CFLAGS are passed to the compiler (e.g. CFLAGS=-I/path/to/drm/headers).
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+CC=${CC:-gcc}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cd "$DIR/.." || exit 1
+$CC $CFLAGS -shared -fpic -o "$TMP/tiler_shim.so" -Wno-int-to-pointer-cast -Wno-pointer-to-int-cast \
+	tiler_shim.c tiler_bo.c tiler_rotate.c tiler_sim.c tiler_schema.c -ldl -lpthread || exit 1
+# For the tests of the helpers themselves
+$CC $CFLAGS -c -o "$TMP/tiler_schema.o" tiler_schema.c || exit 1
+
+# name, then the environment it runs with on top of ROTATE_SIM=1
+TESTS=(
+	"dirty ROTATE_DIRTY=1"
+	"suballoc ROTATE_SUBALLOC=1 ROTATE_SIM_MODE=320x240@60"
+	"migrate ROTATE_MIGRATE=1 ROTATE_DEBUG=1"
+	"max_fps ROTATE_MAX_FPS=30 ROTATE_SIM_MODE=720x1280@60"
+	"async_flip ROTATE_ASYNC_FLIP=1 ROTATE_SIM_ASYNC=1"
+	"schema"
+)
+
+failed=0
+for entry in "${TESTS[@]}"; do
+	read -r name env <<< "$entry"
+	if [ $# -gt 0 ] && [[ ! " $* " =~ " $name " ]]; then
+		continue
+	fi
+	$CC $CFLAGS -o "$TMP/$name" "$DIR/$name.c" "$TMP/tiler_schema.o" || { failed=1; continue; }
+	if env ROTATE_SIM=1 ROTATE_RECORD_FILE="$TMP/$name.rec" $env LD_PRELOAD="$TMP/tiler_shim.so" \
+			"$TMP/$name" > "$TMP/$name.log" 2>&1; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name (exit $?)"
+		sed 's/^/    /' "$TMP/$name.log"
+		failed=1
+	fi
+done
+exit $failed
@@ -0,0 +1,60 @@
+/*
+	tiler_schema: a deep copy of an argument is self-contained and hashes
+	the same as the original, whatever its pointers are; the hash changes
+	with any element the capacities cover and ignores the ones past them.
+*/
+
+#include "sim_client.h"
+#include "../tiler_schema.h"
+
+int main(void) {
+	uint32_t objs[2] = { 31, 40 }, count_props[2] = { 2, 1 }, props[3] = { 20, 21, 22 };
+	uint64_t values[3] = { 50, 31, 1 << 16 };
+	struct drm_mode_atomic atomic = {
+		.flags = DRM_MODE_ATOMIC_NONBLOCK, .count_objs = 2,
+		.objs_ptr = (uint64_t)(uintptr_t)objs, .count_props_ptr = (uint64_t)(uintptr_t)count_props,
+		.props_ptr = (uint64_t)(uintptr_t)props, .prop_values_ptr = (uint64_t)(uintptr_t)values,
+	};
+	uint64_t buf[32];
+	uint64_t hash = tiler_schema_hash(DRM_IOCTL_MODE_ATOMIC, &atomic, NULL);
+
+	size_t need = tiler_schema_copy(DRM_IOCTL_MODE_ATOMIC, &atomic, NULL, buf, sizeof(buf));
+	check(need > sizeof(atomic) && need <= sizeof(buf), "copy needs %zu bytes", need);
+	memset(buf, 0xaa, sizeof(buf));
+	check(tiler_schema_copy(DRM_IOCTL_MODE_ATOMIC, &atomic, NULL, buf, need - 1) == need, "short buffer");
+	check(buf[0] == 0xaaaaaaaaaaaaaaaaull, "short buffer was written");
+	check(tiler_schema_copy(DRM_IOCTL_MODE_ATOMIC, &atomic, NULL, buf, sizeof(buf)) == need, "copy");
+
+	/* The copy's pointers are into buf, and nothing is shared with the original */
+	struct drm_mode_atomic *copy = (struct drm_mode_atomic *)buf;
+	const char *start = (const char *)buf, *end = start + need;
+	uint64_t ptrs[4] = { copy->objs_ptr, copy->count_props_ptr, copy->props_ptr, copy->prop_values_ptr };
+	for (int i = 0; i < 4; i++)
+		check((const char *)(uintptr_t)ptrs[i] >= start && (const char *)(uintptr_t)ptrs[i] < end,
+				"pointer %d outside the copy", i);
+	check(memcmp((void *)(uintptr_t)copy->prop_values_ptr, values, sizeof(values)) == 0, "values copied");
+	check(tiler_schema_hash(DRM_IOCTL_MODE_ATOMIC, copy, NULL) == hash, "copy hashes differently");
+	values[2] = 2 << 16;
+	check(tiler_schema_hash(DRM_IOCTL_MODE_ATOMIC, copy, NULL) == hash, "copy shares the values array");
+	check(tiler_schema_hash(DRM_IOCTL_MODE_ATOMIC, &atomic, NULL) != hash, "hash misses a value");
+	values[2] = 1 << 16;
+
+	/* Only as far as the capacity captured before the call */
+	struct drm_mode_obj_get_properties get = {
+		.props_ptr = (uint64_t)(uintptr_t)props, .prop_values_ptr = (uint64_t)(uintptr_t)values,
+		.count_props = 2, .obj_id = 31, .obj_type = DRM_MODE_OBJECT_PLANE,
+	};
+	uint32_t counts[TILER_SCHEMA_MAX_ARRAYS];
+	check(tiler_schema_counts(DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &get, counts) == 2, "two arrays");
+	get.count_props = 3; /* as the kernel writes back */
+	hash = tiler_schema_hash(DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &get, counts);
+	values[2] = 7;
+	check(tiler_schema_hash(DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &get, counts) == hash, "hash past the capacity");
+	values[1] = 7;
+	check(tiler_schema_hash(DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &get, counts) != hash, "hash misses a value");
+
+	/* Requests that aren't described are not copied */
+	check(tiler_schema_copy(DRM_IOCTL_GEM_FLINK, &get, NULL, buf, sizeof(buf)) == 0, "GEM_FLINK copied");
+	printf("schema: ok, %zu byte copy\n", need);
+	return 0;
+}
@@ -0,0 +1,215 @@
+/*
+
+OpenGL TILER rotation shim - helpers for the simulator-driven tests
+
+Each test is a small DRM client run by tests/run.sh under tiler_shim.so
+with ROTATE_SIM=1, so it talks to the simulated omapdrm device. A test
+exits 0 when it passes; check() prints what went wrong and exits 1.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SIM_CLIENT_H
+#define SIM_CLIENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+
+struct sim_client {
+	int fd;
+	uint32_t crtc_id, connector_id;
+	struct drm_mode_modeinfo mode;
+};
+
+struct sim_buffer {
+	uint32_t width, height;
+	uint32_t handle, pitch, fb_id;
+	uint64_t size;
+	uint8_t *map;
+};
+
+#define check(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf(" (errno %d)\n", errno); \
+		exit(1); \
+	} \
+} while (0)
+
+static void sim_client_open(struct sim_client *c) {
+	struct drm_mode_card_res res;
+	struct drm_mode_get_connector conn;
+	uint32_t crtcs[4], connectors[4], encoders[4], encoder;
+
+	c->fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+	check(c->fd >= 0, "open card0");
+
+	memset(&res, 0, sizeof(res));
+	res.crtc_id_ptr = (uint64_t)(uintptr_t)crtcs;
+	res.connector_id_ptr = (uint64_t)(uintptr_t)connectors;
+	res.encoder_id_ptr = (uint64_t)(uintptr_t)encoders;
+	res.count_crtcs = res.count_connectors = res.count_encoders = 4;
+	check(ioctl(c->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) == 0, "GETRESOURCES");
+	check(res.count_crtcs >= 1 && res.count_connectors >= 1, "no CRTC or connector");
+	c->crtc_id = crtcs[0];
+	c->connector_id = connectors[0];
+
+	memset(&conn, 0, sizeof(conn));
+	conn.connector_id = c->connector_id;
+	conn.count_modes = 1;
+	conn.modes_ptr = (uint64_t)(uintptr_t)&c->mode;
+	conn.count_encoders = 1;
+	conn.encoders_ptr = (uint64_t)(uintptr_t)&encoder;
+	check(ioctl(c->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) == 0, "GETCONNECTOR");
+	check(conn.count_modes >= 1, "no mode");
+}
+
+static void sim_buffer_new(struct sim_client *c, struct sim_buffer *b, uint32_t width, uint32_t height) {
+	struct drm_mode_create_dumb create = { .width = width, .height = height, .bpp = 32 };
+	check(ioctl(c->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) == 0, "CREATE_DUMB %ux%u", width, height);
+
+	struct drm_mode_map_dumb map = { .handle = create.handle };
+	check(ioctl(c->fd, DRM_IOCTL_MODE_MAP_DUMB, &map) == 0, "MAP_DUMB");
+	b->map = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, map.offset);
+	check(b->map != MAP_FAILED, "mmap dumb buffer");
+
+	struct drm_mode_fb_cmd fb = {
+		.width = width, .height = height, .pitch = create.pitch,
+		.bpp = 32, .depth = 24, .handle = create.handle,
+	};
+	check(ioctl(c->fd, DRM_IOCTL_MODE_ADDFB, &fb) == 0, "ADDFB");
+
+	b->width = width;
+	b->height = height;
+	b->handle = create.handle;
+	b->pitch = create.pitch;
+	b->size = create.size;
+	b->fb_id = fb.fb_id;
+}
+
+static void sim_client_set_crtc(struct sim_client *c, struct sim_buffer *b) {
+	struct drm_mode_crtc crtc;
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = c->crtc_id;
+	crtc.fb_id = b->fb_id;
+	crtc.set_connectors_ptr = (uint64_t)(uintptr_t)&c->connector_id;
+	crtc.count_connectors = 1;
+	crtc.mode = c->mode;
+	crtc.mode_valid = 1;
+	check(ioctl(c->fd, DRM_IOCTL_MODE_SETCRTC, &crtc) == 0, "SETCRTC");
+}
+
+/*
+	The plane showing fb_id on the client's CRTC, and the id and value of
+	its property called name. Returns 0, or -1 if there is no such plane.
+*/
+static int sim_client_plane_prop(struct sim_client *c, uint32_t fb_id, const char *name,
+		uint32_t *plane_id, uint32_t *prop_id, uint64_t *value) {
+	struct drm_mode_get_plane_res res;
+	uint32_t planes[8];
+	struct drm_set_client_cap universal = { .capability = DRM_CLIENT_CAP_UNIVERSAL_PLANES, .value = 1 };
+	check(ioctl(c->fd, DRM_IOCTL_SET_CLIENT_CAP, &universal) == 0, "SET_CLIENT_CAP");
+	memset(&res, 0, sizeof(res));
+	res.plane_id_ptr = (uint64_t)(uintptr_t)planes;
+	res.count_planes = 8;
+	check(ioctl(c->fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) == 0, "GETPLANERESOURCES");
+
+	for (uint32_t i = 0; i < res.count_planes && i < 8; i++) {
+		struct drm_mode_get_plane plane;
+		memset(&plane, 0, sizeof(plane));
+		plane.plane_id = planes[i];
+		check(ioctl(c->fd, DRM_IOCTL_MODE_GETPLANE, &plane) == 0, "GETPLANE");
+		if (plane.fb_id != fb_id || plane.crtc_id != c->crtc_id)
+			continue;
+
+		uint32_t ids[32];
+		uint64_t values[32];
+		struct drm_mode_obj_get_properties props;
+		memset(&props, 0, sizeof(props));
+		props.obj_id = planes[i];
+		props.obj_type = DRM_MODE_OBJECT_PLANE;
+		props.props_ptr = (uint64_t)(uintptr_t)ids;
+		props.prop_values_ptr = (uint64_t)(uintptr_t)values;
+		props.count_props = 32;
+		check(ioctl(c->fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &props) == 0, "OBJ_GETPROPERTIES");
+		for (uint32_t j = 0; j < props.count_props && j < 32; j++) {
+			struct drm_mode_get_property prop;
+			memset(&prop, 0, sizeof(prop));
+			prop.prop_id = ids[j];
+			if (ioctl(c->fd, DRM_IOCTL_MODE_GETPROPERTY, &prop) == 0 && strcmp(prop.name, name) == 0) {
+				*plane_id = planes[i];
+				*prop_id = ids[j];
+				*value = values[j];
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+/* Legacy flip with an event; returns the ioctl's result */
+static int sim_client_flip(struct sim_client *c, struct sim_buffer *b, uint32_t flags) {
+	struct drm_mode_crtc_page_flip flip = {
+		.crtc_id = c->crtc_id, .fb_id = b->fb_id,
+		.flags = DRM_MODE_PAGE_FLIP_EVENT | flags,
+	};
+	return ioctl(c->fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+}
+
+/* Atomic commit of one plane property, with an event; returns the ioctl's result */
+static int sim_client_commit(struct sim_client *c, uint32_t plane_id, uint32_t prop_id, uint64_t value,
+		uint32_t flags) {
+	uint32_t count = 1;
+	struct drm_mode_atomic atomic = {
+		.flags = DRM_MODE_PAGE_FLIP_EVENT | flags, .count_objs = 1,
+		.objs_ptr = (uint64_t)(uintptr_t)&plane_id, .count_props_ptr = (uint64_t)(uintptr_t)&count,
+		.props_ptr = (uint64_t)(uintptr_t)&prop_id, .prop_values_ptr = (uint64_t)(uintptr_t)&value,
+	};
+	return ioctl(c->fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+}
+
+/*
+	Reads one event, which the simulator delivers once its vblank is due.
+	Returns the vblank it was sent for.
+*/
+static uint32_t sim_client_wait_event(struct sim_client *c, uint32_t type) {
+	char buf[256];
+	ssize_t n = read(c->fd, buf, sizeof(buf));
+	check(n >= (ssize_t)sizeof(struct drm_event_vblank), "read event: %zd", n);
+	check(((struct drm_event *)buf)->type == type, "event type %u", ((struct drm_event *)buf)->type);
+	return ((struct drm_event_vblank *)buf)->sequence;
+}
+
+/* The current vblank count */
+static uint32_t sim_client_vblank(struct sim_client *c) {
+	union drm_wait_vblank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = _DRM_VBLANK_RELATIVE;
+	check(ioctl(c->fd, DRM_IOCTL_WAIT_VBLANK, &vbl) == 0, "WAIT_VBLANK");
+	return vbl.reply.sequence;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/*
+	ROTATE_SUBALLOC: a double-buffered client whose buffers both fit the
+	sub-allocator gets them on different shelves of one container. Every
+	legacy flip between them has to work, deliver its event with the
+	client's user data, and leave the primary plane scanning out from the
+	buffer it flipped to.
+*/
+
+#include "sim_client.h"
+
+/* SRC_Y of the plane showing fb_id on the CRTC, in rows */
+static int plane_src_y(struct sim_client *c, uint32_t fb_id, uint64_t *src_y) {
+	uint32_t plane_id, prop_id;
+	if (sim_client_plane_prop(c, fb_id, "SRC_Y", &plane_id, &prop_id, src_y) != 0)
+		return -1;
+	*src_y >>= 16;
+	return 0;
+}
+
+int main(void) {
+	struct sim_client c;
+	struct sim_buffer buffers[2];
+	uint64_t src_y[2];
+
+	sim_client_open(&c);
+	check(c.mode.hdisplay <= 512 && c.mode.vdisplay <= 512, "mode %ux%u is too big to sub-allocate",
+			c.mode.hdisplay, c.mode.vdisplay);
+	for (int i = 0; i < 2; i++)
+		sim_buffer_new(&c, &buffers[i], c.mode.hdisplay, c.mode.vdisplay);
+	sim_client_set_crtc(&c, &buffers[0]);
+	check(plane_src_y(&c, buffers[0].fb_id, &src_y[0]) == 0, "no plane shows the first buffer");
+
+	for (int frame = 1; frame <= 20; frame++) {
+		struct sim_buffer *b = &buffers[frame & 1];
+		struct drm_mode_crtc_page_flip flip = {
+			.crtc_id = c.crtc_id, .fb_id = b->fb_id,
+			.flags = DRM_MODE_PAGE_FLIP_EVENT, .user_data = frame,
+		};
+		check(ioctl(c.fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip) == 0, "PAGE_FLIP frame %d", frame);
+
+		char buf[256];
+		ssize_t n = read(c.fd, buf, sizeof(buf));
+		struct drm_event_vblank *event = (struct drm_event_vblank *)buf;
+		check(n >= (ssize_t)sizeof(*event) && event->base.type == DRM_EVENT_FLIP_COMPLETE, "flip event");
+		check(event->user_data == (uint64_t)frame, "user data %llu for frame %d",
+				(unsigned long long)event->user_data, frame);
+
+		uint64_t y;
+		check(plane_src_y(&c, b->fb_id, &y) == 0, "no plane shows frame %d", frame);
+		if (frame == 1)
+			src_y[1] = y;
+		check(y == src_y[frame & 1], "frame %d scanned out from row %llu", frame, (unsigned long long)y);
+	}
+	check(src_y[0] != src_y[1], "both buffers at row %llu", (unsigned long long)src_y[0]);
+	printf("suballoc: ok, buffers at rows %llu and %llu\n", (unsigned long long)src_y[0], (unsigned long long)src_y[1]);
+	return 0;
+}
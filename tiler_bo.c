@@ -0,0 +1,228 @@
+/*
+
+OpenGL TILER rotation shim - TILER buffer allocation
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <drm/drm.h>
+#include <drm/omap_drm.h>
+
+#include "tiler_bo.h"
+#include "tiler_broker.h"
+
+int (*tiler_bo_ioctl)(int fd, unsigned long request, char *argp) = (int (*)(int, unsigned long, char *))ioctl;
+
+int tiler_bo_new(int fd, uint32_t height, uint32_t bpp, uint32_t cache_flags, struct tiler_bo *bo) {
+	return tiler_bo_new_width(fd, TILER_BO_WIDTH, height, bpp, cache_flags, bo);
+}
+
+int tiler_bo_new_width(int fd, uint32_t width, uint32_t height, uint32_t bpp, uint32_t cache_flags, struct tiler_bo *bo) {
+	struct drm_omap_gem_new gem_new;
+	int sixteen_bpp;
+
+	if (bpp == 32) {
+		sixteen_bpp = 0;
+	} else if (bpp == 16) {
+		sixteen_bpp = 1;
+	} else {
+		return -EINVAL;
+	}
+	if (width == 0 || width > TILER_BO_WIDTH)
+		return -EINVAL;
+
+	memset(&gem_new, 0, sizeof(gem_new));
+	gem_new.size.tiled.width = width;
+	gem_new.size.tiled.height = height;
+	gem_new.flags = (sixteen_bpp ? OMAP_BO_TILED_16 : OMAP_BO_TILED_32) | cache_flags | OMAP_BO_SCANOUT;
+	if (tiler_bo_ioctl(fd, DRM_IOCTL_OMAP_GEM_NEW, (char *) &gem_new) != 0)
+		return -errno;
+
+	bo->handle = gem_new.handle;
+	bo->height = height;
+	bo->bpp = bpp;
+	bo->pitch = sixteen_bpp ? (2 * TILER_BO_WIDTH) : (4 * TILER_BO_WIDTH);
+	bo->flags = gem_new.flags;
+	if (width != TILER_BO_WIDTH) {
+		/* Narrower containers may use a different stride, ask the kernel */
+		struct drm_omap_gem_info info;
+		memset(&info, 0, sizeof(info));
+		info.handle = bo->handle;
+		if (tiler_bo_ioctl(fd, DRM_IOCTL_OMAP_GEM_INFO, (char *) &info) == 0 && info.size >= height)
+			bo->pitch = info.size / height;
+	}
+	bo->size = (uint64_t)bo->pitch * height;
+	return 0;
+}
+
+int tiler_bo_new_linear(int fd, uint32_t width, uint32_t height, uint32_t bpp, uint32_t cache_flags, struct tiler_bo *bo) {
+	struct drm_omap_gem_new gem_new;
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if ((bpp != 16 && bpp != 32) || width == 0 || height == 0)
+		return -EINVAL;
+
+	/*
+		Without a TILED flag omapdrm backs a SCANOUT buffer with shmem pages
+		and pins it through the DMM in page mode when it is scanned out; it
+		only falls back to contiguous memory on parts without a DMM
+	*/
+	memset(&gem_new, 0, sizeof(gem_new));
+	bo->pitch = width * (bpp / 8);
+	bo->size = ((uint64_t)bo->pitch * height + page_size - 1) & ~(uint64_t)(page_size - 1);
+	gem_new.size.bytes = bo->size;
+	gem_new.flags = cache_flags | OMAP_BO_SCANOUT;
+	if (tiler_bo_ioctl(fd, DRM_IOCTL_OMAP_GEM_NEW, (char *) &gem_new) != 0)
+		return -errno;
+
+	bo->handle = gem_new.handle;
+	bo->height = height;
+	bo->bpp = bpp;
+	bo->flags = gem_new.flags;
+	return 0;
+}
+
+void tiler_bo_free(int fd, struct tiler_bo *bo) {
+	struct drm_gem_close gem_close;
+	memset(&gem_close, 0, sizeof(gem_close));
+	gem_close.handle = bo->handle;
+	tiler_bo_ioctl(fd, DRM_IOCTL_GEM_CLOSE, (char *) &gem_close);
+	bo->handle = 0;
+}
+
+/*
+	Buffer broker client, see tiler_broker.h
+*/
+
+#define MAX_BROKERED 32
+
+struct brokered_bo {
+	int fd;
+	uint32_t handle;
+	uint32_t id;
+};
+
+static int broker_sock = -1;
+static struct brokered_bo brokered[MAX_BROKERED];
+static pthread_mutex_t broker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int broker_connect(const char *path) {
+	if (broker_sock >= 0 || !path)
+		return broker_sock;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, *path ? path : TILER_BROKER_SOCKET, sizeof(addr.sun_path) - 1);
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		printf("broker: cannot connect to %s: %d\n", addr.sun_path, errno);
+		close(sock);
+		sock = -1;
+	}
+	broker_sock = sock;
+	return sock;
+}
+
+int tiler_bo_borrow(int fd, const char *path, uint32_t height, uint32_t bpp, struct tiler_bo *bo) {
+	int ret = -ENOENT;
+	pthread_mutex_lock(&broker_lock);
+	int sock = broker_connect(path);
+	if (sock < 0)
+		goto out;
+	/* A buffer that can't be recorded could never be returned, so don't borrow it */
+	struct brokered_bo *slot = NULL;
+	for (int i = 0; i < MAX_BROKERED && !slot; i++)
+		if (brokered[i].handle == 0)
+			slot = &brokered[i];
+	if (!slot) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	struct tiler_broker_request req = { TILER_BROKER_ALLOC, 0, height, bpp };
+	struct tiler_broker_reply reply;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { &reply, sizeof(reply) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if (send(sock, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) ||
+			recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(reply)) {
+		ret = -EIO;
+		goto out;
+	}
+	ret = reply.status;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (ret != 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		if (ret == 0)
+			ret = -EIO;
+		goto out;
+	}
+	int dmabuf;
+	memcpy(&dmabuf, CMSG_DATA(cmsg), sizeof(int));
+
+	struct drm_prime_handle prime;
+	memset(&prime, 0, sizeof(prime));
+	prime.fd = dmabuf;
+	ret = tiler_bo_ioctl(fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, (char *)&prime) == 0 ? 0 : -errno;
+	close(dmabuf);
+	if (ret != 0) {
+		struct tiler_broker_request free_req = { TILER_BROKER_FREE, reply.id, 0, 0 };
+		send(sock, &free_req, sizeof(free_req), MSG_NOSIGNAL);
+		goto out;
+	}
+
+	bo->handle = prime.handle;
+	bo->height = reply.height;
+	bo->bpp = bpp;
+	bo->pitch = reply.pitch;
+	bo->size = reply.size;
+	/* The broker's pool is allocated like tiler_bo_new(..., OMAP_BO_WC, ...) */
+	bo->flags = (bpp == 16 ? OMAP_BO_TILED_16 : OMAP_BO_TILED_32) | OMAP_BO_WC | OMAP_BO_SCANOUT;
+	slot->fd = fd;
+	slot->handle = prime.handle;
+	slot->id = reply.id;
+out:
+	pthread_mutex_unlock(&broker_lock);
+	return ret;
+}
+
+void tiler_bo_return(int fd, uint32_t handle) {
+	pthread_mutex_lock(&broker_lock);
+	for (int i = 0; i < MAX_BROKERED; i++) {
+		if (brokered[i].handle == handle && brokered[i].fd == fd) {
+			struct tiler_broker_request req = { TILER_BROKER_FREE, brokered[i].id, 0, 0 };
+			if (broker_sock >= 0)
+				send(broker_sock, &req, sizeof(req), MSG_NOSIGNAL);
+			brokered[i].handle = 0;
+		}
+	}
+	pthread_mutex_unlock(&broker_lock);
+}
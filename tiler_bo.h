@@ -0,0 +1,74 @@
+/*
+
+OpenGL TILER rotation shim - TILER buffer allocation
+
+Shared between the shim, the buffer broker and libtiler_image.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef TILER_BO_H
+#define TILER_BO_H
+
+#include <stdint.h>
+
+/* TILER containers need a fixed width of 8192 (which seems to be required afaics) */
+#define TILER_BO_WIDTH 8192
+
+struct tiler_bo {
+	uint32_t handle;
+	uint32_t height;
+	uint32_t bpp;
+	uint32_t pitch;
+	uint64_t size;
+	uint32_t flags;
+};
+
+/*
+	ioctl used for allocation. The shim points this at libc's ioctl so that
+	its own allocations don't go back through the interposed one.
+*/
+extern int (*tiler_bo_ioctl)(int fd, unsigned long request, char *argp);
+
+/*
+	Allocate a tiled scanout buffer of TILER_BO_WIDTH x height at 16 or
+	32bpp. cache_flags is one of OMAP_BO_WC, OMAP_BO_CACHED or
+	OMAP_BO_UNCACHED. Returns 0 or -errno.
+*/
+int tiler_bo_new(int fd, uint32_t height, uint32_t bpp, uint32_t cache_flags, struct tiler_bo *bo);
+
+/* As tiler_bo_new, with a container narrower than TILER_BO_WIDTH (for the autotuner and sub-allocation) */
+int tiler_bo_new_width(int fd, uint32_t width, uint32_t height, uint32_t bpp, uint32_t cache_flags, struct tiler_bo *bo);
+
+/*
+	Allocate an untiled width x height scanout buffer that the DMM maps from
+	scattered pages (1D/page mode) rather than contiguous memory. Can't be
+	scanned out rotated. Returns 0 or -errno.
+*/
+int tiler_bo_new_linear(int fd, uint32_t width, uint32_t height, uint32_t bpp, uint32_t cache_flags, struct tiler_bo *bo);
+
+void tiler_bo_free(int fd, struct tiler_bo *bo);
+
+/*
+	Borrow a buffer of at least height rows from the tiler_broker listening
+	at path (TILER_BROKER_SOCKET if empty) instead of allocating one.
+	Returns 0 or -errno; callers fall back to tiler_bo_new on failure.
+	tiler_bo_return gives a borrowed handle back and ignores other handles,
+	so it can be called for every buffer that gets destroyed.
+*/
+int tiler_bo_borrow(int fd, const char *path, uint32_t height, uint32_t bpp, struct tiler_bo *bo);
+void tiler_bo_return(int fd, uint32_t handle);
+
+#endif
@@ -0,0 +1,257 @@
+/*
+
+OpenGL TILER rotation shim - buffer broker
+
+Pre-allocates a pool of tiled scanout buffers and hands them to shimmed
+processes (ROTATE_BROKER=<socket>) as dma-bufs, so app launches get their
+scanout buffers instantly and TILER fragmentation is managed in one place
+rather than by every process allocating and freeing on its own.
+
+Building:
+
+	$ gcc -o tiler_broker tiler_broker.c tiler_bo.c
+
+Using:
+
+	$ tiler_broker [-d /dev/dri/card0] [-s socket] -p 720x32x3 [-p ...]
+
+Each -p HEIGHTxBPPxCOUNT adds COUNT buffers of TILER_BO_WIDTH x HEIGHT at
+BPP to the pool. Requests are served with the smallest free buffer that is
+at least as tall as requested.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <drm/drm.h>
+#include <drm/omap_drm.h>
+
+#include "tiler_bo.h"
+#include "tiler_broker.h"
+
+#define MAX_POOL 64
+#define MAX_CLIENTS 32
+
+struct pool_entry {
+	struct tiler_bo bo;
+	int dmabuf;
+	int owner;      /* client socket holding the buffer, -1 if free */
+};
+
+struct pool_entry pool[MAX_POOL];
+int pool_size = 0;
+int clients[MAX_CLIENTS];
+
+int add_pool(int fd, const char *spec) {
+	unsigned height, bpp, count;
+	if (sscanf(spec, "%ux%ux%u", &height, &bpp, &count) != 3) {
+		fprintf(stderr, "bad pool spec %s, expected HEIGHTxBPPxCOUNT\n", spec);
+		return -1;
+	}
+	for (unsigned i = 0; i < count; i++) {
+		if (pool_size >= MAX_POOL) {
+			fprintf(stderr, "pool full\n");
+			return -1;
+		}
+		struct pool_entry *e = &pool[pool_size];
+		int ret = tiler_bo_new(fd, height, bpp, OMAP_BO_WC, &e->bo);
+		if (ret != 0) {
+			fprintf(stderr, "failed to allocate %ux%u buffer: %d\n", height, bpp, ret);
+			return -1;
+		}
+		struct drm_prime_handle prime;
+		memset(&prime, 0, sizeof(prime));
+		prime.handle = e->bo.handle;
+		prime.flags = DRM_CLOEXEC | DRM_RDWR;
+		if (ioctl(fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime) != 0) {
+			fprintf(stderr, "failed to export buffer: %d\n", errno);
+			tiler_bo_free(fd, &e->bo);
+			return -1;
+		}
+		e->dmabuf = prime.fd;
+		e->owner = -1;
+		pool_size++;
+	}
+	return 0;
+}
+
+void handle_alloc(int sock, struct tiler_broker_request *req) {
+	struct tiler_broker_reply reply;
+	struct pool_entry *best = NULL;
+	memset(&reply, 0, sizeof(reply));
+
+	for (int i = 0; i < pool_size; i++) {
+		struct pool_entry *e = &pool[i];
+		if (e->owner != -1 || e->bo.bpp != req->bpp || e->bo.height < req->height)
+			continue;
+		if (!best || e->bo.height < best->bo.height)
+			best = e;
+	}
+
+	struct iovec iov = { &reply, sizeof(reply) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (best) {
+		best->owner = sock;
+		reply.status = 0;
+		reply.id = best - pool;
+		reply.height = best->bo.height;
+		reply.pitch = best->bo.pitch;
+		reply.size = best->bo.size;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &best->dmabuf, sizeof(int));
+		printf("lent buffer %u (%ux%u) to client %d\n", reply.id, best->bo.height, best->bo.bpp, sock);
+	} else {
+		reply.status = -ENOMEM;
+		printf("no free %ux%u buffer for client %d\n", req->height, req->bpp, sock);
+	}
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 && best)
+		best->owner = -1;
+}
+
+void release_client(int sock) {
+	for (int i = 0; i < pool_size; i++) {
+		if (pool[i].owner == sock) {
+			pool[i].owner = -1;
+			printf("reclaimed buffer %d from client %d\n", i, sock);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *device = "/dev/dri/card0";
+	const char *path = TILER_BROKER_SOCKET;
+	int opt;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	int fd = -1;
+	char *specs[MAX_POOL];
+	int num_specs = 0;
+	while ((opt = getopt(argc, argv, "d:s:p:")) != -1) {
+		switch (opt) {
+		case 'd': device = optarg; break;
+		case 's': path = optarg; break;
+		case 'p':
+			if (num_specs < MAX_POOL)
+				specs[num_specs++] = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-s socket] -p HEIGHTxBPPxCOUNT [-p ...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (num_specs == 0) {
+		fprintf(stderr, "no pool specified\n");
+		return 1;
+	}
+
+	fd = open(device, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s: %d\n", device, errno);
+		return 1;
+	}
+	/* We are authenticated now; let the display client become master */
+	ioctl(fd, DRM_IOCTL_DROP_MASTER, 0);
+
+	for (int i = 0; i < num_specs; i++)
+		if (add_pool(fd, specs[i]) != 0)
+			return 1;
+	printf("allocated %d buffers\n", pool_size);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	unlink(path);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 8) != 0) {
+		fprintf(stderr, "failed to listen on %s: %d\n", path, errno);
+		return 1;
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		clients[i] = -1;
+
+	for (;;) {
+		struct pollfd pfds[MAX_CLIENTS + 1];
+		pfds[0].fd = listen_fd;
+		pfds[0].events = POLLIN;
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			pfds[i + 1].fd = clients[i];
+			pfds[i + 1].events = POLLIN;
+		}
+		if (poll(pfds, MAX_CLIENTS + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		if (pfds[0].revents & POLLIN) {
+			int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			for (int i = 0; sock >= 0 && i < MAX_CLIENTS; i++) {
+				if (clients[i] == -1) {
+					clients[i] = sock;
+					sock = -1;
+				}
+			}
+			if (sock >= 0)
+				close(sock);
+		}
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			if (clients[i] == -1 || !(pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			struct tiler_broker_request req;
+			if (recv(clients[i], &req, sizeof(req), 0) != sizeof(req)) {
+				release_client(clients[i]);
+				close(clients[i]);
+				clients[i] = -1;
+				continue;
+			}
+			if (req.cmd == TILER_BROKER_ALLOC) {
+				handle_alloc(clients[i], &req);
+			} else if (req.cmd == TILER_BROKER_FREE && req.id < pool_size && pool[req.id].owner == clients[i]) {
+				pool[req.id].owner = -1;
+				printf("client %d returned buffer %u\n", clients[i], req.id);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+
+OpenGL TILER rotation shim - buffer broker protocol
+
+tiler_broker owns a pool of pre-allocated tiled scanout buffers and hands
+them out over a SOCK_SEQPACKET Unix socket. A client sends a struct
+tiler_broker_request; TILER_BROKER_ALLOC is answered with a struct
+tiler_broker_reply carrying a dma-buf fd (SCM_RIGHTS) when status is 0.
+TILER_BROKER_FREE returns a buffer to the pool and has no reply. Buffers
+still held when the connection closes (e.g. the process exits) are
+returned to the pool automatically.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef TILER_BROKER_H
+#define TILER_BROKER_H
+
+#include <stdint.h>
+
+#define TILER_BROKER_SOCKET "/tmp/tiler_broker.sock"
+
+#define TILER_BROKER_ALLOC 1
+#define TILER_BROKER_FREE  2
+
+struct tiler_broker_request {
+	uint32_t cmd;
+	uint32_t id;        /* TILER_BROKER_FREE: buffer to return */
+	uint32_t height;    /* TILER_BROKER_ALLOC: minimum height */
+	uint32_t bpp;       /* TILER_BROKER_ALLOC: 16 or 32 */
+};
+
+struct tiler_broker_reply {
+	int32_t status;     /* 0 on success, otherwise a negative errno */
+	uint32_t id;
+	uint32_t height;
+	uint32_t pitch;
+	uint64_t size;
+};
+
+#endif
@@ -0,0 +1,402 @@
+/*
+
+OpenGL TILER rotation shim - image rotation API, see tiler_image.h
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <drm/drm_fourcc.h>
+#include <drm/omap_drm.h>
+
+#include "tiler_bo.h"
+#include "tiler_image.h"
+
+enum image_backend {
+	BACKEND_OMAP,
+	BACKEND_SOFT,
+	BACKEND_FAKE,
+};
+
+/* Plane properties tiler_image_scanout sets */
+enum { FB_ID, CRTC_ID, SRC_X, SRC_Y, SRC_W, SRC_H, CRTC_X, CRTC_Y, CRTC_W, CRTC_H, ROTATION, NUM_PROPS };
+static const char *const prop_names[NUM_PROPS] = {
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "rotation",
+};
+
+struct tiler_image {
+	enum image_backend backend;
+	int fd;
+	uint32_t width, height, bpp;
+	struct tiler_bo bo;
+	int borrowed;
+	uint32_t fb_id;
+	void *map;
+	uint32_t pitch;
+	uint64_t map_size;
+
+	/* soft: rotated copy being scanned out */
+	struct tiler_bo dumb;
+	void *dumb_map;
+	uint32_t dumb_fb;
+	int dumb_rotation;
+
+	/* scanout: property ids of props_plane, -1 for ones it lacks */
+	uint32_t props_plane;
+	int props[NUM_PROPS];
+	int atomic_cap;
+};
+
+static void image_free_bo(struct tiler_image *img);
+static void image_free_dumb(struct tiler_image *img);
+
+static enum image_backend image_default_backend(void) {
+	const char *name = getenv("TILER_IMAGE_BACKEND");
+	if (name && strcmp(name, "soft") == 0)
+		return BACKEND_SOFT;
+	if (name && strcmp(name, "fake") == 0)
+		return BACKEND_FAKE;
+	return BACKEND_OMAP;
+}
+
+static int image_omap_alloc(struct tiler_image *img) {
+	const char *broker = getenv("ROTATE_BROKER");
+	if (broker && tiler_bo_borrow(img->fd, broker, img->height, img->bpp, &img->bo) == 0) {
+		img->borrowed = 1;
+	} else {
+		int ret = tiler_bo_new(img->fd, img->height, img->bpp, OMAP_BO_WC, &img->bo);
+		if (ret != 0)
+			return ret;
+	}
+
+	struct drm_omap_gem_info info;
+	memset(&info, 0, sizeof(info));
+	info.handle = img->bo.handle;
+	if (tiler_bo_ioctl(img->fd, DRM_IOCTL_OMAP_GEM_INFO, (char *)&info) == 0) {
+		void *map = mmap(NULL, img->bo.size, PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, info.offset);
+		if (map != MAP_FAILED) {
+			img->map = map;
+			img->map_size = img->bo.size;
+		}
+	}
+	img->pitch = img->bo.pitch;
+	return 0;
+}
+
+struct tiler_image *tiler_image_alloc(int drm_fd, uint32_t width, uint32_t height, uint32_t bpp) {
+	if ((bpp != 16 && bpp != 32) || width == 0 || height == 0 || width > TILER_BO_WIDTH)
+		return NULL;
+	struct tiler_image *img = calloc(1, sizeof(*img));
+	if (!img)
+		return NULL;
+	img->backend = image_default_backend();
+	img->fd = drm_fd;
+	img->width = width;
+	img->height = height;
+	img->bpp = bpp;
+
+	if (img->backend == BACKEND_OMAP) {
+		int ret = image_omap_alloc(img);
+		if (ret != 0 || !img->map) {
+			printf("tiler_image: tiled allocation failed (%d), using soft backend\n", ret);
+			if (ret == 0)
+				image_free_bo(img);
+			img->backend = BACKEND_SOFT;
+		}
+	}
+	if (img->backend != BACKEND_OMAP) {
+		img->pitch = width * (bpp / 8);
+		img->map_size = (uint64_t)img->pitch * height;
+		img->map = calloc(1, img->map_size);
+		if (!img->map) {
+			free(img);
+			return NULL;
+		}
+	}
+	return img;
+}
+
+void *tiler_image_map(struct tiler_image *img, uint32_t *pitch) {
+	if (pitch)
+		*pitch = img->pitch;
+	return img->map;
+}
+
+uint32_t tiler_image_handle(struct tiler_image *img) {
+	return img->backend == BACKEND_OMAP ? img->bo.handle : 0;
+}
+
+int tiler_image_write(struct tiler_image *img, const void *src, uint32_t src_pitch) {
+	uint32_t row = img->width * (img->bpp / 8);
+	for (uint32_t y = 0; y < img->height; y++)
+		memcpy((uint8_t *)img->map + (uint64_t)y * img->pitch, (const uint8_t *)src + (uint64_t)y * src_pitch, row);
+	return 0;
+}
+
+/*
+	Rotate counter-clockwise in 32x32 pixel blocks so that both the source
+	rows and the destination rows of a block stay in cache.
+*/
+
+#define ROTATE_BLOCK 32
+
+#define ROTATE_COPY(type) \
+	for (uint32_t by = 0; by < h; by += ROTATE_BLOCK) \
+		for (uint32_t bx = 0; bx < w; bx += ROTATE_BLOCK) \
+			for (uint32_t y = by; y < h && y < by + ROTATE_BLOCK; y++) { \
+				const type *s = (const type *)(src + (uint64_t)y * src_pitch); \
+				for (uint32_t x = bx; x < w && x < bx + ROTATE_BLOCK; x++) { \
+					uint32_t dx, dy; \
+					switch (rotation) { \
+					case 90: dx = y; dy = w - 1 - x; break; \
+					case 180: dx = w - 1 - x; dy = h - 1 - y; break; \
+					case 270: dx = h - 1 - y; dy = x; break; \
+					default: dx = x; dy = y; break; \
+					} \
+					((type *)(dst + (uint64_t)dy * dst_pitch))[dx] = s[x]; \
+				} \
+			}
+
+static void rotate_copy(const uint8_t *src, uint32_t src_pitch, uint8_t *dst, uint32_t dst_pitch,
+		uint32_t w, uint32_t h, uint32_t bpp, int rotation) {
+	if (bpp == 16) {
+		ROTATE_COPY(uint16_t)
+	} else {
+		ROTATE_COPY(uint32_t)
+	}
+}
+
+int tiler_image_read(struct tiler_image *img, int rotation, void *dst, uint32_t dst_pitch) {
+	if (rotation != 0 && rotation != 90 && rotation != 180 && rotation != 270)
+		return -EINVAL;
+	if (!img->map)
+		return -ENOMEM;
+	rotate_copy(img->map, img->pitch, dst, dst_pitch, img->width, img->height, img->bpp, rotation);
+	return 0;
+}
+
+static int image_plane_props(int fd, uint32_t plane_id, const char *const *names, int count, int *props) {
+	uint32_t ids[64];
+	uint64_t values[64];
+	struct drm_mode_obj_get_properties get_props;
+	memset(&get_props, 0, sizeof(get_props));
+	get_props.props_ptr = (uint64_t)(uintptr_t)ids;
+	get_props.prop_values_ptr = (uint64_t)(uintptr_t)values;
+	get_props.count_props = 64;
+	get_props.obj_id = plane_id;
+	get_props.obj_type = DRM_MODE_OBJECT_PLANE;
+	if (tiler_bo_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, (char *)&get_props) != 0)
+		return -errno;
+	/* The kernel fills nothing, only the count, when there are more than asked for */
+	if (get_props.count_props > 64)
+		return -E2BIG;
+
+	for (int i = 0; i < count; i++)
+		props[i] = -1;
+	for (uint32_t i = 0; i < get_props.count_props; i++) {
+		struct drm_mode_get_property get_prop;
+		memset(&get_prop, 0, sizeof(get_prop));
+		get_prop.prop_id = ids[i];
+		if (tiler_bo_ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, (char *)&get_prop) != 0)
+			continue;
+		for (int j = 0; j < count; j++)
+			if (strcmp(get_prop.name, names[j]) == 0)
+				props[j] = ids[i];
+	}
+	return 0;
+}
+
+static int image_add_fb(int fd, uint32_t handle, uint32_t width, uint32_t height, uint32_t pitch, uint32_t bpp, uint32_t *fb_id) {
+	struct drm_mode_fb_cmd2 fb;
+	memset(&fb, 0, sizeof(fb));
+	fb.width = width;
+	fb.height = height;
+	fb.pixel_format = bpp == 16 ? DRM_FORMAT_RGB565 : DRM_FORMAT_XRGB8888;
+	fb.handles[0] = handle;
+	fb.pitches[0] = pitch;
+	if (tiler_bo_ioctl(fd, DRM_IOCTL_MODE_ADDFB2, (char *)&fb) != 0)
+		return -errno;
+	*fb_id = fb.fb_id;
+	return 0;
+}
+
+/* Copy the rotated image into a dumb buffer so it can be scanned out unrotated */
+static int image_soft_prepare(struct tiler_image *img, int rotation, uint32_t *fb_id) {
+	int swap = rotation == 90 || rotation == 270;
+	uint32_t w = swap ? img->height : img->width;
+	uint32_t h = swap ? img->width : img->height;
+
+	if (!img->dumb_map || (img->dumb_rotation == 90 || img->dumb_rotation == 270) != swap) {
+		if (img->dumb_map)
+			image_free_dumb(img);
+		struct drm_mode_create_dumb create;
+		memset(&create, 0, sizeof(create));
+		create.width = w;
+		create.height = h;
+		create.bpp = img->bpp;
+		if (tiler_bo_ioctl(img->fd, DRM_IOCTL_MODE_CREATE_DUMB, (char *)&create) != 0)
+			return -errno;
+		img->dumb.handle = create.handle;
+		img->dumb.pitch = create.pitch;
+		img->dumb.size = create.size;
+
+		struct drm_mode_map_dumb map_dumb;
+		memset(&map_dumb, 0, sizeof(map_dumb));
+		map_dumb.handle = create.handle;
+		void *map = MAP_FAILED;
+		if (tiler_bo_ioctl(img->fd, DRM_IOCTL_MODE_MAP_DUMB, (char *)&map_dumb) == 0)
+			map = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, map_dumb.offset);
+		int ret = map == MAP_FAILED ? -ENOMEM :
+			image_add_fb(img->fd, create.handle, w, h, create.pitch, img->bpp, &img->dumb_fb);
+		if (map != MAP_FAILED)
+			img->dumb_map = map;
+		if (ret != 0) {
+			image_free_dumb(img);
+			return ret;
+		}
+	}
+	rotate_copy(img->map, img->pitch, img->dumb_map, img->dumb.pitch, img->width, img->height, img->bpp, rotation);
+	img->dumb_rotation = rotation;
+	*fb_id = img->dumb_fb;
+	return 0;
+}
+
+int tiler_image_scanout(struct tiler_image *img, uint32_t plane_id, uint32_t crtc_id,
+		int rotation, int32_t x, int32_t y) {
+	if (rotation != 0 && rotation != 90 && rotation != 180 && rotation != 270)
+		return -EINVAL;
+	if (img->backend == BACKEND_FAKE) {
+		if (getenv("TILER_IMAGE_DEBUG"))
+			printf("tiler_image fake: %ux%u rotated %d on plane %u crtc %u at %d,%d\n",
+				img->width, img->height, rotation, plane_id, crtc_id, x, y);
+		return 0;
+	}
+
+	uint32_t fb_id;
+	int plane_rotation = rotation;
+	if (img->backend == BACKEND_OMAP) {
+		if (!img->fb_id) {
+			int ret = image_add_fb(img->fd, img->bo.handle, img->width, img->height, img->pitch, img->bpp, &img->fb_id);
+			if (ret != 0)
+				return ret;
+		}
+		fb_id = img->fb_id;
+	} else {
+		int ret = image_soft_prepare(img, rotation, &fb_id);
+		if (ret != 0)
+			return ret;
+		plane_rotation = 0;
+	}
+
+	/* Property ids don't change, so only look them up when the plane does */
+	int *props = img->props;
+	if (img->props_plane != plane_id) {
+		img->props_plane = 0;
+		int ret = image_plane_props(img->fd, plane_id, prop_names, NUM_PROPS, props);
+		if (ret != 0)
+			return ret;
+		img->props_plane = plane_id;
+	}
+	if (plane_rotation != 0 && props[ROTATION] < 0)
+		return -ENOTSUP;
+
+	/* Source is in buffer orientation, destination in panel orientation */
+	int swap = rotation == 90 || rotation == 270;
+	uint32_t src_w = (img->backend == BACKEND_OMAP || !swap) ? img->width : img->height;
+	uint32_t src_h = (img->backend == BACKEND_OMAP || !swap) ? img->height : img->width;
+	uint64_t values[NUM_PROPS] = {
+		fb_id, crtc_id, 0, 0, (uint64_t)src_w << 16, (uint64_t)src_h << 16,
+		(uint64_t)(int64_t)x, (uint64_t)(int64_t)y,
+		swap ? img->height : img->width, swap ? img->width : img->height,
+		plane_rotation == 90 ? DRM_MODE_ROTATE_90 : plane_rotation == 180 ? DRM_MODE_ROTATE_180 :
+			plane_rotation == 270 ? DRM_MODE_ROTATE_270 : DRM_MODE_ROTATE_0,
+	};
+
+	uint32_t prop_ids[NUM_PROPS];
+	uint64_t prop_values[NUM_PROPS];
+	uint32_t count = 0;
+	for (int i = 0; i < NUM_PROPS; i++) {
+		if (props[i] < 0)
+			continue;
+		prop_ids[count] = props[i];
+		prop_values[count++] = values[i];
+	}
+
+	if (!img->atomic_cap) {
+		struct drm_set_client_cap atomic_cap;
+		atomic_cap.capability = DRM_CLIENT_CAP_ATOMIC;
+		atomic_cap.value = 1;
+		img->atomic_cap = tiler_bo_ioctl(img->fd, DRM_IOCTL_SET_CLIENT_CAP, (char *)&atomic_cap) == 0;
+	}
+
+	struct drm_mode_atomic atomic;
+	memset(&atomic, 0, sizeof(atomic));
+	atomic.count_objs = 1;
+	atomic.objs_ptr = (uint64_t)(uintptr_t)&plane_id;
+	atomic.count_props_ptr = (uint64_t)(uintptr_t)&count;
+	atomic.props_ptr = (uint64_t)(uintptr_t)prop_ids;
+	atomic.prop_values_ptr = (uint64_t)(uintptr_t)prop_values;
+	if (tiler_bo_ioctl(img->fd, DRM_IOCTL_MODE_ATOMIC, (char *)&atomic) != 0)
+		return -errno;
+	return 0;
+}
+
+static void image_free_dumb(struct tiler_image *img) {
+	if (img->dumb_fb)
+		tiler_bo_ioctl(img->fd, DRM_IOCTL_MODE_RMFB, (char *)&img->dumb_fb);
+	if (img->dumb_map)
+		munmap(img->dumb_map, img->dumb.size);
+	if (img->dumb.handle) {
+		struct drm_mode_destroy_dumb destroy;
+		destroy.handle = img->dumb.handle;
+		tiler_bo_ioctl(img->fd, DRM_IOCTL_MODE_DESTROY_DUMB, (char *)&destroy);
+	}
+	img->dumb_fb = 0;
+	img->dumb_map = NULL;
+	img->dumb.handle = 0;
+}
+
+static void image_free_bo(struct tiler_image *img) {
+	if (img->fb_id)
+		tiler_bo_ioctl(img->fd, DRM_IOCTL_MODE_RMFB, (char *)&img->fb_id);
+	if (img->map)
+		munmap(img->map, img->map_size);
+	if (img->borrowed)
+		tiler_bo_return(img->fd, img->bo.handle);
+	tiler_bo_free(img->fd, &img->bo);
+	img->fb_id = 0;
+	img->map = NULL;
+}
+
+void tiler_image_free(struct tiler_image *img) {
+	if (!img)
+		return;
+	if (img->backend == BACKEND_OMAP) {
+		image_free_bo(img);
+	} else {
+		image_free_dumb(img);
+		free(img->map);
+	}
+	free(img);
+}
@@ -0,0 +1,80 @@
+/*
+
+OpenGL TILER rotation shim - image rotation API
+
+Rotates images (camera frames, decoded pictures, ...) using TILER buffers
+instead of a strided CPU copy. An image is allocated as a tiled buffer,
+written through its 0 degree view and then either scanned out on a plane
+through a 90, 180 or 270 degree view, which costs nothing but a plane
+property, or read back rotated into ordinary memory.
+
+Mainline omapdrm only maps the 0 degree TILER view to the CPU, so reading
+a rotated view is done in software with a cache-blocked copy; scanout is
+where the rotation is free. Angles are counter-clockwise like
+DRM_MODE_ROTATE_*.
+
+Backends, picked with TILER_IMAGE_BACKEND:
+
+	omap  tiled buffers from OMAP_GEM_NEW, borrowed from tiler_broker
+	      when ROTATE_BROKER is set (the default; falls back to soft if
+	      the device cannot allocate them)
+	soft  plain memory; scanout rotates into a dumb buffer on the CPU
+	fake  plain memory and no device at all; scanout only records the
+	      request (printed with TILER_IMAGE_DEBUG), for testing clients
+
+Scanout uses the atomic API on the fd passed to tiler_image_alloc.
+
+Building:
+
+	$ gcc -shared -fpic -o libtiler_image.so tiler_image.c tiler_bo.c -lpthread
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef TILER_IMAGE_H
+#define TILER_IMAGE_H
+
+#include <stdint.h>
+
+struct tiler_image;
+
+/* width x height at 16 (RGB565) or 32 (XRGB8888) bpp. Returns NULL on failure */
+struct tiler_image *tiler_image_alloc(int drm_fd, uint32_t width, uint32_t height, uint32_t bpp);
+
+/* CPU mapping of the 0 degree view, or NULL */
+void *tiler_image_map(struct tiler_image *img, uint32_t *pitch);
+
+/* Copy width x height pixels into the 0 degree view */
+int tiler_image_write(struct tiler_image *img, const void *src, uint32_t src_pitch);
+
+/*
+	Copy the image rotated by rotation (0, 90, 180 or 270) into dst, which
+	is height x width for 90 and 270. Returns 0 or -errno.
+*/
+int tiler_image_read(struct tiler_image *img, int rotation, void *dst, uint32_t dst_pitch);
+
+/*
+	Show the image rotated by rotation on plane_id at x, y of crtc_id.
+	Returns 0 or -errno.
+*/
+int tiler_image_scanout(struct tiler_image *img, uint32_t plane_id, uint32_t crtc_id,
+	int rotation, int32_t x, int32_t y);
+
+/* GEM handle of the underlying buffer, 0 for memory backed images */
+uint32_t tiler_image_handle(struct tiler_image *img);
+
+void tiler_image_free(struct tiler_image *img);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+
+OpenGL TILER rotation shim - hardware plane offload client library
+
+Forwards to tiler_shim.so when it is loaded, otherwise provides the local
+stand-in described in tiler_offload.h.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "tiler_offload.h"
+
+/*
+	Stand-in backend: no DRM device, buffers are malloc'd and a fixed
+	number of fake planes is handed out with the same rules as the shim
+*/
+
+struct tiler_offload {
+	uint32_t crtc_id;
+	int num_planes;
+	uint32_t next_handle;
+	int debug;
+};
+
+struct tiler_offload *standin_open(int drm_fd, uint32_t crtc_id) {
+	struct tiler_offload *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	const char *planes = getenv("TILER_OFFLOAD_FAKE_PLANES");
+	ctx->crtc_id = crtc_id;
+	ctx->num_planes = planes ? atoi(planes) : 2;
+	ctx->next_handle = 1;
+	ctx->debug = getenv("TILER_OFFLOAD_DEBUG") != NULL;
+	return ctx;
+}
+
+int standin_alloc(struct tiler_offload *ctx, struct tiler_offload_layer *layer) {
+	if ((layer->bpp != 16 && layer->bpp != 32) || layer->width == 0 || layer->height == 0)
+		return -EINVAL;
+	layer->pitch = layer->width * (layer->bpp / 8);
+	layer->size = (uint64_t)layer->pitch * layer->height;
+	layer->map = calloc(1, layer->size);
+	if (!layer->map)
+		return -ENOMEM;
+	layer->handle = ctx->next_handle++;
+	layer->fb_id = layer->handle;
+	layer->plane_id = 0;
+	return 0;
+}
+
+void standin_free(struct tiler_offload *ctx, struct tiler_offload_layer *layer) {
+	free(layer->map);
+	layer->map = NULL;
+	layer->handle = 0;
+	layer->fb_id = 0;
+}
+
+int standin_commit(struct tiler_offload *ctx, struct tiler_offload_layer *layers, int count) {
+	int order[TILER_OFFLOAD_MAX_LAYERS];
+	if (count > TILER_OFFLOAD_MAX_LAYERS)
+		count = TILER_OFFLOAD_MAX_LAYERS;
+	tiler_offload_order(layers, count, order);
+
+	int placed = 0;
+	for (int i = 0; i < count; i++) {
+		struct tiler_offload_layer *layer = &layers[order[i]];
+		if (placed == i && placed < ctx->num_planes) {
+			layer->plane_id = 1000 + placed;
+			placed++;
+		} else {
+			layer->plane_id = 0;
+		}
+		if (ctx->debug)
+			printf("offload stand-in: layer z=%u %ux%u at %d,%d -> plane %u\n",
+				layer->zpos, layer->width, layer->height, layer->x, layer->y, layer->plane_id);
+	}
+	return placed;
+}
+
+void standin_close(struct tiler_offload *ctx) {
+	free(ctx);
+}
+
+const struct tiler_offload_ops standin_ops = {
+	standin_open, standin_alloc, standin_free, standin_commit, standin_close,
+};
+
+const struct tiler_offload_ops *offload_ops = NULL;
+
+struct tiler_offload *tiler_offload_open(int drm_fd, uint32_t crtc_id) {
+	if (!offload_ops) {
+		const char *standin = getenv("TILER_OFFLOAD_STANDIN");
+		if (!standin || !atoi(standin))
+			offload_ops = dlsym(RTLD_DEFAULT, "tiler_shim_offload_ops");
+		if (!offload_ops)
+			offload_ops = &standin_ops;
+	}
+	return offload_ops->open(drm_fd, crtc_id);
+}
+
+int tiler_offload_alloc(struct tiler_offload *ctx, struct tiler_offload_layer *layer) {
+	return offload_ops->alloc(ctx, layer);
+}
+
+void tiler_offload_free(struct tiler_offload *ctx, struct tiler_offload_layer *layer) {
+	offload_ops->free(ctx, layer);
+}
+
+int tiler_offload_commit(struct tiler_offload *ctx, struct tiler_offload_layer *layers, int count) {
+	return offload_ops->commit(ctx, layers, count);
+}
+
+void tiler_offload_close(struct tiler_offload *ctx) {
+	offload_ops->close(ctx);
+}
@@ -0,0 +1,106 @@
+/*
+
+OpenGL TILER rotation shim - hardware plane offload
+
+Lets a client hand up to TILER_OFFLOAD_MAX_LAYERS layers (e.g. a video or
+3D layer plus a UI overlay) to the display instead of compositing them on
+the GPU every frame. Each layer gets its own tiled buffer; on commit the
+layers are assigned, top-most first, to rotation-capable overlay planes
+with their z-order and alpha. Layers left with plane_id == 0 did not get a
+plane and must be composited by the client into its primary buffer as
+before; every layer below such a layer is also left to the client so the
+stacking order is preserved.
+
+All positions and sizes are in the orientation the application renders
+in; the shim rotates them into panel coordinates.
+
+When the process runs under tiler_shim.so, libtiler_offload.so forwards to
+the shim. Otherwise (or with TILER_OFFLOAD_STANDIN=1) a local stand-in is
+used that needs no DRM device: buffers are plain memory and
+TILER_OFFLOAD_FAKE_PLANES (default 2) planes are pretended to exist, so
+clients can exercise the API and their fallback path anywhere.
+
+Building:
+
+	$ gcc -shared -fpic -o libtiler_offload.so tiler_offload.c -ldl
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef TILER_OFFLOAD_H
+#define TILER_OFFLOAD_H
+
+#include <stdint.h>
+
+#define TILER_OFFLOAD_MAX_LAYERS 4
+
+struct tiler_offload_layer {
+	/* Set by the client */
+	uint32_t width, height;     /* buffer size */
+	uint32_t bpp;               /* 16 or 32 */
+	int has_alpha;              /* 32bpp only: ARGB8888 instead of XRGB8888 */
+	int32_t x, y;               /* position on screen */
+	uint32_t zpos;              /* higher is on top */
+	uint16_t alpha;             /* plane alpha, 0xffff is opaque */
+
+	/* Filled in by tiler_offload_alloc */
+	uint32_t handle;
+	uint32_t fb_id;
+	uint32_t pitch;
+	uint64_t size;
+	void *map;                  /* CPU mapping, NULL if unavailable */
+
+	/* Filled in by tiler_offload_commit */
+	uint32_t plane_id;          /* 0: composite this layer on the GPU */
+};
+
+struct tiler_offload;
+
+/* Returns NULL on failure */
+struct tiler_offload *tiler_offload_open(int drm_fd, uint32_t crtc_id);
+int tiler_offload_alloc(struct tiler_offload *ctx, struct tiler_offload_layer *layer);
+void tiler_offload_free(struct tiler_offload *ctx, struct tiler_offload_layer *layer);
+/* Returns the number of layers placed on planes, or a negative errno */
+int tiler_offload_commit(struct tiler_offload *ctx, struct tiler_offload_layer *layers, int count);
+void tiler_offload_close(struct tiler_offload *ctx);
+
+/*
+	Backend interface, implemented by tiler_shim.so (exported as
+	tiler_shim_offload_ops) and by the stand-in
+*/
+struct tiler_offload_ops {
+	struct tiler_offload *(*open)(int drm_fd, uint32_t crtc_id);
+	int (*alloc)(struct tiler_offload *ctx, struct tiler_offload_layer *layer);
+	void (*free)(struct tiler_offload *ctx, struct tiler_offload_layer *layer);
+	int (*commit)(struct tiler_offload *ctx, struct tiler_offload_layer *layers, int count);
+	void (*close)(struct tiler_offload *ctx);
+};
+
+/*
+	Order layers top-most first, which is the order planes are handed out
+	in. Shared by both backends so they agree on the assignment.
+*/
+static inline void tiler_offload_order(const struct tiler_offload_layer *layers, int count, int *order) {
+	for (int i = 0; i < count; i++)
+		order[i] = i;
+	for (int i = 1; i < count; i++) {
+		int o = order[i], j = i;
+		for (; j > 0 && layers[order[j - 1]].zpos < layers[o].zpos; j--)
+			order[j] = order[j - 1];
+		order[j] = o;
+	}
+}
+
+#endif
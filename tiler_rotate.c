@@ -0,0 +1,227 @@
+/*
+
+OpenGL TILER rotation shim - rotation library
+
+See tiler_rotate.h.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <drm/omap_drm.h>
+
+#include "tiler_bo.h"
+#include "tiler_rotate.h"
+
+#define MAX_PROPS 64
+#define MAX_PLANES 16
+
+struct tiler_rotate {
+	int fd;
+	uint32_t rotation;
+};
+
+int tiler_rotate_swaps_axes(uint32_t rotation) {
+	return (rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270)) != 0;
+}
+
+void tiler_rotate_mode(uint32_t rotation, struct drm_mode_modeinfo *mode) {
+	if (!tiler_rotate_swaps_axes(rotation))
+		return;
+	uint16_t temp = mode->hdisplay;
+	mode->hdisplay = mode->vdisplay;
+	mode->vdisplay = temp;
+}
+
+void tiler_rotate_rect(uint32_t rotation, uint32_t phys_w, uint32_t phys_h,
+		int32_t *x, int32_t *y, uint32_t *w, uint32_t *h) {
+	int32_t ox = *x, oy = *y;
+	uint32_t ow = *w, oh = *h;
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		*x = oy;
+		*y = (int32_t)phys_h - (ox + (int32_t)ow);
+		*w = oh;
+		*h = ow;
+		break;
+	case DRM_MODE_ROTATE_180:
+		*x = (int32_t)phys_w - (ox + (int32_t)ow);
+		*y = (int32_t)phys_h - (oy + (int32_t)oh);
+		break;
+	case DRM_MODE_ROTATE_270:
+		*x = (int32_t)phys_w - (oy + (int32_t)oh);
+		*y = ox;
+		*w = oh;
+		*h = ow;
+		break;
+	}
+}
+
+int tiler_rotate_property(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, uint64_t *value) {
+	uint32_t properties[MAX_PROPS];
+	uint64_t prop_values[MAX_PROPS];
+	struct drm_mode_obj_get_properties get_props;
+	memset(&get_props, 0, sizeof(get_props));
+	get_props.props_ptr = (uint64_t)(uintptr_t)properties;
+	get_props.prop_values_ptr = (uint64_t)(uintptr_t)prop_values;
+	get_props.count_props = MAX_PROPS;
+	get_props.obj_id = obj_id;
+	get_props.obj_type = obj_type;
+	int ret = tiler_bo_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, (char *)&get_props);
+	if (ret != 0)
+		return ret;
+	if (get_props.count_props > MAX_PROPS)
+		get_props.count_props = MAX_PROPS;
+
+	for (uint32_t i = 0; i < get_props.count_props; i++) {
+		uint64_t values[MAX_PROPS];
+		uint64_t enum_blob[MAX_PROPS];
+		struct drm_mode_get_property get_prop;
+		memset(&get_prop, 0, sizeof(get_prop));
+		get_prop.values_ptr = (uint64_t)(uintptr_t)values;
+		get_prop.enum_blob_ptr = (uint64_t)(uintptr_t)enum_blob;
+		get_prop.count_values = MAX_PROPS;
+		get_prop.count_enum_blobs = MAX_PROPS;
+		get_prop.prop_id = properties[i];
+		ret = tiler_bo_ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, (char *)&get_prop);
+		if (ret != 0)
+			return ret;
+		if (strcmp(get_prop.name, name) == 0) {
+			if (value)
+				*value = prop_values[i];
+			return properties[i];
+		}
+	}
+
+	return -1;
+}
+
+int tiler_rotate_plane(int fd, uint32_t plane_id, int rotation_prop, uint32_t rotation, uint32_t flags) {
+	if (rotation_prop < 0)
+		return -EINVAL;
+	uint32_t count_props = 1;
+	uint32_t prop = rotation_prop;
+	uint64_t value = rotation;
+	struct drm_mode_atomic atomic;
+	memset(&atomic, 0, sizeof(atomic));
+	atomic.flags = flags;
+	atomic.count_objs = 1;
+	atomic.objs_ptr = (uint64_t)(uintptr_t)&plane_id;
+	atomic.count_props_ptr = (uint64_t)(uintptr_t)&count_props;
+	atomic.props_ptr = (uint64_t)(uintptr_t)&prop;
+	atomic.prop_values_ptr = (uint64_t)(uintptr_t)&value;
+	if (tiler_bo_ioctl(fd, DRM_IOCTL_MODE_ATOMIC, (char *)&atomic) != 0)
+		return -errno;
+	return 0;
+}
+
+static uint32_t rotation_from_env(void) {
+	const char *angle = getenv("ROTATE_ANGLE");
+	switch (angle ? atoi(angle) : 270) {
+	case 90: return DRM_MODE_ROTATE_90;
+	case 180: return DRM_MODE_ROTATE_180;
+	case 360: return DRM_MODE_ROTATE_0;
+	default: return DRM_MODE_ROTATE_270;
+	}
+}
+
+struct tiler_rotate *tiler_rotate_open(int drm_fd, uint32_t rotation) {
+	struct tiler_rotate *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->fd = drm_fd;
+	ctx->rotation = rotation ? rotation : rotation_from_env();
+	return ctx;
+}
+
+uint32_t tiler_rotate_rotation(struct tiler_rotate *ctx) {
+	return ctx->rotation;
+}
+
+int tiler_rotate_alloc(struct tiler_rotate *ctx, uint32_t width, uint32_t height, uint32_t bpp,
+		struct tiler_rotate_buffer *buf) {
+	struct tiler_bo bo;
+	if ((bpp != 16 && bpp != 32) || width == 0 || width > TILER_BO_WIDTH)
+		return -EINVAL;
+	int ret = tiler_bo_new(ctx->fd, height, bpp, OMAP_BO_WC, &bo);
+	if (ret != 0)
+		return ret;
+	buf->handle = bo.handle;
+	buf->pitch = bo.pitch;
+	buf->size = (uint64_t)bo.pitch * height;
+	return 0;
+}
+
+void tiler_rotate_free(struct tiler_rotate *ctx, struct tiler_rotate_buffer *buf) {
+	struct drm_gem_close close_req;
+	memset(&close_req, 0, sizeof(close_req));
+	close_req.handle = buf->handle;
+	tiler_bo_ioctl(ctx->fd, DRM_IOCTL_GEM_CLOSE, (char *)&close_req);
+	buf->handle = 0;
+}
+
+int tiler_rotate_apply(struct tiler_rotate *ctx) {
+	struct drm_set_client_cap atomic_cap;
+	atomic_cap.capability = DRM_CLIENT_CAP_ATOMIC;
+	atomic_cap.value = 1;
+	if (tiler_bo_ioctl(ctx->fd, DRM_IOCTL_SET_CLIENT_CAP, (char *)&atomic_cap) != 0)
+		return -errno;
+
+	uint32_t planes[MAX_PLANES];
+	struct drm_mode_get_plane_res res;
+	memset(&res, 0, sizeof(res));
+	res.plane_id_ptr = (uint64_t)(uintptr_t)planes;
+	res.count_planes = MAX_PLANES;
+	if (tiler_bo_ioctl(ctx->fd, DRM_IOCTL_MODE_GETPLANERESOURCES, (char *)&res) != 0)
+		return -errno;
+	if (res.count_planes > MAX_PLANES)
+		res.count_planes = MAX_PLANES;
+
+	int rotated = 0, err = 0;
+	for (uint32_t i = 0; i < res.count_planes; i++) {
+		int prop = tiler_rotate_property(ctx->fd, planes[i], DRM_MODE_OBJECT_PLANE, "rotation", NULL);
+		if (prop < 0)
+			continue;
+		int ret = tiler_rotate_plane(ctx->fd, planes[i], prop, ctx->rotation, 0);
+		if (ret == 0)
+			rotated++;
+		else
+			err = ret;
+	}
+	return rotated ? rotated : err;
+}
+
+int tiler_rotate_get_mode(struct tiler_rotate *ctx, uint32_t crtc_id, struct drm_mode_modeinfo *mode) {
+	struct drm_mode_crtc crtc;
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = crtc_id;
+	if (tiler_bo_ioctl(ctx->fd, DRM_IOCTL_MODE_GETCRTC, (char *)&crtc) != 0)
+		return -errno;
+	if (!crtc.mode_valid)
+		return -ENOENT;
+	*mode = crtc.mode;
+	tiler_rotate_mode(ctx->rotation, mode);
+	return 0;
+}
+
+void tiler_rotate_close(struct tiler_rotate *ctx) {
+	free(ctx);
+}
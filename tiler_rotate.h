@@ -0,0 +1,98 @@
+/*
+
+OpenGL TILER rotation shim - rotation library
+
+The rotation logic of tiler_shim.so with an explicit API, for applications
+that would rather call it than have their ioctls interposed. An application
+opens a context on its DRM fd, allocates its scanout buffers with
+tiler_rotate_alloc (tiled, so the display can read them rotated), applies
+the rotation to the planes once, and sizes its rendering from
+tiler_rotate_get_mode, which reports the mode in the orientation it renders
+in. Modes passed to SETCRTC go through tiler_rotate_mode first.
+
+tiler_shim.so is built on the same code, so both behave the same.
+
+Angles are DRM_MODE_ROTATE_* values (counter-clockwise); 0 uses
+ROTATE_ANGLE from the environment as the shim does, defaulting to 270.
+
+Building:
+
+	$ gcc -shared -fpic -o libtilerrotate.so tiler_rotate.c tiler_bo.c -lpthread
+	$ gcc -c tiler_rotate.c tiler_bo.c && ar rcs libtilerrotate.a tiler_rotate.o tiler_bo.o
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef TILER_ROTATE_H
+#define TILER_ROTATE_H
+
+#include <stdint.h>
+
+struct drm_mode_modeinfo;
+struct tiler_rotate;
+
+struct tiler_rotate_buffer {
+	uint32_t handle;    /* GEM handle on the context's fd */
+	uint32_t pitch;
+	uint64_t size;      /* for MAP_DUMB/mmap, as with a dumb buffer */
+};
+
+/* Returns NULL on failure */
+struct tiler_rotate *tiler_rotate_open(int drm_fd, uint32_t rotation);
+
+/* Rotation the context applies, as a DRM_MODE_ROTATE_* value */
+uint32_t tiler_rotate_rotation(struct tiler_rotate *ctx);
+
+/* A width x height scanout buffer at 16 or 32bpp. Returns 0 or -errno */
+int tiler_rotate_alloc(struct tiler_rotate *ctx, uint32_t width, uint32_t height, uint32_t bpp,
+	struct tiler_rotate_buffer *buf);
+void tiler_rotate_free(struct tiler_rotate *ctx, struct tiler_rotate_buffer *buf);
+
+/* Set the rotation on every plane. Returns the number of planes rotated or -errno */
+int tiler_rotate_apply(struct tiler_rotate *ctx);
+
+/* Current mode of crtc_id as the application sees it. Returns 0 or -errno */
+int tiler_rotate_get_mode(struct tiler_rotate *ctx, uint32_t crtc_id, struct drm_mode_modeinfo *mode);
+
+void tiler_rotate_close(struct tiler_rotate *ctx);
+
+/*
+	Building blocks, shared with tiler_shim.so. They make no ioctls
+	other than through tiler_bo_ioctl.
+*/
+
+int tiler_rotate_swaps_axes(uint32_t rotation);
+
+/* Swap a mode between panel and application orientation (its own inverse) */
+void tiler_rotate_mode(uint32_t rotation, struct drm_mode_modeinfo *mode);
+
+/*
+	Convert a rectangle in the orientation the application renders in to
+	CRTC coordinates for a plane scanned out with the given rotation.
+	phys_w/phys_h are the dimensions of the real (unswapped) mode.
+*/
+void tiler_rotate_rect(uint32_t rotation, uint32_t phys_w, uint32_t phys_h,
+	int32_t *x, int32_t *y, uint32_t *w, uint32_t *h);
+
+/*
+	Look up a property by name on a KMS object, returning its id (or -1 if
+	the object has no such property) and optionally its current value
+*/
+int tiler_rotate_property(int fd, uint32_t obj_id, uint32_t obj_type, const char *name, uint64_t *value);
+
+/* Commit rotation to one plane through its rotation property. Returns 0 or -errno */
+int tiler_rotate_plane(int fd, uint32_t plane_id, int rotation_prop, uint32_t rotation, uint32_t flags);
+
+#endif
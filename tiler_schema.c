@@ -0,0 +1,392 @@
+/*
+
+OpenGL TILER rotation shim - DRM ioctl argument schema
+
+See tiler_schema.h.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include <linux/ioctl.h>
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <drm/omap_drm.h>
+
+#include "tiler_schema.h"
+
+/* Elements shown per array by tiler_schema_format */
+#define FORMAT_ELEMENTS 8
+
+#define MEMBER_SIZE(type, member) sizeof(((type *)0)->member)
+
+/* How an array element is shown */
+#define ELEMENT_FORMAT(element) _Generic(*(element *)0, \
+	char: 's', \
+	uint8_t: 'x', \
+	uint32_t: 'u', \
+	uint64_t: 'u', \
+	struct drm_mode_modeinfo: 'm', \
+	struct drm_mode_property_enum: 'e', \
+	struct drm_clip_rect: 'c', \
+	default: '?')
+
+enum schema_request {
+#define SCHEMA_ENUM(name, request, type) SCHEMA_##name,
+	TILER_SCHEMA_REQUESTS(SCHEMA_ENUM)
+#undef SCHEMA_ENUM
+	SCHEMA_REQUESTS
+};
+
+struct schema_request_info {
+	const char *name;
+	size_t size;
+};
+
+struct schema_field {
+	enum schema_request request;
+	const char *name;
+	size_t offset, size;
+	char format;
+};
+
+struct schema_array {
+	enum schema_request request;
+	const char *name;
+	size_t offset, size;             /* the pointer */
+	size_t count_offset, count_size; /* its count, or for TILER_SCHEMA_SUM the pointer to sum */
+	size_t element_size;
+	char format;
+	int kind;
+};
+
+static const struct schema_request_info schema_requests[] = {
+#define SCHEMA_REQUEST(name, request, type) { #name, sizeof(type) },
+	TILER_SCHEMA_REQUESTS(SCHEMA_REQUEST)
+#undef SCHEMA_REQUEST
+};
+
+static const struct schema_field schema_fields[] = {
+#define SCHEMA_FIELD(name, type, member, format) \
+	{ SCHEMA_##name, #member, offsetof(type, member), MEMBER_SIZE(type, member), format },
+	TILER_SCHEMA_FIELDS(SCHEMA_FIELD)
+#undef SCHEMA_FIELD
+};
+
+static const struct schema_array schema_arrays[] = {
+#define SCHEMA_ARRAY(name, type, pointer, count, element, kind) \
+	{ SCHEMA_##name, #pointer, offsetof(type, pointer), MEMBER_SIZE(type, pointer), \
+	  offsetof(type, count), MEMBER_SIZE(type, count), sizeof(element), ELEMENT_FORMAT(element), kind },
+	TILER_SCHEMA_ARRAYS(SCHEMA_ARRAY)
+#undef SCHEMA_ARRAY
+};
+
+#define N_FIELDS (sizeof(schema_fields) / sizeof(schema_fields[0]))
+#define N_ARRAYS (sizeof(schema_arrays) / sizeof(schema_arrays[0]))
+
+static int schema_index(unsigned long request) {
+	switch (request) {
+#define SCHEMA_CASE(name, request, type) case request: return SCHEMA_##name;
+	TILER_SCHEMA_REQUESTS(SCHEMA_CASE)
+#undef SCHEMA_CASE
+	default:
+		return -1;
+	}
+}
+
+static uint64_t read_uint(const void *p, size_t size) {
+	uint8_t u8; uint16_t u16; uint32_t u32; uint64_t u64;
+	switch (size) {
+	case 1: memcpy(&u8, p, 1); return u8;
+	case 2: memcpy(&u16, p, 2); return u16;
+	case 4: memcpy(&u32, p, 4); return u32;
+	case 8: memcpy(&u64, p, 8); return u64;
+	default: return 0;
+	}
+}
+
+static void write_uint(void *p, size_t size, uint64_t value) {
+	uint32_t u32 = value;
+	if (size == 8)
+		memcpy(p, &value, 8);
+	else if (size == 4)
+		memcpy(p, &u32, 4);
+}
+
+static const void *array_pointer(const struct schema_array *a, const void *arg) {
+	return (const void *)(uintptr_t)read_uint((const char *)arg + a->offset, a->size);
+}
+
+/* The arrays of a request, in table order. Returns how many */
+static int schema_arrays_of(int index, const struct schema_array **arrays) {
+	int n = 0;
+	for (size_t i = 0; i < N_ARRAYS && n < TILER_SCHEMA_MAX_ARRAYS; i++)
+		if ((int)schema_arrays[i].request == index)
+			arrays[n++] = &schema_arrays[i];
+	return n;
+}
+
+/*
+	Element count of array i as the argument stands now. counts[] holds the
+	arrays before i, which a TILER_SCHEMA_SUM array needs for the length of
+	the array it sums.
+*/
+static uint32_t array_count(const struct schema_array **arrays, int i, const void *arg, const uint32_t *counts) {
+	const struct schema_array *a = arrays[i];
+	uint64_t n = 0;
+
+	if (a->kind == TILER_SCHEMA_SUM) {
+		for (int j = 0; j < i; j++) {
+			if (arrays[j]->offset != a->count_offset)
+				continue;
+			const uint32_t *values = array_pointer(arrays[j], arg);
+			if (values)
+				for (uint32_t k = 0; k < counts[j]; k++)
+					n += values[k];
+			break;
+		}
+	} else {
+		n = read_uint((const char *)arg + a->count_offset, a->count_size);
+		if (a->kind == TILER_SCHEMA_BYTES)
+			n /= a->element_size;
+	}
+	return n > UINT32_MAX ? UINT32_MAX : n;
+}
+
+/* Elements that can be followed: the smaller of the capacity given and what the argument holds now */
+static int schema_layout(unsigned long request, const void *arg, const uint32_t *counts,
+		const struct schema_array **arrays, uint32_t *n) {
+	int index = schema_index(request);
+	if (index < 0 || !arg)
+		return -1;
+	int count = schema_arrays_of(index, arrays);
+	for (int i = 0; i < count; i++) {
+		n[i] = array_count(arrays, i, arg, n);
+		if (counts && counts[i] < n[i])
+			n[i] = counts[i];
+		if (!array_pointer(arrays[i], arg))
+			n[i] = 0;
+	}
+	return index;
+}
+
+const char *tiler_schema_name(unsigned long request) {
+	int index = schema_index(request);
+	return index < 0 ? NULL : schema_requests[index].name;
+}
+
+int tiler_schema_counts(unsigned long request, const void *arg, uint32_t counts[TILER_SCHEMA_MAX_ARRAYS]) {
+	const struct schema_array *arrays[TILER_SCHEMA_MAX_ARRAYS];
+	int index = schema_index(request);
+	if (index < 0 || !arg)
+		return 0;
+	int count = schema_arrays_of(index, arrays);
+	for (int i = 0; i < count; i++)
+		counts[i] = array_pointer(arrays[i], arg) ? array_count(arrays, i, arg, counts) : 0;
+	return count;
+}
+
+int tiler_schema_check(unsigned long request, const void *arg, const uint32_t *counts, uint32_t max_count) {
+	const struct schema_array *arrays[TILER_SCHEMA_MAX_ARRAYS];
+	uint32_t n[TILER_SCHEMA_MAX_ARRAYS];
+	int index = schema_index(request);
+	if (index < 0)
+		return 0;
+	if (!arg)
+		return -EFAULT;
+	int count = schema_arrays_of(index, arrays);
+	for (int i = 0; i < count; i++) {
+		n[i] = counts ? counts[i] : array_count(arrays, i, arg, n);
+		if (n[i] > max_count)
+			return -E2BIG;
+		if (n[i] && !array_pointer(arrays[i], arg))
+			return -EFAULT;
+	}
+	return 0;
+}
+
+size_t tiler_schema_copy(unsigned long request, const void *arg, const uint32_t *counts, void *buf, size_t size) {
+	const struct schema_array *arrays[TILER_SCHEMA_MAX_ARRAYS];
+	uint32_t n[TILER_SCHEMA_MAX_ARRAYS];
+	size_t offsets[TILER_SCHEMA_MAX_ARRAYS];
+	int index = schema_layout(request, arg, counts, arrays, n);
+	if (index < 0)
+		return 0;
+
+	int count = schema_arrays_of(index, arrays);
+	size_t need = schema_requests[index].size;
+	for (int i = 0; i < count; i++) {
+		need = (need + 7) & ~(size_t)7;
+		offsets[i] = need;
+		need += (size_t)n[i] * arrays[i]->element_size;
+	}
+	if (need > size)
+		return need;
+
+	char *out = buf;
+	memcpy(out, arg, schema_requests[index].size);
+	for (int i = 0; i < count; i++) {
+		if (n[i])
+			memcpy(out + offsets[i], array_pointer(arrays[i], arg), (size_t)n[i] * arrays[i]->element_size);
+		write_uint(out + arrays[i]->offset, arrays[i]->size, n[i] ? (uintptr_t)(out + offsets[i]) : 0);
+	}
+	return need;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *p = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+uint64_t tiler_schema_hash(unsigned long request, const void *arg, const uint32_t *counts) {
+	const struct schema_array *arrays[TILER_SCHEMA_MAX_ARRAYS];
+	uint32_t n[TILER_SCHEMA_MAX_ARRAYS];
+	uint64_t hash = 0xcbf29ce484222325ull;
+	int index = schema_layout(request, arg, counts, arrays, n);
+	if (index < 0)
+		return hash;
+
+	int count = schema_arrays_of(index, arrays);
+	const uint8_t *p = arg;
+	size_t size = schema_requests[index].size;
+	hash = fnv1a(hash, &request, sizeof(request));
+	for (size_t i = 0; i < size; i++) {
+		uint8_t byte = p[i];
+		for (int j = 0; j < count; j++)
+			if (i >= arrays[j]->offset && i < arrays[j]->offset + arrays[j]->size)
+				byte = 0;
+		hash = fnv1a(hash, &byte, 1);
+	}
+	for (int i = 0; i < count; i++) {
+		hash = fnv1a(hash, &n[i], sizeof(n[i]));
+		if (n[i])
+			hash = fnv1a(hash, array_pointer(arrays[i], arg), (size_t)n[i] * arrays[i]->element_size);
+	}
+	return hash;
+}
+
+static void append(char *out, size_t size, size_t *len, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(*len < size ? out + *len : NULL, *len < size ? size - *len : 0, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		*len += n;
+}
+
+static void append_mode(char *out, size_t size, size_t *len, const struct drm_mode_modeinfo *mode) {
+	append(out, size, len, "%ux%u@%u", mode->hdisplay, mode->vdisplay, mode->vrefresh);
+}
+
+static void append_value(char *out, size_t size, size_t *len, const void *p, size_t bytes, char format) {
+	uint64_t value = read_uint(p, bytes);
+	switch (format) {
+	case 'd':
+		if (bytes < 8 && (value >> (bytes * 8 - 1)) & 1)
+			value |= ~0ull << (bytes * 8);
+		append(out, size, len, "%lld", (long long)value);
+		break;
+	case 'x':
+		append(out, size, len, "0x%llx", (unsigned long long)value);
+		break;
+	case 's':
+		append(out, size, len, "\"%.*s\"", (int)strnlen(p, bytes), (const char *)p);
+		break;
+	case 'm':
+		append_mode(out, size, len, p);
+		break;
+	default:
+		append(out, size, len, "%llu", (unsigned long long)value);
+		break;
+	}
+}
+
+static void append_element(char *out, size_t size, size_t *len, const struct schema_array *a, const void *p) {
+	const struct drm_mode_property_enum *e = p;
+	const struct drm_clip_rect *clip = p;
+
+	switch (a->format) {
+	case 'm':
+		append_mode(out, size, len, p);
+		break;
+	case 'e':
+		append(out, size, len, "%llu:%.*s", (unsigned long long)e->value,
+				(int)strnlen(e->name, sizeof(e->name)), e->name);
+		break;
+	case 'c':
+		append(out, size, len, "%u,%u-%u,%u", clip->x1, clip->y1, clip->x2, clip->y2);
+		break;
+	default:
+		append_value(out, size, len, p, a->element_size, a->format);
+		break;
+	}
+}
+
+int tiler_schema_format(unsigned long request, const void *arg, const uint32_t *counts, char *out, size_t size) {
+	const struct schema_array *arrays[TILER_SCHEMA_MAX_ARRAYS];
+	uint32_t n[TILER_SCHEMA_MAX_ARRAYS];
+	size_t len = 0;
+
+	if (size)
+		out[0] = '\0';
+	int index = schema_layout(request, arg, counts, arrays, n);
+	if (index < 0) {
+		/* Not described, or no argument: the first few words of whatever the request's size says */
+		uint32_t words = _IOC_SIZE(request) / 4;
+		append(out, size, &len, "[%02x]", _IOC_NR(request));
+		for (uint32_t i = 0; arg && i < words && i < FORMAT_ELEMENTS; i++)
+			append(out, size, &len, " %08x", ((const uint32_t *)arg)[i]);
+		if (arg && words > FORMAT_ELEMENTS)
+			append(out, size, &len, " ...");
+		return len;
+	}
+
+	append(out, size, &len, "%s", schema_requests[index].name);
+	for (size_t i = 0; i < N_FIELDS; i++) {
+		const struct schema_field *f = &schema_fields[i];
+		if ((int)f->request != index)
+			continue;
+		append(out, size, &len, " %s=", f->name);
+		append_value(out, size, &len, (const char *)arg + f->offset, f->size, f->format);
+	}
+
+	int count = schema_arrays_of(index, arrays);
+	for (int i = 0; i < count; i++) {
+		const struct schema_array *a = arrays[i];
+		const char *p = array_pointer(a, arg);
+		append(out, size, &len, " %s=", a->name);
+		if (a->format == 's') {
+			append(out, size, &len, "\"%.*s\"", (int)strnlen(p ? p : "", n[i]), p ? p : "");
+			continue;
+		}
+		append(out, size, &len, "[%u]{", n[i]);
+		for (uint32_t j = 0; j < n[i] && j < FORMAT_ELEMENTS; j++) {
+			if (j)
+				append(out, size, &len, ", ");
+			append_element(out, size, &len, a, p + (size_t)j * a->element_size);
+		}
+		append(out, size, &len, n[i] > FORMAT_ELEMENTS ? ", ...}" : "}");
+	}
+	return len;
+}
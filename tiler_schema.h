@@ -0,0 +1,285 @@
+/*
+
+OpenGL TILER rotation shim - DRM ioctl argument schema
+
+A compile-time description of the argument of each DRM request the shim
+knows about: its struct, the scalar fields worth printing, and which
+fields are user pointers together with the field that counts their
+elements. tiler_schema.c expands the tables below into generic deep
+copy, hashing, bounds checking and pretty-printing, none of which
+allocate, so tracing and caching don't need a hand-written decoder per
+request.
+
+Counts in DRM arguments are in/out: the caller passes the capacity of
+each array and the kernel writes back how many elements there are, which
+may be more. Functions that follow pointers after the call therefore take
+the capacities from before it, as captured by tiler_schema_counts; pass
+NULL to use the counts currently in the argument (before the call, or for
+requests that don't write them back).
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef TILER_SCHEMA_H
+#define TILER_SCHEMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	Requests: X(name, request, type)
+*/
+#define TILER_SCHEMA_REQUESTS(X) \
+	X(VERSION, DRM_IOCTL_VERSION, struct drm_version) \
+	X(GET_CAP, DRM_IOCTL_GET_CAP, struct drm_get_cap) \
+	X(SET_CLIENT_CAP, DRM_IOCTL_SET_CLIENT_CAP, struct drm_set_client_cap) \
+	X(GEM_CLOSE, DRM_IOCTL_GEM_CLOSE, struct drm_gem_close) \
+	X(PRIME_HANDLE_TO_FD, DRM_IOCTL_PRIME_HANDLE_TO_FD, struct drm_prime_handle) \
+	X(PRIME_FD_TO_HANDLE, DRM_IOCTL_PRIME_FD_TO_HANDLE, struct drm_prime_handle) \
+	X(WAIT_VBLANK, DRM_IOCTL_WAIT_VBLANK, union drm_wait_vblank) \
+	X(MODE_GETRESOURCES, DRM_IOCTL_MODE_GETRESOURCES, struct drm_mode_card_res) \
+	X(MODE_GETCRTC, DRM_IOCTL_MODE_GETCRTC, struct drm_mode_crtc) \
+	X(MODE_SETCRTC, DRM_IOCTL_MODE_SETCRTC, struct drm_mode_crtc) \
+	X(MODE_GETENCODER, DRM_IOCTL_MODE_GETENCODER, struct drm_mode_get_encoder) \
+	X(MODE_GETCONNECTOR, DRM_IOCTL_MODE_GETCONNECTOR, struct drm_mode_get_connector) \
+	X(MODE_GETPROPERTY, DRM_IOCTL_MODE_GETPROPERTY, struct drm_mode_get_property) \
+	X(MODE_GETPROPBLOB, DRM_IOCTL_MODE_GETPROPBLOB, struct drm_mode_get_blob) \
+	X(MODE_GETFB, DRM_IOCTL_MODE_GETFB, struct drm_mode_fb_cmd) \
+	X(MODE_ADDFB, DRM_IOCTL_MODE_ADDFB, struct drm_mode_fb_cmd) \
+	X(MODE_PAGE_FLIP, DRM_IOCTL_MODE_PAGE_FLIP, struct drm_mode_crtc_page_flip_target) \
+	X(MODE_DIRTYFB, DRM_IOCTL_MODE_DIRTYFB, struct drm_mode_fb_dirty_cmd) \
+	X(MODE_CREATE_DUMB, DRM_IOCTL_MODE_CREATE_DUMB, struct drm_mode_create_dumb) \
+	X(MODE_MAP_DUMB, DRM_IOCTL_MODE_MAP_DUMB, struct drm_mode_map_dumb) \
+	X(MODE_DESTROY_DUMB, DRM_IOCTL_MODE_DESTROY_DUMB, struct drm_mode_destroy_dumb) \
+	X(MODE_GETPLANERESOURCES, DRM_IOCTL_MODE_GETPLANERESOURCES, struct drm_mode_get_plane_res) \
+	X(MODE_GETPLANE, DRM_IOCTL_MODE_GETPLANE, struct drm_mode_get_plane) \
+	X(MODE_SETPLANE, DRM_IOCTL_MODE_SETPLANE, struct drm_mode_set_plane) \
+	X(MODE_ADDFB2, DRM_IOCTL_MODE_ADDFB2, struct drm_mode_fb_cmd2) \
+	X(MODE_OBJ_GETPROPERTIES, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, struct drm_mode_obj_get_properties) \
+	X(MODE_OBJ_SETPROPERTY, DRM_IOCTL_MODE_OBJ_SETPROPERTY, struct drm_mode_obj_set_property) \
+	X(MODE_ATOMIC, DRM_IOCTL_MODE_ATOMIC, struct drm_mode_atomic) \
+	X(MODE_CREATEPROPBLOB, DRM_IOCTL_MODE_CREATEPROPBLOB, struct drm_mode_create_blob) \
+	X(MODE_DESTROYPROPBLOB, DRM_IOCTL_MODE_DESTROYPROPBLOB, struct drm_mode_destroy_blob) \
+	X(MODE_CREATE_LEASE, DRM_IOCTL_MODE_CREATE_LEASE, struct drm_mode_create_lease) \
+	X(MODE_LIST_LESSEES, DRM_IOCTL_MODE_LIST_LESSEES, struct drm_mode_list_lessees) \
+	X(MODE_GET_LEASE, DRM_IOCTL_MODE_GET_LEASE, struct drm_mode_get_lease) \
+	X(MODE_REVOKE_LEASE, DRM_IOCTL_MODE_REVOKE_LEASE, struct drm_mode_revoke_lease) \
+	X(OMAP_GET_PARAM, DRM_IOCTL_OMAP_GET_PARAM, struct drm_omap_param) \
+	X(OMAP_GEM_NEW, DRM_IOCTL_OMAP_GEM_NEW, struct drm_omap_gem_new) \
+	X(OMAP_GEM_CPU_PREP, DRM_IOCTL_OMAP_GEM_CPU_PREP, struct drm_omap_gem_cpu_prep) \
+	X(OMAP_GEM_CPU_FINI, DRM_IOCTL_OMAP_GEM_CPU_FINI, struct drm_omap_gem_cpu_fini) \
+	X(OMAP_GEM_INFO, DRM_IOCTL_OMAP_GEM_INFO, struct drm_omap_gem_info)
+
+/*
+	Scalar fields, in print order: F(name, type, member, format)
+	format is 'u' (unsigned), 'd' (signed), 'x' (hex), 's' (char array)
+	or 'm' (an embedded struct drm_mode_modeinfo)
+*/
+#define TILER_SCHEMA_FIELDS(F) \
+	F(VERSION, struct drm_version, version_major, 'd') \
+	F(VERSION, struct drm_version, version_minor, 'd') \
+	F(GET_CAP, struct drm_get_cap, capability, 'x') \
+	F(GET_CAP, struct drm_get_cap, value, 'u') \
+	F(SET_CLIENT_CAP, struct drm_set_client_cap, capability, 'u') \
+	F(SET_CLIENT_CAP, struct drm_set_client_cap, value, 'u') \
+	F(GEM_CLOSE, struct drm_gem_close, handle, 'u') \
+	F(PRIME_HANDLE_TO_FD, struct drm_prime_handle, handle, 'u') \
+	F(PRIME_HANDLE_TO_FD, struct drm_prime_handle, flags, 'x') \
+	F(PRIME_HANDLE_TO_FD, struct drm_prime_handle, fd, 'd') \
+	F(PRIME_FD_TO_HANDLE, struct drm_prime_handle, fd, 'd') \
+	F(PRIME_FD_TO_HANDLE, struct drm_prime_handle, handle, 'u') \
+	F(WAIT_VBLANK, union drm_wait_vblank, request.type, 'x') \
+	F(WAIT_VBLANK, union drm_wait_vblank, request.sequence, 'u') \
+	F(WAIT_VBLANK, union drm_wait_vblank, reply.tval_sec, 'd') \
+	F(WAIT_VBLANK, union drm_wait_vblank, reply.tval_usec, 'd') \
+	F(MODE_GETRESOURCES, struct drm_mode_card_res, max_width, 'u') \
+	F(MODE_GETRESOURCES, struct drm_mode_card_res, max_height, 'u') \
+	F(MODE_GETCRTC, struct drm_mode_crtc, crtc_id, 'u') \
+	F(MODE_GETCRTC, struct drm_mode_crtc, fb_id, 'u') \
+	F(MODE_GETCRTC, struct drm_mode_crtc, x, 'u') \
+	F(MODE_GETCRTC, struct drm_mode_crtc, y, 'u') \
+	F(MODE_GETCRTC, struct drm_mode_crtc, mode_valid, 'u') \
+	F(MODE_GETCRTC, struct drm_mode_crtc, mode, 'm') \
+	F(MODE_SETCRTC, struct drm_mode_crtc, crtc_id, 'u') \
+	F(MODE_SETCRTC, struct drm_mode_crtc, fb_id, 'u') \
+	F(MODE_SETCRTC, struct drm_mode_crtc, x, 'u') \
+	F(MODE_SETCRTC, struct drm_mode_crtc, y, 'u') \
+	F(MODE_SETCRTC, struct drm_mode_crtc, mode_valid, 'u') \
+	F(MODE_SETCRTC, struct drm_mode_crtc, mode, 'm') \
+	F(MODE_GETENCODER, struct drm_mode_get_encoder, encoder_id, 'u') \
+	F(MODE_GETENCODER, struct drm_mode_get_encoder, crtc_id, 'u') \
+	F(MODE_GETENCODER, struct drm_mode_get_encoder, possible_crtcs, 'x') \
+	F(MODE_GETCONNECTOR, struct drm_mode_get_connector, connector_id, 'u') \
+	F(MODE_GETCONNECTOR, struct drm_mode_get_connector, encoder_id, 'u') \
+	F(MODE_GETCONNECTOR, struct drm_mode_get_connector, connector_type, 'u') \
+	F(MODE_GETCONNECTOR, struct drm_mode_get_connector, connection, 'u') \
+	F(MODE_GETPROPERTY, struct drm_mode_get_property, prop_id, 'u') \
+	F(MODE_GETPROPERTY, struct drm_mode_get_property, name, 's') \
+	F(MODE_GETPROPERTY, struct drm_mode_get_property, flags, 'x') \
+	F(MODE_GETPROPBLOB, struct drm_mode_get_blob, blob_id, 'u') \
+	F(MODE_GETFB, struct drm_mode_fb_cmd, fb_id, 'u') \
+	F(MODE_GETFB, struct drm_mode_fb_cmd, width, 'u') \
+	F(MODE_GETFB, struct drm_mode_fb_cmd, height, 'u') \
+	F(MODE_GETFB, struct drm_mode_fb_cmd, handle, 'u') \
+	F(MODE_ADDFB, struct drm_mode_fb_cmd, fb_id, 'u') \
+	F(MODE_ADDFB, struct drm_mode_fb_cmd, width, 'u') \
+	F(MODE_ADDFB, struct drm_mode_fb_cmd, height, 'u') \
+	F(MODE_ADDFB, struct drm_mode_fb_cmd, pitch, 'u') \
+	F(MODE_ADDFB, struct drm_mode_fb_cmd, bpp, 'u') \
+	F(MODE_ADDFB, struct drm_mode_fb_cmd, depth, 'u') \
+	F(MODE_ADDFB, struct drm_mode_fb_cmd, handle, 'u') \
+	F(MODE_PAGE_FLIP, struct drm_mode_crtc_page_flip_target, crtc_id, 'u') \
+	F(MODE_PAGE_FLIP, struct drm_mode_crtc_page_flip_target, fb_id, 'u') \
+	F(MODE_PAGE_FLIP, struct drm_mode_crtc_page_flip_target, flags, 'x') \
+	F(MODE_PAGE_FLIP, struct drm_mode_crtc_page_flip_target, sequence, 'u') \
+	F(MODE_PAGE_FLIP, struct drm_mode_crtc_page_flip_target, user_data, 'x') \
+	F(MODE_DIRTYFB, struct drm_mode_fb_dirty_cmd, fb_id, 'u') \
+	F(MODE_DIRTYFB, struct drm_mode_fb_dirty_cmd, flags, 'x') \
+	F(MODE_CREATE_DUMB, struct drm_mode_create_dumb, width, 'u') \
+	F(MODE_CREATE_DUMB, struct drm_mode_create_dumb, height, 'u') \
+	F(MODE_CREATE_DUMB, struct drm_mode_create_dumb, bpp, 'u') \
+	F(MODE_CREATE_DUMB, struct drm_mode_create_dumb, flags, 'x') \
+	F(MODE_CREATE_DUMB, struct drm_mode_create_dumb, handle, 'u') \
+	F(MODE_CREATE_DUMB, struct drm_mode_create_dumb, pitch, 'u') \
+	F(MODE_CREATE_DUMB, struct drm_mode_create_dumb, size, 'u') \
+	F(MODE_MAP_DUMB, struct drm_mode_map_dumb, handle, 'u') \
+	F(MODE_MAP_DUMB, struct drm_mode_map_dumb, offset, 'x') \
+	F(MODE_DESTROY_DUMB, struct drm_mode_destroy_dumb, handle, 'u') \
+	F(MODE_GETPLANE, struct drm_mode_get_plane, plane_id, 'u') \
+	F(MODE_GETPLANE, struct drm_mode_get_plane, crtc_id, 'u') \
+	F(MODE_GETPLANE, struct drm_mode_get_plane, fb_id, 'u') \
+	F(MODE_GETPLANE, struct drm_mode_get_plane, possible_crtcs, 'x') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, plane_id, 'u') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, crtc_id, 'u') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, fb_id, 'u') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, crtc_x, 'd') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, crtc_y, 'd') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, crtc_w, 'u') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, crtc_h, 'u') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, src_x, 'x') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, src_y, 'x') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, src_w, 'x') \
+	F(MODE_SETPLANE, struct drm_mode_set_plane, src_h, 'x') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, fb_id, 'u') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, width, 'u') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, height, 'u') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, pixel_format, 'x') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, flags, 'x') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, handles[0], 'u') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, pitches[0], 'u') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, offsets[0], 'u') \
+	F(MODE_ADDFB2, struct drm_mode_fb_cmd2, modifier[0], 'x') \
+	F(MODE_OBJ_GETPROPERTIES, struct drm_mode_obj_get_properties, obj_id, 'u') \
+	F(MODE_OBJ_GETPROPERTIES, struct drm_mode_obj_get_properties, obj_type, 'x') \
+	F(MODE_OBJ_SETPROPERTY, struct drm_mode_obj_set_property, obj_id, 'u') \
+	F(MODE_OBJ_SETPROPERTY, struct drm_mode_obj_set_property, obj_type, 'x') \
+	F(MODE_OBJ_SETPROPERTY, struct drm_mode_obj_set_property, prop_id, 'u') \
+	F(MODE_OBJ_SETPROPERTY, struct drm_mode_obj_set_property, value, 'u') \
+	F(MODE_ATOMIC, struct drm_mode_atomic, flags, 'x') \
+	F(MODE_ATOMIC, struct drm_mode_atomic, user_data, 'x') \
+	F(MODE_CREATEPROPBLOB, struct drm_mode_create_blob, blob_id, 'u') \
+	F(MODE_DESTROYPROPBLOB, struct drm_mode_destroy_blob, blob_id, 'u') \
+	F(MODE_CREATE_LEASE, struct drm_mode_create_lease, flags, 'x') \
+	F(MODE_CREATE_LEASE, struct drm_mode_create_lease, lessee_id, 'u') \
+	F(MODE_CREATE_LEASE, struct drm_mode_create_lease, fd, 'u') \
+	F(MODE_REVOKE_LEASE, struct drm_mode_revoke_lease, lessee_id, 'u') \
+	F(OMAP_GET_PARAM, struct drm_omap_param, param, 'u') \
+	F(OMAP_GET_PARAM, struct drm_omap_param, value, 'x') \
+	F(OMAP_GEM_NEW, struct drm_omap_gem_new, size.bytes, 'x') \
+	F(OMAP_GEM_NEW, struct drm_omap_gem_new, flags, 'x') \
+	F(OMAP_GEM_NEW, struct drm_omap_gem_new, handle, 'u') \
+	F(OMAP_GEM_CPU_PREP, struct drm_omap_gem_cpu_prep, handle, 'u') \
+	F(OMAP_GEM_CPU_PREP, struct drm_omap_gem_cpu_prep, op, 'x') \
+	F(OMAP_GEM_CPU_FINI, struct drm_omap_gem_cpu_fini, handle, 'u') \
+	F(OMAP_GEM_CPU_FINI, struct drm_omap_gem_cpu_fini, op, 'x') \
+	F(OMAP_GEM_INFO, struct drm_omap_gem_info, handle, 'u') \
+	F(OMAP_GEM_INFO, struct drm_omap_gem_info, offset, 'x') \
+	F(OMAP_GEM_INFO, struct drm_omap_gem_info, size, 'u')
+
+/*
+	User pointers: A(name, type, pointer, count, element, kind)
+	kind is TILER_SCHEMA_COUNT (count holds the number of elements),
+	TILER_SCHEMA_BYTES (count holds a length in bytes) or TILER_SCHEMA_SUM
+	(count names another pointer of the same request, listed earlier, whose
+	u32 elements add up to the number of elements)
+*/
+#define TILER_SCHEMA_ARRAYS(A) \
+	A(VERSION, struct drm_version, name, name_len, char, TILER_SCHEMA_BYTES) \
+	A(VERSION, struct drm_version, date, date_len, char, TILER_SCHEMA_BYTES) \
+	A(VERSION, struct drm_version, desc, desc_len, char, TILER_SCHEMA_BYTES) \
+	A(MODE_GETRESOURCES, struct drm_mode_card_res, fb_id_ptr, count_fbs, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETRESOURCES, struct drm_mode_card_res, crtc_id_ptr, count_crtcs, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETRESOURCES, struct drm_mode_card_res, connector_id_ptr, count_connectors, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETRESOURCES, struct drm_mode_card_res, encoder_id_ptr, count_encoders, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_SETCRTC, struct drm_mode_crtc, set_connectors_ptr, count_connectors, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETCONNECTOR, struct drm_mode_get_connector, encoders_ptr, count_encoders, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETCONNECTOR, struct drm_mode_get_connector, modes_ptr, count_modes, struct drm_mode_modeinfo, TILER_SCHEMA_COUNT) \
+	A(MODE_GETCONNECTOR, struct drm_mode_get_connector, props_ptr, count_props, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETCONNECTOR, struct drm_mode_get_connector, prop_values_ptr, count_props, uint64_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETPROPERTY, struct drm_mode_get_property, values_ptr, count_values, uint64_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETPROPERTY, struct drm_mode_get_property, enum_blob_ptr, count_enum_blobs, struct drm_mode_property_enum, TILER_SCHEMA_COUNT) \
+	A(MODE_GETPROPBLOB, struct drm_mode_get_blob, data, length, uint8_t, TILER_SCHEMA_BYTES) \
+	A(MODE_DIRTYFB, struct drm_mode_fb_dirty_cmd, clips_ptr, num_clips, struct drm_clip_rect, TILER_SCHEMA_COUNT) \
+	A(MODE_GETPLANERESOURCES, struct drm_mode_get_plane_res, plane_id_ptr, count_planes, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GETPLANE, struct drm_mode_get_plane, format_type_ptr, count_format_types, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_OBJ_GETPROPERTIES, struct drm_mode_obj_get_properties, props_ptr, count_props, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_OBJ_GETPROPERTIES, struct drm_mode_obj_get_properties, prop_values_ptr, count_props, uint64_t, TILER_SCHEMA_COUNT) \
+	A(MODE_ATOMIC, struct drm_mode_atomic, objs_ptr, count_objs, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_ATOMIC, struct drm_mode_atomic, count_props_ptr, count_objs, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_ATOMIC, struct drm_mode_atomic, props_ptr, count_props_ptr, uint32_t, TILER_SCHEMA_SUM) \
+	A(MODE_ATOMIC, struct drm_mode_atomic, prop_values_ptr, count_props_ptr, uint64_t, TILER_SCHEMA_SUM) \
+	A(MODE_CREATEPROPBLOB, struct drm_mode_create_blob, data, length, uint8_t, TILER_SCHEMA_BYTES) \
+	A(MODE_CREATE_LEASE, struct drm_mode_create_lease, object_ids, object_count, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_LIST_LESSEES, struct drm_mode_list_lessees, lessees_ptr, count_lessees, uint32_t, TILER_SCHEMA_COUNT) \
+	A(MODE_GET_LEASE, struct drm_mode_get_lease, objects_ptr, count_objects, uint32_t, TILER_SCHEMA_COUNT)
+
+#define TILER_SCHEMA_COUNT 0
+#define TILER_SCHEMA_BYTES 1
+#define TILER_SCHEMA_SUM 2
+
+/* Most pointers any one request has */
+#define TILER_SCHEMA_MAX_ARRAYS 4
+
+/* Name of the request without the DRM_IOCTL_ prefix, or NULL if it isn't described */
+const char *tiler_schema_name(unsigned long request);
+
+/* Capture the element count of each pointer, for use after the call. Returns how many */
+int tiler_schema_counts(unsigned long request, const void *arg, uint32_t counts[TILER_SCHEMA_MAX_ARRAYS]);
+
+/*
+	0 if every pointer with elements is non-NULL and no array has more than
+	max_count elements, else -EFAULT or -E2BIG. Requests that aren't
+	described pass.
+*/
+int tiler_schema_check(unsigned long request, const void *arg, const uint32_t *counts, uint32_t max_count);
+
+/*
+	Deep copy into buf: the argument, then each array it points to, with
+	the pointers in the copy pointing at the copied arrays. Returns the
+	size needed; nothing is written if that is more than size.
+*/
+size_t tiler_schema_copy(unsigned long request, const void *arg, const uint32_t *counts, void *buf, size_t size);
+
+/* 64-bit FNV-1a of the argument and its arrays, ignoring the pointer values themselves */
+uint64_t tiler_schema_hash(unsigned long request, const void *arg, const uint32_t *counts);
+
+/*
+	One line description such as "MODE_OBJ_GETPROPERTIES obj_id=31
+	obj_type=0xcccccccc props_ptr=[3]{20, 21, 22} ...". Like snprintf,
+	returns the length it needed.
+*/
+int tiler_schema_format(unsigned long request, const void *arg, const uint32_t *counts, char *out, size_t size);
+
+#endif
@@ -7,7 +7,7 @@ of fullscreen OpenGL ES applications.
 
 Building:
 
-	$ gcc -shared -fpic -ldl -o tiler_shim.so  -Wno-int-to-pointer-cast -Wno-pointer-to-int-cast  tiler_shim.c
+	$ gcc -shared -fpic -ldl -lpthread -o tiler_shim.so  -Wno-int-to-pointer-cast -Wno-pointer-to-int-cast  tiler_shim.c tiler_bo.c tiler_rotate.c tiler_sim.c tiler_schema.c
 
 Using:
 	
@@ -43,198 +43,5248 @@ PERFORMANCE OF THIS SOFTWARE.
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef __aarch64__
+#include <asm/sigcontext.h>
+#endif
 
 #include <linux/ioctl.h>
 #include <drm/drm.h>
 #include <drm/drm_mode.h>
 #include <drm/omap_drm.h>
+#include <drm/drm_fourcc.h>
+
+#include "tiler_shim.h"
+#include "tiler_bo.h"
+#include "tiler_rotate.h"
+#include "tiler_sim.h"
+#include "tiler_schema.h"
+#include "tiler_offload.h"
 
 int init_done = 0;
 int debug_flag = 0;
 
-int  (*libc_ioctl)(int fd, unsigned long request, char *argp);
+int  (*libc_ioctl)(int fd, unsigned long request, char *argp);
+void *(*libc_dlopen)(const char *filename, int flags);
+ssize_t (*libc_read)(int fd, void *buf, size_t count);
+int  (*libc_close)(int fd);
+int (*libc_open)(const char *path, int flags, ...);
+int (*libc_open64)(const char *path, int flags, ...);
+int (*libc_openat)(int dirfd, const char *path, int flags, ...);
+void *(*libc_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+void *(*libc_mmap64)(void *addr, size_t length, int prot, int flags, int fd, int64_t offset);
+int (*libc_munmap)(void *addr, size_t length);
+ssize_t (*libc_pread)(int fd, void *buf, size_t count, off_t offset);
+ssize_t (*libc_pread64)(int fd, void *buf, size_t count, int64_t offset);
+size_t (*libc_fread)(void *ptr, size_t size, size_t n, FILE *stream);
+ssize_t (*libc_recv)(int fd, void *buf, size_t len, int flags);
+ssize_t (*libc_recvfrom)(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen);
+ssize_t (*libc_readv)(int fd, const struct iovec *iov, int iovcnt);
+ssize_t (*libc_preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t (*libc_preadv64)(int fd, const struct iovec *iov, int iovcnt, int64_t offset);
+ssize_t (*libc_recvmsg)(int fd, struct msghdr *msg, int flags);
+int (*libc_recvmmsg)(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags, struct timespec *timeout);
+
+int targeted_flag = 0;
+int vblank_model_flag = 0;
+uint64_t vblank_resync_ns = 500000000ULL;
+int hide_slow_formats = 0;
+int autotune_flag = 0;
+int stats_interval = 0;
+int egl_flag = 0;
+int suballoc_flag = 0;
+int pagemode_flag = 0;
+int migrate_flag = 0;
+int dirty_flag = 0;
+int mmap_hook_flag = 0;
+int sim_flag = 0;
+int limit_fps = 0;
+int async_flag = 0;
+uint32_t suballoc_max_w = 512, suballoc_max_h = 512;
+uint32_t shim_rotation = DRM_MODE_ROTATE_270;
+const char *default_target_libs = "libpvrDRMWSEGL.so:libGL.so:libdrm.so";
+
+int ioctl(int fd, unsigned long request, char *argp);
+int close(int fd);
+void got_patch_all(void);
+void socket_start(const char *path);
+void record_start(void);
+void dirty_init(void);
+void dirty_before_write(void *buf, size_t count);
+void suballoc_init(void);
+void migrate_init(void);
+void sim_start(void);
+
+int test_flag(const char *name) {
+	const char *e = getenv(name);
+	if (!e)
+		return 0;
+	return atoi(e);
+}
+
+const char *get_option(const char *name, const char *def) {
+	const char *e = getenv(name);
+	if (!e || !*e)
+		return def;
+	return e;
+}
+
+void init(void) {
+	if (init_done)
+		return;
+
+	debug_flag = test_flag("ROTATE_DEBUG");
+	targeted_flag = test_flag("ROTATE_TARGETED");
+	hide_slow_formats = test_flag("ROTATE_HIDE_SLOW_FORMATS");
+	vblank_model_flag = test_flag("ROTATE_VBLANK_MODEL");
+	vblank_resync_ns = (uint64_t)atoi(get_option("ROTATE_VBLANK_RESYNC_MS", "500")) * 1000000ULL;
+	autotune_flag = test_flag("ROTATE_AUTOTUNE");
+	stats_interval = test_flag("ROTATE_STATS");
+	egl_flag = test_flag("ROTATE_EGL");
+	suballoc_flag = test_flag("ROTATE_SUBALLOC");
+	migrate_flag = test_flag("ROTATE_MIGRATE");
+	dirty_flag = test_flag("ROTATE_DIRTY");
+	sim_flag = test_flag("ROTATE_SIM");
+	limit_fps = test_flag("ROTATE_MAX_FPS");
+	if (limit_fps < 0)
+		limit_fps = 0;
+	async_flag = test_flag("ROTATE_ASYNC_FLIP");
+	mmap_hook_flag = suballoc_flag || migrate_flag || dirty_flag;
+	if (sscanf(get_option("ROTATE_SUBALLOC_MAX", ""), "%ux%u", &suballoc_max_w, &suballoc_max_h) != 2)
+		suballoc_max_w = suballoc_max_h = 512;
+	if (suballoc_max_w == 0 || suballoc_max_w > TILER_BO_WIDTH)
+		suballoc_max_w = TILER_BO_WIDTH;
+	switch (test_flag("ROTATE_ANGLE")) {
+	case 0: break; /* unset: keep the default */
+	case 90: shim_rotation = DRM_MODE_ROTATE_90; break;
+	case 180: shim_rotation = DRM_MODE_ROTATE_180; break;
+	case 270: shim_rotation = DRM_MODE_ROTATE_270; break;
+	case 360: shim_rotation = DRM_MODE_ROTATE_0; break;
+	default: printf("ROTATE_ANGLE must be 90, 180, 270 or 360\n"); break;
+	}
+	pagemode_flag = test_flag("ROTATE_PAGEMODE");
+	if (pagemode_flag && shim_rotation != DRM_MODE_ROTATE_0) {
+		printf("ROTATE_PAGEMODE only applies with ROTATE_ANGLE=360\n");
+		pagemode_flag = 0;
+	}
+	libc_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	libc_dlopen = dlsym(RTLD_NEXT, "dlopen");
+	libc_close = dlsym(RTLD_NEXT, "close");
+	libc_read = dlsym(RTLD_NEXT, "read");
+	libc_mmap = dlsym(RTLD_NEXT, "mmap");
+	libc_mmap64 = dlsym(RTLD_NEXT, "mmap64");
+	libc_munmap = dlsym(RTLD_NEXT, "munmap");
+	libc_open = dlsym(RTLD_NEXT, "open");
+	libc_open64 = dlsym(RTLD_NEXT, "open64");
+	libc_openat = dlsym(RTLD_NEXT, "openat");
+	libc_pread = dlsym(RTLD_NEXT, "pread");
+	libc_pread64 = dlsym(RTLD_NEXT, "pread64");
+	libc_fread = dlsym(RTLD_NEXT, "fread");
+	libc_recv = dlsym(RTLD_NEXT, "recv");
+	libc_recvfrom = dlsym(RTLD_NEXT, "recvfrom");
+	libc_readv = dlsym(RTLD_NEXT, "readv");
+	libc_preadv = dlsym(RTLD_NEXT, "preadv");
+	libc_preadv64 = dlsym(RTLD_NEXT, "preadv64");
+	libc_recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	libc_recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
+	/* Before any other fault handler, so that those see faults first and pass on what isn't theirs */
+	record_start();
+	if (sim_flag)
+		sim_start();
+	tiler_bo_ioctl = libc_ioctl;
+	if (dirty_flag)
+		dirty_init();
+	if (suballoc_flag)
+		suballoc_init();
+	if (migrate_flag)
+		migrate_init();
+
+	init_done = 1;
+}
+
+__attribute__((constructor)) void shim_constructor(void) {
+	init();
+	if (targeted_flag || vblank_model_flag || egl_flag || mmap_hook_flag || sim_flag || limit_fps)
+		got_patch_all();
+	if (getenv("ROTATE_SOCKET"))
+		socket_start(getenv("ROTATE_SOCKET"));
+}
+
+/*
+	Targeted interposition (ROTATE_TARGETED=1)
+
+	Exporting ioctl from an LD_PRELOADed object routes every ioctl in the
+	process through the wrapper below, including audio, input and network
+	libraries that have nothing to do with DRM. In targeted mode we instead
+	walk all loaded objects and rewrite their GOT slots for the hooked
+	symbols: libraries named in ROTATE_TARGET_LIBS (a colon separated list
+	of basename prefixes) are pointed at the shim, everything else is
+	pointed straight back at libc. dlopen is hooked the same way so that
+	libraries loaded later (libpvrDRMWSEGL.so is dlopened by the PowerVR
+	stack) get patched as soon as they appear.
+*/
+
+#if defined(__arm__)
+#define SHIM_R_JUMP_SLOT R_ARM_JUMP_SLOT
+#define SHIM_R_GLOB_DAT R_ARM_GLOB_DAT
+#elif defined(__aarch64__)
+#define SHIM_R_JUMP_SLOT R_AARCH64_JUMP_SLOT
+#define SHIM_R_GLOB_DAT R_AARCH64_GLOB_DAT
+#elif defined(__x86_64__)
+#define SHIM_R_JUMP_SLOT R_X86_64_JUMP_SLOT
+#define SHIM_R_GLOB_DAT R_X86_64_GLOB_DAT
+#elif defined(__i386__)
+#define SHIM_R_JUMP_SLOT R_386_JMP_SLOT
+#define SHIM_R_GLOB_DAT R_386_GLOB_DAT
+#else
+#error "targeted interposition: unsupported architecture"
+#endif
+
+#if __SIZEOF_POINTER__ == 8
+#define SHIM_R_SYM ELF64_R_SYM
+#define SHIM_R_TYPE ELF64_R_TYPE
+#else
+#define SHIM_R_SYM ELF32_R_SYM
+#define SHIM_R_TYPE ELF32_R_TYPE
+#endif
+
+void *shim_dlopen(const char *filename, int flags);
+
+ssize_t shim_read(int fd, void *buf, size_t count);
+int shim_open(const char *path, int flags, ...);
+int shim_open64(const char *path, int flags, ...);
+int shim_openat(int dirfd, const char *path, int flags, ...);
+int shim_clock_gettime(clockid_t clock, struct timespec *ts);
+unsigned int shim_eglQuerySurface(void *dpy, void *surface, int32_t attribute, int32_t *value);
+void *shim_eglCreateWindowSurface(void *dpy, void *config, uintptr_t win, const int32_t *attribs);
+unsigned int shim_eglDestroySurface(void *dpy, void *surface);
+void *shim_eglGetProcAddress(const char *name);
+void *shim_dlsym(void *handle, const char *name);
+void *shim_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+void *shim_mmap64(void *addr, size_t length, int prot, int flags, int fd, int64_t offset);
+int shim_munmap(void *addr, size_t length);
+ssize_t shim_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t shim_pread64(int fd, void *buf, size_t count, int64_t offset);
+size_t shim_fread(void *ptr, size_t size, size_t n, FILE *stream);
+ssize_t shim_recv(int fd, void *buf, size_t len, int flags);
+ssize_t shim_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen);
+ssize_t shim_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t shim_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t shim_preadv64(int fd, const struct iovec *iov, int iovcnt, int64_t offset);
+ssize_t shim_recvmsg(int fd, struct msghdr *msg, int flags);
+int shim_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags, struct timespec *timeout);
+
+struct got_hook {
+	const char *name;
+	void *shim_fn;      /* installed in target libraries */
+	void **real_fn;     /* installed everywhere else, NULL to leave alone */
+	int all_objects;    /* install shim_fn in every object, not just targets */
+	int *enable;        /* only patch when this flag is set, NULL for always */
+};
+
+struct got_hook got_hooks[] = {
+	{ "ioctl", (void *)ioctl, (void **)&libc_ioctl, 0, &targeted_flag },
+	{ "close", (void *)close, (void **)&libc_close, 0, &targeted_flag },
+	{ "read", (void *)shim_read, NULL, 0, &vblank_model_flag },
+	{ "read", (void *)shim_read, NULL, 0, &limit_fps },
+	{ "dlopen", (void *)shim_dlopen, NULL, 1, NULL },
+	{ "eglQuerySurface", (void *)shim_eglQuerySurface, NULL, 1, &egl_flag },
+	{ "eglCreateWindowSurface", (void *)shim_eglCreateWindowSurface, NULL, 1, &egl_flag },
+	{ "eglDestroySurface", (void *)shim_eglDestroySurface, NULL, 1, &egl_flag },
+	{ "eglGetProcAddress", (void *)shim_eglGetProcAddress, NULL, 1, &egl_flag },
+	{ "dlsym", (void *)shim_dlsym, NULL, 0, &egl_flag },
+	{ "mmap", (void *)shim_mmap, NULL, 1, &mmap_hook_flag },
+	{ "mmap64", (void *)shim_mmap64, NULL, 1, &mmap_hook_flag },
+	{ "munmap", (void *)shim_munmap, NULL, 1, &mmap_hook_flag },
+	/* Reads into write-protected mappings, see dirty_before_write */
+	{ "read", (void *)shim_read, NULL, 1, &dirty_flag },
+	{ "pread", (void *)shim_pread, NULL, 1, &dirty_flag },
+	{ "pread64", (void *)shim_pread64, NULL, 1, &dirty_flag },
+	{ "fread", (void *)shim_fread, NULL, 1, &dirty_flag },
+	{ "recv", (void *)shim_recv, NULL, 1, &dirty_flag },
+	{ "recvfrom", (void *)shim_recvfrom, NULL, 1, &dirty_flag },
+	{ "readv", (void *)shim_readv, NULL, 1, &dirty_flag },
+	{ "preadv", (void *)shim_preadv, NULL, 1, &dirty_flag },
+	{ "preadv64", (void *)shim_preadv64, NULL, 1, &dirty_flag },
+	{ "recvmsg", (void *)shim_recvmsg, NULL, 1, &dirty_flag },
+	{ "recvmmsg", (void *)shim_recvmmsg, NULL, 1, &dirty_flag },
+	/* The simulated device replaces the real one for the whole process */
+	{ "read", (void *)shim_read, NULL, 1, &sim_flag },
+	{ "open", (void *)shim_open, NULL, 1, &sim_flag },
+	{ "open64", (void *)shim_open64, NULL, 1, &sim_flag },
+	{ "openat", (void *)shim_openat, NULL, 1, &sim_flag },
+	{ "clock_gettime", (void *)shim_clock_gettime, NULL, 1, &sim_flag },
+};
+#define NUM_GOT_HOOKS (sizeof(got_hooks) / sizeof(got_hooks[0]))
+
+pthread_mutex_t got_lock = PTHREAD_MUTEX_INITIALIZER;
+int got_slots_patched = 0;
+
+int is_target_library(const char *path) {
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	const char *list = get_option("ROTATE_TARGET_LIBS", default_target_libs);
+	while (*list) {
+		const char *end = strchr(list, ':');
+		size_t len = end ? (size_t)(end - list) : strlen(list);
+		if (len > 0 && strncmp(base, list, len) == 0)
+			return 1;
+		if (!end)
+			break;
+		list = end + 1;
+	}
+	return 0;
+}
+
+void got_write_slot(void **slot, void *value, uintptr_t relro_start, uintptr_t relro_end) {
+	if (*slot == value)
+		return;
+	long page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t page = (uintptr_t)slot & ~(uintptr_t)(page_size - 1);
+	if (mprotect((void *)page, page_size, PROT_READ | PROT_WRITE) != 0) {
+		printf("got_write_slot: mprotect failed: %d\n", errno);
+		return;
+	}
+	*slot = value;
+	if ((uintptr_t)slot >= relro_start && (uintptr_t)slot < relro_end)
+		mprotect((void *)page, page_size, PROT_READ);
+	got_slots_patched++;
+}
+
+void got_patch_relocs(uintptr_t base, const void *relocs, size_t size, int is_rela,
+		const ElfW(Sym) *symtab, const char *strtab, int target,
+		uintptr_t relro_start, uintptr_t relro_end) {
+	size_t entsize = is_rela ? sizeof(ElfW(Rela)) : sizeof(ElfW(Rel));
+	for (size_t off = 0; off + entsize <= size; off += entsize) {
+		const ElfW(Rel) *rel = (const ElfW(Rel) *)((const char *)relocs + off);
+		size_t type = SHIM_R_TYPE(rel->r_info);
+		if (type != SHIM_R_JUMP_SLOT && type != SHIM_R_GLOB_DAT)
+			continue;
+		const char *name = strtab + symtab[SHIM_R_SYM(rel->r_info)].st_name;
+		for (int i = 0; i < NUM_GOT_HOOKS; i++) {
+			if (strcmp(name, got_hooks[i].name) != 0)
+				continue;
+			if (got_hooks[i].enable && !*got_hooks[i].enable)
+				continue;
+			void *value = (target || got_hooks[i].all_objects) ? got_hooks[i].shim_fn :
+				(got_hooks[i].real_fn ? *got_hooks[i].real_fn : NULL);
+			if (value)
+				got_write_slot((void **)(base + rel->r_offset), value, relro_start, relro_end);
+		}
+	}
+}
+
+int got_patch_object(struct dl_phdr_info *info, size_t size, void *data) {
+	Dl_info self;
+	uintptr_t base = info->dlpi_addr;
+	const char *path = info->dlpi_name ? info->dlpi_name : "";
+
+	/* Never patch ourselves, libc or the dynamic loader */
+	if (dladdr((void *)got_patch_object, &self) && (uintptr_t)self.dli_fbase == base && base != 0)
+		return 0;
+	if (strstr(path, "/libc.so") || strstr(path, "/ld-linux") || strstr(path, "/libdl.so"))
+		return 0;
+
+	const ElfW(Dyn) *dyn = NULL;
+	uintptr_t relro_start = 0, relro_end = 0;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		if (info->dlpi_phdr[i].p_type == PT_DYNAMIC)
+			dyn = (const ElfW(Dyn) *)(base + info->dlpi_phdr[i].p_vaddr);
+		if (info->dlpi_phdr[i].p_type == PT_GNU_RELRO) {
+			relro_start = base + info->dlpi_phdr[i].p_vaddr;
+			relro_end = relro_start + info->dlpi_phdr[i].p_memsz;
+		}
+	}
+	if (!dyn)
+		return 0;
+
+	uintptr_t symtab = 0, strtab = 0, jmprel = 0, rel = 0, rela = 0;
+	size_t pltrelsz = 0, relsz = 0, relasz = 0;
+	int pltrel_is_rela = 0;
+	for (; dyn->d_tag != DT_NULL; dyn++) {
+		switch (dyn->d_tag) {
+		case DT_SYMTAB: symtab = dyn->d_un.d_ptr; break;
+		case DT_STRTAB: strtab = dyn->d_un.d_ptr; break;
+		case DT_JMPREL: jmprel = dyn->d_un.d_ptr; break;
+		case DT_PLTRELSZ: pltrelsz = dyn->d_un.d_val; break;
+		case DT_PLTREL: pltrel_is_rela = (dyn->d_un.d_val == DT_RELA); break;
+		case DT_REL: rel = dyn->d_un.d_ptr; break;
+		case DT_RELSZ: relsz = dyn->d_un.d_val; break;
+		case DT_RELA: rela = dyn->d_un.d_ptr; break;
+		case DT_RELASZ: relasz = dyn->d_un.d_val; break;
+		}
+	}
+	if (!symtab || !strtab)
+		return 0;
+	/* glibc relocates these in place on most targets, but not all */
+	if (symtab < base) symtab += base;
+	if (strtab < base) strtab += base;
+	if (jmprel && jmprel < base) jmprel += base;
+	if (rel && rel < base) rel += base;
+	if (rela && rela < base) rela += base;
+
+	int target = is_target_library(path);
+	const ElfW(Sym) *syms = (const ElfW(Sym) *)symtab;
+	const char *strs = (const char *)strtab;
+	if (jmprel)
+		got_patch_relocs(base, (void *)jmprel, pltrelsz, pltrel_is_rela, syms, strs, target, relro_start, relro_end);
+	if (rel)
+		got_patch_relocs(base, (void *)rel, relsz, 0, syms, strs, target, relro_start, relro_end);
+	if (rela)
+		got_patch_relocs(base, (void *)rela, relasz, 1, syms, strs, target, relro_start, relro_end);
+
+	if (debug_flag)
+		printf("targeted: %s %s\n", target ? "hooked" : "bypassed", path[0] ? path : "<main>");
+	return 0;
+}
+
+void got_patch_all(void) {
+	pthread_mutex_lock(&got_lock);
+	got_slots_patched = 0;
+	dl_iterate_phdr(got_patch_object, NULL);
+	if (debug_flag)
+		printf("targeted: patched %d GOT slots\n", got_slots_patched);
+	pthread_mutex_unlock(&got_lock);
+}
+
+void *shim_dlopen(const char *filename, int flags) {
+	void *handle = libc_dlopen(filename, flags);
+	if (handle)
+		got_patch_all();
+	return handle;
+}
+
+int get_rotation_property_key(int fd, int plane) {
+	int key = tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "rotation", NULL);
+	if (key == -1)
+		printf("get_rotation_property_key: no rotation\n");
+	return key;
+}
+
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	if (sim_flag)
+		return tiler_sim_now_ns();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+	Framebuffer and front buffer tracking
+
+	Remember which GEM handle and geometry each framebuffer the client
+	creates refers to, and which framebuffer each CRTC is currently
+	flipping to, so that the current frame can be handed out for capture.
+*/
+
+#define MAX_FBS 64
+#define MAX_CRTCS 8
+
+struct fb_info {
+	uint32_t fb_id;
+	int fd;
+	uint32_t handle;
+	uint32_t width, height, pitch, offset, format;
+};
+
+struct crtc_info {
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t sequence;
+};
+
+struct fb_info fbs[MAX_FBS];
+struct crtc_info crtcs[MAX_CRTCS];
+pthread_mutex_t fb_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t flip_sequence = 0;
+
+uint32_t legacy_fourcc(uint32_t bpp, uint32_t depth) {
+	if (bpp == 32)
+		return depth == 32 ? DRM_FORMAT_ARGB8888 : DRM_FORMAT_XRGB8888;
+	if (bpp == 24)
+		return DRM_FORMAT_RGB888;
+	if (bpp == 16)
+		return depth == 15 ? DRM_FORMAT_XRGB1555 : DRM_FORMAT_RGB565;
+	return 0;
+}
+
+void fb_track_add(int fd, uint32_t fb_id, uint32_t handle, uint32_t width, uint32_t height,
+		uint32_t pitch, uint32_t offset, uint32_t format) {
+	pthread_mutex_lock(&fb_lock);
+	for (int i = 0; i < MAX_FBS; i++) {
+		if (fbs[i].fb_id == 0 || fbs[i].fb_id == fb_id) {
+			struct fb_info info = { fb_id, fd, handle, width, height, pitch, offset, format };
+			fbs[i] = info;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fb_lock);
+}
+
+void fb_track_remove(uint32_t fb_id) {
+	pthread_mutex_lock(&fb_lock);
+	for (int i = 0; i < MAX_FBS; i++)
+		if (fbs[i].fb_id == fb_id)
+			fbs[i].fb_id = 0;
+	pthread_mutex_unlock(&fb_lock);
+}
+
+/* A framebuffer replaced by another on a new buffer (see migrate_buffer) */
+void fb_track_rebind(uint32_t fb_id, uint32_t new_fb_id, uint32_t handle) {
+	pthread_mutex_lock(&fb_lock);
+	for (int i = 0; i < MAX_FBS; i++) {
+		if (fbs[i].fb_id == fb_id && fb_id != 0) {
+			fbs[i].fb_id = new_fb_id;
+			fbs[i].handle = handle;
+		}
+	}
+	pthread_mutex_unlock(&fb_lock);
+}
+
+/* Called with fb_lock held */
+struct fb_info *fb_lookup(uint32_t fb_id) {
+	for (int i = 0; i < MAX_FBS; i++)
+		if (fbs[i].fb_id == fb_id && fb_id != 0)
+			return &fbs[i];
+	return NULL;
+}
+
+uint32_t fb_format(uint32_t fb_id) {
+	pthread_mutex_lock(&fb_lock);
+	struct fb_info *fb = fb_lookup(fb_id);
+	uint32_t format = fb ? fb->format : 0;
+	pthread_mutex_unlock(&fb_lock);
+	return format;
+}
+
+void socket_notify_flip(uint32_t sequence, uint32_t crtc_id, uint32_t fb_id);
+void stats_frame(void);
+
+void fb_track_flip(uint32_t crtc_id, uint32_t fb_id) {
+	uint32_t sequence;
+	pthread_mutex_lock(&fb_lock);
+	sequence = ++flip_sequence;
+	for (int i = 0; i < MAX_CRTCS; i++) {
+		if (crtcs[i].crtc_id == 0 || crtcs[i].crtc_id == crtc_id) {
+			crtcs[i].crtc_id = crtc_id;
+			crtcs[i].fb_id = fb_id;
+			crtcs[i].sequence = sequence;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fb_lock);
+	socket_notify_flip(sequence, crtc_id, fb_id);
+	stats_frame();
+}
+
+/*
+	Per-device state
+
+	Every fd is mapped to the device node it refers to (by st_rdev) the
+	first time it issues a DRM ioctl, so fds opened separately on the same
+	card share what has been probed about it. Only omapdrm primary nodes,
+	as reported by DRM_IOCTL_VERSION, are intercepted: render nodes and
+	other devices such as USB display adaptors are passed straight through.
+*/
+
+#define MAX_FDS 1024
+#define MAX_DEVICES 4
+#define DRM_MINOR_CONTROL_BASE 64 /* primary nodes are minors 0-63 */
+
+struct device_state {
+	dev_t rdev;
+	int intercept;
+	char driver[32];
+	uint32_t crtc_ids[MAX_CRTCS];
+	int num_crtcs;          /* -1 until queried */
+	int probe_fd;
+	int probe_done;
+	int async_flip;         /* DRM_CAP_ASYNC_PAGE_FLIP, -1 until asked */
+	int async_atomic;       /* DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, -1 until asked */
+};
+
+struct device_state devices[MAX_DEVICES];
+int num_devices = 0;
+struct device_state *fd_devices[MAX_FDS];
+pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void device_start_probe(int fd, struct device_state *dev);
+void device_wait_probe(struct device_state *dev);
+int crtc_index(int fd, uint32_t crtc_id);
+void limit_report(void);
+void limit_flip_done(int fd, uint32_t crtc_id, uint32_t sequence, uint64_t time_ns);
+
+/* The device node behind fd, or 0 for anything that isn't a character device */
+dev_t fd_rdev(int fd) {
+	struct stat st;
+	if (sim_flag && tiler_sim_owns(fd, 1))
+		return makedev(TILER_SIM_MAJOR, TILER_SIM_MINOR);
+	if (fstat(fd, &st) != 0 || !S_ISCHR(st.st_mode))
+		return 0;
+	return st.st_rdev;
+}
+
+void fd_forget(int fd);
+
+struct device_state *fd_device(int fd) {
+	if (fd < 0 || fd >= MAX_FDS)
+		return NULL;
+	dev_t rdev = fd_rdev(fd);
+	struct device_state *dev = __atomic_load_n(&fd_devices[fd], __ATOMIC_ACQUIRE);
+	/*
+		close() only sees the fds it is interposed on: with ROTATE_TARGETED
+		that is the target libraries, and dup2/dup3/close_range replace fds
+		without it anywhere. A number reused for another node loses what was
+		recorded for the old one before it is looked up again.
+	*/
+	if (dev && dev->rdev == rdev)
+		return dev;
+	if (dev)
+		fd_forget(fd);
+	if (rdev == 0)
+		return NULL;
+	dev = NULL;
+
+	pthread_mutex_lock(&device_lock);
+	for (int i = 0; i < num_devices; i++)
+		if (devices[i].rdev == rdev)
+			dev = &devices[i];
+	if (!dev && num_devices < MAX_DEVICES) {
+		dev = &devices[num_devices];
+		memset(dev, 0, sizeof(*dev));
+		dev->rdev = rdev;
+		dev->num_crtcs = -1;
+		dev->async_flip = dev->async_atomic = -1;
+		struct drm_version version;
+		memset(&version, 0, sizeof(version));
+		version.name = dev->driver;
+		version.name_len = sizeof(dev->driver) - 1;
+		libc_ioctl(fd, DRM_IOCTL_VERSION, (char *)&version);
+		dev->intercept = strcmp(dev->driver, "omapdrm") == 0 && minor(rdev) < DRM_MINOR_CONTROL_BASE;
+		printf("device %u:%u: %s%s\n", major(rdev), minor(rdev),
+			dev->driver[0] ? dev->driver : "unknown", dev->intercept ? "" : ", not intercepted");
+		__atomic_store_n(&num_devices, num_devices + 1, __ATOMIC_RELEASE);
+		if (dev->intercept)
+			device_start_probe(fd, dev);
+		else
+			dev->probe_done = 1;
+	}
+	if (dev)
+		__atomic_store_n(&fd_devices[fd], dev, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&device_lock);
+	return dev;
+}
+
+/*
+	Per-lease state
+
+	A DRM fd may be a lessee that only owns some of the CRTCs, connectors
+	and planes, or a lessor that has leased some of them away. Rotation and
+	geometry rewriting are limited to the objects the fd may use, so that a
+	rotated panel app and an unrotated HDMI app can share the device.
+
+	fds we create leases on are tracked directly; any other fd is asked
+	with DRM_IOCTL_MODE_GET_LEASE on first use (for the device owner the
+	kernel reports every object). fds with the same set of objects share a
+	lease_state, which also holds the plane caches for that lease. The
+	state of a lease created here is freed when it is revoked or the last
+	fd using it is closed. An fd that can't get one is treated as owning nothing, so
+	running out of slots never lets the shim touch objects leased away.
+*/
+
+#define MAX_LEASES 8
+#define MAX_LEASE_OBJECTS 64
+#define MAX_PLANES 16
+
+struct plane_info {
+	uint32_t plane_id;
+	uint32_t crtc_id;
+	uint32_t possible_crtcs;
+	int primary;
+	int fb_id_prop;
+	int crtc_id_prop;
+	int src_x_prop;
+	int src_y_prop;
+	int src_w_prop;
+	int src_h_prop;
+	int rotation_prop;
+};
+
+struct lease_state {
+	int in_use;
+	struct device_state *dev;
+	uint32_t lessee_id;     /* non-zero for leases created in this process */
+	int restricted;         /* only the objects listed may be used */
+	uint32_t objects[MAX_LEASE_OBJECTS];
+	int num_objects;
+	uint32_t leased_out[MAX_LEASE_OBJECTS];
+	uint32_t leased_to[MAX_LEASE_OBJECTS]; /* lessee_id of each leased_out object */
+	int num_leased_out;
+	struct plane_info planes[MAX_PLANES];
+	int num_planes;         /* -1 until enumerated */
+	int rotation_pending;   /* buffers were created but rotation not committed yet */
+};
+
+struct lease_state leases[MAX_LEASES];
+struct lease_state *fd_leases[MAX_FDS];
+uint8_t drm_fds[MAX_FDS];
+pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct lease_state *lease_alloc(struct device_state *dev, int restricted, const uint32_t *objects, int count) {
+	if (count > MAX_LEASE_OBJECTS)
+		count = MAX_LEASE_OBJECTS;
+	for (int i = 0; i < MAX_LEASES; i++) {
+		struct lease_state *l = &leases[i];
+		if (l->in_use && l->dev == dev && l->lessee_id == 0 && l->restricted == restricted && l->num_objects == count
+				&& memcmp(l->objects, objects, count * sizeof(uint32_t)) == 0)
+			return l;
+	}
+	for (int i = 0; i < MAX_LEASES; i++) {
+		struct lease_state *l = &leases[i];
+		if (!l->in_use) {
+			memset(l, 0, sizeof(*l));
+			l->in_use = 1;
+			l->dev = dev;
+			l->restricted = restricted;
+			memcpy(l->objects, objects, count * sizeof(uint32_t));
+			l->num_objects = count;
+			l->num_planes = -1;
+			return l;
+		}
+	}
+	printf("lease: out of lease slots\n");
+	return NULL;
+}
+
+struct lease_state *fd_lease(int fd) {
+	if (fd < 0 || fd >= MAX_FDS)
+		return NULL;
+	if (fd_leases[fd])
+		return fd_leases[fd];
+
+	uint32_t objects[MAX_LEASE_OBJECTS];
+	struct drm_mode_get_lease get_lease;
+	memset(&get_lease, 0, sizeof(get_lease));
+	get_lease.count_objects = MAX_LEASE_OBJECTS;
+	get_lease.objects_ptr = (uint64_t)objects;
+	int restricted = (libc_ioctl(fd, DRM_IOCTL_MODE_GET_LEASE, (char *)&get_lease) == 0);
+	if (restricted && get_lease.count_objects > MAX_LEASE_OBJECTS) {
+		printf("lease: too many objects (%u), not restricting fd %d\n", get_lease.count_objects, fd);
+		restricted = 0;
+	}
+
+	pthread_mutex_lock(&lease_lock);
+	struct lease_state *lease = lease_alloc(fd_device(fd), restricted, objects, restricted ? get_lease.count_objects : 0);
+	fd_leases[fd] = lease;
+	pthread_mutex_unlock(&lease_lock);
+	if (debug_flag && lease)
+		printf("lease: fd %d may use %s%d objects\n", fd, restricted ? "" : "all (no lease support) ", lease->num_objects);
+	return lease;
+}
+
+int lease_allows(struct lease_state *lease, uint32_t obj_id) {
+	if (!lease)
+		return 0;
+	for (int i = 0; i < lease->num_leased_out; i++)
+		if (lease->leased_out[i] == obj_id)
+			return 0;
+	if (!lease->restricted)
+		return 1;
+	for (int i = 0; i < lease->num_objects; i++)
+		if (lease->objects[i] == obj_id)
+			return 1;
+	return 0;
+}
+
+void lease_created(int lessor_fd, struct drm_mode_create_lease *create) {
+	const uint32_t *objects = (const uint32_t *)create->object_ids;
+	struct lease_state *lessor = fd_lease(lessor_fd);
+
+	pthread_mutex_lock(&lease_lock);
+	struct lease_state *lessee = create->fd < MAX_FDS ?
+		lease_alloc(fd_device(lessor_fd), 1, objects, create->object_count) : NULL;
+	if (lessee) {
+		lessee->lessee_id = create->lessee_id;
+		fd_leases[create->fd] = lessee;
+	}
+	for (int i = 0; lessor && i < create->object_count && lessor->num_leased_out < MAX_LEASE_OBJECTS; i++) {
+		lessor->leased_out[lessor->num_leased_out] = objects[i];
+		lessor->leased_to[lessor->num_leased_out++] = create->lessee_id;
+	}
+	if (lessor)
+		lessor->num_planes = -1;
+	pthread_mutex_unlock(&lease_lock);
+	printf("lease: created lessee %u (fd %u) with %u objects\n", create->lessee_id, create->fd, create->object_count);
+}
+
+/* Free a lease_state and drop the fds using it; lease_lock held */
+void lease_release(struct lease_state *lease) {
+	for (int fd = 0; fd < MAX_FDS; fd++)
+		if (fd_leases[fd] == lease)
+			fd_leases[fd] = NULL;
+	lease->in_use = 0;
+}
+
+void lease_revoked(uint32_t lessee_id) {
+	pthread_mutex_lock(&lease_lock);
+	for (int i = 0; i < MAX_LEASES; i++) {
+		struct lease_state *l = &leases[i];
+		if (!l->in_use)
+			continue;
+		if (l->lessee_id == lessee_id) {
+			lease_release(l);
+			continue;
+		}
+		/* Hand the objects back to the lessor */
+		int returned = 0;
+		for (int k = 0; k < l->num_leased_out; ) {
+			if (l->leased_to[k] == lessee_id) {
+				l->num_leased_out--;
+				l->leased_out[k] = l->leased_out[l->num_leased_out];
+				l->leased_to[k] = l->leased_to[l->num_leased_out];
+				returned = 1;
+			} else {
+				k++;
+			}
+		}
+		if (returned)
+			l->num_planes = -1;
+	}
+	pthread_mutex_unlock(&lease_lock);
+}
+
+void fd_forget(int fd) {
+	if (fd < 0 || fd >= MAX_FDS)
+		return;
+	pthread_mutex_lock(&lease_lock);
+	struct lease_state *lease = fd_leases[fd];
+	fd_leases[fd] = NULL;
+	int used = 0;
+	for (int i = 0; lease && i < MAX_FDS && !used; i++)
+		used = fd_leases[i] == lease;
+	/*
+		A lessee's slot goes with its last fd. The lease may live on in
+		another process, so a lessor keeps the objects it leased out until
+		REVOKE_LEASE. Shared states stay for the next fd with the same
+		objects (the probe thread's dup is closed before the client's fd
+		asks).
+	*/
+	if (lease && !used && lease->lessee_id != 0)
+		lease_release(lease);
+	pthread_mutex_unlock(&lease_lock);
+	fd_devices[fd] = NULL;
+	drm_fds[fd] = 0;
+}
+
+/*
+	Enumerate the planes visible to this lease, caching the property ids
+	we need for rotation and for spotting atomic flips on the primary plane
+*/
+void lease_enumerate_planes(int fd, struct lease_state *lease) {
+	if (lease->num_planes >= 0)
+		return;
+
+	uint32_t planes[MAX_PLANES];
+	struct drm_mode_get_plane_res plane_res;
+	plane_res.count_planes = MAX_PLANES;
+	plane_res.plane_id_ptr = (uint64_t)planes;
+	if (libc_ioctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, (char *) &plane_res) != 0)
+		return;
+	int count = plane_res.count_planes < MAX_PLANES ? plane_res.count_planes : MAX_PLANES;
+
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		uint32_t plane_id = planes[i];
+		if (!lease_allows(lease, plane_id))
+			continue;
+		struct plane_info *plane = &lease->planes[n++];
+		uint64_t type = 0;
+		struct drm_mode_get_plane get_plane;
+		memset(&get_plane, 0, sizeof(get_plane));
+		get_plane.plane_id = plane_id;
+		libc_ioctl(fd, DRM_IOCTL_MODE_GETPLANE, (char *)&get_plane);
+		tiler_rotate_property(fd, plane_id, DRM_MODE_OBJECT_PLANE, "type", &type);
+		plane->plane_id = plane_id;
+		plane->crtc_id = get_plane.crtc_id;
+		plane->possible_crtcs = get_plane.possible_crtcs;
+		plane->primary = (type == 1); /* DRM_PLANE_TYPE_PRIMARY */
+		plane->fb_id_prop = tiler_rotate_property(fd, plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID", NULL);
+		plane->crtc_id_prop = tiler_rotate_property(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", NULL);
+		plane->src_x_prop = tiler_rotate_property(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X", NULL);
+		plane->src_y_prop = tiler_rotate_property(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y", NULL);
+		plane->src_w_prop = tiler_rotate_property(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W", NULL);
+		plane->src_h_prop = tiler_rotate_property(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H", NULL);
+		plane->rotation_prop = get_rotation_property_key(fd, plane_id);
+	}
+	lease->num_planes = n;
+}
+
+struct plane_info *plane_lookup(int fd, uint32_t plane_id) {
+	struct lease_state *lease = fd_lease(fd);
+	if (!lease)
+		return NULL;
+	lease_enumerate_planes(fd, lease);
+	for (int i = 0; i < lease->num_planes; i++)
+		if (lease->planes[i].plane_id == plane_id)
+			return &lease->planes[i];
+	return NULL;
+}
+
+void fb_track_atomic(int fd, struct drm_mode_atomic *atomic) {
+	uint32_t *objs = (uint32_t *)atomic->objs_ptr;
+	uint32_t *count_props = (uint32_t *)atomic->count_props_ptr;
+	uint32_t *props = (uint32_t *)atomic->props_ptr;
+	uint64_t *values = (uint64_t *)atomic->prop_values_ptr;
+	int k = 0;
+	for (int i = 0; i < atomic->count_objs; k += count_props[i], i++) {
+		struct plane_info *plane = plane_lookup(fd, objs[i]);
+		if (!plane)
+			continue;
+		uint32_t fb_id = 0;
+		for (int j = 0; j < count_props[i]; j++) {
+			if (props[k + j] == plane->fb_id_prop)
+				fb_id = values[k + j];
+			if (props[k + j] == plane->crtc_id_prop)
+				plane->crtc_id = values[k + j];
+		}
+		if (plane->primary && fb_id != 0 && plane->crtc_id != 0)
+			fb_track_flip(plane->crtc_id, fb_id);
+	}
+}
+
+/*
+	Bandwidth accounting (ROTATE_STATS=n, TILER_SHIM_CMD_STATS)
+
+	This is a model rather than a measurement: every active plane reads its
+	source rectangle once per refresh of its CRTC, planes scanned out
+	through a 90 or 270 degree TILER view are charged TILED_OVERHEAD_PCT
+	extra for fetching across tile rows, and the shim's own copies are
+	counted as it makes them. Cumulative figures advance with time.
+*/
+
+#define TILED_OVERHEAD_PCT 25
+#define STATS_DEFAULT_VREFRESH 60
+
+struct stats_plane {
+	uint32_t plane_id;  /* 0: legacy primary of crtc_id, plane unknown */
+	uint32_t crtc_id;
+	uint32_t width, height, bpp;
+	uint32_t rotation;
+};
+
+struct stats_plane stats_planes[MAX_PLANES];
+uint32_t stats_vrefresh[MAX_CRTCS][2]; /* crtc id, Hz */
+uint64_t stats_frames = 0;
+uint64_t stats_copy_bytes = 0;
+uint64_t stats_updated_ns = 0;
+double stats_scanout_bytes = 0, stats_overhead_bytes = 0;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct plane_info *primary_plane_for_crtc(int fd, struct lease_state *lease, uint32_t crtc_id);
+
+uint32_t format_bpp(uint32_t format) {
+	switch (format) {
+	case DRM_FORMAT_RGB565: case DRM_FORMAT_BGR565:
+	case DRM_FORMAT_YUYV: case DRM_FORMAT_UYVY:
+		return 16;
+	case DRM_FORMAT_RGB888: case DRM_FORMAT_BGR888:
+		return 24;
+	case DRM_FORMAT_NV12:
+		return 12;
+	default:
+		return 32;
+	}
+}
+
+uint32_t fb_bpp(uint32_t fb_id) {
+	pthread_mutex_lock(&fb_lock);
+	struct fb_info *fb = fb_lookup(fb_id);
+	uint32_t bpp = fb ? format_bpp(fb->format) : 32;
+	pthread_mutex_unlock(&fb_lock);
+	return bpp;
+}
+
+uint32_t stats_crtc_vrefresh(uint32_t crtc_id) {
+	for (int i = 0; i < MAX_CRTCS; i++)
+		if (stats_vrefresh[i][0] == crtc_id && stats_vrefresh[i][1] != 0)
+			return stats_vrefresh[i][1];
+	return STATS_DEFAULT_VREFRESH;
+}
+
+uint64_t stats_plane_bytes(const struct stats_plane *p) {
+	return (uint64_t)p->width * p->height * p->bpp / 8;
+}
+
+uint64_t stats_plane_overhead(const struct stats_plane *p) {
+	if (p->rotation != DRM_MODE_ROTATE_90 && p->rotation != DRM_MODE_ROTATE_270)
+		return 0;
+	return stats_plane_bytes(p) * TILED_OVERHEAD_PCT / 100;
+}
+
+/* Bring the cumulative totals up to now, stats_lock held */
+void stats_advance(void) {
+	uint64_t now = monotonic_ns();
+	double elapsed = stats_updated_ns ? (now - stats_updated_ns) / 1e9 : 0;
+	stats_updated_ns = now;
+	for (int i = 0; i < MAX_PLANES; i++) {
+		struct stats_plane *p = &stats_planes[i];
+		if (p->crtc_id == 0)
+			continue;
+		double refreshes = elapsed * stats_crtc_vrefresh(p->crtc_id);
+		stats_scanout_bytes += refreshes * stats_plane_bytes(p);
+		stats_overhead_bytes += refreshes * stats_plane_overhead(p);
+	}
+}
+
+/* Find or add the entry for a plane, stats_lock held */
+struct stats_plane *stats_plane_find(uint32_t plane_id, uint32_t crtc_id) {
+	struct stats_plane *free_slot = NULL;
+	for (int i = 0; i < MAX_PLANES; i++) {
+		struct stats_plane *p = &stats_planes[i];
+		if (p->crtc_id != 0 && p->plane_id == plane_id && (plane_id != 0 || p->crtc_id == crtc_id))
+			return p;
+		if (p->crtc_id == 0 && !free_slot)
+			free_slot = p;
+	}
+	if (free_slot) {
+		memset(free_slot, 0, sizeof(*free_slot));
+		free_slot->plane_id = plane_id;
+	}
+	return free_slot;
+}
+
+/* crtc_id 0 disables the plane */
+void stats_plane_update(uint32_t plane_id, uint32_t crtc_id, uint32_t width, uint32_t height, uint32_t bpp) {
+	pthread_mutex_lock(&stats_lock);
+	stats_advance();
+	struct stats_plane *p = stats_plane_find(plane_id, crtc_id);
+	if (p) {
+		p->crtc_id = crtc_id;
+		p->width = width;
+		p->height = height;
+		p->bpp = bpp;
+		p->rotation = shim_rotation;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_crtc_mode(uint32_t crtc_id, uint32_t vrefresh) {
+	pthread_mutex_lock(&stats_lock);
+	stats_advance();
+	for (int i = 0; i < MAX_CRTCS; i++) {
+		if (stats_vrefresh[i][0] == 0 || stats_vrefresh[i][0] == crtc_id) {
+			stats_vrefresh[i][0] = crtc_id;
+			stats_vrefresh[i][1] = vrefresh;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_add_copy(uint64_t bytes) {
+	__atomic_add_fetch(&stats_copy_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_fill(struct tiler_shim_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&stats_lock);
+	stats_advance();
+	stats->frames = stats_frames;
+	stats->scanout_bytes = stats_scanout_bytes;
+	stats->overhead_bytes = stats_overhead_bytes;
+	stats->copy_bytes = __atomic_load_n(&stats_copy_bytes, __ATOMIC_RELAXED);
+	for (int i = 0; i < MAX_PLANES; i++) {
+		struct stats_plane *p = &stats_planes[i];
+		if (p->crtc_id == 0)
+			continue;
+		stats->scanout_bytes_per_frame += stats_plane_bytes(p);
+		stats->overhead_bytes_per_frame += stats_plane_overhead(p);
+		if (stats->num_planes < TILER_SHIM_STATS_PLANES) {
+			struct tiler_shim_plane_stats *out = &stats->planes[stats->num_planes++];
+			out->plane_id = p->plane_id;
+			out->crtc_id = p->crtc_id;
+			out->width = p->width;
+			out->height = p->height;
+			out->bpp = p->bpp;
+			out->rotation = p->rotation;
+			out->vrefresh = stats_crtc_vrefresh(p->crtc_id);
+			out->bytes_per_frame = stats_plane_bytes(p) + stats_plane_overhead(p);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* Called for every flip the client makes */
+void stats_frame(void) {
+	uint64_t frames = __atomic_add_fetch(&stats_frames, 1, __ATOMIC_RELAXED);
+	if (stats_interval <= 0 || frames % stats_interval != 0)
+		return;
+	struct tiler_shim_stats stats;
+	stats_fill(&stats);
+	printf("stats: %llu frames, scanout %llu KiB/refresh (+%llu KiB tiled overhead), totals %llu MiB scanout, %llu MiB overhead, %llu MiB copied\n",
+		(unsigned long long)stats.frames, (unsigned long long)stats.scanout_bytes_per_frame >> 10,
+		(unsigned long long)stats.overhead_bytes_per_frame >> 10, (unsigned long long)stats.scanout_bytes >> 20,
+		(unsigned long long)stats.overhead_bytes >> 20, (unsigned long long)stats.copy_bytes >> 20);
+	if (limit_fps)
+		limit_report();
+}
+
+void stats_track_setcrtc(int fd, struct drm_mode_crtc *crtc) {
+	if (crtc->mode_valid)
+		stats_crtc_mode(crtc->crtc_id, crtc->mode.vrefresh);
+	if (crtc->fb_id == (uint32_t)-1)
+		return;
+	struct lease_state *lease = fd_lease(fd);
+	struct plane_info *primary = lease ? primary_plane_for_crtc(fd, lease, crtc->crtc_id) : NULL;
+	uint32_t plane_id = primary ? primary->plane_id : 0;
+	if (crtc->fb_id == 0 || !crtc->mode_valid)
+		stats_plane_update(plane_id, 0, 0, 0, 0);
+	else
+		stats_plane_update(plane_id, crtc->crtc_id, crtc->mode.hdisplay, crtc->mode.vdisplay, fb_bpp(crtc->fb_id));
+}
+
+void stats_track_atomic(int fd, struct drm_mode_atomic *atomic) {
+	uint32_t *objs = (uint32_t *)atomic->objs_ptr;
+	uint32_t *count_props = (uint32_t *)atomic->count_props_ptr;
+	uint32_t *props = (uint32_t *)atomic->props_ptr;
+	uint64_t *values = (uint64_t *)atomic->prop_values_ptr;
+	int k = 0;
+	for (int i = 0; i < atomic->count_objs; k += count_props[i], i++) {
+		struct plane_info *plane = plane_lookup(fd, objs[i]);
+		if (!plane)
+			continue;
+		pthread_mutex_lock(&stats_lock);
+		struct stats_plane *p = stats_plane_find(plane->plane_id, plane->crtc_id);
+		struct stats_plane cur = p ? *p : (struct stats_plane){ plane->plane_id };
+		pthread_mutex_unlock(&stats_lock);
+		uint32_t fb_id = 0;
+		for (int j = 0; j < count_props[i]; j++) {
+			if (props[k + j] == plane->fb_id_prop)
+				fb_id = values[k + j];
+			else if (props[k + j] == plane->crtc_id_prop)
+				cur.crtc_id = values[k + j];
+			else if (props[k + j] == plane->src_w_prop)
+				cur.width = values[k + j] >> 16;
+			else if (props[k + j] == plane->src_h_prop)
+				cur.height = values[k + j] >> 16;
+		}
+		if (fb_id != 0)
+			cur.bpp = fb_bpp(fb_id);
+		stats_plane_update(cur.plane_id, cur.crtc_id, cur.width, cur.height, cur.bpp);
+	}
+}
+
+/*
+	Flight recorder (on unless ROTATE_RECORD=0)
+
+	The last RECORD_ENTRIES DRM ioctls are kept in a ring with a timestamp,
+	the request, the first words of the argument (after the call, so ids
+	the kernel hands back are included) and the result. Recording is a
+	clock read and a 40 byte store. The ring is written as text to
+	ROTATE_RECORD_FILE on a fatal signal and at exit, and can be fetched
+	over the control socket with TILER_SHIM_CMD_RECORD. The default file is
+	tiler_shim-<pid>.rec in the user's XDG_RUNTIME_DIR, or in /tmp without
+	one; as the name is predictable and clients often run as root, it is
+	only ever created afresh, never opened through a symlink or truncated.
+
+	Where the CPU counter can be read directly the ring stores raw ticks,
+	converted to CLOCK_MONOTONIC when it is dumped, since even a vDSO
+	clock_gettime would be most of the per-record budget. Elsewhere (32-bit
+	ARM) it stores CLOCK_MONOTONIC_COARSE. scripts/bench_record.sh measures
+	the cost. Processes that never make a DRM ioctl leave no file behind.
+*/
+
+#define RECORD_ENTRIES 4096 /* power of two */
+
+struct tiler_shim_record record_ring[RECORD_ENTRIES];
+uint32_t record_next = 0;
+int record_flag = 1;
+char record_path[256];
+int record_path_shared = 0;     /* the default path, in a directory others can write to */
+struct sigaction record_old_actions[NSIG];
+const int record_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+uint64_t record_base_ticks, record_base_ns;
+
+static inline uint64_t record_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	/*
+		32-bit ARM: the Cortex-A9 (OMAP4) has no generic timer, and without
+		one the vDSO makes a syscall for CLOCK_MONOTONIC. The coarse clock
+		is read from the vDSO page alone. It only advances once a tick, but
+		records are dumped in the order they were made, so that is kept.
+	*/
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Convert recorded ticks using the start of recording and now as reference points */
+uint64_t record_ticks_to_ns(uint64_t ticks, uint64_t now_ticks, uint64_t now_ns) {
+	if (now_ticks <= record_base_ticks || now_ns <= record_base_ns)
+		return ticks;
+	double scale = (double)(now_ns - record_base_ns) / (double)(now_ticks - record_base_ticks);
+	return record_base_ns + (uint64_t)((double)(int64_t)(ticks - record_base_ticks) * scale);
+}
+
+void record_ioctl(int fd, unsigned long request, const char *argp, int result, int error) {
+	uint32_t index = __atomic_fetch_add(&record_next, 1, __ATOMIC_RELAXED) & (RECORD_ENTRIES - 1);
+	struct tiler_shim_record *r = &record_ring[index];
+	r->time_ns = record_ticks();
+	r->request = request;
+	r->fd = fd;
+	r->result = result;
+	r->error = result < 0 ? error : 0;
+	size_t size = _IOC_SIZE(request);
+	if (argp && size >= sizeof(r->args)) {
+		memcpy(r->args, argp, sizeof(r->args));
+	} else {
+		memset(r->args, 0, sizeof(r->args));
+		if (argp)
+			memcpy(r->args, argp, size);
+	}
+}
+
+/*
+	ROTATE_DEBUG=2 traces every DRM ioctl the application makes, decoded
+	through tiler_schema: the argument as it is after the call, following
+	pointers only as far as the capacities counted before it. Clients that
+	poll (GET_CAP, GETCONNECTOR, WAIT_VBLANK queries) would drown the rest,
+	so a described call identical to the one before it, arrays and outcome
+	included, is counted by its hash and reported once something else is
+	called.
+*/
+struct trace_call {
+	int fd;
+	unsigned long request;
+	uint64_t hash;
+	int result, error;
+};
+
+struct trace_call trace_last;
+uint32_t trace_repeats = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void trace_ioctl(int fd, unsigned long request, const char *argp, const uint32_t *counts, int result, int error) {
+	char line[1024];
+	struct trace_call call;
+	memset(&call, 0, sizeof(call)); /* compared with memcmp */
+	call.fd = fd;
+	call.request = request;
+	call.hash = tiler_schema_hash(request, argp, counts);
+	call.result = result;
+	call.error = result < 0 ? error : 0;
+	pthread_mutex_lock(&trace_lock);
+	if (tiler_schema_name(request) && memcmp(&call, &trace_last, sizeof(call)) == 0) {
+		trace_repeats++;
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	if (trace_repeats)
+		printf("ioctl %d: same again %u times\n", trace_last.fd, trace_repeats);
+	trace_last = call;
+	trace_repeats = 0;
+	pthread_mutex_unlock(&trace_lock);
+
+	tiler_schema_format(request, argp, counts, line, sizeof(line));
+	if (result < 0)
+		printf("ioctl %d %s = %d (%s)\n", fd, line, result, strerror(error));
+	else
+		printf("ioctl %d %s = %d\n", fd, line, result);
+}
+
+/* Oldest first; returns the number of records copied */
+int record_snapshot(struct tiler_shim_record *out) {
+	uint32_t next = __atomic_load_n(&record_next, __ATOMIC_RELAXED);
+	uint32_t count = next < RECORD_ENTRIES ? next : RECORD_ENTRIES;
+	uint64_t now_ticks = record_ticks(), now_ns = monotonic_ns();
+	for (uint32_t i = 0; i < count; i++) {
+		out[i] = record_ring[(next - count + i) & (RECORD_ENTRIES - 1)];
+		out[i].time_ns = record_ticks_to_ns(out[i].time_ns, now_ticks, now_ns);
+	}
+	return count;
+}
+
+/* Formatting that is safe to use from a signal handler */
+char *record_put_u64(char *p, uint64_t value, int base, int width) {
+	char digits[24];
+	int n = 0;
+	do {
+		digits[n++] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value && n < (int)sizeof(digits));
+	while (n < width)
+		digits[n++] = '0';
+	while (n)
+		*p++ = digits[--n];
+	return p;
+}
+
+char *record_put_str(char *p, const char *s) {
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+void record_dump_fd(int out) {
+	uint32_t next = __atomic_load_n(&record_next, __ATOMIC_RELAXED);
+	uint32_t count = next < RECORD_ENTRIES ? next : RECORD_ENTRIES;
+	uint64_t now_ticks = record_ticks(), now_ns = monotonic_ns();
+	char line[160];
+	char *p = record_put_str(line, "# time_ns fd nr result errno args\n");
+	write(out, line, p - line);
+	for (uint32_t i = 0; i < count; i++) {
+		const struct tiler_shim_record *r = &record_ring[(next - count + i) & (RECORD_ENTRIES - 1)];
+		p = record_put_u64(line, record_ticks_to_ns(r->time_ns, now_ticks, now_ns), 10, 1);
+		*p++ = ' ';
+		p = record_put_u64(p, r->fd, 10, 1);
+		p = record_put_str(p, " 0x");
+		p = record_put_u64(p, (r->request >> _IOC_NRSHIFT) & _IOC_NRMASK, 16, 2);
+		*p++ = ' ';
+		if (r->result < 0)
+			*p++ = '-';
+		p = record_put_u64(p, r->result < 0 ? -(int64_t)r->result : r->result, 10, 1);
+		*p++ = ' ';
+		p = record_put_u64(p, r->error, 10, 1);
+		for (int j = 0; j < 4; j++) {
+			p = record_put_str(p, " 0x");
+			p = record_put_u64(p, r->args[j], 16, 8);
+		}
+		*p++ = '\n';
+		write(out, line, p - line);
+	}
+}
+
+void record_dump(void) {
+	if (__atomic_load_n(&record_next, __ATOMIC_RELAXED) == 0)
+		return;
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW;
+	if (record_path_shared) {
+		/* Replaces an earlier dump of ours; whatever else is there now makes the open fail */
+		unlink(record_path);
+		flags |= O_EXCL;
+	} else {
+		flags |= O_TRUNC;
+	}
+	int out = open(record_path, flags, 0600);
+	if (out < 0)
+		return;
+	record_dump_fd(out);
+	libc_close(out);
+}
+
+/*
+	Dumps once, then hands the signal to whatever was installed before. A
+	fault the kernel raised for an instruction is simply returned from: the
+	instruction faults again, now into the old action, and keeps its real
+	si_code and si_addr for the core dump or the handler.
+*/
+void record_signal(int sig, siginfo_t *info, void *context) {
+	struct sigaction *old = &record_old_actions[sig];
+	sigaction(sig, old, NULL);
+	record_dump();
+	if (info->si_code > 0 && sig != SIGABRT)
+		return;
+	if (old->sa_flags & SA_SIGINFO)
+		old->sa_sigaction(sig, info, context);
+	else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+		old->sa_handler(sig);
+	else
+		raise(sig);
+}
+
+void record_start(void) {
+	const char *flag = getenv("ROTATE_RECORD");
+	record_flag = !flag || atoi(flag) != 0;
+	if (!record_flag)
+		return;
+	record_base_ticks = record_ticks();
+	record_base_ns = monotonic_ns();
+	const char *path = get_option("ROTATE_RECORD_FILE", NULL);
+	if (path) {
+		snprintf(record_path, sizeof(record_path), "%s", path);
+	} else {
+		snprintf(record_path, sizeof(record_path), "%s/tiler_shim-%d.rec",
+			get_option("XDG_RUNTIME_DIR", "/tmp"), getpid());
+		record_path_shared = 1;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = record_signal;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	for (int i = 0; i < sizeof(record_signals) / sizeof(record_signals[0]); i++)
+		sigaction(record_signals[i], &action, &record_old_actions[record_signals[i]]);
+	atexit(record_dump);
+}
+
+/*
+	Local control socket (ROTATE_SOCKET=<path>), see tiler_shim.h for the
+	protocol. Served from its own thread so that the client's rendering
+	thread never blocks on a consumer.
+*/
+
+#define MAX_SOCKET_CLIENTS 8
+
+int socket_listen_fd = -1;
+int socket_clients[MAX_SOCKET_CLIENTS];
+uint32_t socket_subscribed[MAX_SOCKET_CLIENTS]; /* SOCKET_SUBSCRIBED | TILER_SHIM_SUBSCRIBE_* */
+#define SOCKET_SUBSCRIBED 0x80000000u
+
+int socket_send_fd(int sock, const void *data, size_t len, int fd) {
+	struct iovec iov = { (void *)data, len };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -errno : 0;
+}
+
+void socket_capture(int sock) {
+	struct tiler_shim_frame frame;
+	int dmabuf = -1;
+	memset(&frame, 0, sizeof(frame));
+	frame.status = -ENOENT;
+
+	pthread_mutex_lock(&fb_lock);
+	struct crtc_info *crtc = NULL;
+	for (int i = 0; i < MAX_CRTCS; i++)
+		if (crtcs[i].crtc_id != 0 && (!crtc || crtcs[i].sequence > crtc->sequence))
+			crtc = &crtcs[i];
+	struct fb_info *fb = crtc ? fb_lookup(crtc->fb_id) : NULL;
+	if (fb) {
+		struct drm_prime_handle prime;
+		prime.handle = fb->handle;
+		prime.flags = DRM_CLOEXEC;
+		prime.fd = -1;
+		if (libc_ioctl(fb->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, (char *)&prime) == 0) {
+			dmabuf = prime.fd;
+			frame.status = 0;
+			frame.fb_id = fb->fb_id;
+			frame.crtc_id = crtc->crtc_id;
+			frame.width = fb->width;
+			frame.height = fb->height;
+			frame.pitch = fb->pitch;
+			frame.offset = fb->offset;
+			frame.format = fb->format;
+			frame.rotation = shim_rotation;
+			frame.sequence = crtc->sequence;
+		} else {
+			frame.status = -errno;
+		}
+	}
+	pthread_mutex_unlock(&fb_lock);
+
+	socket_send_fd(sock, &frame, sizeof(frame), dmabuf);
+	if (dmabuf >= 0)
+		close(dmabuf);
+}
+
+int dirty_fb_damage(uint32_t fb_id, struct tiler_shim_damage *damage);
+
+void socket_notify_flip(uint32_t sequence, uint32_t crtc_id, uint32_t fb_id) {
+	if (socket_listen_fd < 0)
+		return;
+	struct {
+		struct tiler_shim_event event;
+		struct tiler_shim_damage damage;
+	} packet = { { sequence, fb_id, crtc_id, 0, monotonic_ns() } };
+	int have_damage = 0;
+	for (int i = 0; i < MAX_SOCKET_CLIENTS; i++) {
+		int sock = __atomic_load_n(&socket_clients[i], __ATOMIC_ACQUIRE);
+		if (sock <= 0 || !socket_subscribed[i])
+			continue;
+		if (!(socket_subscribed[i] & TILER_SHIM_SUBSCRIBE_DAMAGE)) {
+			send(sock, &packet.event, sizeof(packet.event), MSG_DONTWAIT | MSG_NOSIGNAL);
+			continue;
+		}
+		if (!have_damage && !(dirty_flag && dirty_fb_damage(fb_id, &packet.damage))) {
+			memset(&packet.damage, 0, sizeof(packet.damage));
+			packet.damage.flags = TILER_SHIM_DAMAGE_FULL;
+		}
+		have_damage = 1;
+		send(sock, &packet, sizeof(packet), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+}
+
+void socket_stats(int sock) {
+	struct tiler_shim_stats stats;
+	stats_fill(&stats);
+	send(sock, &stats, sizeof(stats), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+void socket_record(int sock) {
+	struct tiler_shim_record *records = malloc(RECORD_ENTRIES * sizeof(*records));
+	int count = records ? record_snapshot(records) : 0;
+	for (int i = 0; i < count; i += TILER_SHIM_RECORDS_PER_PACKET) {
+		int n = count - i < TILER_SHIM_RECORDS_PER_PACKET ? count - i : TILER_SHIM_RECORDS_PER_PACKET;
+		if (send(sock, &records[i], n * sizeof(*records), MSG_NOSIGNAL) < 0)
+			break;
+	}
+	send(sock, NULL, 0, MSG_NOSIGNAL);
+	free(records);
+}
+
+void *socket_thread(void *arg) {
+	struct pollfd pfds[MAX_SOCKET_CLIENTS + 1];
+	for (;;) {
+		pfds[0].fd = socket_listen_fd;
+		pfds[0].events = POLLIN;
+		for (int i = 0; i < MAX_SOCKET_CLIENTS; i++) {
+			pfds[i + 1].fd = socket_clients[i] > 0 ? socket_clients[i] : -1;
+			pfds[i + 1].events = POLLIN;
+		}
+		if (poll(pfds, MAX_SOCKET_CLIENTS + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("socket: poll failed: %d\n", errno);
+			return NULL;
+		}
+		if (pfds[0].revents & POLLIN) {
+			int sock = accept4(socket_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			for (int i = 0; sock >= 0 && i < MAX_SOCKET_CLIENTS; i++) {
+				if (socket_clients[i] <= 0) {
+					socket_subscribed[i] = 0;
+					__atomic_store_n(&socket_clients[i], sock, __ATOMIC_RELEASE);
+					sock = -1;
+				}
+			}
+			if (sock >= 0)
+				close(sock);
+		}
+		for (int i = 0; i < MAX_SOCKET_CLIENTS; i++) {
+			if (!(pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			struct tiler_shim_request req;
+			int sock = socket_clients[i];
+			if (recv(sock, &req, sizeof(req), 0) != sizeof(req)) {
+				__atomic_store_n(&socket_clients[i], 0, __ATOMIC_RELEASE);
+				close(sock);
+				continue;
+			}
+			if (req.cmd == TILER_SHIM_CMD_CAPTURE)
+				socket_capture(sock);
+			else if (req.cmd == TILER_SHIM_CMD_SUBSCRIBE)
+				socket_subscribed[i] = req.arg | SOCKET_SUBSCRIBED;
+			else if (req.cmd == TILER_SHIM_CMD_STATS)
+				socket_stats(sock);
+			else if (req.cmd == TILER_SHIM_CMD_RECORD)
+				socket_record(sock);
+		}
+	}
+	return NULL;
+}
+
+void socket_start(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return;
+	/* Don't steal the socket from another live shim instance */
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		printf("socket: %s already in use\n", path);
+		close(sock);
+		return;
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+		printf("socket: failed to listen on %s: %d\n", path, errno);
+		close(sock);
+		return;
+	}
+	socket_listen_fd = sock;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, socket_thread, NULL) != 0) {
+		close(sock);
+		socket_listen_fd = -1;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/*
+	Helper for building atomic requests. Properties for one object must
+	be added consecutively.
+*/
+
+#define MAX_COMMIT_OBJS 32
+#define MAX_COMMIT_PROPS 160
+
+struct atomic_req {
+	uint32_t objs[MAX_COMMIT_OBJS];
+	uint32_t count_props[MAX_COMMIT_OBJS];
+	uint32_t props[MAX_COMMIT_PROPS];
+	uint64_t values[MAX_COMMIT_PROPS];
+	int num_objs, num_props;
+};
+
+int atomic_req_add(struct atomic_req *req, uint32_t obj_id, int prop, uint64_t value) {
+	if (prop < 0)
+		return -1;
+	if (req->num_props >= MAX_COMMIT_PROPS)
+		return -1;
+	if (req->num_objs == 0 || req->objs[req->num_objs - 1] != obj_id) {
+		if (req->num_objs >= MAX_COMMIT_OBJS)
+			return -1;
+		req->objs[req->num_objs] = obj_id;
+		req->count_props[req->num_objs++] = 0;
+	}
+	req->props[req->num_props] = prop;
+	req->values[req->num_props++] = value;
+	req->count_props[req->num_objs - 1]++;
+	return 0;
+}
+
+int atomic_req_commit(int fd, struct atomic_req *req, uint32_t flags, uint64_t user_data) {
+	struct drm_mode_atomic atomic;
+	memset(&atomic, 0, sizeof(atomic));
+	atomic.flags = flags;
+	atomic.count_objs = req->num_objs;
+	atomic.objs_ptr = (uint64_t)req->objs;
+	atomic.count_props_ptr = (uint64_t)req->count_props;
+	atomic.props_ptr = (uint64_t)req->props;
+	atomic.prop_values_ptr = (uint64_t)req->values;
+	atomic.user_data = user_data;
+	return libc_ioctl(fd, DRM_IOCTL_MODE_ATOMIC, (char *)&atomic);
+}
+
+/*
+	Verdict table. Configurations the shim is about to commit for real are
+	first checked with DRM_MODE_ATOMIC_TEST_ONLY, and the answer is kept,
+	keyed by device, plane, rotation, format and source/CRTC size, so an
+	unsupported configuration is only ever tried once, and as a test.
+	Entries are replaced round-robin.
+*/
+
+#define MAX_VERDICTS 64
+
+struct verdict_key {
+	dev_t rdev;
+	uint32_t plane_id;
+	uint32_t rotation;
+	uint32_t format;            /* 0 when no framebuffer is part of the commit */
+	uint32_t src_w, src_h;      /* pixels, as are the CRTC sizes */
+	uint32_t crtc_w, crtc_h;
+};
+
+struct verdict {
+	struct verdict_key key;
+	int result;                 /* 0 or -errno */
+};
+
+struct verdict verdicts[MAX_VERDICTS];
+int num_verdicts = 0, next_verdict = 0;
+pthread_mutex_t verdict_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void verdict_key_init(struct verdict_key *key, int fd, uint32_t plane_id, uint32_t format,
+		uint32_t src_w, uint32_t src_h, uint32_t crtc_w, uint32_t crtc_h) {
+	struct device_state *dev = fd_device(fd);
+	memset(key, 0, sizeof(*key)); /* keys are compared with memcmp */
+	key->rdev = dev ? dev->rdev : 0;
+	key->plane_id = plane_id;
+	key->rotation = shim_rotation;
+	key->format = format;
+	key->src_w = src_w;
+	key->src_h = src_h;
+	key->crtc_w = crtc_w;
+	key->crtc_h = crtc_h;
+}
+
+/* Returns 1 and sets *result if the configuration has been tested */
+int verdict_lookup(const struct verdict_key *key, int *result) {
+	int found = 0;
+	pthread_mutex_lock(&verdict_lock);
+	for (int i = 0; i < num_verdicts && !found; i++) {
+		if (memcmp(&verdicts[i].key, key, sizeof(*key)) == 0) {
+			*result = verdicts[i].result;
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&verdict_lock);
+	return found;
+}
+
+/*
+	Check req (flags as for the real commit) against the table, testing it
+	if the configuration hasn't been seen. Returns 0 or -errno. Only
+	rejections that depend on the configuration itself are remembered;
+	EBUSY and the like say nothing about it.
+*/
+int verdict_check(int fd, const struct verdict_key *key, struct atomic_req *req, uint32_t flags) {
+	int result;
+	if (verdict_lookup(key, &result))
+		return result;
+
+	result = atomic_req_commit(fd, req, (flags & ~DRM_MODE_ATOMIC_NONBLOCK) | DRM_MODE_ATOMIC_TEST_ONLY, 0) == 0 ? 0 : -errno;
+	if (debug_flag)
+		printf("verdict: plane %u rotation %x format %08x %ux%u -> %ux%u: %d\n", key->plane_id,
+			key->rotation, key->format, key->src_w, key->src_h, key->crtc_w, key->crtc_h, result);
+	if (result != 0 && result != -EINVAL && result != -ERANGE)
+		return result;
+
+	pthread_mutex_lock(&verdict_lock);
+	verdicts[next_verdict].key = *key;
+	verdicts[next_verdict].result = result;
+	next_verdict = (next_verdict + 1) % MAX_VERDICTS;
+	if (num_verdicts < MAX_VERDICTS)
+		num_verdicts++;
+	pthread_mutex_unlock(&verdict_lock);
+	return result;
+}
+
+/*
+	Hardware plane offload, the backend behind libtiler_offload (see
+	tiler_offload.h). Layers are given overlay planes on the client's CRTC,
+	top-most first, and committed in one atomic request.
+*/
+
+enum {
+	OFFLOAD_FB_ID, OFFLOAD_CRTC_ID,
+	OFFLOAD_SRC_X, OFFLOAD_SRC_Y, OFFLOAD_SRC_W, OFFLOAD_SRC_H,
+	OFFLOAD_CRTC_X, OFFLOAD_CRTC_Y, OFFLOAD_CRTC_W, OFFLOAD_CRTC_H,
+	OFFLOAD_ROTATION, OFFLOAD_ZPOS, OFFLOAD_ALPHA,
+	OFFLOAD_NUM_PROPS
+};
+
+const char *offload_prop_names[OFFLOAD_NUM_PROPS] = {
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "rotation", "zpos", "alpha",
+};
+
+struct offload_plane {
+	uint32_t plane_id;
+	int props[OFFLOAD_NUM_PROPS];
+	int in_use;
+};
+
+struct tiler_offload {
+	int fd;
+	uint32_t crtc_id;
+	uint32_t phys_w, phys_h;
+	int num_planes;
+	struct offload_plane planes[MAX_PLANES];
+};
+
+struct tiler_offload *offload_open(int fd, uint32_t crtc_id) {
+	init();
+	struct device_state *dev = fd_device(fd);
+	if (!dev || !dev->intercept)
+		return NULL;
+	device_wait_probe(dev);
+	struct lease_state *lease = fd_lease(fd);
+	if (!lease || !lease_allows(lease, crtc_id))
+		return NULL;
+
+	struct drm_set_client_cap atomic_cap;
+	atomic_cap.capability = DRM_CLIENT_CAP_ATOMIC;
+	atomic_cap.value = 1;
+	if (libc_ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, (char *) &atomic_cap) != 0)
+		return NULL;
+
+	int index = crtc_index(fd, crtc_id);
+	struct drm_mode_crtc crtc;
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = crtc_id;
+	if (index < 0 || libc_ioctl(fd, DRM_IOCTL_MODE_GETCRTC, (char *)&crtc) != 0 || !crtc.mode_valid)
+		return NULL;
+
+	struct tiler_offload *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->fd = fd;
+	ctx->crtc_id = crtc_id;
+	ctx->phys_w = crtc.mode.hdisplay;
+	ctx->phys_h = crtc.mode.vdisplay;
+
+	lease_enumerate_planes(fd, lease);
+	for (int i = 0; i < lease->num_planes; i++) {
+		struct plane_info *plane = &lease->planes[i];
+		if (plane->primary || plane->rotation_prop < 0 || !(plane->possible_crtcs & (1 << index)))
+			continue;
+		struct offload_plane *op = &ctx->planes[ctx->num_planes];
+		op->plane_id = plane->plane_id;
+		for (int j = 0; j < OFFLOAD_NUM_PROPS; j++)
+			op->props[j] = tiler_rotate_property(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, offload_prop_names[j], NULL);
+		if (op->props[OFFLOAD_FB_ID] < 0 || op->props[OFFLOAD_CRTC_X] < 0)
+			continue;
+		ctx->num_planes++;
+	}
+	printf("offload: %d planes available on crtc %u\n", ctx->num_planes, crtc_id);
+	return ctx;
+}
+
+uint32_t offload_format(const struct tiler_offload_layer *layer) {
+	return layer->bpp == 16 ? DRM_FORMAT_RGB565 :
+		(layer->has_alpha ? DRM_FORMAT_ARGB8888 : DRM_FORMAT_XRGB8888);
+}
+
+int offload_alloc(struct tiler_offload *ctx, struct tiler_offload_layer *layer) {
+	struct tiler_bo bo;
+	if (layer->width == 0 || layer->width > TILER_BO_WIDTH)
+		return -EINVAL;
+	int ret = tiler_bo_new(ctx->fd, layer->height, layer->bpp, OMAP_BO_WC, &bo);
+	if (ret != 0)
+		return ret;
+
+	struct drm_mode_fb_cmd2 fb;
+	memset(&fb, 0, sizeof(fb));
+	fb.width = layer->width;
+	fb.height = layer->height;
+	fb.pixel_format = offload_format(layer);
+	fb.handles[0] = bo.handle;
+	fb.pitches[0] = bo.pitch;
+	if (libc_ioctl(ctx->fd, DRM_IOCTL_MODE_ADDFB2, (char *)&fb) != 0) {
+		ret = -errno;
+		tiler_bo_free(ctx->fd, &bo);
+		return ret;
+	}
+
+	layer->handle = bo.handle;
+	layer->fb_id = fb.fb_id;
+	layer->pitch = bo.pitch;
+	layer->size = bo.size;
+	layer->plane_id = 0;
+	layer->map = NULL;
+
+	struct drm_omap_gem_info info;
+	memset(&info, 0, sizeof(info));
+	info.handle = bo.handle;
+	if (libc_ioctl(ctx->fd, DRM_IOCTL_OMAP_GEM_INFO, (char *)&info) == 0) {
+		void *map = mmap(NULL, bo.size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, info.offset);
+		if (map != MAP_FAILED)
+			layer->map = map;
+	}
+	return 0;
+}
+
+void offload_free(struct tiler_offload *ctx, struct tiler_offload_layer *layer) {
+	if (layer->map)
+		munmap(layer->map, layer->size);
+	libc_ioctl(ctx->fd, DRM_IOCTL_MODE_RMFB, (char *)&layer->fb_id);
+	struct tiler_bo bo;
+	bo.handle = layer->handle;
+	tiler_bo_free(ctx->fd, &bo);
+	layer->map = NULL;
+	layer->fb_id = 0;
+	layer->handle = 0;
+}
+
+/* Whether the plane can show the layer at x, y, w, h, from the verdict table */
+int offload_plane_supports(struct tiler_offload *ctx, struct offload_plane *plane,
+		struct tiler_offload_layer *layer, int32_t x, int32_t y, uint32_t w, uint32_t h) {
+	struct atomic_req req;
+	struct verdict_key key;
+	uint32_t id = plane->plane_id;
+	int err = 0;
+	req.num_objs = req.num_props = 0;
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_FB_ID], layer->fb_id);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_CRTC_ID], ctx->crtc_id);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_SRC_X], 0);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_SRC_Y], 0);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_SRC_W], (uint64_t)layer->width << 16);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_SRC_H], (uint64_t)layer->height << 16);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_CRTC_X], (uint64_t)(int64_t)x);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_CRTC_Y], (uint64_t)(int64_t)y);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_CRTC_W], w);
+	err |= atomic_req_add(&req, id, plane->props[OFFLOAD_CRTC_H], h);
+	if (plane->props[OFFLOAD_ROTATION] >= 0)
+		err |= atomic_req_add(&req, id, plane->props[OFFLOAD_ROTATION], shim_rotation);
+	if (err != 0)
+		return 0;
+	verdict_key_init(&key, ctx->fd, id, offload_format(layer), layer->width, layer->height, w, h);
+	return verdict_check(ctx->fd, &key, &req, DRM_MODE_ATOMIC_NONBLOCK) == 0;
+}
+
+int offload_commit(struct tiler_offload *ctx, struct tiler_offload_layer *layers, int count) {
+	uint32_t objs[MAX_PLANES];
+	uint32_t count_props[MAX_PLANES];
+	uint32_t props[MAX_PLANES * OFFLOAD_NUM_PROPS];
+	uint64_t values[MAX_PLANES * OFFLOAD_NUM_PROPS];
+	int assigned[MAX_PLANES];
+	int order[TILER_OFFLOAD_MAX_LAYERS];
+	int num_objs = 0, k = 0, placed = 0;
+
+	if (count > TILER_OFFLOAD_MAX_LAYERS)
+		count = TILER_OFFLOAD_MAX_LAYERS;
+	tiler_offload_order(layers, count, order);
+	for (int i = 0; i < count; i++)
+		layers[i].plane_id = 0;
+
+#define OFFLOAD_SET(prop, value) do { \
+		if (plane->props[prop] >= 0) { \
+			props[k] = plane->props[prop]; \
+			values[k++] = (value); \
+			count_props[num_objs]++; \
+		} \
+	} while (0)
+
+	for (int i = 0; i < ctx->num_planes; i++) {
+		struct offload_plane *plane = &ctx->planes[i];
+		assigned[i] = 0;
+		count_props[num_objs] = 0;
+		struct tiler_offload_layer *layer = placed < count ? &layers[order[placed]] : NULL;
+		int32_t x = 0, y = 0;
+		uint32_t w = 0, h = 0;
+		if (layer) {
+			x = layer->x;
+			y = layer->y;
+			w = layer->width;
+			h = layer->height;
+			tiler_rotate_rect(shim_rotation, ctx->phys_w, ctx->phys_h, &x, &y, &w, &h);
+			/* Try the next plane for this layer if the configuration is known not to work */
+			if (!offload_plane_supports(ctx, plane, layer, x, y, w, h))
+				layer = NULL;
+		}
+		if (layer) {
+			OFFLOAD_SET(OFFLOAD_FB_ID, layer->fb_id);
+			OFFLOAD_SET(OFFLOAD_CRTC_ID, ctx->crtc_id);
+			OFFLOAD_SET(OFFLOAD_SRC_X, 0);
+			OFFLOAD_SET(OFFLOAD_SRC_Y, 0);
+			OFFLOAD_SET(OFFLOAD_SRC_W, (uint64_t)layer->width << 16);
+			OFFLOAD_SET(OFFLOAD_SRC_H, (uint64_t)layer->height << 16);
+			OFFLOAD_SET(OFFLOAD_CRTC_X, (uint64_t)(int64_t)x);
+			OFFLOAD_SET(OFFLOAD_CRTC_Y, (uint64_t)(int64_t)y);
+			OFFLOAD_SET(OFFLOAD_CRTC_W, w);
+			OFFLOAD_SET(OFFLOAD_CRTC_H, h);
+			OFFLOAD_SET(OFFLOAD_ROTATION, shim_rotation);
+			/* Keep every offloaded layer above the primary plane */
+			OFFLOAD_SET(OFFLOAD_ZPOS, count - placed);
+			OFFLOAD_SET(OFFLOAD_ALPHA, layer->alpha);
+			assigned[i] = 1;
+			placed++;
+		} else if (plane->in_use) {
+			OFFLOAD_SET(OFFLOAD_FB_ID, 0);
+			OFFLOAD_SET(OFFLOAD_CRTC_ID, 0);
+		}
+		if (count_props[num_objs] > 0)
+			objs[num_objs++] = plane->plane_id;
+	}
+#undef OFFLOAD_SET
+
+	if (num_objs == 0)
+		return 0;
+
+	struct drm_mode_atomic atomic;
+	memset(&atomic, 0, sizeof(atomic));
+	atomic.flags = DRM_MODE_ATOMIC_NONBLOCK;
+	atomic.count_objs = num_objs;
+	atomic.objs_ptr = (uint64_t)objs;
+	atomic.count_props_ptr = (uint64_t)count_props;
+	atomic.props_ptr = (uint64_t)props;
+	atomic.prop_values_ptr = (uint64_t)values;
+	int ret = libc_ioctl(ctx->fd, DRM_IOCTL_MODE_ATOMIC, (char *)&atomic);
+	if (ret != 0 && errno == EBUSY) {
+		atomic.flags = 0;
+		ret = libc_ioctl(ctx->fd, DRM_IOCTL_MODE_ATOMIC, (char *)&atomic);
+	}
+	if (ret != 0) {
+		/* Leave everything to GPU composition */
+		if (debug_flag)
+			printf("offload: commit failed: %d\n", errno);
+		return 0;
+	}
+
+	placed = 0;
+	for (int i = 0; i < ctx->num_planes; i++) {
+		struct tiler_offload_layer *layer = assigned[i] ? &layers[order[placed]] : NULL;
+		if (layer || ctx->planes[i].in_use)
+			stats_plane_update(ctx->planes[i].plane_id, layer ? ctx->crtc_id : 0,
+				layer ? layer->width : 0, layer ? layer->height : 0, layer ? layer->bpp : 0);
+		ctx->planes[i].in_use = assigned[i];
+		if (assigned[i])
+			layers[order[placed++]].plane_id = ctx->planes[i].plane_id;
+	}
+	return placed;
+}
+
+void offload_close(struct tiler_offload *ctx) {
+	offload_commit(ctx, NULL, 0);
+	free(ctx);
+}
+
+const struct tiler_offload_ops tiler_shim_offload_ops = {
+	offload_open, offload_alloc, offload_free, offload_commit, offload_close,
+};
+
+/*
+	Set the rotation property on all planes in the lease, one NONBLOCK
+	commit per plane. This seems to need the atomic API, and so is a bit
+	intricate, first needing to set the atomic capability. Only used when
+	the rotation couldn't be folded into the client's first modeset.
+*/
+void apply_plane_rotation(int fd, struct lease_state *lease) {
+	struct drm_set_client_cap atomic_cap;
+	atomic_cap.capability = DRM_CLIENT_CAP_ATOMIC;
+	atomic_cap.value = 1;
+	libc_ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, (char *) &atomic_cap);
+
+	lease->rotation_pending = 0;
+	lease_enumerate_planes(fd, lease);
+	printf("   found %d plane resources\n", lease->num_planes);
+	for (int i = 0; i < lease->num_planes; i++) {
+		int plane_id = lease->planes[i].plane_id;
+		if (!lease_allows(lease, plane_id))
+			continue;
+		printf("        setting rotation for plane %d\n", plane_id);
+		int rot_prop = lease->planes[i].rotation_prop;
+		if (rot_prop < 0)
+			continue;
+		printf("rotate prop for plane %d: %d\n", plane_id, rot_prop);
+
+		struct atomic_req req;
+		struct verdict_key key;
+		req.num_objs = req.num_props = 0;
+		atomic_req_add(&req, plane_id, rot_prop, shim_rotation);
+		verdict_key_init(&key, fd, plane_id, 0, 0, 0, 0, 0);
+		if (verdict_check(fd, &key, &req, DRM_MODE_ATOMIC_NONBLOCK) != 0) {
+			printf("rotation not supported on plane %d\n", plane_id);
+			continue;
+		}
+		int a_result = tiler_rotate_plane(fd, plane_id, rot_prop, shim_rotation, DRM_MODE_ATOMIC_NONBLOCK);
+		if (a_result != 0)
+			printf("rotate set for plane %d failed: %d\n", plane_id, a_result);
+	}
+}
+
+int crtc_index(int fd, uint32_t crtc_id) {
+	struct device_state *dev = fd_device(fd);
+	if (!dev)
+		return -1;
+	if (dev->num_crtcs < 0) {
+		struct drm_mode_card_res res;
+		memset(&res, 0, sizeof(res));
+		res.crtc_id_ptr = (uint64_t)dev->crtc_ids;
+		res.count_crtcs = MAX_CRTCS;
+		if (libc_ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, (char *)&res) != 0)
+			return -1;
+		dev->num_crtcs = res.count_crtcs < MAX_CRTCS ? res.count_crtcs : MAX_CRTCS;
+	}
+	for (int i = 0; i < dev->num_crtcs; i++)
+		if (dev->crtc_ids[i] == crtc_id)
+			return i;
+	return -1;
+}
+
+struct plane_info *primary_plane_for_crtc(int fd, struct lease_state *lease, uint32_t crtc_id) {
+	int index = crtc_index(fd, crtc_id);
+	if (index < 0)
+		return NULL;
+	lease_enumerate_planes(fd, lease);
+	for (int i = 0; i < lease->num_planes; i++)
+		if (lease->planes[i].primary && (lease->planes[i].possible_crtcs & (1 << index)))
+			return &lease->planes[i];
+	return NULL;
+}
+
+/*
+	Turn the client's first SETCRTC into a single atomic modeset that also
+	carries the primary plane geometry and the rotation of every plane, so
+	the DSS is programmed once instead of once per plane plus the modeset.
+	crtc->mode has already been swapped to the real panel mode.
+*/
+int fold_rotation_into_setcrtc(int fd, struct lease_state *lease, struct drm_mode_crtc *crtc) {
+	if (!crtc->mode_valid || crtc->fb_id == 0 || crtc->fb_id == (uint32_t)-1)
+		return -1;
+
+	struct drm_set_client_cap atomic_cap;
+	atomic_cap.capability = DRM_CLIENT_CAP_ATOMIC;
+	atomic_cap.value = 1;
+	if (libc_ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, (char *) &atomic_cap) != 0)
+		return -1;
+	struct plane_info *primary = primary_plane_for_crtc(fd, lease, crtc->crtc_id);
+	if (!primary)
+		return -1;
+
+	uint32_t src_w = tiler_rotate_swaps_axes(shim_rotation) ? crtc->mode.vdisplay : crtc->mode.hdisplay;
+	uint32_t src_h = tiler_rotate_swaps_axes(shim_rotation) ? crtc->mode.hdisplay : crtc->mode.vdisplay;
+
+	struct drm_mode_create_blob blob;
+	memset(&blob, 0, sizeof(blob));
+	blob.data = (uint64_t)&crtc->mode;
+	blob.length = sizeof(crtc->mode);
+	if (libc_ioctl(fd, DRM_IOCTL_MODE_CREATEPROPBLOB, (char *)&blob) != 0)
+		return -1;
+
+	uint32_t plane = primary->plane_id;
+	struct atomic_req req;
+	int err = 0;
+	req.num_objs = req.num_props = 0;
+	err |= atomic_req_add(&req, crtc->crtc_id, tiler_rotate_property(fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", NULL), blob.blob_id);
+	err |= atomic_req_add(&req, crtc->crtc_id, tiler_rotate_property(fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", NULL), 1);
+	uint32_t *connectors = (uint32_t *)crtc->set_connectors_ptr;
+	for (int i = 0; i < crtc->count_connectors; i++)
+		err |= atomic_req_add(&req, connectors[i], tiler_rotate_property(fd, connectors[i], DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", NULL), crtc->crtc_id);
+	err |= atomic_req_add(&req, plane, primary->fb_id_prop, crtc->fb_id);
+	err |= atomic_req_add(&req, plane, primary->crtc_id_prop, crtc->crtc_id);
+	err |= atomic_req_add(&req, plane, tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_X", NULL), (uint64_t)crtc->x << 16);
+	err |= atomic_req_add(&req, plane, tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_Y", NULL), (uint64_t)crtc->y << 16);
+	err |= atomic_req_add(&req, plane, tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_W", NULL), (uint64_t)src_w << 16);
+	err |= atomic_req_add(&req, plane, tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_H", NULL), (uint64_t)src_h << 16);
+	err |= atomic_req_add(&req, plane, tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_X", NULL), 0);
+	err |= atomic_req_add(&req, plane, tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_Y", NULL), 0);
+	err |= atomic_req_add(&req, plane, tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_W", NULL), crtc->mode.hdisplay);
+	err |= atomic_req_add(&req, plane, tiler_rotate_property(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_H", NULL), crtc->mode.vdisplay);
+	for (int i = 0; i < lease->num_planes; i++) {
+		struct plane_info *p = &lease->planes[i];
+		if (p->rotation_prop >= 0 && lease_allows(lease, p->plane_id))
+			err |= atomic_req_add(&req, p->plane_id, p->rotation_prop, shim_rotation);
+	}
+
+	struct verdict_key key;
+	verdict_key_init(&key, fd, plane, fb_format(crtc->fb_id), src_w, src_h, crtc->mode.hdisplay, crtc->mode.vdisplay);
+	int ret = -1;
+	if (err == 0 && verdict_check(fd, &key, &req, DRM_MODE_ATOMIC_ALLOW_MODESET) != 0) {
+		printf("   folded modeset not supported, falling back\n");
+	} else if (err == 0) {
+		ret = atomic_req_commit(fd, &req, DRM_MODE_ATOMIC_ALLOW_MODESET, 0);
+		if (ret != 0)
+			printf("   folded modeset failed: %d\n", errno);
+	}
+	struct drm_mode_destroy_blob destroy = { blob.blob_id };
+	libc_ioctl(fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, (char *)&destroy);
+	if (ret == 0) {
+		lease->rotation_pending = 0;
+		printf("   rotation folded into modeset on crtc %u\n", crtc->crtc_id);
+	}
+	return ret;
+}
+
+/*
+	For atomic clients, add the rotation of every plane to the client's
+	own modeset. Returns the ioctl result, or -2 if the client's request
+	was left alone.
+*/
+int fold_rotation_into_atomic(int fd, struct lease_state *lease, struct drm_mode_atomic *atomic) {
+	uint32_t *objs = (uint32_t *)atomic->objs_ptr;
+	uint32_t *count_props = (uint32_t *)atomic->count_props_ptr;
+	uint32_t *props = (uint32_t *)atomic->props_ptr;
+	uint64_t *values = (uint64_t *)atomic->prop_values_ptr;
+	int done[MAX_PLANES];
+	struct atomic_req req;
+	int err = 0, k = 0;
+
+	lease_enumerate_planes(fd, lease);
+	memset(done, 0, sizeof(done));
+	req.num_objs = req.num_props = 0;
+	for (int i = 0; i < atomic->count_objs; i++) {
+		int has_rotation = 0;
+		for (int j = 0; j < count_props[i]; j++, k++) {
+			err |= atomic_req_add(&req, objs[i], props[k], values[k]);
+			for (int p = 0; p < lease->num_planes; p++)
+				if (lease->planes[p].plane_id == objs[i] && lease->planes[p].rotation_prop == props[k])
+					has_rotation = 1;
+		}
+		for (int p = 0; p < lease->num_planes; p++) {
+			struct plane_info *plane = &lease->planes[p];
+			if (plane->plane_id != objs[i] || plane->rotation_prop < 0 || !lease_allows(lease, plane->plane_id))
+				continue;
+			if (!has_rotation)
+				err |= atomic_req_add(&req, objs[i], plane->rotation_prop, shim_rotation);
+			done[p] = 1;
+		}
+	}
+	for (int p = 0; p < lease->num_planes; p++) {
+		struct plane_info *plane = &lease->planes[p];
+		struct verdict_key key;
+		int verdict = 0;
+		if (done[p] || plane->rotation_prop < 0 || !lease_allows(lease, plane->plane_id))
+			continue;
+		/* Leave out planes already known not to rotate */
+		verdict_key_init(&key, fd, plane->plane_id, 0, 0, 0, 0, 0);
+		if (!verdict_lookup(&key, &verdict) || verdict == 0)
+			err |= atomic_req_add(&req, plane->plane_id, plane->rotation_prop, shim_rotation);
+	}
+	if (err != 0)
+		return -2;
+
+	int ret = atomic_req_commit(fd, &req, atomic->flags, atomic->user_data);
+	if (ret == 0 && !(atomic->flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		lease->rotation_pending = 0;
+		printf("   rotation folded into atomic modeset\n");
+	}
+	return ret;
+}
+
+/*
+	Format steering for DRM_IOCTL_MODE_GETPLANE
+
+	Clients tend to take the first usable format from the plane's list,
+	which may be one the CREATE_DUMB path can't rotate without conversion
+	(24bpp RGB888, YUV). Reorder the list so the formats that map directly
+	onto TILED_32 and TILED_16 buffers come first, and optionally
+	(ROTATE_HIDE_SLOW_FORMATS=1) drop the rest.
+*/
+
+#define MAX_FORMATS 64
+#define FORMAT_RANK_SLOW 4
+
+int format_rank(uint32_t format) {
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+		return 0;
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_RGBX8888:
+	case DRM_FORMAT_RGBA8888:
+		return 1;
+	case DRM_FORMAT_RGB565:
+		return 2;
+	case DRM_FORMAT_BGR565:
+	case DRM_FORMAT_XRGB1555:
+	case DRM_FORMAT_ARGB1555:
+	case DRM_FORMAT_XRGB4444:
+	case DRM_FORMAT_ARGB4444:
+	case DRM_FORMAT_RGBX4444:
+	case DRM_FORMAT_RGBA4444:
+		return 3;
+	default:
+		return FORMAT_RANK_SLOW;
+	}
+}
+
+int steer_plane_formats(int fd, struct drm_mode_get_plane *client) {
+	uint32_t formats[MAX_FORMATS];
+	uint32_t sorted[MAX_FORMATS];
+	struct drm_mode_get_plane plane = *client;
+	plane.count_format_types = MAX_FORMATS;
+	plane.format_type_ptr = (uint64_t)formats;
+	int result = libc_ioctl(fd, DRM_IOCTL_MODE_GETPLANE, (char *)&plane);
+	if (result != 0 || plane.count_format_types > MAX_FORMATS) {
+		/* Can't see the whole list, let the client talk to the kernel directly */
+		return libc_ioctl(fd, DRM_IOCTL_MODE_GETPLANE, (char *)client);
+	}
+
+	int n = 0;
+	for (int rank = 0; rank <= FORMAT_RANK_SLOW; rank++) {
+		if (rank == FORMAT_RANK_SLOW && hide_slow_formats)
+			break;
+		for (int i = 0; i < plane.count_format_types; i++)
+			if (format_rank(formats[i]) == rank)
+				sorted[n++] = formats[i];
+	}
+	if (n == 0) {
+		/* Nothing rotatable at all, hiding everything would be worse */
+		memcpy(sorted, formats, plane.count_format_types * sizeof(uint32_t));
+		n = plane.count_format_types;
+	}
+
+	uint32_t capacity = client->count_format_types;
+	uint64_t ptr = client->format_type_ptr;
+	*client = plane;
+	client->format_type_ptr = ptr;
+	if (ptr && capacity >= n)
+		memcpy((void *)(uintptr_t)ptr, sorted, n * sizeof(uint32_t));
+	client->count_format_types = n;
+	if (debug_flag)
+		printf("getplane %u: reporting %d of %u formats, first %.4s\n", plane.plane_id, n, plane.count_format_types, (char *)&sorted[0]);
+	return 0;
+}
+
+/*
+	Vblank model (ROTATE_VBLANK_MODEL=1)
+
+	Many clients call DRM_IOCTL_WAIT_VBLANK with _DRM_VBLANK_RELATIVE and
+	sequence 0 every frame just to read the current vblank count and
+	timestamp. Keep a per-pipe model of the vblank clock, fed by the
+	replies to real waits and by the vblank and flip-complete events the
+	client reads (libdrm's read() is hooked through the GOT for this), and
+	answer such pure queries from it. The model is resynchronised with a
+	real query every ROTATE_VBLANK_RESYNC_MS (default 500) so the drift
+	stays bounded; blocking waits and event requests are always forwarded.
+*/
+
+struct vblank_model {
+	int valid;
+	uint32_t sequence;
+	uint64_t time_ns;       /* CLOCK_MONOTONIC timestamp of sequence */
+	uint64_t period_ns;     /* 0 until two samples have been seen */
+	uint64_t synced_ns;     /* when the model was last fed a real sample */
+};
+
+struct vblank_model vblank_models[MAX_CRTCS];
+pthread_mutex_t vblank_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t vblank_answered = 0, vblank_forwarded = 0;
+
+int vblank_pipe(uint32_t type) {
+	if (type & _DRM_VBLANK_SECONDARY)
+		return 1;
+	return (type & _DRM_VBLANK_HIGH_CRTC_MASK) >> _DRM_VBLANK_HIGH_CRTC_SHIFT;
+}
+
+void vblank_sample(int pipe, uint32_t sequence, uint64_t time_ns) {
+	if (pipe < 0 || pipe >= MAX_CRTCS || time_ns == 0)
+		return;
+	pthread_mutex_lock(&vblank_lock);
+	struct vblank_model *m = &vblank_models[pipe];
+	uint32_t delta = sequence - m->sequence;
+	if (m->valid && delta > 0 && delta < (1u << 30) && time_ns > m->time_ns) {
+		uint64_t period = (time_ns - m->time_ns) / delta;
+		m->period_ns = m->period_ns ? (3 * m->period_ns + period) / 4 : period;
+	}
+	if (!m->valid || delta < (1u << 30)) {
+		m->sequence = sequence;
+		m->time_ns = time_ns;
+	}
+	m->valid = 1;
+	m->synced_ns = monotonic_ns();
+	pthread_mutex_unlock(&vblank_lock);
+}
+
+/* Returns 0 if the query was answered from the model */
+int vblank_answer_query(union drm_wait_vblank *vbl) {
+	uint32_t type = vbl->request.type;
+	if ((type & _DRM_VBLANK_TYPES_MASK) != _DRM_VBLANK_RELATIVE || vbl->request.sequence != 0 ||
+			(type & (_DRM_VBLANK_EVENT | _DRM_VBLANK_SIGNAL))) {
+		vblank_forwarded++;
+		return -1;
+	}
+
+	int pipe = vblank_pipe(type);
+	if (pipe >= MAX_CRTCS)
+		return -1;
+	uint64_t now = monotonic_ns();
+
+	pthread_mutex_lock(&vblank_lock);
+	struct vblank_model *m = &vblank_models[pipe];
+	int ok = m->valid && m->period_ns != 0 && now >= m->time_ns && now - m->synced_ns < vblank_resync_ns;
+	if (ok) {
+		uint64_t n = (now - m->time_ns) / m->period_ns;
+		uint64_t t = m->time_ns + n * m->period_ns;
+		vbl->reply.type = type;
+		vbl->reply.sequence = m->sequence + (uint32_t)n;
+		vbl->reply.tval_sec = t / 1000000000ULL;
+		vbl->reply.tval_usec = (t % 1000000000ULL) / 1000;
+	}
+	pthread_mutex_unlock(&vblank_lock);
+
+	if (ok)
+		vblank_answered++;
+	else
+		vblank_forwarded++;
+	if (debug_flag && ((vblank_answered + vblank_forwarded) % 600) == 0)
+		printf("vblank: answered %llu queries, forwarded %llu\n",
+			(unsigned long long)vblank_answered, (unsigned long long)vblank_forwarded);
+	return ok ? 0 : -1;
+}
+
+/*
+	Vblank and flip-complete events carry the CRTC id rather than the pipe
+	index; the device's CRTC list translates
+*/
+int vblank_pipe_for_crtc(int fd, uint32_t crtc_id) {
+	return crtc_index(fd, crtc_id);
+}
+
+ssize_t shim_read(int fd, void *buf, size_t count) {
+	if (dirty_flag)
+		dirty_before_write(buf, count);
+	ssize_t len = libc_read(fd, buf, count);
+	if (len <= 0 || fd < 0 || fd >= MAX_FDS || !drm_fds[fd])
+		return len;
+
+	for (ssize_t off = 0; off + (ssize_t)sizeof(struct drm_event) <= len; ) {
+		struct drm_event *e = (struct drm_event *)((char *)buf + off);
+		if (e->length < sizeof(struct drm_event) || off + e->length > len)
+			break;
+		if ((e->type == DRM_EVENT_VBLANK || e->type == DRM_EVENT_FLIP_COMPLETE) &&
+				e->length >= sizeof(struct drm_event_vblank)) {
+			struct drm_event_vblank *vbl = (struct drm_event_vblank *)e;
+			uint64_t time_ns = (uint64_t)vbl->tv_sec * 1000000000ULL + (uint64_t)vbl->tv_usec * 1000ULL;
+			if (vbl->crtc_id != 0)
+				vblank_sample(vblank_pipe_for_crtc(fd, vbl->crtc_id), vbl->sequence, time_ns);
+			if (limit_fps && e->type == DRM_EVENT_FLIP_COMPLETE && vbl->crtc_id != 0)
+				limit_flip_done(fd, vbl->crtc_id, vbl->sequence, time_ns);
+		}
+		off += e->length;
+	}
+	return len;
+}
+
+/*
+	Frame rate limiter (ROTATE_MAX_FPS=n)
+
+	Caps the rate a client flips at by holding each flip until the display
+	is one vblank short of the Nth since the client's previous frame was
+	shown, where N is the refresh rate divided by n, rounded up. The flip
+	then latches on that Nth vblank. The previous frame's vblank comes
+	from the flip-complete events the client reads (read() is hooked as for
+	the vblank model), or from a vblank query after a blocking atomic
+	commit. The wait is a blocking absolute WAIT_VBLANK on the client's own
+	fd, so the client thread sleeps in the kernel rather than spinning, and
+	a client that blocks on its flip renders no more often than it is
+	shown. Flips whose previous frame isn't known yet go through at once.
+*/
+
+struct limit_crtc {
+	int valid;
+	uint32_t sequence;      /* vblank the client's last frame latched on */
+};
+
+struct limit_crtc limit_crtcs[MAX_CRTCS];
+uint64_t limit_frames = 0, limit_skipped = 0, limit_held_ns = 0;
+uint64_t limit_first_ns = 0, limit_last_ns = 0;
+pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t limit_divisor(uint32_t crtc_id) {
+	uint32_t vrefresh = stats_crtc_vrefresh(crtc_id);
+	uint32_t divisor = (vrefresh + limit_fps - 1) / limit_fps;
+	return divisor ? divisor : 1;
+}
+
+uint32_t limit_vblank_type(int pipe) {
+	if (pipe == 1)
+		return _DRM_VBLANK_SECONDARY;
+	return (pipe << _DRM_VBLANK_HIGH_CRTC_SHIFT) & _DRM_VBLANK_HIGH_CRTC_MASK;
+}
+
+void limit_flip_done(int fd, uint32_t crtc_id, uint32_t sequence, uint64_t time_ns) {
+	int pipe = crtc_index(fd, crtc_id);
+	if (pipe < 0 || pipe >= MAX_CRTCS)
+		return;
+	pthread_mutex_lock(&limit_lock);
+	struct limit_crtc *c = &limit_crtcs[pipe];
+	uint32_t delta = sequence - c->sequence;
+	if (c->valid && delta > 1 && delta < 1000)
+		limit_skipped += delta - 1;
+	c->valid = 1;
+	c->sequence = sequence;
+	if (!limit_first_ns)
+		limit_first_ns = time_ns;
+	limit_last_ns = time_ns;
+	limit_frames++;
+	pthread_mutex_unlock(&limit_lock);
+}
+
+/* The CRTC a client flip or commit shows a new frame on, 0 for anything else */
+uint32_t limit_flip_crtc(int fd, unsigned long request, const char *argp) {
+	if (request == DRM_IOCTL_MODE_PAGE_FLIP)
+		return ((const struct drm_mode_crtc_page_flip *)argp)->crtc_id;
+	if (request != DRM_IOCTL_MODE_ATOMIC)
+		return 0;
+	const struct drm_mode_atomic *atomic = (const struct drm_mode_atomic *)argp;
+	if (atomic->flags & (DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET))
+		return 0;
+	uint32_t *objs = (uint32_t *)atomic->objs_ptr;
+	uint32_t *count_props = (uint32_t *)atomic->count_props_ptr;
+	uint32_t *props = (uint32_t *)atomic->props_ptr;
+	uint64_t *values = (uint64_t *)atomic->prop_values_ptr;
+	int k = 0;
+	for (int i = 0; i < atomic->count_objs; k += count_props[i], i++) {
+		if (crtc_index(fd, objs[i]) >= 0)
+			return objs[i];
+		struct plane_info *plane = plane_lookup(fd, objs[i]);
+		if (!plane)
+			continue;
+		for (int j = 0; j < count_props[i]; j++)
+			if (props[k + j] == plane->crtc_id_prop && values[k + j] != 0)
+				return values[k + j];
+		if (plane->crtc_id)
+			return plane->crtc_id;
+	}
+	return 0;
+}
+
+/* Sleep until the flip in argp may be submitted */
+void limit_before_flip(int fd, unsigned long request, const char *argp) {
+	uint32_t crtc_id = limit_flip_crtc(fd, request, argp);
+	int pipe = crtc_id ? crtc_index(fd, crtc_id) : -1;
+	if (pipe < 0 || pipe >= MAX_CRTCS)
+		return;
+	uint32_t divisor = limit_divisor(crtc_id);
+	pthread_mutex_lock(&limit_lock);
+	struct limit_crtc c = limit_crtcs[pipe];
+	pthread_mutex_unlock(&limit_lock);
+	if (!c.valid || divisor <= 1)
+		return;
+
+	union drm_wait_vblank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = _DRM_VBLANK_ABSOLUTE | limit_vblank_type(pipe);
+	vbl.request.sequence = c.sequence + divisor - 1;
+	uint64_t start = monotonic_ns();
+	if (libc_ioctl(fd, DRM_IOCTL_WAIT_VBLANK, (char *)&vbl) == 0)
+		vblank_sample(pipe, vbl.reply.sequence,
+			(uint64_t)vbl.reply.tval_sec * 1000000000ULL + (uint64_t)vbl.reply.tval_usec * 1000ULL);
+	__atomic_add_fetch(&limit_held_ns, monotonic_ns() - start, __ATOMIC_RELAXED);
+}
+
+/* A blocking commit has latched by the time it returns: note the vblank it latched on */
+void limit_after_flip(int fd, unsigned long request, const char *argp) {
+	if (request != DRM_IOCTL_MODE_ATOMIC || (((const struct drm_mode_atomic *)argp)->flags & DRM_MODE_ATOMIC_NONBLOCK))
+		return;
+	uint32_t crtc_id = limit_flip_crtc(fd, request, argp);
+	int pipe = crtc_id ? crtc_index(fd, crtc_id) : -1;
+	if (pipe < 0)
+		return;
+	union drm_wait_vblank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = _DRM_VBLANK_RELATIVE | limit_vblank_type(pipe);
+	if (libc_ioctl(fd, DRM_IOCTL_WAIT_VBLANK, (char *)&vbl) == 0)
+		limit_flip_done(fd, crtc_id, vbl.reply.sequence,
+			(uint64_t)vbl.reply.tval_sec * 1000000000ULL + (uint64_t)vbl.reply.tval_usec * 1000ULL);
+}
+
+/*
+	The achieved rate, and what the cap saved: vblanks that showed the
+	previous frame again instead of a newly rendered one, and how long
+	clients were kept asleep
+*/
+void limit_report(void) {
+	pthread_mutex_lock(&limit_lock);
+	uint64_t frames = limit_frames, skipped = limit_skipped;
+	uint64_t elapsed = limit_last_ns - limit_first_ns;
+	pthread_mutex_unlock(&limit_lock);
+	uint64_t held = __atomic_load_n(&limit_held_ns, __ATOMIC_RELAXED);
+	printf("limit: cap %d fps, achieved %.1f fps over %llu frames, %llu vblanks repeated, clients held %llu ms\n",
+		limit_fps, elapsed && frames > 1 ? (frames - 1) * 1e9 / elapsed : 0.0, (unsigned long long)frames,
+		(unsigned long long)skipped, (unsigned long long)held / 1000000);
+}
+
+/*
+	Tearing flips (ROTATE_ASYNC_FLIP=1)
+
+	For games that would rather tear than wait: client page flips are
+	submitted with DRM_MODE_PAGE_FLIP_ASYNC, and atomic commits that don't
+	modeset get the same flag, so the new buffer is scanned out at once
+	instead of on the next vblank. Whether the driver takes async flips is
+	asked once per device (DRM_CAP_ASYNC_PAGE_FLIP for the legacy ioctl,
+	DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP for atomic) and flips stay vsynced where
+	it doesn't. Drivers may still refuse an async flip they can't do, e.g.
+	an atomic commit that changes more than the framebuffer, in which case
+	it is resubmitted as it was; a refused legacy flip stops further tries
+	on that device.
+*/
+
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
+uint64_t async_flips = 0, async_refused = 0;
+
+int async_supported(int fd, int *cached, uint64_t capability, const char *what) {
+	if (*cached < 0) {
+		struct drm_get_cap cap = { .capability = capability };
+		*cached = libc_ioctl(fd, DRM_IOCTL_GET_CAP, (char *)&cap) == 0 && cap.value != 0;
+		printf("async flip: %s %s\n", what, *cached ? "tear" : "stay vsynced, not supported by the driver");
+	}
+	return *cached;
+}
+
+/* Returns 1 if the flip was submitted here, with its result in *result */
+int async_flip(int fd, unsigned long request, char *argp, int *result) {
+	struct device_state *dev = fd_device(fd);
+	uint32_t *flags;
+	if (!dev)
+		return 0;
+
+	if (request == DRM_IOCTL_MODE_PAGE_FLIP) {
+		flags = &((struct drm_mode_crtc_page_flip *)argp)->flags;
+		if ((*flags & (DRM_MODE_PAGE_FLIP_ASYNC | DRM_MODE_PAGE_FLIP_TARGET)) ||
+				!async_supported(fd, &dev->async_flip, DRM_CAP_ASYNC_PAGE_FLIP, "page flips"))
+			return 0;
+	} else if (request == DRM_IOCTL_MODE_ATOMIC) {
+		flags = &((struct drm_mode_atomic *)argp)->flags;
+		if ((*flags & (DRM_MODE_PAGE_FLIP_ASYNC | DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET)) ||
+				!async_supported(fd, &dev->async_atomic, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, "atomic commits"))
+			return 0;
+	} else {
+		return 0;
+	}
+
+	*flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+	*result = libc_ioctl(fd, request, argp);
+	*flags &= ~DRM_MODE_PAGE_FLIP_ASYNC;
+	if (*result != 0 && errno == EINVAL) {
+		if (request == DRM_IOCTL_MODE_PAGE_FLIP) {
+			printf("async flip: page flip refused, staying vsynced\n");
+			dev->async_flip = 0;
+		}
+		async_refused++;
+		*result = libc_ioctl(fd, request, argp);
+	} else if (*result == 0) {
+		async_flips++;
+	}
+	if (debug_flag && ((async_flips + async_refused) % 600) == 0)
+		printf("async flip: %llu flips torn, %llu refused\n",
+			(unsigned long long)async_flips, (unsigned long long)async_refused);
+	return 1;
+}
+
+/*
+	Simulated device (ROTATE_SIM=1)
+
+	Replace omapdrm with the virtual-time model in tiler_sim.c, so changes
+	to the flip path can be benchmarked off-device and faster than real
+	time. Opening /dev/dri/card* returns a simulated fd instead, and
+	everything the shim would forward to the kernel for it goes to the
+	model. CLOCK_MONOTONIC (for the client and the shim's own timing) is
+	the model's virtual clock. Flip counts, repeated vblanks and EBUSYs
+	are printed at exit.
+*/
+
+int (*sim_real_ioctl)(int fd, unsigned long request, char *argp);
+ssize_t (*sim_real_read)(int fd, void *buf, size_t count);
+uint64_t sim_real_start_ns;
+
+/* Only DRM requests look for dups of the device fd, which the simulator can't see being made */
+int sim_ioctl(int fd, unsigned long request, char *argp) {
+	if (tiler_sim_owns(fd, ((request >> _IOC_TYPESHIFT) & _IOC_TYPEMASK) == DRM_IOCTL_BASE))
+		return tiler_sim_ioctl(fd, request, argp);
+	return sim_real_ioctl(fd, request, argp);
+}
+
+ssize_t sim_read(int fd, void *buf, size_t count) {
+	if (tiler_sim_owns(fd, 0))
+		return tiler_sim_read(fd, buf, count);
+	return sim_real_read(fd, buf, count);
+}
+
+int sim_is_card(const char *path) {
+	return path && strncmp(path, "/dev/dri/card", 13) == 0;
+}
+
+int sim_open_card(const char *path) {
+	int fd = tiler_sim_open();
+	printf("sim: %s -> fd %d\n", path, fd);
+	return fd;
+}
+
+/* mode is only passed, and may only be read, with O_CREAT or O_TMPFILE */
+#define OPEN_NEEDS_MODE(flags) (((flags) & O_CREAT) || ((flags) & O_TMPFILE) == O_TMPFILE)
+
+int shim_open(const char *path, int flags, ...) {
+	int mode = 0;
+	if (OPEN_NEEDS_MODE(flags)) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	if (sim_is_card(path))
+		return sim_open_card(path);
+	return libc_open(path, flags, mode);
+}
+
+int shim_open64(const char *path, int flags, ...) {
+	int mode = 0;
+	if (OPEN_NEEDS_MODE(flags)) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	if (sim_is_card(path))
+		return sim_open_card(path);
+	return libc_open64(path, flags, mode);
+}
+
+int shim_openat(int dirfd, const char *path, int flags, ...) {
+	int mode = 0;
+	if (OPEN_NEEDS_MODE(flags)) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	if (sim_is_card(path))
+		return sim_open_card(path);
+	return libc_openat(dirfd, path, flags, mode);
+}
+
+int shim_clock_gettime(clockid_t clock, struct timespec *ts) {
+	if (clock != CLOCK_MONOTONIC && clock != CLOCK_MONOTONIC_RAW && clock != CLOCK_MONOTONIC_COARSE)
+		return clock_gettime(clock, ts);
+	uint64_t now = tiler_sim_now_ns();
+	ts->tv_sec = now / 1000000000ULL;
+	ts->tv_nsec = now % 1000000000ULL;
+	return 0;
+}
+
+void sim_report(void) {
+	struct tiler_sim_stats stats;
+	struct timespec ts;
+	tiler_sim_stats(&stats);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t real_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - sim_real_start_ns;
+	printf("sim: %llu frames over %llu vblanks in %.1fs virtual (%.2fs real), %llu repeated vblanks, %llu EBUSY, %llu torn\n",
+		(unsigned long long)stats.frames, (unsigned long long)stats.vblanks, stats.virtual_ns / 1e9, real_ns / 1e9,
+		(unsigned long long)stats.repeats, (unsigned long long)stats.ebusy, (unsigned long long)stats.torn);
+}
+
+void sim_start(void) {
+	struct tiler_sim_config config;
+	struct timespec ts;
+	memset(&config, 0, sizeof(config));
+	if (sscanf(get_option("ROTATE_SIM_MODE", "720x1280@60"), "%ux%u@%u", &config.width, &config.height, &config.refresh) != 3) {
+		printf("ROTATE_SIM_MODE must look like 720x1280@60\n");
+		config.width = 720;
+		config.height = 1280;
+		config.refresh = 60;
+	}
+	config.planes = atoi(get_option("ROTATE_SIM_PLANES", "4"));
+	config.commit_us = atoi(get_option("ROTATE_SIM_LATENCY_US", "1000"));
+	config.render_us = atoi(get_option("ROTATE_SIM_RENDER_US", "0"));
+	config.async = test_flag("ROTATE_SIM_ASYNC");
+	tiler_sim_init(&config);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	sim_real_start_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	sim_real_ioctl = libc_ioctl;
+	sim_real_read = libc_read;
+	libc_ioctl = sim_ioctl;
+	libc_read = sim_read;
+	atexit(sim_report);
+	printf("sim: %ux%u@%u, %d planes, commit latency %uus, render %uus per frame%s\n", config.width, config.height,
+		config.refresh, config.planes, config.commit_us, config.render_us, config.async ? ", async flips" : "");
+}
+
+/*
+	EGL surface sizing (ROTATE_EGL=1)
+
+	Swapping the mode in SETCRTC/GETCRTC only helps clients that size
+	their rendering from KMS. Native EGL clients ask eglQuerySurface, and
+	the window system library answers with the size of the buffers it
+	allocated for the physical panel. With ROTATE_EGL=1 the EGL entry
+	points are hooked like ioctl in targeted mode (GOT slots, plus dlsym in
+	the target libraries and eglGetProcAddress for libraries that look them
+	up at runtime), and
+	EGL_WIDTH/EGL_HEIGHT of window surfaces that are panel-sized are
+	reported swapped. The panel size comes from the CRTC modes seen, or
+	from ROTATE_EGL_PANEL=WxH (handy for testing on Mesa without KMS).
+*/
+
+#define SHIM_EGL_HEIGHT 0x3056
+#define SHIM_EGL_WIDTH 0x3057
+#define MAX_EGL_SURFACES 16
+
+typedef unsigned int (*egl_query_surface_fn)(void *dpy, void *surface, int32_t attribute, int32_t *value);
+typedef void *(*egl_create_window_surface_fn)(void *dpy, void *config, uintptr_t win, const int32_t *attribs);
+typedef unsigned int (*egl_destroy_surface_fn)(void *dpy, void *surface);
+typedef void *(*egl_get_proc_address_fn)(const char *name);
+
+egl_query_surface_fn real_egl_query_surface;
+egl_create_window_surface_fn real_egl_create_window_surface;
+egl_destroy_surface_fn real_egl_destroy_surface;
+egl_get_proc_address_fn real_egl_get_proc_address;
+
+void *egl_window_surfaces[MAX_EGL_SURFACES];
+uint32_t egl_panel_sizes[MAX_CRTCS][2];
+pthread_mutex_t egl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *shim_eglGetProcAddress(const char *name);
+
+/* Record the physical size of a mode the display is (or will be) using */
+void egl_note_mode(uint32_t width, uint32_t height) {
+	pthread_mutex_lock(&egl_lock);
+	for (int i = 0; i < MAX_CRTCS; i++) {
+		if (egl_panel_sizes[i][0] == width && egl_panel_sizes[i][1] == height)
+			break;
+		if (egl_panel_sizes[i][0] == 0) {
+			egl_panel_sizes[i][0] = width;
+			egl_panel_sizes[i][1] = height;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&egl_lock);
+}
+
+int egl_is_panel_sized(uint32_t width, uint32_t height) {
+	unsigned int w, h;
+	const char *panel = getenv("ROTATE_EGL_PANEL");
+	if (panel && sscanf(panel, "%ux%u", &w, &h) == 2)
+		return width == w && height == h;
+	int found = 0;
+	pthread_mutex_lock(&egl_lock);
+	for (int i = 0; i < MAX_CRTCS && !found; i++)
+		found = egl_panel_sizes[i][0] == width && egl_panel_sizes[i][1] == height;
+	pthread_mutex_unlock(&egl_lock);
+	return found;
+}
+
+/* Resolve the real entry point if the client didn't go through dlsym */
+void *egl_real(void **real, const char *name) {
+	if (!*real)
+		*real = dlsym(RTLD_NEXT, name);
+	if (!*real)
+		*real = dlsym(RTLD_DEFAULT, name);
+	return *real;
+}
+
+void *shim_eglCreateWindowSurface(void *dpy, void *config, uintptr_t win, const int32_t *attribs) {
+	if (!egl_real((void **)&real_egl_create_window_surface, "eglCreateWindowSurface"))
+		return NULL;
+	void *surface = real_egl_create_window_surface(dpy, config, win, attribs);
+	if (!surface)
+		return surface;
+	pthread_mutex_lock(&egl_lock);
+	for (int i = 0; i < MAX_EGL_SURFACES; i++) {
+		if (!egl_window_surfaces[i]) {
+			egl_window_surfaces[i] = surface;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&egl_lock);
+	return surface;
+}
+
+unsigned int shim_eglDestroySurface(void *dpy, void *surface) {
+	pthread_mutex_lock(&egl_lock);
+	for (int i = 0; i < MAX_EGL_SURFACES; i++)
+		if (egl_window_surfaces[i] == surface)
+			egl_window_surfaces[i] = NULL;
+	pthread_mutex_unlock(&egl_lock);
+	if (!egl_real((void **)&real_egl_destroy_surface, "eglDestroySurface"))
+		return 0;
+	return real_egl_destroy_surface(dpy, surface);
+}
+
+unsigned int shim_eglQuerySurface(void *dpy, void *surface, int32_t attribute, int32_t *value) {
+	if (!egl_real((void **)&real_egl_query_surface, "eglQuerySurface"))
+		return 0;
+	if ((attribute != SHIM_EGL_WIDTH && attribute != SHIM_EGL_HEIGHT) || !tiler_rotate_swaps_axes(shim_rotation))
+		return real_egl_query_surface(dpy, surface, attribute, value);
+
+	int window = 0;
+	pthread_mutex_lock(&egl_lock);
+	for (int i = 0; i < MAX_EGL_SURFACES; i++)
+		window |= egl_window_surfaces[i] == surface;
+	pthread_mutex_unlock(&egl_lock);
+	int32_t width, height;
+	if (!window || !real_egl_query_surface(dpy, surface, SHIM_EGL_WIDTH, &width) ||
+			!real_egl_query_surface(dpy, surface, SHIM_EGL_HEIGHT, &height))
+		return real_egl_query_surface(dpy, surface, attribute, value);
+
+	if (egl_is_panel_sized(width, height)) {
+		int32_t temp = width;
+		width = height;
+		height = temp;
+	}
+	*value = attribute == SHIM_EGL_WIDTH ? width : height;
+	return 1;
+}
+
+/* Hand out the hooks to clients that look the entry points up at runtime */
+void *egl_hook_for(const char *name, void *real) {
+	if (!egl_flag || !name || !real)
+		return real;
+	if (strcmp(name, "eglQuerySurface") == 0) {
+		real_egl_query_surface = real;
+		return (void *)shim_eglQuerySurface;
+	}
+	if (strcmp(name, "eglCreateWindowSurface") == 0) {
+		real_egl_create_window_surface = real;
+		return (void *)shim_eglCreateWindowSurface;
+	}
+	if (strcmp(name, "eglDestroySurface") == 0) {
+		real_egl_destroy_surface = real;
+		return (void *)shim_eglDestroySurface;
+	}
+	if (strcmp(name, "eglGetProcAddress") == 0) {
+		real_egl_get_proc_address = real;
+		return (void *)shim_eglGetProcAddress;
+	}
+	return real;
+}
+
+void *shim_eglGetProcAddress(const char *name) {
+	if (!egl_real((void **)&real_egl_get_proc_address, "eglGetProcAddress"))
+		return NULL;
+	return egl_hook_for(name, real_egl_get_proc_address(name));
+}
+
+/*
+	dlsym is only hooked in the target libraries, which look EGL up at
+	runtime; other preloads and wrappers keep their own lookups. The real
+	dlsym would resolve RTLD_NEXT relative to the shim, so that is done here
+	for the caller instead: the first object loaded after it that defines
+	the symbol itself.
+*/
+#define DLSYM_NEXT_OBJECTS 64
+
+struct dlsym_next_walk {
+	uintptr_t caller_base;
+	int past_caller;
+	int count;
+	const char *names[DLSYM_NEXT_OBJECTS];
+	uintptr_t bases[DLSYM_NEXT_OBJECTS];
+};
+
+/* List the objects after the caller; dlopen can't be called from in here */
+int dlsym_next_object(struct dl_phdr_info *info, size_t size, void *data) {
+	struct dlsym_next_walk *walk = data;
+	(void)size;
+	if (!walk->past_caller) {
+		walk->past_caller = info->dlpi_addr == walk->caller_base;
+		return 0;
+	}
+	if (info->dlpi_name && info->dlpi_name[0]) {
+		walk->names[walk->count] = info->dlpi_name;
+		walk->bases[walk->count++] = info->dlpi_addr;
+	}
+	return walk->count == DLSYM_NEXT_OBJECTS;
+}
+
+void *shim_dlsym(void *handle, const char *name) {
+	if (handle != RTLD_NEXT)
+		return egl_hook_for(name, dlsym(handle, name));
+	Dl_info caller;
+	if (!dladdr(__builtin_return_address(0), &caller))
+		return NULL;
+	struct dlsym_next_walk walk = { .caller_base = (uintptr_t)caller.dli_fbase };
+	dl_iterate_phdr(dlsym_next_object, &walk);
+	for (int i = 0; i < walk.count; i++) {
+		void *object = dlopen(walk.names[i], RTLD_LAZY | RTLD_NOLOAD);
+		if (!object)
+			continue;
+		void *sym = dlsym(object, name);
+		Dl_info where;
+		int own = sym && dladdr(sym, &where) && (uintptr_t)where.dli_fbase == walk.bases[i];
+		dlclose(object);
+		if (own)
+			return egl_hook_for(name, sym);
+	}
+	return NULL;
+}
+
+/*
+	Device probing
+
+	What the shim needs to know about a device (CRTC list and modes, the
+	fd's lease, planes and their property ids including rotation) is
+	fetched on a helper thread using a dup of the fd, as soon as the device
+	is first seen. The client is usually busy in EGL and gl4es setup for a
+	long while after opening the device, so by the first ioctl the shim
+	acts on this has normally finished; if not, that ioctl waits for it.
+*/
+
+pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t probe_cond = PTHREAD_COND_INITIALIZER;
+
+void device_probe_done(struct device_state *dev) {
+	pthread_mutex_lock(&probe_lock);
+	__atomic_store_n(&dev->probe_done, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&probe_cond);
+	pthread_mutex_unlock(&probe_lock);
+}
+
+void *device_probe_thread(void *arg) {
+	struct device_state *dev = arg;
+	int fd = dev->probe_fd;
+	uint64_t start = monotonic_ns();
+
+	/* Atomic is needed for the rotation commit later anyway */
+	struct drm_set_client_cap atomic_cap;
+	atomic_cap.capability = DRM_CLIENT_CAP_ATOMIC;
+	atomic_cap.value = 1;
+	libc_ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, (char *) &atomic_cap);
+
+	crtc_index(fd, 0);
+	for (int i = 0; i < dev->num_crtcs; i++) {
+		struct drm_mode_crtc crtc;
+		memset(&crtc, 0, sizeof(crtc));
+		crtc.crtc_id = dev->crtc_ids[i];
+		if (libc_ioctl(fd, DRM_IOCTL_MODE_GETCRTC, (char *)&crtc) == 0 && crtc.mode_valid) {
+			stats_crtc_mode(crtc.crtc_id, crtc.mode.vrefresh);
+			egl_note_mode(crtc.mode.hdisplay, crtc.mode.vdisplay);
+		}
+	}
+	struct lease_state *lease = fd_lease(fd);
+	if (lease)
+		lease_enumerate_planes(fd, lease);
+
+	fd_forget(fd);
+	libc_close(fd);
+	if (debug_flag)
+		printf("device: probed in %llu us\n", (unsigned long long)(monotonic_ns() - start) / 1000);
+	device_probe_done(dev);
+	return NULL;
+}
+
+/* Called with device_lock held */
+void device_start_probe(int fd, struct device_state *dev) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	dev->probe_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dev->probe_fd < 0 || dev->probe_fd >= MAX_FDS) {
+		/* Probe lazily on the client's thread as before */
+		if (dev->probe_fd >= 0)
+			libc_close(dev->probe_fd);
+		dev->probe_done = 1;
+		return;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, device_probe_thread, dev) != 0) {
+		libc_close(dev->probe_fd);
+		dev->probe_done = 1;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void device_wait_probe(struct device_state *dev) {
+	if (__atomic_load_n(&dev->probe_done, __ATOMIC_ACQUIRE))
+		return;
+	uint64_t start = monotonic_ns();
+	pthread_mutex_lock(&probe_lock);
+	while (!dev->probe_done)
+		pthread_cond_wait(&probe_cond, &probe_lock);
+	pthread_mutex_unlock(&probe_lock);
+	if (debug_flag)
+		printf("device: waited %llu us for probing\n", (unsigned long long)(monotonic_ns() - start) / 1000);
+}
+
+/* Requests whose handling uses the probed state */
+int request_needs_probe(unsigned long request) {
+	switch (request) {
+	case DRM_IOCTL_MODE_CREATE_DUMB:
+	case DRM_IOCTL_MODE_SETCRTC:
+	case DRM_IOCTL_MODE_GETCRTC:
+	case DRM_IOCTL_MODE_PAGE_FLIP:
+	case DRM_IOCTL_MODE_SETPLANE:
+	case DRM_IOCTL_MODE_GETPLANE:
+	case DRM_IOCTL_MODE_ATOMIC:
+	case DRM_IOCTL_MODE_CREATE_LEASE:
+	case DRM_IOCTL_MODE_REVOKE_LEASE:
+	case DRM_IOCTL_WAIT_VBLANK:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+	Sub-allocation (ROTATE_SUBALLOC=1)
+
+	Every tiled buffer takes a TILER_BO_WIDTH wide container, which is a
+	waste for cursors and small overlays. With ROTATE_SUBALLOC=1, dumb
+	buffers no larger than ROTATE_SUBALLOC_MAX (default 512x512) are packed
+	into shared containers of SUBALLOC_HEIGHT rows, only as wide as
+	ROTATE_SUBALLOC_MAX, and the client gets a virtual handle for each one.
+	Buffers are stacked, each on shelf rows of its own: the client sees the
+	container's pitch, and clearing or copying its whole size must not reach
+	a neighbour, which anything sharing its rows would be. (omapdrm maps
+	tiled buffers by position in the mapping rather than by offset, so the
+	rows can't be remapped to give each column its own range instead.)
+
+	- MAP_DUMB returns a token offset below the range DRM uses, and the
+	  hooked mmap maps the whole container and returns a pointer to the
+	  buffer inside it (munmap is hooked to undo that)
+	- ADDFB/ADDFB2 create the framebuffer on the container, grown by the
+	  buffer's position; omapdrm ignores framebuffer offsets for tiled
+	  buffers, so scanout is pointed at the buffer by adding its position
+	  to SRC_X/SRC_Y (SETPLANE, atomic) or x/y (SETCRTC). PAGE_FLIP can't
+	  move the CRTC's position, so a flip to a buffer at another position
+	  than the one shown becomes a nonblocking atomic commit of the primary
+	  plane's FB_ID, SRC_X and SRC_Y, with the flip's event and user data.
+	- DESTROY_DUMB/GEM_CLOSE release the space; a container is freed when
+	  its last buffer goes
+	- GEM_INFO and CPU_PREP/FINI are passed on for the container. PRIME
+	  export is refused, as an importer would see the whole container.
+
+	What this buys over giving each small buffer a container of its own
+	width: omapdrm reserves every 2D TILER block on a 4KiB boundary, which
+	at 32bpp is every 1024 pixels of the 8192 wide container space, so a
+	64x64 cursor on its own blocks a 1024 pixel band over its rows. A
+	shared container pays that once for SUBALLOC_HEIGHT rows and stacks
+	buffers inside it, and saves a GEM_NEW per buffer. The price is the
+	virtual handles, no PRIME export or MAP_FIXED, and flips that move.
+*/
+
+#define SUBALLOC_HEIGHT 512
+#define SUBALLOC_CONTAINERS 8
+#define SUBALLOC_SHELVES 16
+#define SUBALLOC_BUFFERS 128
+#define SUBALLOC_MAPPINGS 128
+#define SUBALLOC_FBS 128
+#define SUBALLOC_ALIGN_X 32
+#define SUBALLOC_ALIGN_Y 8
+#define SUBALLOC_HANDLE_BASE 0x70000000u
+/* DRM's own mmap offsets start at 256MiB (32-bit) or higher */
+#define SUBALLOC_MMAP_BASE 0x08000000u
+#define SUBALLOC_MMAP_STRIDE 0x00100000u
+
+struct sub_shelf {
+	uint32_t y, height;
+	int count;              /* 0 or 1 */
+};
+
+struct sub_container {
+	int fd;                 /* -1: free slot */
+	struct tiler_bo bo;
+	uint32_t width;
+	uint64_t mmap_offset;
+	struct sub_shelf shelves[SUBALLOC_SHELVES];
+	int num_shelves;
+	uint32_t next_y;
+	int count;
+};
+
+struct sub_buffer {
+	struct sub_container *container; /* NULL: free slot */
+	struct sub_shelf *shelf;
+	uint32_t x, y, width, height;
+};
+
+struct sub_mapping {
+	void *ptr, *base;
+	size_t size;
+};
+
+struct sub_fb {
+	int fd;
+	uint32_t fb_id;
+	uint32_t x, y;
+};
+
+/* What each CRTC was last set to show, for PAGE_FLIP */
+struct sub_crtc {
+	uint32_t crtc_id;
+	uint32_t x, y;          /* position of the buffer in its container */
+	uint32_t src_x, src_y;  /* the client's own x/y, on top of that */
+};
+
+struct sub_container sub_containers[SUBALLOC_CONTAINERS];
+struct sub_buffer sub_buffers[SUBALLOC_BUFFERS];
+struct sub_mapping sub_mappings[SUBALLOC_MAPPINGS];
+struct sub_fb sub_fbs[SUBALLOC_FBS];
+struct sub_crtc sub_crtcs[MAX_CRTCS];
+pthread_mutex_t sub_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* sub_lock held */
+struct sub_buffer *sub_lookup(int fd, uint32_t handle) {
+	if (handle < SUBALLOC_HANDLE_BASE || handle >= SUBALLOC_HANDLE_BASE + SUBALLOC_BUFFERS)
+		return NULL;
+	struct sub_buffer *buf = &sub_buffers[handle - SUBALLOC_HANDLE_BASE];
+	return buf->container && buf->container->fd == fd ? buf : NULL;
+}
+
+struct sub_fb *sub_fb_lookup(uint32_t fb_id) {
+	for (int i = 0; i < SUBALLOC_FBS; i++)
+		if (sub_fbs[i].fb_id == fb_id && fb_id != 0)
+			return &sub_fbs[i];
+	return NULL;
+}
+
+void suballoc_init(void) {
+	for (int i = 0; i < SUBALLOC_CONTAINERS; i++)
+		sub_containers[i].fd = -1;
+}
+
+/* Remember where a CRTC scans out from, sub_lock held */
+struct sub_crtc *sub_crtc_set(uint32_t crtc_id, uint32_t x, uint32_t y) {
+	for (int i = 0; i < MAX_CRTCS; i++) {
+		if (sub_crtcs[i].crtc_id == 0 || sub_crtcs[i].crtc_id == crtc_id) {
+			sub_crtcs[i].crtc_id = crtc_id;
+			sub_crtcs[i].x = x;
+			sub_crtcs[i].y = y;
+			return &sub_crtcs[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+	Whether a legacy flip of crtc_id to fb_id has to move the scanout
+	origin, and if so where to: the framebuffer's position plus the
+	client's x/y from its last SETCRTC.
+*/
+int sub_flip_moves(uint32_t crtc_id, uint32_t fb_id, uint32_t *src_x, uint32_t *src_y) {
+	pthread_mutex_lock(&sub_lock);
+	struct sub_fb *fb = sub_fb_lookup(fb_id);
+	uint32_t x = fb ? fb->x : 0, y = fb ? fb->y : 0, cur_x = 0, cur_y = 0;
+	*src_x = *src_y = 0;
+	for (int i = 0; i < MAX_CRTCS; i++) {
+		if (sub_crtcs[i].crtc_id == crtc_id) {
+			cur_x = sub_crtcs[i].x;
+			cur_y = sub_crtcs[i].y;
+			*src_x = sub_crtcs[i].src_x;
+			*src_y = sub_crtcs[i].src_y;
+		}
+	}
+	pthread_mutex_unlock(&sub_lock);
+	*src_x += x;
+	*src_y += y;
+	return x != cur_x || y != cur_y;
+}
+
+/* Show fb_id at src_x/src_y on the CRTC's primary plane in place of a legacy flip */
+int suballoc_flip(int fd, struct drm_mode_crtc_page_flip *flip, uint32_t src_x, uint32_t src_y) {
+	struct lease_state *lease = fd_lease(fd);
+	struct plane_info *primary = lease ? primary_plane_for_crtc(fd, lease, flip->crtc_id) : NULL;
+	struct drm_set_client_cap atomic_cap;
+	atomic_cap.capability = DRM_CLIENT_CAP_ATOMIC;
+	atomic_cap.value = 1;
+	if (!primary || libc_ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, (char *)&atomic_cap) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct atomic_req req;
+	int err = 0;
+	req.num_objs = req.num_props = 0;
+	err |= atomic_req_add(&req, primary->plane_id, primary->fb_id_prop, flip->fb_id);
+	err |= atomic_req_add(&req, primary->plane_id, primary->src_x_prop, (uint64_t)src_x << 16);
+	err |= atomic_req_add(&req, primary->plane_id, primary->src_y_prop, (uint64_t)src_y << 16);
+	if (err != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | (flip->flags & (DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC));
+	int ret = atomic_req_commit(fd, &req, flags, flip->user_data);
+	if (ret == 0) {
+		pthread_mutex_lock(&sub_lock);
+		struct sub_fb *fb = sub_fb_lookup(flip->fb_id);
+		sub_crtc_set(flip->crtc_id, fb ? fb->x : 0, fb ? fb->y : 0);
+		pthread_mutex_unlock(&sub_lock);
+		if (debug_flag)
+			printf("suballoc: flipped crtc %u to fb %u at %u,%u atomically\n", flip->crtc_id, flip->fb_id, src_x, src_y);
+	}
+	return ret;
+}
+
+/* Find a free shelf in a container, sub_lock held */
+int sub_place(struct sub_container *c, uint32_t width, uint32_t height, struct sub_buffer *buf) {
+	uint32_t h = (height + SUBALLOC_ALIGN_Y - 1) & ~(SUBALLOC_ALIGN_Y - 1);
+	struct sub_shelf *shelf = NULL;
+	if (width > c->width)
+		return -1;
+	/* Best fit: the lowest free shelf that is tall enough without wasting half of it */
+	for (int i = 0; i < c->num_shelves; i++) {
+		struct sub_shelf *s = &c->shelves[i];
+		if (s->count == 0 && s->height >= h && s->height <= 2 * h &&
+				(!shelf || s->height < shelf->height))
+			shelf = s;
+	}
+	if (!shelf) {
+		if (c->num_shelves >= SUBALLOC_SHELVES || c->next_y + h > SUBALLOC_HEIGHT)
+			return -1;
+		shelf = &c->shelves[c->num_shelves++];
+		shelf->y = c->next_y;
+		shelf->height = h;
+		shelf->count = 0;
+		c->next_y += h;
+	}
+	buf->container = c;
+	buf->shelf = shelf;
+	buf->x = 0;
+	buf->y = shelf->y;
+	buf->width = width;
+	buf->height = height;
+	shelf->count++;
+	c->count++;
+	return 0;
+}
+
+/* Returns 1 and fills in the request if the buffer was sub-allocated */
+int suballoc_create(int fd, struct drm_mode_create_dumb *create) {
+	if (create->width > suballoc_max_w || create->height > suballoc_max_h || (create->bpp != 16 && create->bpp != 32))
+		return 0;
+
+	pthread_mutex_lock(&sub_lock);
+	struct sub_buffer *buf = NULL;
+	for (int i = 0; i < SUBALLOC_BUFFERS && !buf; i++)
+		if (!sub_buffers[i].container)
+			buf = &sub_buffers[i];
+	int placed = -1;
+	for (int i = 0; buf && placed != 0 && i < SUBALLOC_CONTAINERS; i++)
+		if (sub_containers[i].fd == fd && sub_containers[i].bo.bpp == create->bpp)
+			placed = sub_place(&sub_containers[i], create->width, create->height, buf);
+	for (int i = 0; buf && placed != 0 && i < SUBALLOC_CONTAINERS; i++) {
+		struct sub_container *c = &sub_containers[i];
+		if (c->fd != -1)
+			continue;
+		memset(c, 0, sizeof(*c));
+		c->fd = -1;
+		c->width = (suballoc_max_w + SUBALLOC_ALIGN_X - 1) & ~(SUBALLOC_ALIGN_X - 1);
+		if (tiler_bo_new_width(fd, c->width, SUBALLOC_HEIGHT, create->bpp, OMAP_BO_WC, &c->bo) != 0)
+			break;
+		struct drm_omap_gem_info info;
+		memset(&info, 0, sizeof(info));
+		info.handle = c->bo.handle;
+		if (libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_INFO, (char *)&info) != 0) {
+			tiler_bo_free(fd, &c->bo);
+			break;
+		}
+		c->mmap_offset = info.offset;
+		c->fd = fd;
+		placed = sub_place(c, create->width, create->height, buf);
+		printf("suballoc: new %ux%u %ubpp container, handle %u\n", c->width, SUBALLOC_HEIGHT, create->bpp, c->bo.handle);
+	}
+	if (placed == 0) {
+		create->handle = SUBALLOC_HANDLE_BASE + (buf - sub_buffers);
+		/* The buffer's rows are its own, full pitch included */
+		create->pitch = buf->container->bo.pitch;
+		create->size = (uint64_t)create->pitch * create->height;
+		if (debug_flag)
+			printf("suballoc: %ux%u at %u,%u in container %u\n", create->width, create->height,
+				buf->x, buf->y, buf->container->bo.handle);
+	}
+	pthread_mutex_unlock(&sub_lock);
+	return placed == 0;
+}
+
+/* sub_lock held */
+void suballoc_destroy(int fd, struct sub_buffer *buf) {
+	struct sub_container *c = buf->container;
+	buf->shelf->count--;
+	buf->container = NULL;
+	if (--c->count == 0) {
+		tiler_bo_free(fd, &c->bo);
+		c->fd = -1;
+	}
+}
+
+/* Framebuffer on the container, big enough to reach the buffer at x, y */
+int suballoc_addfb2(int fd, struct drm_mode_fb_cmd2 *cmd, uint32_t container, uint32_t x, uint32_t y) {
+	struct drm_mode_fb_cmd2 fb = *cmd;
+	fb.width = x + cmd->width;
+	fb.height = y + cmd->height;
+	fb.handles[0] = container;
+	fb.offsets[0] = 0;
+	int ret = libc_ioctl(fd, DRM_IOCTL_MODE_ADDFB2, (char *)&fb);
+	if (ret != 0)
+		return ret;
+	cmd->fb_id = fb.fb_id;
+	pthread_mutex_lock(&sub_lock);
+	struct sub_fb *slot = NULL;
+	for (int i = 0; i < SUBALLOC_FBS && !slot; i++)
+		if (sub_fbs[i].fb_id == 0)
+			slot = &sub_fbs[i];
+	if (slot) {
+		slot->fd = fd;
+		slot->fb_id = fb.fb_id;
+		slot->x = x;
+		slot->y = y;
+	}
+	pthread_mutex_unlock(&sub_lock);
+	return 0;
+}
+
+/*
+	Ioctls on virtual handles. Returns 1 with *result set if the request was
+	handled here.
+*/
+int suballoc_ioctl(int fd, unsigned long request, char *argp, int *result) {
+	struct sub_buffer *buf;
+	uint32_t container, x, y;
+	*result = 0;
+	if (request == DRM_IOCTL_MODE_CREATE_DUMB) {
+		return suballoc_create(fd, (struct drm_mode_create_dumb *)argp);
+	} else if (request == DRM_IOCTL_MODE_MAP_DUMB) {
+		struct drm_mode_map_dumb *map = (struct drm_mode_map_dumb *)argp;
+		pthread_mutex_lock(&sub_lock);
+		if ((buf = sub_lookup(fd, map->handle)))
+			map->offset = SUBALLOC_MMAP_BASE + (uint64_t)(buf - sub_buffers) * SUBALLOC_MMAP_STRIDE;
+		pthread_mutex_unlock(&sub_lock);
+		return buf != NULL;
+	} else if (request == DRM_IOCTL_MODE_DESTROY_DUMB || request == DRM_IOCTL_GEM_CLOSE) {
+		uint32_t handle = *(uint32_t *)argp; /* first field of both */
+		pthread_mutex_lock(&sub_lock);
+		if ((buf = sub_lookup(fd, handle)))
+			suballoc_destroy(fd, buf);
+		pthread_mutex_unlock(&sub_lock);
+		return buf != NULL;
+	} else if (request == DRM_IOCTL_MODE_ADDFB2 || request == DRM_IOCTL_MODE_ADDFB) {
+		struct drm_mode_fb_cmd2 *cmd2 = (struct drm_mode_fb_cmd2 *)argp;
+		struct drm_mode_fb_cmd *cmd = (struct drm_mode_fb_cmd *)argp;
+		pthread_mutex_lock(&sub_lock);
+		if ((buf = sub_lookup(fd, request == DRM_IOCTL_MODE_ADDFB2 ? cmd2->handles[0] : cmd->handle))) {
+			container = buf->container->bo.handle;
+			x = buf->x;
+			y = buf->y;
+		}
+		pthread_mutex_unlock(&sub_lock);
+		if (!buf)
+			return 0;
+		if (request == DRM_IOCTL_MODE_ADDFB2) {
+			*result = suballoc_addfb2(fd, cmd2, container, x, y);
+			return 1;
+		}
+		struct drm_mode_fb_cmd2 legacy;
+		memset(&legacy, 0, sizeof(legacy));
+		legacy.width = cmd->width;
+		legacy.height = cmd->height;
+		legacy.pixel_format = legacy_fourcc(cmd->bpp, cmd->depth);
+		legacy.pitches[0] = cmd->pitch;
+		*result = suballoc_addfb2(fd, &legacy, container, x, y);
+		cmd->fb_id = legacy.fb_id;
+		return 1;
+	} else if (request == DRM_IOCTL_MODE_RMFB) {
+		pthread_mutex_lock(&sub_lock);
+		struct sub_fb *fb = sub_fb_lookup(*(uint32_t *)argp);
+		if (fb)
+			fb->fb_id = 0;
+		pthread_mutex_unlock(&sub_lock);
+		return 0;
+	} else if (request == DRM_IOCTL_MODE_PAGE_FLIP) {
+		struct drm_mode_crtc_page_flip *flip = (struct drm_mode_crtc_page_flip *)argp;
+		if (!sub_flip_moves(flip->crtc_id, flip->fb_id, &x, &y))
+			return 0;
+		*result = suballoc_flip(fd, flip, x, y);
+		return 1;
+	} else if (request == DRM_IOCTL_PRIME_HANDLE_TO_FD) {
+		pthread_mutex_lock(&sub_lock);
+		buf = sub_lookup(fd, ((struct drm_prime_handle *)argp)->handle);
+		pthread_mutex_unlock(&sub_lock);
+		if (!buf)
+			return 0;
+		errno = EINVAL;
+		*result = -1;
+		return 1;
+	} else if (request == DRM_IOCTL_OMAP_GEM_INFO || request == DRM_IOCTL_OMAP_GEM_CPU_PREP ||
+			request == DRM_IOCTL_OMAP_GEM_CPU_FINI) {
+		/* All start with the handle */
+		uint32_t *handle = (uint32_t *)argp;
+		pthread_mutex_lock(&sub_lock);
+		if ((buf = sub_lookup(fd, *handle)))
+			container = buf->container->bo.handle;
+		pthread_mutex_unlock(&sub_lock);
+		if (!buf)
+			return 0;
+		uint32_t virtual = *handle;
+		*handle = container;
+		*result = libc_ioctl(fd, request, argp);
+		*handle = virtual;
+		return 1;
+	}
+	return 0;
+}
+
+/* The kernel frees everything when the device fd is closed; mappings stay valid */
+void suballoc_forget(int fd) {
+	pthread_mutex_lock(&sub_lock);
+	for (int i = 0; i < SUBALLOC_BUFFERS; i++)
+		if (sub_buffers[i].container && sub_buffers[i].container->fd == fd)
+			sub_buffers[i].container = NULL;
+	for (int i = 0; i < SUBALLOC_CONTAINERS; i++)
+		if (sub_containers[i].fd == fd)
+			sub_containers[i].fd = -1;
+	for (int i = 0; i < SUBALLOC_FBS; i++)
+		if (sub_fbs[i].fd == fd)
+			sub_fbs[i].fb_id = 0;
+	pthread_mutex_unlock(&sub_lock);
+}
+
+/*
+	Point scanout at sub-allocated buffers. The client's request is changed
+	in place and put back by suballoc_restore once the ioctl is done.
+*/
+
+struct sub_saved {
+	uint32_t x, y;
+	uint64_t props_ptr, values_ptr, count_props_ptr, objs_ptr, count_objs;
+	struct atomic_req *req;
+};
+
+int suballoc_translate(int fd, unsigned long request, char *argp, struct sub_saved *saved) {
+	if (request == DRM_IOCTL_MODE_SETCRTC) {
+		struct drm_mode_crtc *crtc = (struct drm_mode_crtc *)argp;
+		pthread_mutex_lock(&sub_lock);
+		struct sub_fb *fb = sub_fb_lookup(crtc->fb_id);
+		if (fb) {
+			saved->x = crtc->x;
+			saved->y = crtc->y;
+			crtc->x += fb->x;
+			crtc->y += fb->y;
+		}
+		struct sub_crtc *shown = crtc->fb_id != (uint32_t)-1 ? sub_crtc_set(crtc->crtc_id, fb ? fb->x : 0, fb ? fb->y : 0) : NULL;
+		if (shown) {
+			shown->src_x = fb ? saved->x : crtc->x;
+			shown->src_y = fb ? saved->y : crtc->y;
+		}
+		pthread_mutex_unlock(&sub_lock);
+		return fb != NULL;
+	} else if (request == DRM_IOCTL_MODE_SETPLANE) {
+		struct drm_mode_set_plane *plane = (struct drm_mode_set_plane *)argp;
+		pthread_mutex_lock(&sub_lock);
+		struct sub_fb *fb = sub_fb_lookup(plane->fb_id);
+		if (fb) {
+			saved->x = plane->src_x;
+			saved->y = plane->src_y;
+			plane->src_x += fb->x << 16;
+			plane->src_y += fb->y << 16;
+		}
+		pthread_mutex_unlock(&sub_lock);
+		return fb != NULL;
+	} else if (request != DRM_IOCTL_MODE_ATOMIC) {
+		return 0;
+	}
+
+	/*
+		Atomic: copy the request, adding each sub-allocated buffer's
+		position to SRC_X/SRC_Y of the plane showing it (and setting them if
+		the client didn't)
+	*/
+	struct drm_mode_atomic *atomic = (struct drm_mode_atomic *)argp;
+	uint32_t *objs = (uint32_t *)atomic->objs_ptr;
+	uint32_t *count_props = (uint32_t *)atomic->count_props_ptr;
+	uint32_t *props = (uint32_t *)atomic->props_ptr;
+	uint64_t *values = (uint64_t *)atomic->prop_values_ptr;
+	int k = 0, any = 0, err = 0;
+
+	for (int i = 0; i < atomic->count_objs; k += count_props[i], i++) {
+		struct plane_info *plane = plane_lookup(fd, objs[i]);
+		for (int j = 0; plane && j < count_props[i]; j++)
+			if (props[k + j] == plane->fb_id_prop && sub_fb_lookup(values[k + j]))
+				any = 1;
+	}
+	if (!any)
+		return 0;
+
+	struct atomic_req *req = malloc(sizeof(*req));
+	if (!req)
+		return 0;
+	req->num_objs = req->num_props = 0;
+	k = 0;
+	for (int i = 0; i < atomic->count_objs; k += count_props[i], i++) {
+		struct plane_info *plane = plane_lookup(fd, objs[i]);
+		struct sub_fb *fb = NULL;
+		for (int j = 0; plane && j < count_props[i]; j++)
+			if (props[k + j] == plane->fb_id_prop)
+				fb = sub_fb_lookup(values[k + j]);
+		int has_x = 0, has_y = 0;
+		for (int j = 0; j < count_props[i]; j++) {
+			uint64_t value = values[k + j];
+			if (fb && props[k + j] == plane->src_x_prop) {
+				value += (uint64_t)fb->x << 16;
+				has_x = 1;
+			} else if (fb && props[k + j] == plane->src_y_prop) {
+				value += (uint64_t)fb->y << 16;
+				has_y = 1;
+			}
+			err |= atomic_req_add(req, objs[i], props[k + j], value);
+		}
+		if (fb && !has_x)
+			err |= atomic_req_add(req, objs[i], plane->src_x_prop, (uint64_t)fb->x << 16);
+		if (fb && !has_y)
+			err |= atomic_req_add(req, objs[i], plane->src_y_prop, (uint64_t)fb->y << 16);
+	}
+	if (err != 0) {
+		free(req);
+		return 0;
+	}
+	saved->req = req;
+	saved->objs_ptr = atomic->objs_ptr;
+	saved->count_props_ptr = atomic->count_props_ptr;
+	saved->props_ptr = atomic->props_ptr;
+	saved->values_ptr = atomic->prop_values_ptr;
+	saved->count_objs = atomic->count_objs;
+	atomic->objs_ptr = (uint64_t)req->objs;
+	atomic->count_props_ptr = (uint64_t)req->count_props;
+	atomic->props_ptr = (uint64_t)req->props;
+	atomic->prop_values_ptr = (uint64_t)req->values;
+	atomic->count_objs = req->num_objs;
+	return 1;
+}
+
+void suballoc_restore(unsigned long request, char *argp, struct sub_saved *saved) {
+	if (request == DRM_IOCTL_MODE_SETCRTC) {
+		((struct drm_mode_crtc *)argp)->x = saved->x;
+		((struct drm_mode_crtc *)argp)->y = saved->y;
+	} else if (request == DRM_IOCTL_MODE_SETPLANE) {
+		((struct drm_mode_set_plane *)argp)->src_x = saved->x;
+		((struct drm_mode_set_plane *)argp)->src_y = saved->y;
+	} else if (request == DRM_IOCTL_MODE_ATOMIC) {
+		struct drm_mode_atomic *atomic = (struct drm_mode_atomic *)argp;
+		atomic->objs_ptr = saved->objs_ptr;
+		atomic->count_props_ptr = saved->count_props_ptr;
+		atomic->props_ptr = saved->props_ptr;
+		atomic->prop_values_ptr = saved->values_ptr;
+		atomic->count_objs = saved->count_objs;
+		free(saved->req);
+	}
+}
+
+/* Map the container and hand out a pointer to the buffer inside it */
+void *suballoc_mmap(void *addr, size_t length, int prot, int flags, int fd, uint64_t offset, int *handled) {
+	*handled = 0;
+	if (!suballoc_flag || offset < SUBALLOC_MMAP_BASE ||
+			offset >= SUBALLOC_MMAP_BASE + SUBALLOC_BUFFERS * SUBALLOC_MMAP_STRIDE ||
+			fd < 0 || fd >= MAX_FDS || !drm_fds[fd])
+		return NULL;
+	if (flags & MAP_FIXED) {
+		/* The buffer is somewhere inside the container mapping, not at addr */
+		errno = EINVAL;
+		*handled = 1;
+		return MAP_FAILED;
+	}
+	pthread_mutex_lock(&sub_lock);
+	struct sub_buffer *buf = sub_lookup(fd, SUBALLOC_HANDLE_BASE + (offset - SUBALLOC_MMAP_BASE) / SUBALLOC_MMAP_STRIDE);
+	struct sub_mapping *mapping = NULL;
+	for (int i = 0; buf && i < SUBALLOC_MAPPINGS && !mapping; i++)
+		if (!sub_mappings[i].ptr)
+			mapping = &sub_mappings[i];
+	void *ptr = MAP_FAILED;
+	if (mapping) {
+		struct tiler_bo *bo = &buf->container->bo;
+		void *base = libc_mmap64(NULL, bo->size, prot, flags, fd, buf->container->mmap_offset);
+		if (base != MAP_FAILED) {
+			ptr = (char *)base + (uint64_t)buf->y * bo->pitch + buf->x * (bo->bpp / 8);
+			mapping->ptr = ptr;
+			mapping->base = base;
+			mapping->size = bo->size;
+		}
+	} else {
+		errno = buf ? ENOMEM : EINVAL;
+	}
+	pthread_mutex_unlock(&sub_lock);
+	*handled = 1;
+	return ptr;
+}
+
+/*
+	SIGSEGV handling for migration and dirty tracking. Both only ever
+	remove permissions, so only SEGV_ACCERR faults can be theirs; an access
+	to memory that has gone away must not be retried. Faults that aren't
+	theirs go to the previous handler (the flight recorder's, which is
+	installed first), by putting it back and letting the access fault
+	again; a SIGSEGV that was sent rather than caused is raised again.
+*/
+
+struct sigaction fault_old_action;
+int fault_handler_installed = 0;
+int migrate_fault(char *addr, void *context);
+void migrate_start_thread(void);
+int dirty_fault(char *addr);
+
+void fault_handler(int sig, siginfo_t *info, void *context) {
+	if (info->si_code == SEGV_ACCERR && (migrate_fault(info->si_addr, context) || dirty_fault(info->si_addr)))
+		return;
+	sigaction(SIGSEGV, &fault_old_action, NULL);
+	if (info->si_code <= 0)
+		raise(sig);
+}
+
+void fault_handler_install(void) {
+	if (fault_handler_installed)
+		return;
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = fault_handler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigaction(SIGSEGV, &action, &fault_old_action);
+	fault_handler_installed = 1;
+}
+
+/*
+	Adaptive migration (ROTATE_MIGRATE=1)
+
+	The best backing for a buffer depends on how it is used, which isn't
+	known at CREATE_DUMB time. With ROTATE_MIGRATE=1 the client's handle
+	and framebuffer ids for locally allocated tiled buffers are indirected
+	through the shim, and usage is observed per MIGRATE_WINDOW flips:
+
+	- flips of the buffer (scanout)
+	- DIRTYFB (CPU drawing into a shown buffer)
+	- CPU_PREP for reading, and one sampled page fault per window on a CPU
+	  mapping, which tells reads from writes where the architecture says so
+
+	Buffers that are read by the CPU move to cached tiled memory, other
+	scanout buffers to write-combined tiled memory, and buffers that haven't
+	been shown for MIGRATE_IDLE_WINDOWS windows to linear memory (unless
+	they may be shown rotated, which linear memory can't be). Flips only
+	note the decision: buffers are moved on a migration thread while they
+	aren't on screen. The contents are copied without mig_lock, with the
+	client's mappings read-only so that writers racing with the copy sleep
+	in the fault handler until it is done. Only if the buffer still isn't
+	shown are the client's mappings replaced in place and new framebuffers
+	made to stand in for the client's; otherwise the copy is dropped and
+	tried again later. Buffers exported with PRIME, or borrowed from the
+	broker, stay where they are. Their mappings are never dirty-tracked
+	(the mmap hook hands them out before dirty_track), so the protection
+	changes here don't undo ROTATE_DIRTY's.
+*/
+
+#define MIGRATE_BUFFERS 32
+#define MIGRATE_FBS 4
+#define MIGRATE_MAPS 4
+#define MIGRATE_WINDOW 32
+#define MIGRATE_IDLE_WINDOWS 2
+#define MIGRATE_HANDLE_BASE 0x60000000u
+/* Below the sub-allocation tokens, which are below DRM's own offsets */
+#define MIGRATE_MMAP_BASE 0x04000000u
+#define MIGRATE_MMAP_STRIDE 0x00100000u
+
+enum backing { BACKING_TILED_WC, BACKING_TILED_CACHED, BACKING_LINEAR };
+const char *backing_names[] = { "tiled WC", "tiled cached", "linear" };
+
+struct mig_fb {
+	uint32_t client_id;     /* 0: free slot */
+	uint32_t real_id;
+	struct drm_mode_fb_cmd2 cmd;
+};
+
+struct mig_map {
+	void *ptr;              /* NULL: free slot */
+	size_t length;
+	int prot, flags;
+};
+
+struct mig_buffer {
+	int fd;                 /* -1: free slot */
+	int pinned;             /* exported, never migrated */
+	int migrating;          /* copy in progress, writers wait on it */
+	enum backing backing, want;
+	struct tiler_bo bo;
+	uint32_t container_width, width;
+	uint64_t mmap_offset;
+	uint32_t shown_on;      /* CRTC or plane showing it, 0 if none */
+	struct mig_fb fbs[MIGRATE_FBS];
+	struct mig_map maps[MIGRATE_MAPS];
+	/* Usage in the current window */
+	uint32_t flips, dirtyfbs, cpu_reads, read_faults, write_faults;
+	uint32_t idle_windows;
+};
+
+struct mig_buffer mig_buffers[MIGRATE_BUFFERS];
+pthread_mutex_t mig_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mig_cond = PTHREAD_COND_INITIALIZER;
+int mig_thread_started = 0;
+uint32_t mig_flips = 0;
+int mig_sample_next = 0;
+volatile struct mig_map *mig_sampled = NULL;
+struct mig_buffer *volatile mig_sampled_buf = NULL;
+
+void migrate_init(void) {
+	for (int i = 0; i < MIGRATE_BUFFERS; i++)
+		mig_buffers[i].fd = -1;
+}
+
+struct mig_buffer *mig_lookup(int fd, uint32_t handle) {
+	if (handle < MIGRATE_HANDLE_BASE || handle >= MIGRATE_HANDLE_BASE + MIGRATE_BUFFERS)
+		return NULL;
+	struct mig_buffer *b = &mig_buffers[handle - MIGRATE_HANDLE_BASE];
+	return b->fd == fd ? b : NULL;
+}
+
+/* Buffer and slot behind a client framebuffer id, mig_lock held */
+struct mig_buffer *mig_fb_lookup(int fd, uint32_t client_id, struct mig_fb **fb) {
+	for (int i = 0; client_id && i < MIGRATE_BUFFERS; i++) {
+		if (mig_buffers[i].fd != fd)
+			continue;
+		for (int j = 0; j < MIGRATE_FBS; j++) {
+			if (mig_buffers[i].fbs[j].client_id == client_id) {
+				*fb = &mig_buffers[i].fbs[j];
+				return &mig_buffers[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Whether the access that faulted was a write, -1 if the architecture doesn't say */
+int mig_fault_is_write(void *context) {
+	ucontext_t *uc = (ucontext_t *)context;
+#if defined(__x86_64__) || defined(__i386__)
+	return (uc->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#elif defined(__arm__)
+	return (uc->uc_mcontext.error_code & (1 << 11)) != 0; /* WnR */
+#elif defined(__aarch64__)
+	struct _aarch64_ctx *ctx = (struct _aarch64_ctx *)uc->uc_mcontext.__reserved;
+	for (; ctx->magic != 0; ctx = (struct _aarch64_ctx *)((char *)ctx + ctx->size))
+		if (ctx->magic == ESR_MAGIC)
+			return (((struct esr_context *)ctx)->esr & (1 << 6)) != 0; /* WnR */
+	return -1;
+#else
+	return -1;
+#endif
+}
+
+/* Faults on migrating or sampled mappings */
+int migrate_fault(char *addr, void *context) {
+	for (int i = 0; i < MIGRATE_BUFFERS; i++) {
+		struct mig_buffer *b = &mig_buffers[i];
+		for (int j = 0; b->fd >= 0 && j < MIGRATE_MAPS; j++) {
+			struct mig_map *map = &b->maps[j];
+			if (!map->ptr || addr < (char *)map->ptr || addr >= (char *)map->ptr + map->length)
+				continue;
+			if (__atomic_load_n(&b->migrating, __ATOMIC_ACQUIRE)) {
+				/* The mapping is replaced (or made writable) once the copy is done */
+				while (__atomic_load_n(&b->migrating, __ATOMIC_ACQUIRE))
+					syscall(SYS_futex, &b->migrating, FUTEX_WAIT, 1, NULL, NULL, 0);
+				return 1;
+			}
+			if (mig_sampled == map) {
+				int write = mig_fault_is_write(context);
+				if (write > 0)
+					b->write_faults++;
+				else
+					b->read_faults++; /* reads, or unknown: both favour cached memory */
+				mig_sampled = NULL;
+				mprotect(map->ptr, map->length, map->prot);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Take over a freshly allocated tiled buffer, giving the client a virtual handle */
+void migrate_adopt(int fd, struct drm_mode_create_dumb *create, struct tiler_bo *bo, uint32_t container_width) {
+	struct drm_omap_gem_info info;
+	memset(&info, 0, sizeof(info));
+	info.handle = bo->handle;
+	if (libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_INFO, (char *)&info) != 0)
+		return;
+	pthread_mutex_lock(&mig_lock);
+	for (int i = 0; i < MIGRATE_BUFFERS; i++) {
+		struct mig_buffer *b = &mig_buffers[i];
+		if (b->fd >= 0 || b->migrating)
+			continue;
+		memset(b, 0, sizeof(*b));
+		b->fd = fd;
+		b->bo = *bo;
+		b->backing = b->want = (bo->flags & OMAP_BO_CACHED) ? BACKING_TILED_CACHED : BACKING_TILED_WC;
+		b->container_width = container_width;
+		b->width = create->width;
+		b->mmap_offset = info.offset;
+		create->handle = MIGRATE_HANDLE_BASE + i;
+		fault_handler_install();
+		migrate_start_thread();
+		break;
+	}
+	pthread_mutex_unlock(&mig_lock);
+}
+
+/* Let writers that waited for a copy go on, mig_lock held */
+void mig_copy_done(struct mig_buffer *b) {
+	__atomic_store_n(&b->migrating, 0, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &b->migrating, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/*
+	Move a buffer to another backing, on the migration thread with mig_lock
+	held. The lock is dropped for the allocation and copy.
+*/
+int migrate_buffer(struct mig_buffer *b, enum backing want) {
+	int fd = b->fd;
+	struct tiler_bo old = b->bo, bo;
+	uint64_t old_offset = b->mmap_offset;
+	uint32_t container_width = b->container_width, width = b->width;
+
+	/* Writers wait in migrate_fault until their mapping points at the copy */
+	__atomic_store_n(&b->migrating, 1, __ATOMIC_RELEASE);
+	if (mig_sampled_buf == b)
+		mig_sampled = NULL;
+	for (int i = 0; i < MIGRATE_MAPS; i++)
+		if (b->maps[i].ptr)
+			mprotect(b->maps[i].ptr, b->maps[i].length, b->maps[i].prot & ~PROT_WRITE);
+	pthread_mutex_unlock(&mig_lock);
+
+	int ret = want == BACKING_LINEAR ?
+		tiler_bo_new_linear(fd, old.pitch / (old.bpp / 8), old.height, old.bpp, OMAP_BO_CACHED, &bo) :
+		tiler_bo_new_width(fd, container_width, old.height, old.bpp,
+			want == BACKING_TILED_CACHED ? OMAP_BO_CACHED : OMAP_BO_WC, &bo);
+	int allocated = ret == 0;
+	if (allocated && bo.pitch != old.pitch)
+		ret = -1;
+	struct drm_omap_gem_info info;
+	memset(&info, 0, sizeof(info));
+	info.handle = bo.handle;
+	if (ret == 0)
+		ret = libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_INFO, (char *)&info);
+	size_t size = (size_t)old.pitch * old.height;
+	void *src = MAP_FAILED, *dst = MAP_FAILED;
+	if (ret == 0) {
+		src = libc_mmap64(NULL, size, PROT_READ, MAP_SHARED, fd, old_offset);
+		dst = libc_mmap64(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, info.offset);
+		ret = src == MAP_FAILED || dst == MAP_FAILED ? -1 : 0;
+	}
+	if (ret == 0) {
+		size_t row = (size_t)width * (old.bpp / 8);
+		for (uint32_t y = 0; y < old.height; y++)
+			memcpy((char *)dst + (size_t)y * old.pitch, (char *)src + (size_t)y * old.pitch, row);
+		stats_add_copy((uint64_t)row * old.height);
+		if (want == BACKING_TILED_CACHED || want == BACKING_LINEAR) {
+			struct drm_omap_gem_cpu_fini fini;
+			memset(&fini, 0, sizeof(fini));
+			fini.handle = bo.handle;
+			fini.op = OMAP_GEM_WRITE;
+			libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_CPU_FINI, (char *)&fini);
+		}
+	}
+	if (src != MAP_FAILED)
+		libc_munmap(src, size);
+	if (dst != MAP_FAILED)
+		libc_munmap(dst, size);
+
+	pthread_mutex_lock(&mig_lock);
+	/* Destroyed, exported or flipped to while copying: keep the old backing */
+	int current = b->fd == fd && b->bo.handle == old.handle;
+	if (ret == 0 && (!current || b->pinned || b->shown_on))
+		ret = -1;
+	uint32_t real_ids[MIGRATE_FBS];
+	int num_fbs = 0;
+	for (int i = 0; ret == 0 && i < MIGRATE_FBS; i++, num_fbs++) {
+		struct drm_mode_fb_cmd2 cmd = b->fbs[i].cmd;
+		real_ids[i] = 0;
+		if (!b->fbs[i].client_id)
+			continue;
+		cmd.handles[0] = bo.handle;
+		ret = libc_ioctl(fd, DRM_IOCTL_MODE_ADDFB2, (char *)&cmd);
+		real_ids[i] = cmd.fb_id;
+	}
+	if (ret != 0) {
+		for (int i = 0; i < num_fbs; i++)
+			if (real_ids[i])
+				libc_ioctl(fd, DRM_IOCTL_MODE_RMFB, (char *)&real_ids[i]);
+		if (allocated)
+			tiler_bo_free(fd, &bo);
+		for (int i = 0; current && i < MIGRATE_MAPS; i++)
+			if (b->maps[i].ptr)
+				mprotect(b->maps[i].ptr, b->maps[i].length, b->maps[i].prot);
+		if (current && !b->shown_on)
+			b->want = b->backing;
+		mig_copy_done(b);
+		return -1;
+	}
+
+	for (int i = 0; i < MIGRATE_MAPS; i++) {
+		struct mig_map *map = &b->maps[i];
+		if (map->ptr && libc_mmap64(map->ptr, map->length, map->prot, map->flags | MAP_FIXED, fd, info.offset) == MAP_FAILED)
+			printf("migrate: remapping %p failed: %d\n", map->ptr, errno);
+	}
+	mig_copy_done(b);
+	for (int i = 0; i < MIGRATE_FBS; i++) {
+		if (!b->fbs[i].client_id)
+			continue;
+		libc_ioctl(fd, DRM_IOCTL_MODE_RMFB, (char *)&b->fbs[i].real_id);
+		fb_track_rebind(b->fbs[i].real_id, real_ids[i], bo.handle);
+		b->fbs[i].real_id = real_ids[i];
+		b->fbs[i].cmd.handles[0] = bo.handle;
+	}
+	tiler_bo_free(fd, &b->bo);
+	if (debug_flag)
+		printf("migrate: buffer %u %s -> %s\n", (uint32_t)(b - mig_buffers) + MIGRATE_HANDLE_BASE,
+			backing_names[b->backing], backing_names[want]);
+	b->bo = bo;
+	b->mmap_offset = info.offset;
+	b->backing = want;
+	return 0;
+}
+
+/* Move buffers that want another backing whenever they are off screen */
+void *migrate_thread(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&mig_lock);
+	for (;;) {
+		struct mig_buffer *due = NULL;
+		for (int i = 0; i < MIGRATE_BUFFERS && !due; i++) {
+			struct mig_buffer *b = &mig_buffers[i];
+			if (b->fd >= 0 && !b->pinned && !b->shown_on && b->want != b->backing)
+				due = b;
+		}
+		if (due)
+			migrate_buffer(due, due->want);
+		else
+			pthread_cond_wait(&mig_cond, &mig_lock);
+	}
+	return NULL;
+}
 
-int test_flag(const char *name) {
-	const char *e = getenv(name);
-	if (!e)
-		return 0;
-	return atoi(e);
+/* mig_lock held */
+void migrate_start_thread(void) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	if (mig_thread_started)
+		return;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, migrate_thread, NULL) == 0)
+		mig_thread_started = 1;
+	else
+		printf("migrate: can't start the migration thread\n");
+	pthread_attr_destroy(&attr);
 }
 
-void init(void) {
-	if (init_done)
+/* End of an observation window: pick backings and sample a mapping, mig_lock held */
+void migrate_decide(int fd) {
+	for (int i = 0; i < MIGRATE_BUFFERS; i++) {
+		struct mig_buffer *b = &mig_buffers[i];
+		if (b->fd != fd || b->pinned)
+			continue;
+		b->idle_windows = b->flips ? 0 : b->idle_windows + 1;
+		if (b->idle_windows >= MIGRATE_IDLE_WINDOWS && !b->shown_on && shim_rotation == DRM_MODE_ROTATE_0)
+			b->want = BACKING_LINEAR;
+		else if (b->cpu_reads || b->read_faults || b->dirtyfbs > b->flips)
+			b->want = BACKING_TILED_CACHED;
+		else if (b->flips)
+			b->want = BACKING_TILED_WC;
+		b->flips = b->dirtyfbs = b->cpu_reads = b->read_faults = b->write_faults = 0;
+	}
+	pthread_cond_signal(&mig_cond);
+
+	if (mig_sampled)
+		mprotect(mig_sampled->ptr, mig_sampled->length, mig_sampled->prot);
+	mig_sampled = NULL;
+	for (int n = 0; n < MIGRATE_BUFFERS; n++) {
+		struct mig_buffer *b = &mig_buffers[mig_sample_next];
+		mig_sample_next = (mig_sample_next + 1) % MIGRATE_BUFFERS;
+		if (b->fd == fd && !b->pinned && b->maps[0].ptr) {
+			mig_sampled_buf = b;
+			mig_sampled = &b->maps[0];
+			mprotect(b->maps[0].ptr, b->maps[0].length, PROT_NONE);
+			break;
+		}
+	}
+}
+
+/*
+	Ioctls on virtual handles and client framebuffer ids. Returns 1 with
+	*result set if the request was handled here.
+*/
+int migrate_ioctl(int fd, unsigned long request, char *argp, int *result) {
+	struct mig_buffer *b;
+	struct mig_fb *fb;
+	int handled = 1;
+	*result = 0;
+	pthread_mutex_lock(&mig_lock);
+	if (request == DRM_IOCTL_MODE_MAP_DUMB) {
+		struct drm_mode_map_dumb *map = (struct drm_mode_map_dumb *)argp;
+		if ((b = mig_lookup(fd, map->handle)))
+			map->offset = MIGRATE_MMAP_BASE + (uint64_t)(b - mig_buffers) * MIGRATE_MMAP_STRIDE;
+		handled = b != NULL;
+	} else if (request == DRM_IOCTL_MODE_DESTROY_DUMB || request == DRM_IOCTL_GEM_CLOSE) {
+		if ((b = mig_lookup(fd, *(uint32_t *)argp))) {
+			tiler_bo_free(fd, &b->bo);
+			if (mig_sampled_buf == b && mig_sampled)
+				mprotect(mig_sampled->ptr, mig_sampled->length, mig_sampled->prot);
+			if (mig_sampled_buf == b)
+				mig_sampled = NULL;
+			b->fd = -1;
+		}
+		handled = b != NULL;
+	} else if (request == DRM_IOCTL_MODE_ADDFB || request == DRM_IOCTL_MODE_ADDFB2) {
+		struct drm_mode_fb_cmd *legacy = (struct drm_mode_fb_cmd *)argp;
+		struct drm_mode_fb_cmd2 cmd;
+		if (request == DRM_IOCTL_MODE_ADDFB) {
+			memset(&cmd, 0, sizeof(cmd));
+			cmd.width = legacy->width;
+			cmd.height = legacy->height;
+			cmd.pixel_format = legacy_fourcc(legacy->bpp, legacy->depth);
+			cmd.pitches[0] = legacy->pitch;
+			cmd.handles[0] = legacy->handle;
+		} else {
+			cmd = *(struct drm_mode_fb_cmd2 *)argp;
+		}
+		fb = NULL;
+		if ((b = mig_lookup(fd, cmd.handles[0])))
+			for (int i = 0; i < MIGRATE_FBS && !fb; i++)
+				if (!b->fbs[i].client_id)
+					fb = &b->fbs[i];
+		handled = b != NULL;
+		if (b && !fb) {
+			errno = ENOSPC;
+			*result = -1;
+		} else if (b) {
+			uint32_t virtual = cmd.handles[0];
+			cmd.handles[0] = b->bo.handle;
+			*result = libc_ioctl(fd, DRM_IOCTL_MODE_ADDFB2, (char *)&cmd);
+			if (*result == 0) {
+				cmd.handles[0] = virtual;
+				fb->client_id = fb->real_id = cmd.fb_id;
+				fb->cmd = cmd;
+				fb_track_add(fd, cmd.fb_id, b->bo.handle, cmd.width, cmd.height, cmd.pitches[0], cmd.offsets[0], cmd.pixel_format);
+				if (request == DRM_IOCTL_MODE_ADDFB)
+					legacy->fb_id = cmd.fb_id;
+				else
+					((struct drm_mode_fb_cmd2 *)argp)->fb_id = cmd.fb_id;
+			}
+		}
+	} else if (request == DRM_IOCTL_MODE_RMFB) {
+		if ((b = mig_fb_lookup(fd, *(uint32_t *)argp, &fb))) {
+			*result = libc_ioctl(fd, request, (char *)&fb->real_id);
+			fb_track_remove(fb->real_id);
+			fb->client_id = 0;
+		}
+		handled = b != NULL;
+	} else if (request == DRM_IOCTL_MODE_DIRTYFB) {
+		struct drm_mode_fb_dirty_cmd *dirty = (struct drm_mode_fb_dirty_cmd *)argp;
+		if ((b = mig_fb_lookup(fd, dirty->fb_id, &fb))) {
+			uint32_t client_id = dirty->fb_id;
+			b->dirtyfbs++;
+			dirty->fb_id = fb->real_id;
+			*result = libc_ioctl(fd, request, argp);
+			dirty->fb_id = client_id;
+		}
+		handled = b != NULL;
+	} else if (request == DRM_IOCTL_PRIME_HANDLE_TO_FD) {
+		struct drm_prime_handle *prime = (struct drm_prime_handle *)argp;
+		if ((b = mig_lookup(fd, prime->handle))) {
+			/* Whoever imports it keeps the current backing */
+			b->pinned = 1;
+			prime->handle = b->bo.handle;
+			*result = libc_ioctl(fd, request, argp);
+			prime->handle = MIGRATE_HANDLE_BASE + (b - mig_buffers);
+		}
+		handled = b != NULL;
+	} else if (request == DRM_IOCTL_OMAP_GEM_INFO || request == DRM_IOCTL_OMAP_GEM_CPU_PREP ||
+			request == DRM_IOCTL_OMAP_GEM_CPU_FINI) {
+		uint32_t *handle = (uint32_t *)argp;
+		if ((b = mig_lookup(fd, *handle))) {
+			if (request == DRM_IOCTL_OMAP_GEM_CPU_PREP && (((struct drm_omap_gem_cpu_prep *)argp)->op & OMAP_GEM_READ))
+				b->cpu_reads++;
+			uint32_t virtual = *handle;
+			*handle = b->bo.handle;
+			*result = libc_ioctl(fd, request, argp);
+			*handle = virtual;
+		}
+		handled = b != NULL;
+	} else {
+		handled = 0;
+	}
+	pthread_mutex_unlock(&mig_lock);
+	return handled;
+}
+
+/*
+	Replace client framebuffer ids with the current ones in scanout
+	requests, noting buffers that are due to move as they are flipped to. The
+	request is put back by migrate_restore once the ioctl is done.
+*/
+
+struct mig_saved {
+	uint32_t fb_id;
+	uint64_t values_ptr;
+	uint64_t *values;
+};
+
+/* The real fb to show client_id on obj, mig_lock held */
+uint32_t migrate_show(int fd, uint32_t client_id, uint32_t obj, int test_only) {
+	struct mig_fb *fb;
+	struct mig_buffer *b = mig_fb_lookup(fd, client_id, &fb);
+	if (!b)
+		return client_id;
+	if (test_only)
+		return fb->real_id;
+
+	if (b->backing != BACKING_TILED_WC) {
+		struct drm_omap_gem_cpu_fini fini;
+		memset(&fini, 0, sizeof(fini));
+		fini.handle = b->bo.handle;
+		fini.op = OMAP_GEM_WRITE;
+		libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_CPU_FINI, (char *)&fini);
+	}
+	int off_screen = 0;
+	for (int i = 0; i < MIGRATE_BUFFERS; i++) {
+		if (mig_buffers[i].shown_on == obj && &mig_buffers[i] != b) {
+			mig_buffers[i].shown_on = 0;
+			off_screen |= mig_buffers[i].want != mig_buffers[i].backing;
+		}
+	}
+	/* The one it replaces can move now */
+	if (off_screen)
+		pthread_cond_signal(&mig_cond);
+	b->shown_on = obj;
+	b->flips++;
+	if (++mig_flips % MIGRATE_WINDOW == 0)
+		migrate_decide(fd);
+	return fb->real_id;
+}
+
+int migrate_translate(int fd, unsigned long request, char *argp, struct mig_saved *saved) {
+	int translated = 0;
+	pthread_mutex_lock(&mig_lock);
+	if (request == DRM_IOCTL_MODE_SETCRTC) {
+		struct drm_mode_crtc *crtc = (struct drm_mode_crtc *)argp;
+		saved->fb_id = crtc->fb_id;
+		if (crtc->fb_id != 0 && crtc->fb_id != (uint32_t)-1)
+			crtc->fb_id = migrate_show(fd, crtc->fb_id, crtc->crtc_id, 0);
+		translated = crtc->fb_id != saved->fb_id;
+	} else if (request == DRM_IOCTL_MODE_PAGE_FLIP) {
+		struct drm_mode_crtc_page_flip *flip = (struct drm_mode_crtc_page_flip *)argp;
+		saved->fb_id = flip->fb_id;
+		flip->fb_id = migrate_show(fd, flip->fb_id, flip->crtc_id, 0);
+		translated = flip->fb_id != saved->fb_id;
+	} else if (request == DRM_IOCTL_MODE_SETPLANE) {
+		struct drm_mode_set_plane *plane = (struct drm_mode_set_plane *)argp;
+		saved->fb_id = plane->fb_id;
+		plane->fb_id = migrate_show(fd, plane->fb_id, plane->plane_id, 0);
+		translated = plane->fb_id != saved->fb_id;
+	} else if (request == DRM_IOCTL_MODE_ATOMIC) {
+		struct drm_mode_atomic *atomic = (struct drm_mode_atomic *)argp;
+		uint32_t *objs = (uint32_t *)atomic->objs_ptr;
+		uint32_t *count_props = (uint32_t *)atomic->count_props_ptr;
+		uint32_t *props = (uint32_t *)atomic->props_ptr;
+		uint64_t *values = (uint64_t *)atomic->prop_values_ptr;
+		uint64_t *copy = NULL;
+		int total = 0, k = 0;
+		for (int i = 0; i < atomic->count_objs; i++)
+			total += count_props[i];
+		for (int i = 0; i < atomic->count_objs; k += count_props[i], i++) {
+			struct plane_info *plane = plane_lookup(fd, objs[i]);
+			for (int j = 0; plane && j < count_props[i]; j++) {
+				if (props[k + j] != plane->fb_id_prop)
+					continue;
+				uint32_t real = migrate_show(fd, values[k + j], objs[i], atomic->flags & DRM_MODE_ATOMIC_TEST_ONLY);
+				if (real == values[k + j])
+					continue;
+				if (!copy && (copy = malloc(total * sizeof(uint64_t))))
+					memcpy(copy, values, total * sizeof(uint64_t));
+				if (copy)
+					copy[k + j] = real;
+			}
+		}
+		if (copy) {
+			saved->values_ptr = atomic->prop_values_ptr;
+			saved->values = copy;
+			atomic->prop_values_ptr = (uint64_t)copy;
+			translated = 1;
+		}
+	}
+	pthread_mutex_unlock(&mig_lock);
+	return translated;
+}
+
+void migrate_restore(unsigned long request, char *argp, struct mig_saved *saved) {
+	if (request == DRM_IOCTL_MODE_SETCRTC) {
+		((struct drm_mode_crtc *)argp)->fb_id = saved->fb_id;
+	} else if (request == DRM_IOCTL_MODE_PAGE_FLIP) {
+		((struct drm_mode_crtc_page_flip *)argp)->fb_id = saved->fb_id;
+	} else if (request == DRM_IOCTL_MODE_SETPLANE) {
+		((struct drm_mode_set_plane *)argp)->fb_id = saved->fb_id;
+	} else if (request == DRM_IOCTL_MODE_ATOMIC) {
+		((struct drm_mode_atomic *)argp)->prop_values_ptr = saved->values_ptr;
+		free(saved->values);
+	}
+}
+
+/* Hand out the current backing for a token from MAP_DUMB, and remember where */
+void *migrate_mmap(void *addr, size_t length, int prot, int flags, int fd, uint64_t offset, int *handled) {
+	*handled = 0;
+	if (!migrate_flag || offset < MIGRATE_MMAP_BASE ||
+			offset >= MIGRATE_MMAP_BASE + MIGRATE_BUFFERS * MIGRATE_MMAP_STRIDE ||
+			fd < 0 || fd >= MAX_FDS || !drm_fds[fd])
+		return NULL;
+	pthread_mutex_lock(&mig_lock);
+	struct mig_buffer *b = mig_lookup(fd, MIGRATE_HANDLE_BASE + (offset - MIGRATE_MMAP_BASE) / MIGRATE_MMAP_STRIDE);
+	struct mig_map *map = NULL;
+	for (int i = 0; b && i < MIGRATE_MAPS && !map; i++)
+		if (!b->maps[i].ptr)
+			map = &b->maps[i];
+	void *ptr = MAP_FAILED;
+	if (map) {
+		ptr = libc_mmap64(addr, length, prot, flags, fd, b->mmap_offset);
+		if (ptr != MAP_FAILED) {
+			map->ptr = ptr;
+			map->length = length;
+			map->prot = prot;
+			map->flags = flags & ~MAP_FIXED;
+			/* Being copied: writes have to wait for the copy like the other mappings' */
+			if (b->migrating && (prot & PROT_WRITE))
+				mprotect(ptr, length, prot & ~PROT_WRITE);
+		}
+	} else {
+		errno = b ? ENOMEM : EINVAL;
+	}
+	pthread_mutex_unlock(&mig_lock);
+	*handled = 1;
+	return ptr;
+}
+
+void migrate_munmap(void *addr) {
+	pthread_mutex_lock(&mig_lock);
+	for (int i = 0; i < MIGRATE_BUFFERS; i++) {
+		for (int j = 0; mig_buffers[i].fd >= 0 && j < MIGRATE_MAPS; j++) {
+			struct mig_map *map = &mig_buffers[i].maps[j];
+			if (map->ptr != addr)
+				continue;
+			if (mig_sampled == map)
+				mig_sampled = NULL;
+			map->ptr = NULL;
+		}
+	}
+	pthread_mutex_unlock(&mig_lock);
+}
+
+void migrate_forget(int fd) {
+	pthread_mutex_lock(&mig_lock);
+	for (int i = 0; i < MIGRATE_BUFFERS; i++) {
+		if (mig_buffers[i].fd != fd)
+			continue;
+		if (mig_sampled_buf == &mig_buffers[i] && mig_sampled)
+			mprotect(mig_sampled->ptr, mig_sampled->length, mig_sampled->prot);
+		if (mig_sampled_buf == &mig_buffers[i])
+			mig_sampled = NULL;
+		mig_buffers[i].fd = -1;
+	}
+	pthread_mutex_unlock(&mig_lock);
+}
+
+/*
+	Dirty tracking (ROTATE_DIRTY=1)
+
+	Most CPU-drawing clients never call DIRTYFB, so without help everything
+	done per flip has to assume the whole frame changed. With ROTATE_DIRTY
+	the shim watches the client's mappings of its dumb buffers and works out
+	which rows were written between flips: the mappings are made read-only
+	and the first write to each page is caught in the SIGSEGV handler. Only
+	the tracked mappings are touched. (Soft-dirty bits can only be cleared
+	for the whole process, which would make every page of it fault again
+	after each flip, and userfaultfd write protection covers neither device
+	mappings nor ARM32.)
+
+	A mapping that was mostly rewritten is left writable for the next
+	DIRTY_FULL_FRAMES flips and reported whole, as faulting on every page
+	would cost more than it saves. The damage of the buffer being flipped to
+	is used to skip cache flushes of unchanged buffers and is sent to
+	control socket subscribers that ask for it (see tiler_shim.h). DIRTYFB
+	clips are added to it. Sub-allocated and migrating buffers are reported
+	whole.
+
+	The handler runs without dirty_lock, so a mapping is published by
+	setting ptr last, and its page set is only freed once no handler can be
+	looking at it (dirty_faulting). The kernel doesn't take write faults on
+	the client's behalf: a read() into a read-only page fails with EFAULT.
+	So read, pread, fread, recv and their scatter variants (readv, preadv,
+	recvmsg, recvmmsg) are hooked while tracking, and the pages they may
+	write are marked and made writable first.
+*/
+
+#define MAX_DIRTY_DUMBS 64
+#define MAX_DIRTY_MAPS 32
+#define DIRTY_FULL_FRAMES 8
+
+struct dirty_dumb {
+	int fd;                 /* -1: free slot */
+	uint32_t handle;
+	uint32_t pitch, height;
+	uint64_t offset;        /* from MAP_DUMB */
+};
+
+struct dirty_map {
+	char *ptr;              /* NULL: free slot, set last */
+	size_t length;
+	int prot;
+	int fd;
+	uint32_t handle;
+	uint32_t pitch, height;
+	uint8_t *pages;         /* one bit per page written since the last flip */
+	int armed;              /* read-only until written */
+	int full_frames;        /* flips left reporting the whole buffer */
+	int clean;              /* nothing written before the last flip */
+	struct tiler_shim_damage damage; /* at the last flip */
+};
+
+long dirty_page_size = 4096;
+struct dirty_dumb dirty_dumbs[MAX_DIRTY_DUMBS];
+struct dirty_map dirty_maps[MAX_DIRTY_MAPS];
+int dirty_num_maps = 0;
+int dirty_faulting = 0;         /* handlers looking at dirty_maps */
+pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void dirty_init(void) {
+	dirty_page_size = sysconf(_SC_PAGESIZE);
+	for (int i = 0; i < MAX_DIRTY_DUMBS; i++)
+		dirty_dumbs[i].fd = -1;
+	fault_handler_install();
+}
+
+void dirty_note_dumb(int fd, uint32_t handle, uint32_t pitch, uint32_t height) {
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; i < MAX_DIRTY_DUMBS; i++) {
+		if (dirty_dumbs[i].fd < 0 || (dirty_dumbs[i].fd == fd && dirty_dumbs[i].handle == handle)) {
+			struct dirty_dumb dumb = { fd, handle, pitch, height, 0 };
+			dirty_dumbs[i] = dumb;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dirty_lock);
+}
+
+void dirty_note_offset(int fd, uint32_t handle, uint64_t offset) {
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; i < MAX_DIRTY_DUMBS; i++)
+		if (dirty_dumbs[i].fd == fd && dirty_dumbs[i].handle == handle)
+			dirty_dumbs[i].offset = offset;
+	pthread_mutex_unlock(&dirty_lock);
+}
+
+void dirty_forget(int fd) {
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; i < MAX_DIRTY_DUMBS; i++)
+		if (dirty_dumbs[i].fd == fd)
+			dirty_dumbs[i].fd = -1;
+	pthread_mutex_unlock(&dirty_lock);
+}
+
+void dirty_forget_dumb(int fd, uint32_t handle) {
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; i < MAX_DIRTY_DUMBS; i++)
+		if (dirty_dumbs[i].fd == fd && dirty_dumbs[i].handle == handle)
+			dirty_dumbs[i].fd = -1;
+	pthread_mutex_unlock(&dirty_lock);
+}
+
+/* Start write tracking, dirty_lock held */
+void dirty_arm(struct dirty_map *map) {
+	memset(map->pages, 0, (map->length / dirty_page_size + 7) / 8);
+	if (map->prot & PROT_WRITE)
+		mprotect(map->ptr, map->length, map->prot & ~PROT_WRITE);
+	map->armed = 1;
+}
+
+/* A mapping of a dumb buffer the client just made */
+void dirty_track(void *ptr, size_t length, int prot, int fd, uint64_t offset) {
+	pthread_mutex_lock(&dirty_lock);
+	struct dirty_dumb *dumb = NULL;
+	for (int i = 0; i < MAX_DIRTY_DUMBS && !dumb; i++)
+		if (dirty_dumbs[i].fd == fd && dirty_dumbs[i].offset == offset && offset != 0)
+			dumb = &dirty_dumbs[i];
+	struct dirty_map *map = NULL;
+	for (int i = 0; dumb && i < MAX_DIRTY_MAPS && !map; i++)
+		if (!dirty_maps[i].ptr)
+			map = &dirty_maps[i];
+	if (map && (map->pages = calloc(1, (length / dirty_page_size + 8) / 8))) {
+		map->length = length;
+		map->prot = prot;
+		map->fd = fd;
+		map->handle = dumb->handle;
+		map->pitch = dumb->pitch;
+		map->height = dumb->height;
+		map->full_frames = 0;
+		map->clean = 0;
+		__atomic_store_n(&map->ptr, (char *)ptr, __ATOMIC_RELEASE);
+		__atomic_fetch_add(&dirty_num_maps, 1, __ATOMIC_RELAXED);
+		dirty_arm(map);
+	}
+	pthread_mutex_unlock(&dirty_lock);
+}
+
+void dirty_untrack(void *ptr) {
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; i < MAX_DIRTY_MAPS; i++) {
+		if (dirty_maps[i].ptr == ptr && ptr) {
+			__atomic_store_n(&dirty_maps[i].ptr, NULL, __ATOMIC_SEQ_CST);
+			__atomic_fetch_sub(&dirty_num_maps, 1, __ATOMIC_RELAXED);
+			/* A handler that found the mapping before it went may still use the page set */
+			while (__atomic_load_n(&dirty_faulting, __ATOMIC_SEQ_CST))
+				sched_yield();
+			free(dirty_maps[i].pages);
+			dirty_maps[i].pages = NULL;
+		}
+	}
+	pthread_mutex_unlock(&dirty_lock);
+}
+
+/* Mark a page written and give write access back, the map known to be tracked */
+int dirty_unprotect_page(struct dirty_map *map, size_t page) {
+	__atomic_fetch_or(&map->pages[page / 8], 1 << (page % 8), __ATOMIC_RELAXED);
+	return mprotect(map->ptr + page * dirty_page_size, dirty_page_size, map->prot) == 0;
+}
+
+/* First write to a page of a read-only tracked mapping; called from the SIGSEGV handler */
+int dirty_fault(char *addr) {
+	int handled = 0;
+	__atomic_fetch_add(&dirty_faulting, 1, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < MAX_DIRTY_MAPS && !handled; i++) {
+		struct dirty_map *map = &dirty_maps[i];
+		char *ptr = __atomic_load_n(&map->ptr, __ATOMIC_ACQUIRE);
+		if (!ptr || addr < ptr || addr >= ptr + map->length || !(map->prot & PROT_WRITE))
+			continue;
+		handled = dirty_unprotect_page(map, (addr - ptr) / dirty_page_size);
+	}
+	__atomic_fetch_sub(&dirty_faulting, 1, __ATOMIC_SEQ_CST);
+	return handled;
+}
+
+/* Before the kernel writes count bytes at buf for the client */
+void dirty_before_write(void *buf, size_t count) {
+	char *start = buf, *end = start + count;
+	if (!__atomic_load_n(&dirty_num_maps, __ATOMIC_RELAXED) || count == 0)
 		return;
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; i < MAX_DIRTY_MAPS; i++) {
+		struct dirty_map *map = &dirty_maps[i];
+		if (!map->ptr || !map->armed || !(map->prot & PROT_WRITE) ||
+				end <= map->ptr || start >= map->ptr + map->length)
+			continue;
+		size_t first = (start > map->ptr ? start - map->ptr : 0) / dirty_page_size;
+		size_t last = ((end < map->ptr + map->length ? end : map->ptr + map->length) - map->ptr - 1) / dirty_page_size;
+		for (size_t page = first; page <= last; page++)
+			dirty_unprotect_page(map, page);
+	}
+	pthread_mutex_unlock(&dirty_lock);
+}
 
-	debug_flag = test_flag("ROTATE_DEBUG");
-	libc_ioctl = dlsym(RTLD_NEXT, "ioctl");
+ssize_t shim_pread(int fd, void *buf, size_t count, off_t offset) {
+	dirty_before_write(buf, count);
+	return libc_pread(fd, buf, count, offset);
+}
 
-	init_done = 1;
+ssize_t shim_pread64(int fd, void *buf, size_t count, int64_t offset) {
+	dirty_before_write(buf, count);
+	return libc_pread64(fd, buf, count, offset);
 }
 
-int get_rotation_property_key(int fd, int plane) {
-#define MAX_PROPS 64
-	uint32_t properties[MAX_PROPS];
-	uint64_t prop_values[MAX_PROPS];
-	struct drm_mode_obj_get_properties get_props;
-	get_props.props_ptr = (uint64_t)&properties;
-	get_props.prop_values_ptr = (uint64_t)&prop_values;
-	get_props.count_props = MAX_PROPS;
-	get_props.obj_id = plane;
-	get_props.obj_type = DRM_MODE_OBJECT_PLANE;
-	int ret = libc_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, (char *)&get_props);
-	if (ret != 0) {
-		printf("get_rotation_property_key DRM_IOCTL_MODE_OBJ_GETPROPERTIES failed: %d\n", ret);
-		return ret;
+size_t shim_fread(void *ptr, size_t size, size_t n, FILE *stream) {
+	if (n > 0 && size <= SIZE_MAX / n)
+		dirty_before_write(ptr, size * n);
+	return libc_fread(ptr, size, n, stream);
+}
+
+ssize_t shim_recv(int fd, void *buf, size_t len, int flags) {
+	dirty_before_write(buf, len);
+	return libc_recv(fd, buf, len, flags);
+}
+
+ssize_t shim_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen) {
+	dirty_before_write(buf, len);
+	return libc_recvfrom(fd, buf, len, flags, addr, addrlen);
+}
+
+void dirty_before_write_iov(const struct iovec *iov, size_t iovcnt) {
+	for (size_t i = 0; iov && i < iovcnt; i++)
+		dirty_before_write(iov[i].iov_base, iov[i].iov_len);
+}
+
+ssize_t shim_readv(int fd, const struct iovec *iov, int iovcnt) {
+	if (iovcnt > 0)
+		dirty_before_write_iov(iov, iovcnt);
+	return libc_readv(fd, iov, iovcnt);
+}
+
+ssize_t shim_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+	if (iovcnt > 0)
+		dirty_before_write_iov(iov, iovcnt);
+	return libc_preadv(fd, iov, iovcnt, offset);
+}
+
+ssize_t shim_preadv64(int fd, const struct iovec *iov, int iovcnt, int64_t offset) {
+	if (iovcnt > 0)
+		dirty_before_write_iov(iov, iovcnt);
+	return libc_preadv64(fd, iov, iovcnt, offset);
+}
+
+/* Ancillary data too: SCM_RIGHTS lands in msg_control */
+ssize_t shim_recvmsg(int fd, struct msghdr *msg, int flags) {
+	if (msg) {
+		dirty_before_write_iov(msg->msg_iov, msg->msg_iovlen);
+		dirty_before_write(msg->msg_control, msg->msg_controllen);
+	}
+	return libc_recvmsg(fd, msg, flags);
+}
+
+int shim_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags, struct timespec *timeout) {
+	for (unsigned int i = 0; msgs && i < vlen; i++) {
+		dirty_before_write_iov(msgs[i].msg_hdr.msg_iov, msgs[i].msg_hdr.msg_iovlen);
+		dirty_before_write(msgs[i].msg_hdr.msg_control, msgs[i].msg_hdr.msg_controllen);
+	}
+	return libc_recvmmsg(fd, msgs, vlen, flags, timeout);
+}
+
+/* Turn a page set into at most TILER_SHIM_DAMAGE_RANGES row ranges, merging the closest */
+void dirty_rows(struct dirty_map *map, struct tiler_shim_damage *damage) {
+	size_t pages = map->length / dirty_page_size;
+	uint32_t n = 0, last_row = 0;
+	memset(damage, 0, sizeof(*damage));
+	for (size_t p = 0; p < pages; p++) {
+		if (!(map->pages[p / 8] & (1 << (p % 8))))
+			continue;
+		uint32_t y = (uint64_t)p * dirty_page_size / map->pitch;
+		uint32_t end = ((uint64_t)(p + 1) * dirty_page_size + map->pitch - 1) / map->pitch;
+		if (y >= map->height)
+			break;
+		if (end > map->height)
+			end = map->height;
+		if (n > 0 && y <= last_row) {
+			damage->ranges[n - 1].height = end - damage->ranges[n - 1].y;
+		} else {
+			if (n == TILER_SHIM_DAMAGE_RANGES) {
+				/* Merge the two ranges with the smallest gap between them */
+				int best = 0;
+				uint32_t best_gap = UINT32_MAX;
+				for (int r = 0; r + 1 < n; r++) {
+					uint32_t gap = damage->ranges[r + 1].y - (damage->ranges[r].y + damage->ranges[r].height);
+					if (gap < best_gap) {
+						best_gap = gap;
+						best = r;
+					}
+				}
+				damage->ranges[best].height = damage->ranges[best + 1].y + damage->ranges[best + 1].height - damage->ranges[best].y;
+				memmove(&damage->ranges[best + 1], &damage->ranges[best + 2], (n - best - 2) * sizeof(damage->ranges[0]));
+				n--;
+			}
+			damage->ranges[n].y = y;
+			damage->ranges[n].height = end - y;
+			n++;
+		}
+		last_row = end;
 	}
+	damage->num_ranges = n;
+}
 
-	for (int i = 0; i < get_props.count_props; i++) {
+/*
+	The client is about to show fb_id: work out what changed in its buffer
+	since it was last shown and start watching it again
+*/
+void dirty_collect_fb(uint32_t fb_id) {
+	pthread_mutex_lock(&fb_lock);
+	struct fb_info *fb = fb_lookup(fb_id);
+	int fd = fb ? fb->fd : -1;
+	uint32_t handle = fb ? fb->handle : 0;
+	pthread_mutex_unlock(&fb_lock);
+	if (!handle)
+		return;
 
-		uint64_t values[MAX_PROPS];
-		uint64_t enum_blob[MAX_PROPS];
-		struct drm_mode_get_property get_prop;
-		get_prop.values_ptr = (uint64_t)&values;
-		get_prop.enum_blob_ptr = (uint64_t)&enum_blob;
-		get_prop.count_values = MAX_PROPS;
-		get_prop.count_enum_blobs = MAX_PROPS;
-		get_prop.prop_id = properties[i];
-		get_prop.flags = 0;
-		ret = libc_ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, (char *)&get_prop);
-		if (ret != 0) {
-			printf("get_rotation_property_key DRM_IOCTL_MODE_GETPROPERTY failed: %d\n", ret);
-			return ret;
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; i < MAX_DIRTY_MAPS; i++) {
+		struct dirty_map *map = &dirty_maps[i];
+		if (!map->ptr || map->fd != fd || map->handle != handle)
+			continue;
+		if (!map->armed) {
+			map->damage.num_ranges = 0;
+			map->damage.flags = TILER_SHIM_DAMAGE_FULL;
+			map->clean = 0;
+			if (--map->full_frames <= 0)
+				dirty_arm(map);
+			continue;
 		}
-		if (strcmp(get_prop.name, "rotation") == 0) {
-			return properties[i];
+		dirty_rows(map, &map->damage);
+		uint32_t rows = 0;
+		for (int r = 0; r < map->damage.num_ranges; r++)
+			rows += map->damage.ranges[r].height;
+		map->clean = rows == 0;
+		if (rows > map->height / 2) {
+			/* Mostly redrawn: stop faulting on it for a while */
+			map->armed = 0;
+			map->full_frames = DIRTY_FULL_FRAMES;
+			mprotect(map->ptr, map->length, map->prot);
+		} else {
+			dirty_arm(map);
 		}
+		if (debug_flag)
+			printf("dirty: fb %u %u rows in %u ranges\n", fb_id, rows, map->damage.num_ranges);
 	}
+	pthread_mutex_unlock(&dirty_lock);
+}
 
-	printf("get_rotation_property_key: no rotation\n");
-	return -1;
+/* Damage from DIRTYFB clips, which the client knows better than we do */
+void dirty_add_clips(struct drm_mode_fb_dirty_cmd *dirty) {
+	pthread_mutex_lock(&fb_lock);
+	struct fb_info *fb = fb_lookup(dirty->fb_id);
+	int fd = fb ? fb->fd : -1;
+	uint32_t handle = fb ? fb->handle : 0;
+	pthread_mutex_unlock(&fb_lock);
+	struct drm_clip_rect *clips = (struct drm_clip_rect *)dirty->clips_ptr;
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; handle && i < MAX_DIRTY_MAPS; i++) {
+		struct dirty_map *map = &dirty_maps[i];
+		if (!map->ptr || map->fd != fd || map->handle != handle || !map->armed)
+			continue;
+		for (int c = 0; c < dirty->num_clips && clips; c++) {
+			size_t first = (size_t)clips[c].y1 * map->pitch / dirty_page_size;
+			size_t last = ((size_t)clips[c].y2 * map->pitch + dirty_page_size - 1) / dirty_page_size;
+			for (size_t p = first; p < last && p < map->length / dirty_page_size; p++)
+				map->pages[p / 8] |= 1 << (p % 8);
+		}
+	}
+	pthread_mutex_unlock(&dirty_lock);
 }
 
-int ioctl(int fd, unsigned long request, char *argp) {
+/* Damage of fb_id at its last flip. Returns 0 if unknown, which means all of it */
+int dirty_fb_damage(uint32_t fb_id, struct tiler_shim_damage *damage) {
+	pthread_mutex_lock(&fb_lock);
+	struct fb_info *fb = fb_lookup(fb_id);
+	int fd = fb ? fb->fd : -1;
+	uint32_t handle = fb ? fb->handle : 0;
+	pthread_mutex_unlock(&fb_lock);
+	int found = 0;
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; handle && i < MAX_DIRTY_MAPS && !found; i++) {
+		if (dirty_maps[i].ptr && dirty_maps[i].fd == fd && dirty_maps[i].handle == handle) {
+			*damage = dirty_maps[i].damage;
+			found = !(damage->flags & TILER_SHIM_DAMAGE_FULL);
+		}
+	}
+	pthread_mutex_unlock(&dirty_lock);
+	return found;
+}
+
+/* Whether nothing was written to the buffer behind handle before its last flip */
+int dirty_handle_clean(int fd, uint32_t handle) {
+	int clean = 0;
+	pthread_mutex_lock(&dirty_lock);
+	for (int i = 0; i < MAX_DIRTY_MAPS; i++)
+		if (dirty_maps[i].ptr && dirty_maps[i].fd == fd && dirty_maps[i].handle == handle)
+			clean = dirty_maps[i].clean;
+	pthread_mutex_unlock(&dirty_lock);
+	return clean;
+}
+
+/* Collect the damage of every framebuffer a scanout request is about to show */
+void dirty_collect_request(int fd, unsigned long request, char *argp) {
+	if (request == DRM_IOCTL_MODE_SETCRTC) {
+		dirty_collect_fb(((struct drm_mode_crtc *)argp)->fb_id);
+	} else if (request == DRM_IOCTL_MODE_PAGE_FLIP) {
+		dirty_collect_fb(((struct drm_mode_crtc_page_flip *)argp)->fb_id);
+	} else if (request == DRM_IOCTL_MODE_SETPLANE) {
+		dirty_collect_fb(((struct drm_mode_set_plane *)argp)->fb_id);
+	} else if (request == DRM_IOCTL_MODE_DIRTYFB) {
+		dirty_add_clips((struct drm_mode_fb_dirty_cmd *)argp);
+	} else if (request == DRM_IOCTL_MODE_ATOMIC) {
+		struct drm_mode_atomic *atomic = (struct drm_mode_atomic *)argp;
+		uint32_t *objs = (uint32_t *)atomic->objs_ptr;
+		uint32_t *count_props = (uint32_t *)atomic->count_props_ptr;
+		uint32_t *props = (uint32_t *)atomic->props_ptr;
+		uint64_t *values = (uint64_t *)atomic->prop_values_ptr;
+		int k = 0;
+		if (atomic->flags & DRM_MODE_ATOMIC_TEST_ONLY)
+			return;
+		for (int i = 0; i < atomic->count_objs; k += count_props[i], i++) {
+			struct plane_info *plane = plane_lookup(fd, objs[i]);
+			for (int j = 0; plane && j < count_props[i]; j++)
+				if (props[k + j] == plane->fb_id_prop && values[k + j] != 0)
+					dirty_collect_fb(values[k + j]);
+		}
+	}
+}
+
+/*
+	mmap hooks for sub-allocated, migrating and dirty-tracked buffers
+*/
+
+void *shim_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	int handled;
+	void *ptr = suballoc_mmap(addr, length, prot, flags, fd, (uint64_t)offset, &handled);
+	if (!handled)
+		ptr = migrate_mmap(addr, length, prot, flags, fd, (uint64_t)offset, &handled);
+	if (handled)
+		return ptr;
+	ptr = libc_mmap(addr, length, prot, flags, fd, offset);
+	if (dirty_flag && ptr != MAP_FAILED && fd >= 0 && fd < MAX_FDS && drm_fds[fd])
+		dirty_track(ptr, length, prot, fd, (uint64_t)offset);
+	return ptr;
+}
+
+void *shim_mmap64(void *addr, size_t length, int prot, int flags, int fd, int64_t offset) {
+	int handled;
+	void *ptr = suballoc_mmap(addr, length, prot, flags, fd, (uint64_t)offset, &handled);
+	if (!handled)
+		ptr = migrate_mmap(addr, length, prot, flags, fd, (uint64_t)offset, &handled);
+	if (handled)
+		return ptr;
+	ptr = libc_mmap64(addr, length, prot, flags, fd, offset);
+	if (dirty_flag && ptr != MAP_FAILED && fd >= 0 && fd < MAX_FDS && drm_fds[fd])
+		dirty_track(ptr, length, prot, fd, (uint64_t)offset);
+	return ptr;
+}
+
+int shim_munmap(void *addr, size_t length) {
+	if (suballoc_flag) {
+		pthread_mutex_lock(&sub_lock);
+		for (int i = 0; i < SUBALLOC_MAPPINGS; i++) {
+			if (sub_mappings[i].ptr == addr && addr) {
+				addr = sub_mappings[i].base;
+				length = sub_mappings[i].size;
+				sub_mappings[i].ptr = NULL;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&sub_lock);
+	}
+	if (migrate_flag)
+		migrate_munmap(addr);
+	if (dirty_flag)
+		dirty_untrack(addr);
+	return libc_munmap(addr, length);
+}
+
+/*
+	Autotuner (ROTATE_AUTOTUNE=1)
+
+	Whether write-combined or cached buffers are faster, and how wide the
+	TILER container needs to be, depends on the SoC and on how the client
+	writes. On the first allocation, time each candidate with row-wise and
+	block-wise writes (cached ones including the CPU_PREP/CPU_FINI they
+	need), use the fastest and store the result in ROTATE_AUTOTUNE_CACHE
+	(default /var/tmp/tiler_shim_tune-<major>-<minor>) so later runs on the
+	same device skip the measurement.
+*/
+
+#define TUNE_ROWS 256
+#define TUNE_REPEAT 3
+#define TUNE_BLOCK 32
+
+int autotune_done = 0;
+uint32_t tune_width = TILER_BO_WIDTH;
+uint32_t tune_cache = OMAP_BO_WC;
+
+const uint32_t tune_widths[] = { TILER_BO_WIDTH, 4096, 2048 };
+const uint32_t tune_caches[] = { OMAP_BO_WC, OMAP_BO_CACHED };
+
+const char *tune_cache_name(uint32_t cache) {
+	return cache == OMAP_BO_CACHED ? "cached" : "wc";
+}
+
+void tune_cache_path(int fd, char *path, size_t len) {
+	struct stat st;
+	const char *base = get_option("ROTATE_AUTOTUNE_CACHE", NULL);
+	if (base)
+		snprintf(path, len, "%s", base);
+	else if (fstat(fd, &st) == 0)
+		snprintf(path, len, "/var/tmp/tiler_shim_tune-%u-%u", major(st.st_rdev), minor(st.st_rdev));
+	else
+		snprintf(path, len, "/var/tmp/tiler_shim_tune");
+}
+
+int tune_load(const char *path, uint32_t need_width) {
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+	char line[128], name[16];
+	uint32_t width = 0, cache = OMAP_BO_WC;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "width %u", &width) == 1)
+			continue;
+		if (sscanf(line, "cache %15s", name) == 1)
+			cache = strcmp(name, "cached") == 0 ? OMAP_BO_CACHED : OMAP_BO_WC;
+	}
+	fclose(f);
+	if (width < need_width || width > TILER_BO_WIDTH)
+		return -1;
+	tune_width = width;
+	tune_cache = cache;
+	return 0;
+}
+
+/* Time one write pass over the first TUNE_ROWS rows, in ns */
+uint64_t tune_write(int fd, struct tiler_bo *bo, uint8_t *map, uint32_t width, int blocks) {
+	uint32_t bytes = bo->bpp / 8;
+	int cached = (bo->flags & OMAP_BO_CACHE_MASK) == OMAP_BO_CACHED;
+	uint64_t start = monotonic_ns();
+	if (cached) {
+		struct drm_omap_gem_cpu_prep prep = { bo->handle, OMAP_GEM_WRITE };
+		libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_CPU_PREP, (char *)&prep);
+	}
+	if (!blocks) {
+		for (uint32_t y = 0; y < TUNE_ROWS; y++)
+			memset(map + (uint64_t)y * bo->pitch, y, width * bytes);
+	} else {
+		/* Column of blocks at a time, the way a rotating CPU copy writes */
+		for (uint32_t bx = 0; bx < width; bx += TUNE_BLOCK)
+			for (uint32_t y = 0; y < TUNE_ROWS; y++)
+				memset(map + (uint64_t)y * bo->pitch + bx * bytes, bx, TUNE_BLOCK * bytes);
+	}
+	if (cached) {
+		struct drm_omap_gem_cpu_fini fini;
+		memset(&fini, 0, sizeof(fini));
+		fini.handle = bo->handle;
+		fini.op = OMAP_GEM_WRITE;
+		libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_CPU_FINI, (char *)&fini);
+	}
+	return monotonic_ns() - start;
+}
+
+/* Best of TUNE_REPEAT for rows and blocks, 0 if the candidate can't be allocated */
+int tune_measure(int fd, uint32_t width, uint32_t cache, uint32_t need_width, uint32_t bpp, uint64_t *rows, uint64_t *blocks) {
+	struct tiler_bo bo;
+	if (tiler_bo_new_width(fd, width, TUNE_ROWS, bpp, cache, &bo) != 0)
+		return -1;
+	struct drm_omap_gem_info info;
+	memset(&info, 0, sizeof(info));
+	info.handle = bo.handle;
+	void *map = MAP_FAILED;
+	if (libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_INFO, (char *)&info) == 0)
+		map = mmap(NULL, bo.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, info.offset);
+	if (map == MAP_FAILED) {
+		tiler_bo_free(fd, &bo);
+		return -1;
+	}
+	*rows = *blocks = UINT64_MAX;
+	for (int i = 0; i < TUNE_REPEAT; i++) {
+		uint64_t t = tune_write(fd, &bo, map, need_width, 0);
+		if (t < *rows)
+			*rows = t;
+		t = tune_write(fd, &bo, map, need_width, 1);
+		if (t < *blocks)
+			*blocks = t;
+	}
+	munmap(map, bo.size);
+	tiler_bo_free(fd, &bo);
+	return 0;
+}
+
+void autotune_run(int fd, uint32_t need_width, uint32_t bpp) {
+	char path[256];
+	autotune_done = 1;
+	tune_cache_path(fd, path, sizeof(path));
+	if (tune_load(path, need_width) == 0) {
+		printf("autotune: using %s: width %u %s\n", path, tune_width, tune_cache_name(tune_cache));
+		return;
+	}
+
+	char report[1024];
+	int len = 0;
+	uint64_t best = UINT64_MAX;
+	for (int w = 0; w < sizeof(tune_widths) / sizeof(tune_widths[0]); w++) {
+		if (tune_widths[w] < need_width)
+			continue;
+		for (int c = 0; c < sizeof(tune_caches) / sizeof(tune_caches[0]); c++) {
+			uint64_t rows, blocks;
+			if (tune_measure(fd, tune_widths[w], tune_caches[c], need_width, bpp, &rows, &blocks) != 0) {
+				printf("autotune: width %u %s: allocation failed\n", tune_widths[w], tune_cache_name(tune_caches[c]));
+				continue;
+			}
+			printf("autotune: width %u %s: rows %llu us, blocks %llu us\n", tune_widths[w],
+				tune_cache_name(tune_caches[c]), (unsigned long long)rows / 1000, (unsigned long long)blocks / 1000);
+			if (len < sizeof(report))
+				len += snprintf(report + len, sizeof(report) - len, "# width %u %s rows %llu us blocks %llu us\n",
+					tune_widths[w], tune_cache_name(tune_caches[c]), (unsigned long long)rows / 1000,
+					(unsigned long long)blocks / 1000);
+			/*
+				Ties go to the earlier candidate, i.e. the wider container and
+				write-combining that the shim used before
+			*/
+			if (rows + blocks < best) {
+				best = rows + blocks;
+				tune_width = tune_widths[w];
+				tune_cache = tune_caches[c];
+			}
+		}
+	}
+	if (best == UINT64_MAX)
+		return;
+	printf("autotune: chose width %u %s\n", tune_width, tune_cache_name(tune_cache));
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		printf("autotune: cannot write %s: %d\n", path, errno);
+		return;
+	}
+	fprintf(f, "# tiler_shim autotune, %ux%u %ubpp writes\n%s", need_width, TUNE_ROWS, bpp, report);
+	fprintf(f, "width %u\ncache %s\n", tune_width, tune_cache_name(tune_cache));
+	fclose(f);
+}
+
+/*
+	Cached buffers have to be flushed before the display reads them. Called
+	with the fb about to be shown.
+*/
+void tune_flush_fb(int fd, uint32_t fb_id) {
+	if (tune_cache != OMAP_BO_CACHED)
+		return;
+	pthread_mutex_lock(&fb_lock);
+	struct fb_info *fb = fb_lookup(fb_id);
+	uint32_t handle = fb ? fb->handle : 0;
+	pthread_mutex_unlock(&fb_lock);
+	/* Nothing was drawn since the last flush */
+	if (!handle || (dirty_flag && dirty_handle_clean(fd, handle)))
+		return;
+	struct drm_omap_gem_cpu_fini fini;
+	memset(&fini, 0, sizeof(fini));
+	fini.handle = handle;
+	fini.op = OMAP_GEM_WRITE;
+	libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_CPU_FINI, (char *)&fini);
+}
+
+void tune_flush_atomic(int fd, struct drm_mode_atomic *atomic) {
+	if (tune_cache != OMAP_BO_CACHED)
+		return;
+	uint32_t *objs = (uint32_t *)atomic->objs_ptr;
+	uint32_t *count_props = (uint32_t *)atomic->count_props_ptr;
+	uint32_t *props = (uint32_t *)atomic->props_ptr;
+	uint64_t *values = (uint64_t *)atomic->prop_values_ptr;
+	int k = 0;
+	for (int i = 0; i < atomic->count_objs; k += count_props[i], i++) {
+		struct plane_info *plane = plane_lookup(fd, objs[i]);
+		if (!plane)
+			continue;
+		for (int j = 0; j < count_props[i]; j++)
+			if (props[k + j] == plane->fb_id_prop && values[k + j] != 0)
+				tune_flush_fb(fd, values[k + j]);
+	}
+}
+
+/*
+	Per-fd state has to be dropped when the fd number is reused. Only fds
+	that have been looked up as a device or given a lease have any, so
+	closing everything else costs a couple of loads.
+*/
+int close(int fd) {
+	init();
+	if (fd >= 0 && fd < MAX_FDS && (__atomic_load_n(&fd_devices[fd], __ATOMIC_ACQUIRE) ||
+			__atomic_load_n(&fd_leases[fd], __ATOMIC_ACQUIRE))) {
+		fd_forget(fd);
+		if (suballoc_flag)
+			suballoc_forget(fd);
+		if (migrate_flag)
+			migrate_forget(fd);
+		if (dirty_flag)
+			dirty_forget(fd);
+	}
+	if (sim_flag)
+		tiler_sim_close(fd);
+	return libc_close(fd);
+}
+
+#define SCHEMA_MAX_COUNT 65536 /* elements in any one array of an argument */
+
+int shim_ioctl(int fd, unsigned long request, char *argp) {
+	int handled = 0, handled_result = 0, translated = 0, mig_translated = 0;
+	struct sub_saved sub_saved;
+	struct mig_saved mig_saved;
 	init();
 	if (((request >> (_IOC_TYPESHIFT)) & _IOC_TYPEMASK) == 'd') {
 		if (debug_flag && request != 1075602496)
 			printf("ioctl %d [%02x] %lu\n", fd, (request >> _IOC_NRSHIFT) & _IOC_NRMASK, request);
+		struct device_state *dev = fd_device(fd);
+		if (!dev || !dev->intercept)
+			return libc_ioctl(fd, request, argp);
+		drm_fds[fd] = 1;
+		/* Anything the decoders below would walk off the end of is the kernel's to refuse */
+		if (tiler_schema_check(request, argp, NULL, SCHEMA_MAX_COUNT) != 0)
+			return libc_ioctl(fd, request, argp);
+		if (request_needs_probe(request))
+			device_wait_probe(dev);
+
+		if (request == DRM_IOCTL_WAIT_VBLANK && vblank_model_flag) {
+			union drm_wait_vblank *vbl = (union drm_wait_vblank *)argp;
+			if (vblank_answer_query(vbl) == 0)
+				return 0;
+			int result = libc_ioctl(fd, request, argp);
+			if (result == 0)
+				vblank_sample(vblank_pipe(vbl->request.type), vbl->reply.sequence,
+					(uint64_t)vbl->reply.tval_sec * 1000000000ULL + (uint64_t)vbl->reply.tval_usec * 1000ULL);
+			return result;
+		}
 
 		if (request == DRM_IOCTL_MODE_ADDFB) {
 			struct drm_mode_fb_cmd *cmd = (struct drm_mode_fb_cmd *)argp;
 			printf("addfb [%d] %dx%d %d %d %d %d\n", cmd->fb_id, cmd->width, cmd->height, cmd->pitch, cmd->bpp, cmd->depth, cmd->handle);
 		}
 
+		if (suballoc_flag && suballoc_ioctl(fd, request, argp, &handled_result)) {
+			if (request == DRM_IOCTL_MODE_CREATE_DUMB || request == DRM_IOCTL_MODE_MAP_DUMB || handled_result != 0)
+				return handled_result;
+			/* Fall through to the fb and buffer tracking below */
+			handled = 1;
+		} else if (migrate_flag && migrate_ioctl(fd, request, argp, &handled_result)) {
+			return handled_result;
+		} else {
+			if (migrate_flag)
+				mig_translated = migrate_translate(fd, request, argp, &mig_saved);
+			if (suballoc_flag)
+				translated = suballoc_translate(fd, request, argp, &sub_saved);
+		}
+
+		if (dirty_flag)
+			dirty_collect_request(fd, request, argp);
+
 		if (request == DRM_IOCTL_MODE_CREATE_DUMB) {
 			/*
 				Intercept DRM_IOCTL_MODE_CREATE_DUMB and instead call the device-specific
 				DRM_IOCTL_OMAP_GEM_NEW ioctl, with arguments set up for a TILER-compatible buffer
-				and a fixed width of 8192 (which seems to be required afaics)
+				and a fixed width of 8192 (which seems to be required afaics), or
+				the width and cache mode picked by the autotuner
 			*/
 			struct drm_mode_create_dumb *orig = (struct drm_mode_create_dumb *)argp;
-			struct drm_omap_gem_new gem_new;
+			struct tiler_bo bo;
 
 			printf("intercept create_dumb %ux%ux%u\n", orig->width, orig->height, orig->bpp);
-			
-			int sixteen_bpp = 0;
-			if (orig->bpp == 32) {
-				sixteen_bpp = 0;
-			} else if (orig->bpp == 16) {
-				sixteen_bpp = 1;
-			} else {
+			if (orig->bpp != 32 && orig->bpp != 16)
 				printf("unsupported bpp %d!\n", orig->bpp);
-			}
+			uint32_t bpp = (orig->bpp == 16) ? 16 : 32;
 
-			int fixed_width = 8192;
-			gem_new.size.tiled.width = fixed_width;
-			gem_new.size.tiled.height = orig->height;
-			gem_new.flags = (sixteen_bpp ? OMAP_BO_TILED_16 : OMAP_BO_TILED_32) | OMAP_BO_WC | OMAP_BO_SCANOUT;
-			int result = libc_ioctl(fd, DRM_IOCTL_OMAP_GEM_NEW, (char *) &gem_new);
-			orig->handle = gem_new.handle;
-			orig->pitch = sixteen_bpp ? (2 * fixed_width) : (4 * fixed_width);
-			orig->size = orig->pitch * orig->height;
-			printf("   created tiled buffer with handle %u\n", orig->handle);
-			/*
-				After creating the buffer, set the rotation property on all planes
-				This seems to need the atomic API, and so is a bit intricate,
-				first needing to set the atomic capability
-			*/
+			if (autotune_flag && !autotune_done)
+				autotune_run(fd, orig->width, bpp);
 
-			struct drm_set_client_cap atomic_cap;
-			atomic_cap.capability = DRM_CLIENT_CAP_ATOMIC;
-			atomic_cap.value = 1;
-			libc_ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, (char *) &atomic_cap);
-
-			uint32_t planes[16];
-			struct drm_mode_get_plane_res plane_res;
-			plane_res.count_planes = 16;
-			plane_res.plane_id_ptr = (uint64_t)planes;
-			libc_ioctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, (char *) &plane_res);
-			printf("   found %d plane resources\n", plane_res.count_planes);
-			for (int i = 0; i < plane_res.count_planes; i++) {
-				int plane_id = planes[i];
-				printf("        setting rotation for plane %d\n", plane_id);
-				struct drm_mode_atomic mode_atomic;
-				uint32_t obj[1];
-				uint32_t num_props[1];
-				uint32_t props[1];
-				uint64_t values[1];
-				obj[0] = plane_id;
-				num_props[0] = 1;
-				int rot_prop = get_rotation_property_key(fd, plane_id);
-				if (rot_prop < 0)
-					continue;
-				printf("rotate prop for plane %d: %d\n", plane_id, rot_prop);
-				props[0] = rot_prop;
-				values[0] = DRM_MODE_ROTATE_270;
-
-				mode_atomic.flags = DRM_MODE_ATOMIC_NONBLOCK;
-				mode_atomic.count_objs = 1;
-				mode_atomic.objs_ptr = (uint64_t)obj;
-				mode_atomic.count_props_ptr = (uint64_t)num_props;
-				mode_atomic.props_ptr = (uint64_t)props;
-				mode_atomic.prop_values_ptr = (uint64_t)values;
-				mode_atomic.reserved = 0;
-				mode_atomic.user_data = 0;
-				int a_result = libc_ioctl(fd, DRM_IOCTL_MODE_ATOMIC, (char *) &mode_atomic);
-				if (a_result != 0)
-					printf("rotate set for plane %d failed: %d %d\n", plane_id, a_result, errno);
+			int result = 0;
+			uint32_t width = 0;
+			if (pagemode_flag && tiler_bo_new_linear(fd, orig->width, orig->height, bpp, tune_cache, &bo) == 0) {
+				/* Nothing is rotated, so let the DMM map it from scattered pages */
+				printf("   created page-mode buffer\n");
+			} else if (getenv("ROTATE_BROKER") && tiler_bo_borrow(fd, getenv("ROTATE_BROKER"), orig->height, bpp, &bo) == 0) {
+				printf("   borrowed tiled buffer from broker\n");
+			} else {
+				width = orig->width <= tune_width ? tune_width : TILER_BO_WIDTH;
+				result = tiler_bo_new_width(fd, width, orig->height, bpp, tune_cache, &bo);
+				if (result != 0) {
+					printf("   tiled allocation failed: %d\n", result);
+					errno = -result;
+					return -1;
+				}
 			}
+			orig->handle = bo.handle;
+			orig->pitch = bo.pitch;
+			orig->size = (uint64_t)orig->pitch * orig->height;
+			printf("   created buffer with handle %u\n", orig->handle);
+			/* Only buffers allocated here can be moved to another backing */
+			if (migrate_flag && width != 0)
+				migrate_adopt(fd, orig, &bo, width);
+			if (dirty_flag)
+				dirty_note_dumb(fd, orig->handle, orig->pitch, orig->height);
+			/*
+				Don't commit the rotation yet: hold it back and apply it together
+				with the client's first modeset, see fold_rotation_into_setcrtc()
+			*/
+			struct lease_state *lease = fd_lease(fd);
+			if (lease && shim_rotation != DRM_MODE_ROTATE_0)
+				lease->rotation_pending = 1;
 
 			return result;
 		}
 
+		if (tune_cache == OMAP_BO_CACHED) {
+			/* Flush the CPU cache for buffers about to be scanned out */
+			if (request == DRM_IOCTL_MODE_SETCRTC)
+				tune_flush_fb(fd, ((struct drm_mode_crtc *)argp)->fb_id);
+			else if (request == DRM_IOCTL_MODE_PAGE_FLIP)
+				tune_flush_fb(fd, ((struct drm_mode_crtc_page_flip *)argp)->fb_id);
+			else if (request == DRM_IOCTL_MODE_SETPLANE)
+				tune_flush_fb(fd, ((struct drm_mode_set_plane *)argp)->fb_id);
+			else if (request == DRM_IOCTL_MODE_ATOMIC && !(((struct drm_mode_atomic *)argp)->flags & DRM_MODE_ATOMIC_TEST_ONLY))
+				tune_flush_atomic(fd, (struct drm_mode_atomic *)argp);
+		}
+
 		if (request == DRM_IOCTL_MODE_SETCRTC) {
 			/*
 				Intercept DRM_IOCTL_MODE_SETCRTC to swap width and height
 			*/
 			struct drm_mode_crtc *crtc = (struct drm_mode_crtc *) argp;
+			struct lease_state *lease = fd_lease(fd);
 			printf("mode_setcrtc: %dx%d %d %d\n", crtc->mode.hdisplay, crtc->mode.vdisplay, crtc->mode.htotal, crtc->mode.vtotal);
-			int temp = crtc->mode.hdisplay;
-			crtc->mode.hdisplay = crtc->mode.vdisplay;
-			crtc->mode.vdisplay = temp;
+			if (lease_allows(lease, crtc->crtc_id)) {
+				tiler_rotate_mode(shim_rotation, &crtc->mode);
+				if (lease && lease->rotation_pending) {
+					if (fold_rotation_into_setcrtc(fd, lease, crtc) == 0)
+						handled = 1;
+					else
+						apply_plane_rotation(fd, lease);
+				}
+			}
 		}
 
-	}
-	int result = libc_ioctl(fd, request, argp);
+		if (request == DRM_IOCTL_MODE_ATOMIC) {
+			struct drm_mode_atomic *atomic = (struct drm_mode_atomic *)argp;
+			struct lease_state *lease = fd_lease(fd);
+			if (lease && lease->rotation_pending && (atomic->flags & DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+				handled_result = fold_rotation_into_atomic(fd, lease, atomic);
+				/* If the combined commit fails, forward the client's own one as-is */
+				handled = (handled_result == 0 || (atomic->flags & DRM_MODE_ATOMIC_TEST_ONLY));
+				if (handled_result == -2)
+					handled = 0;
+			}
+		}
+
+		if (request == DRM_IOCTL_MODE_GETPLANE) {
+			handled_result = steer_plane_formats(fd, (struct drm_mode_get_plane *)argp);
+			handled = 1;
+		}
+
+		if (request == DRM_IOCTL_MODE_PAGE_FLIP || request == DRM_IOCTL_MODE_SETPLANE || request == DRM_IOCTL_MODE_ATOMIC) {
+			/*
+				The client is showing something without having done a modeset
+				we could fold the rotation into, so commit it separately now
+			*/
+			struct lease_state *lease = fd_lease(fd);
+			if (!handled && lease && lease->rotation_pending)
+				apply_plane_rotation(fd, lease);
+			if (!handled && limit_fps)
+				limit_before_flip(fd, request, argp);
+			if (!handled && async_flag)
+				handled = async_flip(fd, request, argp, &handled_result);
+		}
 
-	if (request == DRM_IOCTL_MODE_GETPROPERTY) {
-		struct drm_mode_get_property *prop = (struct drm_mode_get_property *) argp;
-		printf("get_property %s\n", prop->name);
 	}
+	int result = handled ? handled_result : libc_ioctl(fd, request, argp);
 
-	if (request == DRM_IOCTL_MODE_OBJ_GETPROPERTIES) {
-		/*
-			For debugging only
-		*/
-		struct drm_mode_obj_get_properties *prop = (struct drm_mode_obj_get_properties *) argp;
-		printf("mode_obj_get_property: [%d %llu %llu]\n", prop->count_props, prop->props_ptr, prop->prop_values_ptr);
-		uint32_t *props = (uint32_t *)prop->props_ptr;
-		uint64_t *values = (uint64_t *)prop->prop_values_ptr;
-		if (props != NULL && values != NULL) {
-			for (int i = 0; i < prop->count_props; i++) {
-				printf("       %u: %llu\n", props[i], values[i]);
-			}
+	if (result == 0 && request == DRM_IOCTL_MODE_ADDFB) {
+		struct drm_mode_fb_cmd *cmd = (struct drm_mode_fb_cmd *)argp;
+		fb_track_add(fd, cmd->fb_id, cmd->handle, cmd->width, cmd->height, cmd->pitch, 0, legacy_fourcc(cmd->bpp, cmd->depth));
+	} else if (result == 0 && request == DRM_IOCTL_MODE_ADDFB2) {
+		struct drm_mode_fb_cmd2 *cmd = (struct drm_mode_fb_cmd2 *)argp;
+		fb_track_add(fd, cmd->fb_id, cmd->handles[0], cmd->width, cmd->height, cmd->pitches[0], cmd->offsets[0], cmd->pixel_format);
+	} else if (result == 0 && request == DRM_IOCTL_MODE_RMFB) {
+		fb_track_remove(*(uint32_t *)argp);
+	} else if (result == 0 && request == DRM_IOCTL_MODE_SETCRTC) {
+		struct drm_mode_crtc *crtc = (struct drm_mode_crtc *) argp;
+		if (crtc->fb_id != 0 && crtc->fb_id != (uint32_t)-1)
+			fb_track_flip(crtc->crtc_id, crtc->fb_id);
+		/* Legacy SETCRTC puts the primary plane on the CRTC, so atomic commits of just FB_ID can be placed */
+		struct lease_state *lease = fd_lease(fd);
+		struct plane_info *primary = lease ? primary_plane_for_crtc(fd, lease, crtc->crtc_id) : NULL;
+		if (primary)
+			primary->crtc_id = crtc->fb_id ? crtc->crtc_id : 0;
+		stats_track_setcrtc(fd, crtc);
+		if (crtc->mode_valid)
+			egl_note_mode(crtc->mode.hdisplay, crtc->mode.vdisplay);
+	} else if (result == 0 && request == DRM_IOCTL_MODE_PAGE_FLIP) {
+		struct drm_mode_crtc_page_flip *flip = (struct drm_mode_crtc_page_flip *)argp;
+		fb_track_flip(flip->crtc_id, flip->fb_id);
+	} else if (result == 0 && request == DRM_IOCTL_MODE_SETPLANE) {
+		struct drm_mode_set_plane *plane = (struct drm_mode_set_plane *)argp;
+		stats_plane_update(plane->plane_id, plane->fb_id ? plane->crtc_id : 0,
+			plane->src_w >> 16, plane->src_h >> 16, fb_bpp(plane->fb_id));
+	} else if (result == 0 && request == DRM_IOCTL_MODE_DESTROY_DUMB) {
+		tiler_bo_return(fd, ((struct drm_mode_destroy_dumb *)argp)->handle);
+		if (dirty_flag)
+			dirty_forget_dumb(fd, ((struct drm_mode_destroy_dumb *)argp)->handle);
+	} else if (result == 0 && request == DRM_IOCTL_GEM_CLOSE) {
+		tiler_bo_return(fd, ((struct drm_gem_close *)argp)->handle);
+		if (dirty_flag)
+			dirty_forget_dumb(fd, ((struct drm_gem_close *)argp)->handle);
+	} else if (result == 0 && request == DRM_IOCTL_MODE_MAP_DUMB) {
+		struct drm_mode_map_dumb *map = (struct drm_mode_map_dumb *)argp;
+		if (dirty_flag)
+			dirty_note_offset(fd, map->handle, map->offset);
+	} else if (result == 0 && request == DRM_IOCTL_MODE_CREATE_LEASE) {
+		lease_created(fd, (struct drm_mode_create_lease *)argp);
+	} else if (result == 0 && request == DRM_IOCTL_MODE_REVOKE_LEASE) {
+		lease_revoked(((struct drm_mode_revoke_lease *)argp)->lessee_id);
+	} else if (result == 0 && request == DRM_IOCTL_MODE_ATOMIC) {
+		struct drm_mode_atomic *atomic = (struct drm_mode_atomic *)argp;
+		if (!(atomic->flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+			fb_track_atomic(fd, atomic);
+			stats_track_atomic(fd, atomic);
+			if (limit_fps)
+				limit_after_flip(fd, request, argp);
 		}
 	}
 
@@ -244,10 +5294,36 @@ int ioctl(int fd, unsigned long request, char *argp) {
 		*/
 		struct drm_mode_crtc *crtc = (struct drm_mode_crtc *) argp;
 		printf("mode_getcrtc: %dx%d %d %d\n", crtc->mode.hdisplay, crtc->mode.vdisplay, crtc->mode.htotal, crtc->mode.vtotal);
-		int temp = crtc->mode.hdisplay;
-		crtc->mode.hdisplay = crtc->mode.vdisplay;
-		crtc->mode.vdisplay = temp;
+		if (result == 0 && crtc->mode_valid) {
+			stats_crtc_mode(crtc->crtc_id, crtc->mode.vrefresh);
+			egl_note_mode(crtc->mode.hdisplay, crtc->mode.vdisplay);
+		}
+		if (lease_allows(fd_lease(fd), crtc->crtc_id))
+			tiler_rotate_mode(shim_rotation, &crtc->mode);
 	}
 
+	if (translated)
+		suballoc_restore(request, argp, &sub_saved);
+	if (mig_translated)
+		migrate_restore(request, argp, &mig_saved);
+	return result;
+}
+
+int ioctl(int fd, unsigned long request, char *argp) {
+	uint32_t counts[TILER_SCHEMA_MAX_ARRAYS] = { 0 };
+	int drm = ((request >> (_IOC_TYPESHIFT)) & _IOC_TYPEMASK) == 'd';
+	int trace = drm && debug_flag >= 2;
+	/* Counts of an argument that fails the check aren't followed, even to trace it */
+	if (trace && tiler_schema_check(request, argp, NULL, SCHEMA_MAX_COUNT) == 0)
+		tiler_schema_counts(request, argp, counts);
+	int result = shim_ioctl(fd, request, argp);
+	if (trace || (record_flag && drm)) {
+		int error = errno;
+		if (trace)
+			trace_ioctl(fd, request, argp, counts, result, error);
+		if (record_flag && drm)
+			record_ioctl(fd, request, argp, result, error);
+		errno = error;
+	}
 	return result;
 }
@@ -0,0 +1,138 @@
+/*
+
+OpenGL TILER rotation shim - local socket protocol
+
+When started with ROTATE_SOCKET=<path>, the shim listens on a SOCK_SEQPACKET
+Unix socket at that path. Each request is a single struct tiler_shim_request;
+replies and notifications are single packets as described below.
+
+TILER_SHIM_CMD_CAPTURE
+	Replies with a struct tiler_shim_frame describing the buffer currently
+	being scanned out on the rotated CRTC. When status is 0 the packet
+	carries a dma-buf fd (SCM_RIGHTS) for the buffer. The dma-buf maps the
+	TILER 0 degree view, which is the orientation the application rendered
+	and the user sees on the rotated panel, so no CPU rotation is needed.
+	rotation is the DRM_MODE_ROTATE_* the display applies for scanout.
+
+TILER_SHIM_CMD_SUBSCRIBE
+	After this, a struct tiler_shim_event is sent for each flip the client
+	makes. Events are dropped rather than blocking the client if the
+	subscriber falls behind. With TILER_SHIM_SUBSCRIBE_DAMAGE in arg, each
+	event is followed in the same packet by a struct tiler_shim_damage
+	listing the rows of the frame that changed since the buffer was last
+	shown, when the shim runs with ROTATE_DIRTY and knows them.
+
+TILER_SHIM_CMD_STATS
+	Replies with a struct tiler_shim_stats: the memory bandwidth model's
+	bytes per refresh for each active plane and in total, cumulative
+	totals, and the bytes the shim copied itself. Scanout figures are
+	estimates from plane geometry and format, including an allowance for
+	reading rotated TILER views; they are not measured.
+
+TILER_SHIM_CMD_RECORD
+	Replies with the flight recorder: the most recent DRM ioctls, oldest
+	first, as packets of up to TILER_SHIM_RECORDS_PER_PACKET struct
+	tiler_shim_record, followed by an empty packet.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef TILER_SHIM_H
+#define TILER_SHIM_H
+
+#include <stdint.h>
+
+#define TILER_SHIM_CMD_CAPTURE    1
+#define TILER_SHIM_CMD_SUBSCRIBE  2
+#define TILER_SHIM_CMD_STATS      3
+#define TILER_SHIM_CMD_RECORD     4
+
+#define TILER_SHIM_SUBSCRIBE_DAMAGE 1
+
+#define TILER_SHIM_STATS_PLANES   8
+#define TILER_SHIM_RECORDS_PER_PACKET 64
+
+struct tiler_shim_request {
+	uint32_t cmd;
+	uint32_t arg;
+};
+
+struct tiler_shim_frame {
+	int32_t status;     /* 0 on success, otherwise a negative errno */
+	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t width;     /* as rendered by the application */
+	uint32_t height;
+	uint32_t pitch;
+	uint32_t offset;
+	uint32_t format;    /* DRM fourcc */
+	uint32_t rotation;  /* DRM_MODE_ROTATE_* applied at scanout */
+	uint32_t sequence;  /* flip count when the frame was made current */
+};
+
+struct tiler_shim_event {
+	uint32_t sequence;
+	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t pad;
+	uint64_t time_ns;   /* CLOCK_MONOTONIC at flip submission */
+};
+
+#define TILER_SHIM_DAMAGE_RANGES  8
+#define TILER_SHIM_DAMAGE_FULL    1 /* rows unknown: assume everything changed */
+
+struct tiler_shim_damage {
+	uint32_t num_ranges;
+	uint32_t flags;
+	struct {
+		uint32_t y;
+		uint32_t height;
+	} ranges[TILER_SHIM_DAMAGE_RANGES]; /* in buffer rows, ascending */
+};
+
+struct tiler_shim_plane_stats {
+	uint32_t plane_id;  /* 0 for a legacy primary the shim couldn't identify */
+	uint32_t crtc_id;
+	uint32_t width;     /* source rectangle */
+	uint32_t height;
+	uint32_t bpp;
+	uint32_t rotation;
+	uint32_t vrefresh;
+	uint32_t pad;
+	uint64_t bytes_per_frame; /* read per refresh, including tiled overhead */
+};
+
+struct tiler_shim_stats {
+	uint64_t frames;                    /* flips made by the client */
+	uint64_t scanout_bytes_per_frame;   /* all planes, one refresh */
+	uint64_t overhead_bytes_per_frame;  /* extra for rotated TILER reads */
+	uint64_t scanout_bytes;             /* cumulative */
+	uint64_t overhead_bytes;
+	uint64_t copy_bytes;                /* client buffer contents copied or converted by the shim */
+	uint32_t num_planes;
+	uint32_t pad;
+	struct tiler_shim_plane_stats planes[TILER_SHIM_STATS_PLANES];
+};
+
+struct tiler_shim_record {
+	uint64_t time_ns;   /* CLOCK_MONOTONIC when the ioctl returned */
+	uint32_t request;
+	int32_t fd;
+	int32_t result;
+	int32_t error;      /* errno if result < 0 */
+	uint32_t args[4];   /* start of the argument struct after the call */
+};
+
+#endif
@@ -0,0 +1,943 @@
+/*
+
+OpenGL TILER rotation shim - simulated omapdrm device
+
+See tiler_sim.h.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/ioctl.h>
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <drm/omap_drm.h>
+#include <drm/drm_fourcc.h>
+
+#include "tiler_sim.h"
+
+#define SIM_MAX_FILES 16
+#define SIM_MAX_FDS 1024
+#define SIM_MAX_BOS 64
+#define SIM_MAX_EVENTS 32
+#define SIM_MAX_WAITS 16
+#define SIM_MAX_BLOBS 16
+#define SIM_MAX_PLANES 4
+
+/* Above the token offsets the shim hands out for its own mappings */
+#define SIM_MMAP_BASE 0x10000000ULL
+
+#define SIM_CRTC_ID 31
+#define SIM_ENCODER_ID 32
+#define SIM_CONNECTOR_ID 33
+#define SIM_PLANE_ID 34     /* planes are SIM_PLANE_ID + index, 0 is primary */
+#define SIM_PROP_ID 100     /* properties are SIM_PROP_ID + enum below */
+
+enum {
+	PROP_TYPE, PROP_FB_ID, PROP_CRTC_ID, PROP_SRC_X, PROP_SRC_Y, PROP_SRC_W, PROP_SRC_H,
+	PROP_CRTC_X, PROP_CRTC_Y, PROP_CRTC_W, PROP_CRTC_H, PROP_ROTATION, PROP_ZPOS, PROP_ALPHA,
+	NUM_PLANE_PROPS,
+	PROP_MODE_ID = NUM_PLANE_PROPS, PROP_ACTIVE,
+	PROP_CONNECTOR_CRTC_ID,
+	NUM_PROPS
+};
+
+const char *const sim_prop_names[NUM_PROPS] = {
+	"type", "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "rotation", "zpos", "alpha",
+	"MODE_ID", "ACTIVE", "CRTC_ID",
+};
+
+struct sim_bo {
+	uint32_t handle;        /* 0: free slot */
+	uint64_t offset, size;
+};
+
+struct sim_file {
+	int in_use;
+	int refs;               /* fds known to refer to it */
+	dev_t dev;
+	ino_t ino;
+	uint64_t mem_end;
+	uint32_t next_handle;
+	struct sim_bo bos[SIM_MAX_BOS];
+	struct drm_event_vblank events[SIM_MAX_EVENTS];
+	int num_events;
+};
+
+/* A vblank event requested with WAIT_VBLANK, sent when its vblank passes */
+struct sim_wait {
+	struct sim_file *file;  /* NULL: free slot */
+	uint64_t sequence;
+	uint64_t user_data;
+};
+
+struct sim_blob {
+	uint32_t blob_id;       /* 0: free slot */
+	struct drm_mode_modeinfo mode;
+};
+
+struct sim_crtc {
+	int active;
+	struct drm_mode_modeinfo mode;
+	uint32_t fb_id, x, y;
+	uint64_t props[2];      /* MODE_ID, ACTIVE */
+	/* The commit waiting for its vblank, at most one */
+	int pending;
+	uint64_t pending_seq;
+	struct sim_file *event_file;    /* NULL: no flip event requested */
+	uint64_t event_user_data;
+	uint64_t last_seq;      /* vblank the last frame latched on */
+};
+
+struct sim_state {
+	struct tiler_sim_config config;
+	uint64_t period_ns, commit_ns, render_ns;
+	uint64_t start_ns, now_ns;
+	struct sim_file files[SIM_MAX_FILES];
+	uint8_t fd_files[SIM_MAX_FDS];  /* file index + 1 */
+	struct sim_wait waits[SIM_MAX_WAITS];
+	struct sim_blob blobs[SIM_MAX_BLOBS];
+	uint32_t next_blob_id, next_fb_id;
+	struct sim_crtc crtc;
+	uint64_t planes[SIM_MAX_PLANES][NUM_PLANE_PROPS];
+	uint64_t connector_crtc;
+	struct tiler_sim_stats stats;
+};
+
+struct sim_state sim;
+pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const uint32_t sim_formats[] = { DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_RGB565 };
+
+/*
+	Virtual clock. Vblank n of the CRTC happens at start_ns + n * period_ns;
+	the clock only moves when something waits.
+*/
+
+static uint64_t sim_seq_now(void) {
+	return (sim.now_ns - sim.start_ns) / sim.period_ns;
+}
+
+static uint64_t sim_seq_time(uint64_t seq) {
+	return sim.start_ns + seq * sim.period_ns;
+}
+
+/* Widen a 32-bit vblank count from a client to the nearest full one */
+static uint64_t sim_seq_absolute(uint32_t sequence) {
+	int64_t seq = (int64_t)sim_seq_now() + (int32_t)(sequence - (uint32_t)sim_seq_now());
+	return seq < 0 ? 0 : seq;
+}
+
+static void sim_queue_event(struct sim_file *f, uint32_t type, uint64_t user_data, uint64_t seq) {
+	if (!f || f->num_events >= SIM_MAX_EVENTS)
+		return;
+	uint64_t t = sim_seq_time(seq);
+	struct drm_event_vblank *e = &f->events[f->num_events++];
+	memset(e, 0, sizeof(*e));
+	e->base.type = type;
+	e->base.length = sizeof(*e);
+	e->user_data = user_data;
+	e->tv_sec = t / 1000000000ULL;
+	e->tv_usec = (t % 1000000000ULL) / 1000;
+	e->sequence = (uint32_t)seq;
+	e->crtc_id = SIM_CRTC_ID;
+}
+
+/* Complete everything that is due at the current time */
+static void sim_retire(void) {
+	uint64_t seq = sim_seq_now();
+	struct sim_crtc *c = &sim.crtc;
+	if (c->pending && c->pending_seq <= seq) {
+		c->pending = 0;
+		if (c->event_file)
+			sim_queue_event(c->event_file, DRM_EVENT_FLIP_COMPLETE, c->event_user_data, c->pending_seq);
+		c->event_file = NULL;
+	}
+	for (int i = 0; i < SIM_MAX_WAITS; i++) {
+		struct sim_wait *w = &sim.waits[i];
+		if (w->file && w->sequence <= seq) {
+			sim_queue_event(w->file, DRM_EVENT_VBLANK, w->user_data, w->sequence);
+			w->file = NULL;
+		}
+	}
+}
+
+static void sim_advance_to(uint64_t t) {
+	if (t > sim.now_ns)
+		sim.now_ns = t;
+	sim_retire();
+}
+
+/*
+	Files are identified by the memfd's inode, so dups of the client's fd
+	(the shim's probe thread uses one) share the open file like they would
+	with the real device
+*/
+
+static void sim_release(struct sim_file *f) {
+	if (f->refs > 0)
+		return;
+	if (sim.crtc.event_file == f)
+		sim.crtc.event_file = NULL;
+	for (int i = 0; i < SIM_MAX_WAITS; i++)
+		if (sim.waits[i].file == f)
+			sim.waits[i].file = NULL;
+	for (int fd = 0; fd < SIM_MAX_FDS; fd++)
+		if (sim.fd_files[fd] == f - sim.files + 1)
+			__atomic_store_n(&sim.fd_files[fd], 0, __ATOMIC_RELAXED);
+	f->in_use = 0;
+}
+
+/* Point fd at file index - 1 (0 for none), keeping the reference counts */
+static void sim_bind_fd(int fd, int index) {
+	if (sim.fd_files[fd] == index)
+		return;
+	if (sim.fd_files[fd]) {
+		struct sim_file *old = &sim.files[sim.fd_files[fd] - 1];
+		old->refs--;
+		sim_release(old);
+	}
+	if (index)
+		sim.files[index - 1].refs++;
+	/* Read without sim_lock by tiler_sim_owns */
+	__atomic_store_n(&sim.fd_files[fd], index, __ATOMIC_RELAXED);
+}
+
+static struct sim_file *sim_lookup(int fd) {
+	struct stat st;
+	struct sim_file *found = NULL;
+	if (fd < 0 || fd >= SIM_MAX_FDS)
+		return NULL;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		for (int i = 0; i < SIM_MAX_FILES; i++)
+			if (sim.files[i].in_use && sim.files[i].dev == st.st_dev && sim.files[i].ino == st.st_ino)
+				found = &sim.files[i];
+	/* Also notices fds that were closed behind our back and reused */
+	sim_bind_fd(fd, found ? (int)(found - sim.files) + 1 : 0);
+	return found;
+}
+
+static struct sim_bo *sim_bo_lookup(struct sim_file *f, uint32_t handle) {
+	for (int i = 0; i < SIM_MAX_BOS; i++)
+		if (handle != 0 && f->bos[i].handle == handle)
+			return &f->bos[i];
+	return NULL;
+}
+
+static int sim_bo_new(int fd, struct sim_file *f, uint64_t size, uint32_t *handle) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	size = (size + page_size - 1) & ~(uint64_t)(page_size - 1);
+	for (int i = 0; i < SIM_MAX_BOS; i++) {
+		struct sim_bo *bo = &f->bos[i];
+		if (bo->handle)
+			continue;
+		if (ftruncate(fd, f->mem_end + size) != 0)
+			return -errno;
+		bo->handle = f->next_handle++;
+		bo->offset = f->mem_end;
+		bo->size = size;
+		f->mem_end += size;
+		*handle = bo->handle;
+		return 0;
+	}
+	return -ENOMEM;
+}
+
+static int sim_bo_free(int fd, struct sim_file *f, uint32_t handle) {
+	struct sim_bo *bo = sim_bo_lookup(f, handle);
+	if (!bo)
+		return -EINVAL;
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, bo->offset, bo->size);
+	bo->handle = 0;
+	return 0;
+}
+
+/*
+	Commits. The CRTC holds at most one commit waiting for a vblank; it
+	latches on the first vblank at least commit_ns after it was made (and
+	not before min_seq, for targeted flips). A nonblocking commit made
+	while one is waiting fails with EBUSY, a blocking one waits for it.
+	With config.async, an async flip is shown at once, tearing, and its
+	event is sent with the current vblank count.
+*/
+
+static int sim_commit(struct sim_file *f, int frame, int nonblock, int event, uint64_t user_data, uint64_t min_seq,
+		int async) {
+	struct sim_crtc *c = &sim.crtc;
+	sim_retire();
+	if (!c->active) {
+		if (event)
+			sim_queue_event(f, DRM_EVENT_FLIP_COMPLETE, user_data, sim_seq_now());
+		return 0;
+	}
+	if (frame) {
+		sim.now_ns += sim.render_ns;
+		sim_retire();
+	}
+	if (c->pending) {
+		if (nonblock) {
+			sim.stats.ebusy++;
+			return -EBUSY;
+		}
+		sim_advance_to(sim_seq_time(c->pending_seq));
+	}
+
+	if (async) {
+		sim.stats.frames++;
+		sim.stats.torn++;
+		c->last_seq = sim_seq_now();
+		if (event)
+			sim_queue_event(f, DRM_EVENT_FLIP_COMPLETE, user_data, c->last_seq);
+		return 0;
+	}
+
+	uint64_t ready = sim.now_ns + sim.commit_ns - sim.start_ns;
+	uint64_t seq = (ready + sim.period_ns - 1) / sim.period_ns;
+	if (seq <= sim_seq_now())
+		seq = sim_seq_now() + 1;
+	if (seq < min_seq)
+		seq = min_seq;
+	c->pending = 1;
+	c->pending_seq = seq;
+	c->event_file = event ? f : NULL;
+	c->event_user_data = user_data;
+	if (frame) {
+		sim.stats.frames++;
+		if (c->last_seq && seq > c->last_seq + 1)
+			sim.stats.repeats += seq - c->last_seq - 1;
+		c->last_seq = seq;
+	}
+
+	if (!nonblock)
+		sim_advance_to(sim_seq_time(seq));
+	return 0;
+}
+
+static void sim_set_mode(const struct drm_mode_modeinfo *mode) {
+	sim.crtc.mode = *mode;
+	sim.crtc.active = 1;
+	sim.crtc.props[1] = 1;
+	sim.connector_crtc = SIM_CRTC_ID;
+}
+
+static void sim_default_mode(struct drm_mode_modeinfo *mode) {
+	memset(mode, 0, sizeof(*mode));
+	mode->hdisplay = sim.config.width;
+	mode->hsync_start = mode->hdisplay + 16;
+	mode->hsync_end = mode->hsync_start + 16;
+	mode->htotal = mode->hsync_end + 16;
+	mode->vdisplay = sim.config.height;
+	mode->vsync_start = mode->vdisplay + 4;
+	mode->vsync_end = mode->vsync_start + 4;
+	mode->vtotal = mode->vsync_end + 4;
+	mode->vrefresh = sim.config.refresh;
+	mode->clock = (uint64_t)mode->htotal * mode->vtotal * mode->vrefresh / 1000;
+	mode->type = DRM_MODE_TYPE_PREFERRED | DRM_MODE_TYPE_DRIVER;
+	snprintf(mode->name, sizeof(mode->name), "%ux%u", sim.config.width, sim.config.height);
+}
+
+/* Property storage for an object, NULL if it doesn't have the property */
+static uint64_t *sim_prop(uint32_t obj_id, uint32_t prop_id) {
+	uint32_t prop = prop_id - SIM_PROP_ID;
+	if (prop_id < SIM_PROP_ID || prop >= NUM_PROPS)
+		return NULL;
+	if (obj_id >= SIM_PLANE_ID && obj_id < SIM_PLANE_ID + (uint32_t)sim.config.planes)
+		return prop < NUM_PLANE_PROPS ? &sim.planes[obj_id - SIM_PLANE_ID][prop] : NULL;
+	if (obj_id == SIM_CRTC_ID)
+		return (prop == PROP_MODE_ID || prop == PROP_ACTIVE) ? &sim.crtc.props[prop - PROP_MODE_ID] : NULL;
+	if (obj_id == SIM_CONNECTOR_ID)
+		return prop == PROP_CONNECTOR_CRTC_ID ? &sim.connector_crtc : NULL;
+	return NULL;
+}
+
+static int sim_obj_props(uint32_t obj_id, uint32_t *props) {
+	int n = 0;
+	for (uint32_t p = 0; p < NUM_PROPS; p++)
+		if (sim_prop(obj_id, SIM_PROP_ID + p))
+			props[n++] = SIM_PROP_ID + p;
+	return n;
+}
+
+static int sim_atomic(struct sim_file *f, struct drm_mode_atomic *atomic) {
+	const uint32_t *objs = (const uint32_t *)(uintptr_t)atomic->objs_ptr;
+	const uint32_t *counts = (const uint32_t *)(uintptr_t)atomic->count_props_ptr;
+	const uint32_t *props = (const uint32_t *)(uintptr_t)atomic->props_ptr;
+	const uint64_t *values = (const uint64_t *)(uintptr_t)atomic->prop_values_ptr;
+
+	if (atomic->flags & ~DRM_MODE_ATOMIC_FLAGS)
+		return -EINVAL;
+	int async = (atomic->flags & DRM_MODE_PAGE_FLIP_ASYNC) != 0;
+	if (async && (!sim.config.async || (atomic->flags & DRM_MODE_ATOMIC_ALLOW_MODESET)))
+		return -EINVAL;
+	uint32_t k = 0;
+	for (uint32_t i = 0; i < atomic->count_objs; i++)
+		for (uint32_t j = 0; j < counts[i]; j++, k++) {
+			uint64_t *value = sim_prop(objs[i], props[k]);
+			if (!value)
+				return -ENOENT;
+			/* As in the kernel, async commits may only change framebuffers */
+			if (async && props[k] != SIM_PROP_ID + PROP_FB_ID && *value != values[k])
+				return -EINVAL;
+			if (props[k] == SIM_PROP_ID + PROP_ROTATION && (values[k] & DRM_MODE_ROTATE_MASK) == 0)
+				return -EINVAL;
+		}
+	if (atomic->flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		return 0;
+
+	k = 0;
+	for (uint32_t i = 0; i < atomic->count_objs; i++)
+		for (uint32_t j = 0; j < counts[i]; j++, k++) {
+			*sim_prop(objs[i], props[k]) = values[k];
+			if (objs[i] == SIM_CRTC_ID && props[k] == SIM_PROP_ID + PROP_MODE_ID)
+				for (int b = 0; b < SIM_MAX_BLOBS; b++)
+					if (values[k] && sim.blobs[b].blob_id == values[k])
+						sim_set_mode(&sim.blobs[b].mode);
+		}
+	sim.crtc.fb_id = sim.planes[0][PROP_FB_ID];
+	if (!sim.crtc.props[1])
+		sim.crtc.active = 0;
+	return sim_commit(f, 1, (atomic->flags & DRM_MODE_ATOMIC_NONBLOCK) != 0,
+		(atomic->flags & DRM_MODE_PAGE_FLIP_EVENT) != 0, atomic->user_data, 0, async);
+}
+
+static int sim_wait_vblank(struct sim_file *f, union drm_wait_vblank *vbl) {
+	uint32_t type = vbl->request.type;
+	int pipe = (type & _DRM_VBLANK_SECONDARY) ? 1 : (type & _DRM_VBLANK_HIGH_CRTC_MASK) >> _DRM_VBLANK_HIGH_CRTC_SHIFT;
+	if (pipe != 0 || !sim.crtc.active || (type & _DRM_VBLANK_SIGNAL))
+		return -EINVAL;
+
+	sim_retire();
+	uint64_t cur = sim_seq_now();
+	uint64_t target = (type & _DRM_VBLANK_RELATIVE) ? cur + vbl->request.sequence :
+		sim_seq_absolute(vbl->request.sequence);
+	if ((type & _DRM_VBLANK_NEXTONMISS) && target <= cur)
+		target = cur + 1;
+	if (target < cur)
+		target = cur;
+
+	if (type & _DRM_VBLANK_EVENT) {
+		int i;
+		for (i = 0; i < SIM_MAX_WAITS && sim.waits[i].file; i++)
+			;
+		if (i == SIM_MAX_WAITS)
+			return -EBUSY;
+		sim.waits[i].file = f;
+		sim.waits[i].sequence = target;
+		sim.waits[i].user_data = vbl->request.signal;
+		sim_retire();
+		vbl->reply.sequence = (uint32_t)target;
+		return 0;
+	}
+
+	if (target > cur)
+		sim_advance_to(sim_seq_time(target));
+	uint64_t seq = sim_seq_now(), t = sim_seq_time(seq);
+	vbl->reply.type = type;
+	vbl->reply.sequence = (uint32_t)seq;
+	vbl->reply.tval_sec = t / 1000000000ULL;
+	vbl->reply.tval_usec = (t % 1000000000ULL) / 1000;
+	return 0;
+}
+
+static void sim_copy_string(char *dst, __kernel_size_t *len, const char *src) {
+	size_t n = strlen(src);
+	if (dst && *len)
+		memcpy(dst, src, n < *len ? n : *len);
+	*len = n;
+}
+
+static int sim_dispatch(int fd, struct sim_file *f, unsigned long request, char *argp) {
+	switch (request) {
+	case DRM_IOCTL_VERSION: {
+		struct drm_version *v = (struct drm_version *)argp;
+		v->version_major = 1;
+		v->version_minor = 0;
+		v->version_patchlevel = 0;
+		sim_copy_string(v->name, &v->name_len, "omapdrm");
+		sim_copy_string(v->date, &v->date_len, "20110917");
+		sim_copy_string(v->desc, &v->desc_len, "OMAP DRM (simulated)");
+		return 0;
+	}
+	case DRM_IOCTL_GET_CAP: {
+		struct drm_get_cap *cap = (struct drm_get_cap *)argp;
+		switch (cap->capability) {
+		case DRM_CAP_DUMB_BUFFER:
+		case DRM_CAP_VBLANK_HIGH_CRTC:
+		case DRM_CAP_TIMESTAMP_MONOTONIC:
+		case DRM_CAP_PAGE_FLIP_TARGET:
+		case DRM_CAP_CRTC_IN_VBLANK_EVENT:
+			cap->value = 1;
+			return 0;
+		case DRM_CAP_ASYNC_PAGE_FLIP:
+		case DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP:
+			cap->value = sim.config.async != 0;
+			return 0;
+		}
+		return -EINVAL;
+	}
+	case DRM_IOCTL_SET_CLIENT_CAP: {
+		struct drm_set_client_cap *cap = (struct drm_set_client_cap *)argp;
+		return (cap->capability == DRM_CLIENT_CAP_UNIVERSAL_PLANES || cap->capability == DRM_CLIENT_CAP_ATOMIC) ? 0 : -EINVAL;
+	}
+	case DRM_IOCTL_SET_MASTER:
+	case DRM_IOCTL_DROP_MASTER:
+	case DRM_IOCTL_MODE_DIRTYFB:
+		return 0;
+
+	case DRM_IOCTL_MODE_GETRESOURCES: {
+		struct drm_mode_card_res *res = (struct drm_mode_card_res *)argp;
+		if (res->count_crtcs >= 1)
+			*(uint32_t *)(uintptr_t)res->crtc_id_ptr = SIM_CRTC_ID;
+		if (res->count_encoders >= 1)
+			*(uint32_t *)(uintptr_t)res->encoder_id_ptr = SIM_ENCODER_ID;
+		if (res->count_connectors >= 1)
+			*(uint32_t *)(uintptr_t)res->connector_id_ptr = SIM_CONNECTOR_ID;
+		res->count_fbs = 0;
+		res->count_crtcs = res->count_encoders = res->count_connectors = 1;
+		res->min_width = res->min_height = 1;
+		res->max_width = res->max_height = 2048;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETCONNECTOR: {
+		struct drm_mode_get_connector *conn = (struct drm_mode_get_connector *)argp;
+		if (conn->connector_id != SIM_CONNECTOR_ID)
+			return -ENOENT;
+		if (conn->count_modes >= 1)
+			sim_default_mode((struct drm_mode_modeinfo *)(uintptr_t)conn->modes_ptr);
+		if (conn->count_encoders >= 1)
+			*(uint32_t *)(uintptr_t)conn->encoders_ptr = SIM_ENCODER_ID;
+		if (conn->count_props >= 1) {
+			*(uint32_t *)(uintptr_t)conn->props_ptr = SIM_PROP_ID + PROP_CONNECTOR_CRTC_ID;
+			*(uint64_t *)(uintptr_t)conn->prop_values_ptr = sim.connector_crtc;
+		}
+		conn->count_modes = conn->count_encoders = conn->count_props = 1;
+		conn->encoder_id = SIM_ENCODER_ID;
+		conn->connector_type = DRM_MODE_CONNECTOR_DSI;
+		conn->connector_type_id = 1;
+		conn->connection = 1; /* connected */
+		conn->mm_width = conn->mm_height = 0;
+		conn->subpixel = 0;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETENCODER: {
+		struct drm_mode_get_encoder *enc = (struct drm_mode_get_encoder *)argp;
+		if (enc->encoder_id != SIM_ENCODER_ID)
+			return -ENOENT;
+		enc->encoder_type = DRM_MODE_ENCODER_DSI;
+		enc->crtc_id = sim.crtc.active ? SIM_CRTC_ID : 0;
+		enc->possible_crtcs = 1;
+		enc->possible_clones = 0;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETCRTC: {
+		struct drm_mode_crtc *crtc = (struct drm_mode_crtc *)argp;
+		if (crtc->crtc_id != SIM_CRTC_ID)
+			return -ENOENT;
+		crtc->fb_id = sim.crtc.fb_id;
+		crtc->x = sim.crtc.x;
+		crtc->y = sim.crtc.y;
+		crtc->gamma_size = 0;
+		crtc->mode_valid = sim.crtc.active;
+		if (sim.crtc.active)
+			crtc->mode = sim.crtc.mode;
+		else
+			memset(&crtc->mode, 0, sizeof(crtc->mode));
+		return 0;
+	}
+	case DRM_IOCTL_MODE_SETCRTC: {
+		struct drm_mode_crtc *crtc = (struct drm_mode_crtc *)argp;
+		if (crtc->crtc_id != SIM_CRTC_ID)
+			return -ENOENT;
+		if (crtc->mode_valid) {
+			sim_set_mode(&crtc->mode);
+		} else if (crtc->fb_id == 0) {
+			sim.crtc.active = 0;
+			sim.crtc.props[1] = 0;
+			sim.connector_crtc = 0;
+			sim.planes[0][PROP_FB_ID] = 0;
+			sim.planes[0][PROP_CRTC_ID] = 0;
+			return 0;
+		}
+		/* As in the kernel, legacy SETCRTC sets up the primary plane */
+		if (crtc->fb_id != (uint32_t)-1) {
+			sim.crtc.fb_id = crtc->fb_id;
+			sim.planes[0][PROP_FB_ID] = crtc->fb_id;
+			sim.planes[0][PROP_CRTC_ID] = SIM_CRTC_ID;
+		}
+		sim.crtc.x = crtc->x;
+		sim.crtc.y = crtc->y;
+		sim.planes[0][PROP_SRC_X] = (uint64_t)crtc->x << 16;
+		sim.planes[0][PROP_SRC_Y] = (uint64_t)crtc->y << 16;
+		return sim_commit(f, 0, 0, 0, 0, 0, 0);
+	}
+	case DRM_IOCTL_MODE_PAGE_FLIP: {
+		struct drm_mode_crtc_page_flip_target *flip = (struct drm_mode_crtc_page_flip_target *)argp;
+		if (flip->crtc_id != SIM_CRTC_ID)
+			return -ENOENT;
+		int async = (flip->flags & DRM_MODE_PAGE_FLIP_ASYNC) != 0;
+		if ((flip->flags & ~DRM_MODE_PAGE_FLIP_FLAGS) || (async && !sim.config.async) ||
+				(async && (flip->flags & DRM_MODE_PAGE_FLIP_TARGET)) ||
+				(flip->flags & DRM_MODE_PAGE_FLIP_TARGET) == DRM_MODE_PAGE_FLIP_TARGET || !sim.crtc.active)
+			return -EINVAL;
+		uint64_t min_seq = 0;
+		sim_retire();
+		if (flip->flags & DRM_MODE_PAGE_FLIP_TARGET_ABSOLUTE)
+			min_seq = sim_seq_absolute(flip->sequence);
+		else if (flip->flags & DRM_MODE_PAGE_FLIP_TARGET_RELATIVE)
+			min_seq = sim_seq_now() + flip->sequence;
+		int ret = sim_commit(f, 1, 1, (flip->flags & DRM_MODE_PAGE_FLIP_EVENT) != 0, flip->user_data, min_seq, async);
+		if (ret == 0) {
+			sim.crtc.fb_id = flip->fb_id;
+			sim.planes[0][PROP_FB_ID] = flip->fb_id;
+		}
+		return ret;
+	}
+	case DRM_IOCTL_WAIT_VBLANK:
+		return sim_wait_vblank(f, (union drm_wait_vblank *)argp);
+
+	case DRM_IOCTL_MODE_GETPLANERESOURCES: {
+		struct drm_mode_get_plane_res *res = (struct drm_mode_get_plane_res *)argp;
+		if (res->count_planes >= (uint32_t)sim.config.planes)
+			for (int i = 0; i < sim.config.planes; i++)
+				((uint32_t *)(uintptr_t)res->plane_id_ptr)[i] = SIM_PLANE_ID + i;
+		res->count_planes = sim.config.planes;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETPLANE: {
+		struct drm_mode_get_plane *plane = (struct drm_mode_get_plane *)argp;
+		uint32_t index = plane->plane_id - SIM_PLANE_ID;
+		uint32_t n = sizeof(sim_formats) / sizeof(sim_formats[0]);
+		if (plane->plane_id < SIM_PLANE_ID || index >= (uint32_t)sim.config.planes)
+			return -ENOENT;
+		plane->crtc_id = sim.planes[index][PROP_CRTC_ID];
+		plane->fb_id = sim.planes[index][PROP_FB_ID];
+		plane->possible_crtcs = 1;
+		plane->gamma_size = 0;
+		if (plane->count_format_types >= n)
+			memcpy((void *)(uintptr_t)plane->format_type_ptr, sim_formats, sizeof(sim_formats));
+		plane->count_format_types = n;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_SETPLANE: {
+		struct drm_mode_set_plane *set = (struct drm_mode_set_plane *)argp;
+		uint32_t index = set->plane_id - SIM_PLANE_ID;
+		if (set->plane_id < SIM_PLANE_ID || index >= (uint32_t)sim.config.planes)
+			return -ENOENT;
+		uint64_t *p = sim.planes[index];
+		p[PROP_FB_ID] = set->fb_id;
+		p[PROP_CRTC_ID] = set->fb_id ? set->crtc_id : 0;
+		p[PROP_CRTC_X] = set->crtc_x;
+		p[PROP_CRTC_Y] = set->crtc_y;
+		p[PROP_CRTC_W] = set->crtc_w;
+		p[PROP_CRTC_H] = set->crtc_h;
+		p[PROP_SRC_X] = set->src_x;
+		p[PROP_SRC_Y] = set->src_y;
+		p[PROP_SRC_W] = set->src_w;
+		p[PROP_SRC_H] = set->src_h;
+		return sim_commit(f, 0, 0, 0, 0, 0, 0);
+	}
+	case DRM_IOCTL_MODE_ATOMIC:
+		return sim_atomic(f, (struct drm_mode_atomic *)argp);
+
+	case DRM_IOCTL_MODE_OBJ_GETPROPERTIES: {
+		struct drm_mode_obj_get_properties *get = (struct drm_mode_obj_get_properties *)argp;
+		uint32_t props[NUM_PROPS];
+		int n = sim_obj_props(get->obj_id, props);
+		if (n == 0)
+			return -ENOENT;
+		if (get->count_props >= (uint32_t)n)
+			for (int i = 0; i < n; i++) {
+				((uint32_t *)(uintptr_t)get->props_ptr)[i] = props[i];
+				((uint64_t *)(uintptr_t)get->prop_values_ptr)[i] = *sim_prop(get->obj_id, props[i]);
+			}
+		get->count_props = n;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETPROPERTY: {
+		struct drm_mode_get_property *prop = (struct drm_mode_get_property *)argp;
+		uint32_t index = prop->prop_id - SIM_PROP_ID;
+		if (prop->prop_id < SIM_PROP_ID || index >= NUM_PROPS)
+			return -ENOENT;
+		memset(prop->name, 0, sizeof(prop->name));
+		strncpy(prop->name, sim_prop_names[index], sizeof(prop->name) - 1);
+		prop->flags = index == PROP_TYPE ? (DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE) :
+			index == PROP_ROTATION ? DRM_MODE_PROP_BITMASK :
+			index == PROP_MODE_ID ? DRM_MODE_PROP_BLOB : DRM_MODE_PROP_RANGE;
+		prop->count_values = 0;
+		prop->count_enum_blobs = 0;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_OBJ_SETPROPERTY: {
+		struct drm_mode_obj_set_property *set = (struct drm_mode_obj_set_property *)argp;
+		uint64_t *value = sim_prop(set->obj_id, set->prop_id);
+		if (!value)
+			return -ENOENT;
+		*value = set->value;
+		return sim_commit(f, 0, 0, 0, 0, 0, 0);
+	}
+	case DRM_IOCTL_MODE_CREATEPROPBLOB: {
+		struct drm_mode_create_blob *create = (struct drm_mode_create_blob *)argp;
+		for (int i = 0; i < SIM_MAX_BLOBS; i++) {
+			struct sim_blob *b = &sim.blobs[i];
+			if (b->blob_id)
+				continue;
+			memset(&b->mode, 0, sizeof(b->mode));
+			memcpy(&b->mode, (void *)(uintptr_t)create->data,
+				create->length < sizeof(b->mode) ? create->length : sizeof(b->mode));
+			b->blob_id = create->blob_id = sim.next_blob_id++;
+			return 0;
+		}
+		return -ENOMEM;
+	}
+	case DRM_IOCTL_MODE_DESTROYPROPBLOB: {
+		struct drm_mode_destroy_blob *destroy = (struct drm_mode_destroy_blob *)argp;
+		for (int i = 0; i < SIM_MAX_BLOBS; i++)
+			if (destroy->blob_id && sim.blobs[i].blob_id == destroy->blob_id) {
+				sim.blobs[i].blob_id = 0;
+				return 0;
+			}
+		return -ENOENT;
+	}
+
+	case DRM_IOCTL_MODE_CREATE_DUMB: {
+		struct drm_mode_create_dumb *create = (struct drm_mode_create_dumb *)argp;
+		if (create->width == 0 || create->height == 0 || create->bpp == 0)
+			return -EINVAL;
+		create->pitch = ((create->width * ((create->bpp + 7) / 8)) + 63) & ~63u;
+		create->size = (uint64_t)create->pitch * create->height;
+		return sim_bo_new(fd, f, create->size, &create->handle);
+	}
+	case DRM_IOCTL_MODE_MAP_DUMB: {
+		struct drm_mode_map_dumb *map = (struct drm_mode_map_dumb *)argp;
+		struct sim_bo *bo = sim_bo_lookup(f, map->handle);
+		if (!bo)
+			return -ENOENT;
+		map->offset = bo->offset;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+		return sim_bo_free(fd, f, ((struct drm_mode_destroy_dumb *)argp)->handle);
+	case DRM_IOCTL_GEM_CLOSE:
+		return sim_bo_free(fd, f, ((struct drm_gem_close *)argp)->handle);
+
+	case DRM_IOCTL_OMAP_GEM_NEW: {
+		struct drm_omap_gem_new *gem_new = (struct drm_omap_gem_new *)argp;
+		uint64_t size = gem_new->size.bytes;
+		if (gem_new->flags & OMAP_BO_TILED_MASK) {
+			/* Rows of a tiled buffer are a whole number of pages */
+			uint32_t cpp = (gem_new->flags & OMAP_BO_TILED_MASK) == OMAP_BO_TILED_32 ? 4 :
+				(gem_new->flags & OMAP_BO_TILED_MASK) == OMAP_BO_TILED_16 ? 2 : 1;
+			uint64_t pitch = ((uint64_t)gem_new->size.tiled.width * cpp + 4095) & ~4095ULL;
+			size = pitch * gem_new->size.tiled.height;
+		}
+		if (size == 0)
+			return -EINVAL;
+		return sim_bo_new(fd, f, size, &gem_new->handle);
+	}
+	case DRM_IOCTL_OMAP_GEM_INFO: {
+		struct drm_omap_gem_info *info = (struct drm_omap_gem_info *)argp;
+		struct sim_bo *bo = sim_bo_lookup(f, info->handle);
+		if (!bo)
+			return -ENOENT;
+		info->offset = bo->offset;
+		info->size = bo->size;
+		return 0;
+	}
+	case DRM_IOCTL_OMAP_GEM_CPU_PREP:
+		return sim_bo_lookup(f, ((struct drm_omap_gem_cpu_prep *)argp)->handle) ? 0 : -ENOENT;
+	case DRM_IOCTL_OMAP_GEM_CPU_FINI:
+		return sim_bo_lookup(f, ((struct drm_omap_gem_cpu_fini *)argp)->handle) ? 0 : -ENOENT;
+	case DRM_IOCTL_OMAP_GET_PARAM: {
+		struct drm_omap_param *param = (struct drm_omap_param *)argp;
+		if (param->param != OMAP_PARAM_CHIPSET_ID)
+			return -EINVAL;
+		param->value = 0x5432;
+		return 0;
+	}
+
+	case DRM_IOCTL_MODE_ADDFB:
+		((struct drm_mode_fb_cmd *)argp)->fb_id = sim.next_fb_id++;
+		return 0;
+	case DRM_IOCTL_MODE_ADDFB2:
+		((struct drm_mode_fb_cmd2 *)argp)->fb_id = sim.next_fb_id++;
+		return 0;
+	case DRM_IOCTL_MODE_RMFB:
+		return 0;
+	}
+
+	/* Leases, PRIME, cursors and the rest aren't simulated */
+	return -EINVAL;
+}
+
+void tiler_sim_init(const struct tiler_sim_config *config) {
+	struct timespec ts;
+	pthread_mutex_lock(&sim_lock);
+	memset(&sim, 0, sizeof(sim));
+	sim.config = *config;
+	if (sim.config.refresh == 0)
+		sim.config.refresh = 60;
+	if (sim.config.planes < 1 || sim.config.planes > SIM_MAX_PLANES)
+		sim.config.planes = SIM_MAX_PLANES;
+	sim.period_ns = 1000000000ULL / sim.config.refresh;
+	sim.commit_ns = (uint64_t)sim.config.commit_us * 1000;
+	sim.render_ns = (uint64_t)sim.config.render_us * 1000;
+	/* Start at the real time so timestamps look plausible, then go virtual */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	sim.start_ns = sim.now_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	sim.next_blob_id = 1;
+	sim.next_fb_id = 50;
+	for (int i = 0; i < sim.config.planes; i++) {
+		sim.planes[i][PROP_TYPE] = i == 0 ? 1 : 0; /* DRM_PLANE_TYPE_PRIMARY, OVERLAY */
+		sim.planes[i][PROP_ROTATION] = DRM_MODE_ROTATE_0;
+		sim.planes[i][PROP_ZPOS] = i;
+		sim.planes[i][PROP_ALPHA] = 0xffff;
+	}
+	pthread_mutex_unlock(&sim_lock);
+}
+
+int tiler_sim_open(void) {
+	struct stat st;
+	int fd = memfd_create("tiler_sim", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fd >= SIM_MAX_FDS || ftruncate(fd, SIM_MMAP_BASE) != 0 || fstat(fd, &st) != 0) {
+		close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sim_lock);
+	/* A file whose fds all went away without us seeing them closed */
+	for (int i = 0; i < SIM_MAX_FILES; i++)
+		if (sim.files[i].in_use && sim.files[i].dev == st.st_dev && sim.files[i].ino == st.st_ino) {
+			sim.files[i].refs = 0;
+			sim_release(&sim.files[i]);
+		}
+	for (int i = 0; i < SIM_MAX_FILES; i++) {
+		struct sim_file *f = &sim.files[i];
+		if (f->in_use)
+			continue;
+		memset(f, 0, sizeof(*f));
+		f->in_use = 1;
+		f->dev = st.st_dev;
+		f->ino = st.st_ino;
+		f->mem_end = SIM_MMAP_BASE;
+		f->next_handle = 1;
+		sim_bind_fd(fd, i + 1);
+		pthread_mutex_unlock(&sim_lock);
+		return fd;
+	}
+	pthread_mutex_unlock(&sim_lock);
+	close(fd);
+	errno = ENFILE;
+	return -1;
+}
+
+int tiler_sim_owns(int fd, int discover) {
+	if (fd < 0 || fd >= SIM_MAX_FDS)
+		return 0;
+	if (!discover && !__atomic_load_n(&sim.fd_files[fd], __ATOMIC_RELAXED))
+		return 0;
+	pthread_mutex_lock(&sim_lock);
+	int owned = sim_lookup(fd) != NULL;
+	pthread_mutex_unlock(&sim_lock);
+	return owned;
+}
+
+int tiler_sim_ioctl(int fd, unsigned long request, char *argp) {
+	pthread_mutex_lock(&sim_lock);
+	struct sim_file *f = sim_lookup(fd);
+	int ret = -EBADF;
+	if (f)
+		ret = ((request >> _IOC_TYPESHIFT) & _IOC_TYPEMASK) == DRM_IOCTL_BASE ?
+			sim_dispatch(fd, f, request, argp) : -ENOTTY;
+	pthread_mutex_unlock(&sim_lock);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+ssize_t tiler_sim_read(int fd, void *buf, size_t count) {
+	pthread_mutex_lock(&sim_lock);
+	struct sim_file *f = sim_lookup(fd);
+	if (!f) {
+		pthread_mutex_unlock(&sim_lock);
+		errno = EBADF;
+		return -1;
+	}
+
+	sim_retire();
+	if (f->num_events == 0) {
+		/* Nothing due yet: skip ahead to whatever this file is waiting for */
+		uint64_t next = UINT64_MAX;
+		if (sim.crtc.pending && sim.crtc.event_file == f)
+			next = sim.crtc.pending_seq;
+		for (int i = 0; i < SIM_MAX_WAITS; i++)
+			if (sim.waits[i].file == f && sim.waits[i].sequence < next)
+				next = sim.waits[i].sequence;
+		if (next != UINT64_MAX)
+			sim_advance_to(sim_seq_time(next));
+	}
+
+	size_t len = 0;
+	int n = 0;
+	while (n < f->num_events && len + sizeof(f->events[n]) <= count) {
+		memcpy((char *)buf + len, &f->events[n], sizeof(f->events[n]));
+		len += sizeof(f->events[n]);
+		n++;
+	}
+	memmove(f->events, f->events + n, (f->num_events - n) * sizeof(f->events[0]));
+	f->num_events -= n;
+	pthread_mutex_unlock(&sim_lock);
+	return len;
+}
+
+void tiler_sim_close(int fd) {
+	if (fd < 0 || fd >= SIM_MAX_FDS || !__atomic_load_n(&sim.fd_files[fd], __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&sim_lock);
+	sim_bind_fd(fd, 0);
+	pthread_mutex_unlock(&sim_lock);
+}
+
+uint64_t tiler_sim_now_ns(void) {
+	pthread_mutex_lock(&sim_lock);
+	uint64_t now = sim.now_ns;
+	pthread_mutex_unlock(&sim_lock);
+	return now;
+}
+
+void tiler_sim_stats(struct tiler_sim_stats *stats) {
+	pthread_mutex_lock(&sim_lock);
+	*stats = sim.stats;
+	stats->vblanks = sim_seq_now();
+	stats->virtual_ns = sim.now_ns - sim.start_ns;
+	pthread_mutex_unlock(&sim_lock);
+}
@@ -0,0 +1,90 @@
+/*
+
+OpenGL TILER rotation shim - simulated omapdrm device
+
+A stand-in for an omapdrm card with one CRTC driving a fixed panel mode
+and a few rotation-capable planes, run on a virtual clock. It models what
+frame pacing depends on: the vblank period, the one-deep flip queue per
+CRTC, the latency between a commit and the vblank it can latch on, and
+EBUSY for nonblocking commits while one is still pending. Waiting (a
+blocking WAIT_VBLANK or commit, or reading an event that is not due yet)
+jumps the clock straight to the moment the wait would end, so hours of
+60Hz frame loops run in seconds and every run gives the same numbers.
+
+Buffers live in a sparse memfd, which is also the fd handed to the client,
+so they can be mmapped at the offsets MAP_DUMB and GEM_INFO report. The
+memfd always polls readable; reading it advances the clock to the next
+pending event, or returns 0 if none is queued.
+
+tiler_shim.so uses it in place of the real device with ROTATE_SIM=1.
+
+Copyright 2020 David Shah <dave@ds0.me>
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef TILER_SIM_H
+#define TILER_SIM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Device number reported for simulated fds (card0) */
+#define TILER_SIM_MAJOR 226
+#define TILER_SIM_MINOR 0
+
+struct tiler_sim_config {
+	uint32_t width, height;     /* panel mode */
+	uint32_t refresh;           /* Hz */
+	int planes;                 /* primary plus overlays, at most 4 */
+	uint32_t commit_us;         /* a commit latches on the first vblank this long after it */
+	uint32_t render_us;         /* virtual time charged per frame submitted */
+	int async;                  /* take async flips that only change framebuffers */
+};
+
+struct tiler_sim_stats {
+	uint64_t frames;            /* commits that latched on a vblank */
+	uint64_t repeats;           /* vblanks that showed the previous frame again */
+	uint64_t ebusy;             /* nonblocking commits refused */
+	uint64_t torn;              /* async flips, shown at once */
+	uint64_t vblanks;
+	uint64_t virtual_ns;        /* virtual time since tiler_sim_init */
+};
+
+void tiler_sim_init(const struct tiler_sim_config *config);
+
+/* A new open file on the device, or -1 with errno set */
+int tiler_sim_open(void);
+
+/*
+	Whether fd (or a dup of it) came from tiler_sim_open. Without discover,
+	only fds already seen are checked, so unrelated fds cost no lock or
+	fstat; a dup is seen once it has been asked about with discover set.
+*/
+int tiler_sim_owns(int fd, int discover);
+
+/* Same contract as ioctl(2) */
+int tiler_sim_ioctl(int fd, unsigned long request, char *argp);
+
+/* Same contract as read(2) on a DRM fd */
+ssize_t tiler_sim_read(int fd, void *buf, size_t count);
+
+/* Drop fd's reference to its open file before it is closed */
+void tiler_sim_close(int fd);
+
+/* Virtual CLOCK_MONOTONIC, which event and vblank timestamps are in */
+uint64_t tiler_sim_now_ns(void);
+
+void tiler_sim_stats(struct tiler_sim_stats *stats);
+
+#endif